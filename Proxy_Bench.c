@@ -0,0 +1,641 @@
+#include "proxy_cache.h"
+#include "proxy_http.h"
+#include "proxy_relay.h"
+#include "proxy_listen.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// Benchmarks of the proxy's modules, run in process against the real code:
+//   bench lookup [entries]   cache hit cost as the cache grows from 10 entries to entries,
+//                            next to the list scan it replaced
+//   bench contention [shards] [threads]
+//                            cache hits per second from 1, 2, 4, ... up to threads threads
+//   bench keepalive port [requests]
+//                            requests per second through the proxy listening on port, with a
+//                            new connection per request, one kept-alive connection, and
+//                            pipelined batches
+//   bench send               bytes per second and per CPU-second sending a cached response
+//                            through a bounce buffer, per segment and with sendmsg()
+
+#define BENCH_ELEMENT_SIZE  64          // Body bytes of each cached response
+#define BENCH_LOOKUPS       1000000     // Hits timed at each cache size
+#define BENCH_ELEMENT_LIMIT (1 << 20)   // max_element given to cache_init()
+#define BENCH_SCAN_WORK     100000000   // List entries compared per size by the scan
+#define BENCH_HOT_ENTRIES   10000       // Responses the contention threads hit
+#define BENCH_RUN_SECONDS   1           // How long each thread count runs
+#define BENCH_REQUESTS      5000        // Requests sent through the proxy per connection mode
+#define BENCH_PIPELINE      16          // Requests sent at once by the pipelined mode
+#define BENCH_SEND_BYTES    (256 << 20) // Bytes sent per response size and path
+#define MAX_BYTES           4096        // Bounce buffer of the first version's hits
+
+static volatile size_t bench_sink;      // Keeps the timed loops from being optimised away
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * bench_key - Writes the URL cached as entry i to key (size bytes).
+ */
+static void bench_key(char *key, size_t size, size_t i) {
+    snprintf(key, size, "http://origin.example/objects/%zu", i);
+}
+
+/*
+ * next_random - xorshift64: cheap enough not to show in the timed loops.
+ */
+static uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/*
+ * bench_fill - Caches entries from..to-1. Returns 0, or -1 if one was not cached.
+ */
+static int bench_fill(size_t from, size_t to) {
+    char key[64], body[BENCH_ELEMENT_SIZE];
+    memset(body, 'x', sizeof(body));
+    for (size_t i = from; i < to; i++) {
+        bench_key(key, sizeof(key), i);
+        if (!cache_add_element(body, sizeof(body), key)) {
+            fprintf(stderr, "Failed to cache %s\n", key);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// The cache before it was indexed: a list walked with strcmp() on every lookup
+typedef struct scan_entry {
+    char *url;
+    struct scan_entry *next;
+} scan_entry;
+
+/*
+ * scan_grow - Prepends entries from..to-1 to the list at *head. Returns 0, or -1 on failure.
+ */
+static int scan_grow(scan_entry **head, size_t from, size_t to) {
+    char key[64];
+    for (size_t i = from; i < to; i++) {
+        scan_entry *entry = malloc(sizeof(*entry));
+        bench_key(key, sizeof(key), i);
+        if (!entry || !(entry->url = strdup(key))) {
+            perror("malloc failed for scan entry");
+            free(entry);
+            return -1;
+        }
+        entry->next = *head;
+        *head = entry;
+    }
+    return 0;
+}
+
+static void scan_free(scan_entry *head) {
+    while (head) {
+        scan_entry *next = head->next;
+        free(head->url);
+        free(head);
+        head = next;
+    }
+}
+
+/*
+ * bench_lookup - Grows the cache tenfold at a time and times hits on random entries at each
+ * size, next to the list scan the index replaced. The index costs a few probes at any size;
+ * what growth remains is the table and elements falling out of the CPU caches.
+ */
+static int bench_lookup(size_t max_entries) {
+    if (cache_init(0, 0, BENCH_ELEMENT_LIMIT, NULL) < 0)
+        return EXIT_FAILURE;
+    // The keys are formatted up front so the loop times only the lookup
+    char (*keys)[64] = malloc(BENCH_LOOKUPS * sizeof(*keys));
+    if (!keys) {
+        perror("malloc failed for bench keys");
+        return EXIT_FAILURE;
+    }
+    printf("%zu shards, %d-byte responses\n", cache_shard_total(), BENCH_ELEMENT_SIZE);
+    uint64_t seed = 88172645463325252ULL;
+    size_t entries = 0;
+    scan_entry *list = NULL;
+    int ret = EXIT_SUCCESS;
+    for (size_t size = 10; size <= max_entries; size *= 10) {
+        if (bench_fill(entries, size) < 0 || scan_grow(&list, entries, size) < 0) {
+            ret = EXIT_FAILURE;
+            break;
+        }
+        entries = size;
+        for (size_t i = 0; i < BENCH_LOOKUPS; i++)
+            bench_key(keys[i], sizeof(keys[i]), next_random(&seed) % entries);
+
+        size_t hits = 0;
+        double start = now_ns();
+        for (size_t i = 0; i < BENCH_LOOKUPS; i++) {
+            cache_element *element = cache_acquire(keys[i]);
+            if (element) {
+                hits++;
+                cache_release(element);
+            }
+        }
+        double ns = (now_ns() - start) / BENCH_LOOKUPS;
+        if (hits != BENCH_LOOKUPS) {
+            fprintf(stderr, "Only %zu of %d lookups hit\n", hits, BENCH_LOOKUPS);
+            ret = EXIT_FAILURE;
+            break;
+        }
+
+        // The scan gets fewer lookups as it slows down, so every size takes about as long
+        size_t scans = BENCH_SCAN_WORK / entries;
+        if (scans > BENCH_LOOKUPS)
+            scans = BENCH_LOOKUPS;
+        start = now_ns();
+        for (size_t i = 0; i < scans; i++) {
+            scan_entry *entry = list;
+            while (entry && strcmp(entry->url, keys[i]) != 0)
+                entry = entry->next;
+            hits += entry != NULL;
+        }
+        double scan_ns = (now_ns() - start) / scans;
+        bench_sink = hits;
+        printf("%8zu entries: index %6.0f ns, list scan %10.0f ns per hit\n", entries, ns,
+               scan_ns);
+    }
+    scan_free(list);
+    free(keys);
+    return ret;
+}
+
+// One thread of the contention benchmark
+typedef struct contention_thread {
+    pthread_t thread;
+    uint64_t seed;
+    size_t hits;
+} contention_thread;
+
+static pthread_barrier_t contention_start;
+static atomic_int contention_stop;
+
+static void *contention_main(void *arg) {
+    contention_thread *self = (contention_thread *)arg;
+    char key[64];
+    size_t hits = 0;
+    pthread_barrier_wait(&contention_start);
+    while (!atomic_load_explicit(&contention_stop, memory_order_relaxed)) {
+        bench_key(key, sizeof(key), next_random(&self->seed) % BENCH_HOT_ENTRIES);
+        cache_element *element = cache_acquire(key);
+        if (element) {
+            hits++;
+            cache_release(element);
+        }
+    }
+    self->hits = hits;
+    return NULL;
+}
+
+/*
+ * bench_contention - Has 1, 2, 4, ... threads hit random entries of one cache for
+ * BENCH_RUN_SECONDS each. With enough shards the hits per second grow with the threads until
+ * they run out of CPUs; run it with 1 shard to see a single lock.
+ */
+static int bench_contention(size_t shards, int max_threads) {
+    if (cache_init(shards, 0, BENCH_ELEMENT_LIMIT, NULL) < 0 ||
+        bench_fill(0, BENCH_HOT_ENTRIES) < 0)
+        return EXIT_FAILURE;
+    contention_thread *threads = calloc((size_t)max_threads, sizeof(*threads));
+    if (!threads) {
+        perror("calloc failed for bench threads");
+        return EXIT_FAILURE;
+    }
+    printf("%zu shards, %d entries, %ld CPUs\n", cache_shard_total(), BENCH_HOT_ENTRIES,
+           sysconf(_SC_NPROCESSORS_ONLN));
+    double single = 0;
+    for (int count = 1; count <= max_threads; count *= 2) {
+        pthread_barrier_init(&contention_start, NULL, (unsigned)count + 1);
+        atomic_store(&contention_stop, 0);
+        for (int i = 0; i < count; i++) {
+            threads[i].seed = 88172645463325252ULL + (uint64_t)i * 7919;
+            if (pthread_create(&threads[i].thread, NULL, contention_main, &threads[i]) != 0) {
+                perror("Failed to start bench thread");
+                exit(EXIT_FAILURE);
+            }
+        }
+        pthread_barrier_wait(&contention_start);
+        double start = now_ns();
+        sleep(BENCH_RUN_SECONDS);
+        atomic_store(&contention_stop, 1);
+        size_t hits = 0;
+        for (int i = 0; i < count; i++) {
+            pthread_join(threads[i].thread, NULL);
+            hits += threads[i].hits;
+        }
+        double rate = hits / ((now_ns() - start) / 1e9);
+        pthread_barrier_destroy(&contention_start);
+        if (count == 1)
+            single = rate;
+        printf("%3d threads: %7.2f M hits/s (%.2fx one thread)\n", count, rate / 1e6,
+               rate / single);
+    }
+    free(threads);
+    return EXIT_SUCCESS;
+}
+
+// --- Keep-Alive ---
+// Requests go through a running proxy to a stand-in origin on loopback for one small cacheable
+// response, so what is timed is how the proxy handles connections rather than the network.
+
+static char origin_response[256];
+static size_t origin_response_len;
+
+/*
+ * origin_connection - Answers each request head arriving on one connection with
+ * origin_response until the proxy closes it.
+ */
+static void *origin_connection(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    char buffer[8192];
+    size_t have = 0;
+    for (;;) {
+        ssize_t n = recv(fd, buffer + have, sizeof(buffer) - have, 0);
+        if (n <= 0)
+            break;
+        size_t searched = have, head;
+        have += (size_t)n;
+        while ((head = http_head_length(buffer, have, searched)) > 0) {
+            if (send_all(fd, origin_response, origin_response_len) < 0)
+                goto done;
+            memmove(buffer, buffer + head, have - head);
+            have -= head;
+            searched = 0;
+        }
+        if (have == sizeof(buffer))
+            break;
+    }
+done:
+    close(fd);
+    return NULL;
+}
+
+static void *origin_main(void *arg) {
+    int listener = (int)(intptr_t)arg;
+    for (;;) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0)
+            continue;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, origin_connection, (void *)(intptr_t)fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+/*
+ * origin_start - Starts the stand-in origin on a loopback port of the kernel's choosing.
+ * Returns the port, or -1 on failure.
+ */
+static int origin_start(void) {
+    char body[BENCH_ELEMENT_SIZE];
+    memset(body, 'x', sizeof(body));
+    origin_response_len = (size_t)snprintf(origin_response, sizeof(origin_response),
+        "HTTP/1.1 200 OK\r\nContent-Length: %d\r\nCache-Control: max-age=3600\r\n\r\n%.*s",
+        BENCH_ELEMENT_SIZE, BENCH_ELEMENT_SIZE, body);
+
+    struct sockaddr_in addr = {0};
+    socklen_t addr_len = sizeof(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    pthread_t thread;
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listener, 128) < 0 ||
+        getsockname(listener, (struct sockaddr *)&addr, &addr_len) < 0 ||
+        pthread_create(&thread, NULL, origin_main, (void *)(intptr_t)listener) != 0) {
+        perror("Failed to start the stand-in origin");
+        return -1;
+    }
+    pthread_detach(thread);
+    return ntohs(addr.sin_port);
+}
+
+static int proxy_connect(int port) {
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Failed to connect to the proxy");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * proxy_receive - Reads count whole responses from the proxy. Returns 0, or -1 if the
+ * connection failed, a response was not a 200 or more bytes followed the last one.
+ */
+static int proxy_receive(int fd, int count) {
+    char buffer[16384];
+    http_response response;
+    http_response_init(&response);
+    while (count > 0) {
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n == 0 && count == 1 && http_response_eof(&response))
+            return response.status == 200 ? 0 : -1;
+        if (n <= 0)
+            return -1;
+        for (size_t used = 0; used < (size_t)n;) {
+            used += http_response_feed(&response, buffer + used, (size_t)n - used);
+            if (!http_response_done(&response))
+                continue;
+            if (response.status != 200)
+                return -1;
+            if (--count == 0)
+                return used == (size_t)n ? 0 : -1;
+            http_response_init(&response);
+        }
+    }
+    return 0;
+}
+
+/*
+ * keepalive_run - Sends requests copies of request through the proxy on port, batch at a time
+ * without waiting for the answers in between, and per_connection on each connection. Returns
+ * the requests per second, or -1 on failure.
+ */
+static double keepalive_run(int port, const char *request, int requests, int per_connection,
+                            int batch) {
+    size_t len = strlen(request);
+    char *batched = malloc(len * (size_t)batch);
+    if (!batched) {
+        perror("malloc failed for bench requests");
+        return -1;
+    }
+    for (int i = 0; i < batch; i++)
+        memcpy(batched + len * (size_t)i, request, len);
+
+    int fd = -1, on_connection = 0, sent = 0;
+    double start = now_ns();
+    while (sent < requests) {
+        if (fd < 0 && (fd = proxy_connect(port)) < 0)
+            break;
+        int count = batch;
+        if (count > requests - sent)
+            count = requests - sent;
+        if (count > per_connection - on_connection)
+            count = per_connection - on_connection;
+        if (send_all(fd, batched, len * (size_t)count) < 0 || proxy_receive(fd, count) < 0) {
+            fprintf(stderr, "Request %d through the proxy failed\n", sent + 1);
+            break;
+        }
+        sent += count;
+        if ((on_connection += count) == per_connection) {
+            close(fd);
+            fd = -1;
+            on_connection = 0;
+        }
+    }
+    double seconds = (now_ns() - start) / 1e9;
+    if (fd >= 0)
+        close(fd);
+    free(batched);
+    return sent == requests ? requests / seconds : -1;
+}
+
+/*
+ * bench_keepalive - Times requests through the proxy on port with a new connection for each,
+ * all on one kept-alive connection, and pipelined BENCH_PIPELINE at a time. The response is
+ * fetched once beforehand, so every timed request is a cache hit.
+ */
+static int bench_keepalive(int port, int requests) {
+    int origin = origin_start();
+    if (origin < 0)
+        return EXIT_FAILURE;
+    char request[256], closing[256];
+    snprintf(request, sizeof(request),
+             "GET http://127.0.0.1:%d/bench HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n\r\n",
+             origin, origin);
+    snprintf(closing, sizeof(closing),
+             "GET http://127.0.0.1:%d/bench HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n"
+             "Connection: close\r\n\r\n", origin, origin);
+    if (keepalive_run(port, closing, 1, 1, 1) < 0)
+        return EXIT_FAILURE;
+
+    printf("%d requests for a %d-byte response through port %d\n", requests,
+           BENCH_ELEMENT_SIZE, port);
+    double single = keepalive_run(port, closing, requests, 1, 1);
+    if (single < 0)
+        return EXIT_FAILURE;
+    printf("new connection each: %8.0f requests/s\n", single);
+    double kept = keepalive_run(port, request, requests, requests, 1);
+    if (kept < 0)
+        return EXIT_FAILURE;
+    printf("one connection:      %8.0f requests/s (%.2fx)\n", kept, kept / single);
+    double pipelined = keepalive_run(port, request, requests, requests, BENCH_PIPELINE);
+    if (pipelined < 0)
+        return EXIT_FAILURE;
+    printf("pipelined by %-2d:     %8.0f requests/s (%.2fx)\n", BENCH_PIPELINE, pipelined,
+           pipelined / single);
+    return EXIT_SUCCESS;
+}
+
+// --- Sending Hits ---
+// A cached response sent to a loopback connection drained by another thread, the ways hits
+// have been sent: copied through a bounce buffer in MAX_BYTES chunks as the first version
+// did, one send() per segment, and relay_cached()'s sendmsg() over several segments.
+
+typedef enum { SEND_BOUNCE, SEND_SEGMENTS, SEND_GATHERED } send_path;
+
+static const char *const send_path_names[] = {"bounce buffer", "send() per segment",
+                                              "sendmsg()"};
+
+/*
+ * loopback_pair - Connects a socket to a loopback listener. The accepted end, set up as the
+ * servers set up their clients, goes to *sender and the connecting end to *receiver. Returns
+ * 0, or -1 on failure.
+ */
+static int loopback_pair(int *sender, int *receiver) {
+    struct sockaddr_in addr = {0};
+    socklen_t addr_len = sizeof(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    *sender = *receiver = -1;
+    if (listener >= 0 && bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+        listen(listener, 1) == 0 &&
+        getsockname(listener, (struct sockaddr *)&addr, &addr_len) == 0 &&
+        (*receiver = socket(AF_INET, SOCK_STREAM, 0)) >= 0 &&
+        connect(*receiver, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+        *sender = accept(listener, NULL, NULL);
+    if (listener >= 0)
+        close(listener);
+    if (*sender < 0) {
+        perror("Failed to connect over loopback");
+        if (*receiver >= 0)
+            close(*receiver);
+        return -1;
+    }
+    client_socket_init(*sender);
+    return 0;
+}
+
+static void *drain_main(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    static char buffer[1 << 18];
+    while (recv(fd, buffer, sizeof(buffer), 0) > 0)
+        ;
+    return NULL;
+}
+
+/*
+ * send_element - Sends element to fd by path. Returns 0, or -1 on a send error.
+ */
+static int send_element(int fd, cache_element *element, send_path path) {
+    if (path == SEND_GATHERED) {
+        size_t sent;
+        http_response response;
+        return relay_cached(fd, element, NULL, &sent, &response);
+    }
+    cache_cursor cursor;
+    const char *data;
+    size_t len;
+    cache_cursor_init(&cursor, element);
+    while ((len = cache_cursor_next(&cursor, &data)) > 0) {
+        if (path == SEND_SEGMENTS) {
+            if (send_all(fd, data, len) < 0)
+                return -1;
+            continue;
+        }
+        char chunk[MAX_BYTES];
+        for (size_t pos = 0; pos < len; pos += sizeof(chunk)) {
+            size_t n = len - pos < sizeof(chunk) ? len - pos : sizeof(chunk);
+            memset(chunk, 0, sizeof(chunk));
+            memcpy(chunk, data + pos, n);
+            if (send_all(fd, chunk, n) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * bench_send - Caches a response of each size and sends it about BENCH_SEND_BYTES worth of
+ * times by each path. Prints the bytes per second and per second of the sending thread's CPU
+ * time, which is what the sending costs a server when the CPUs are busy.
+ */
+static int bench_send(void) {
+    static const size_t sizes[] = {16 << 10, 256 << 10, 1 << 20};
+    size_t count = sizeof(sizes) / sizeof(sizes[0]);
+    if (cache_init(0, 0, 2 * sizes[count - 1], NULL) < 0)
+        return EXIT_FAILURE;
+    char *data = malloc(sizes[count - 1]);
+    if (!data) {
+        perror("malloc failed for bench response");
+        return EXIT_FAILURE;
+    }
+    printf("%d MB sent per size and path over loopback\n", BENCH_SEND_BYTES >> 20);
+    int ret = EXIT_SUCCESS;
+    for (size_t s = 0; s < count && ret == EXIT_SUCCESS; s++) {
+        char key[64];
+        // The head announces the body length it leaves: formatted twice to settle on it
+        size_t head = 0;
+        for (int pass = 0; pass < 2; pass++)
+            head = (size_t)snprintf(data, sizes[s], "HTTP/1.1 200 OK\r\nContent-Length: "
+                                    "%zu\r\n\r\n", sizes[s] - head);
+        memset(data + head, 'x', sizes[s] - head);
+        bench_key(key, sizeof(key), s);
+        cache_element *element = NULL;
+        if (!cache_add_element(data, sizes[s], key) || !(element = cache_acquire(key))) {
+            fprintf(stderr, "Failed to cache %s\n", key);
+            ret = EXIT_FAILURE;
+            break;
+        }
+
+        for (send_path path = SEND_BOUNCE; path <= SEND_GATHERED; path++) {
+            int sender, receiver;
+            pthread_t drain;
+            if (loopback_pair(&sender, &receiver) < 0 ||
+                pthread_create(&drain, NULL, drain_main, (void *)(intptr_t)receiver) != 0) {
+                ret = EXIT_FAILURE;
+                break;
+            }
+            size_t sends = BENCH_SEND_BYTES / sizes[s];
+            struct timespec cpu_start, cpu_end;
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+            double start = now_ns();
+            for (size_t i = 0; i < sends && ret == EXIT_SUCCESS; i++)
+                if (send_element(sender, element, path) < 0) {
+                    perror("Failed to send bench response");
+                    ret = EXIT_FAILURE;
+                }
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+            shutdown(sender, SHUT_WR);
+            pthread_join(drain, NULL);
+            double seconds = (now_ns() - start) / 1e9;
+            double cpu = (cpu_end.tv_sec - cpu_start.tv_sec) +
+                         (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1e9;
+            close(sender);
+            close(receiver);
+            if (ret != EXIT_SUCCESS)
+                break;
+            double bytes = (double)sends * sizes[s];
+            printf("%5zu KB, %-18s %7.0f MB/s, %6.2f GB per CPU-second\n", sizes[s] >> 10,
+                   send_path_names[path], bytes / seconds / 1e6, bytes / cpu / 1e9);
+        }
+        cache_release(element);
+    }
+    free(data);
+    return ret;
+}
+
+static void print_usage(const char *name) {
+    fprintf(stderr, "Usage: %s lookup [entries] | contention [shards] [threads] |\n"
+                    "       keepalive port [requests] | send\n", name);
+    fprintf(stderr, "  lookup      cache hit cost from 10 cached responses up to entries "
+                    "(default: 1000000,\n              about 4.5 GB of memory)\n");
+    fprintf(stderr, "  contention  cache hits per second from 1, 2, 4, ... threads "
+                    "(default: 2 x CPUs)\n              with shards shards "
+                    "(default: chosen as by the servers)\n");
+    fprintf(stderr, "  keepalive   requests per second through the proxy running on port, "
+                    "with new,\n              kept-alive and pipelined connections "
+                    "(default: %d requests)\n", BENCH_REQUESTS);
+    fprintf(stderr, "  send        cached responses sent through a bounce buffer, per segment "
+                    "and with\n              sendmsg() over loopback\n");
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "lookup") == 0)
+        return bench_lookup(argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000);
+    if (argc > 1 && strcmp(argv[1], "contention") == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int threads = argc > 3 ? atoi(argv[3]) : 2 * (int)(cpus > 0 ? cpus : 1);
+        return bench_contention(argc > 2 ? strtoul(argv[2], NULL, 10) : 0,
+                                threads > 0 ? threads : 1);
+    }
+    if (argc > 2 && strcmp(argv[1], "keepalive") == 0) {
+        int requests = argc > 3 ? atoi(argv[3]) : BENCH_REQUESTS;
+        return bench_keepalive(atoi(argv[2]), requests > 0 ? requests : 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "send") == 0)
+        return bench_send();
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+}
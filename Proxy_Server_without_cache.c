@@ -1,4 +1,18 @@
 #include "proxy_parse.h"
+#include "proxy_cache.h"
+#include "proxy_policy.h"
+#include "proxy_relay.h"
+#include "proxy_reactor.h"
+#include "proxy_pool.h"
+#include "proxy_listen.h"
+#include "proxy_upstream.h"
+#include "proxy_resolver.h"
+#include "proxy_refresh.h"
+#include "proxy_disk.h"
+#include "proxy_stats.h"
+#include "proxy_arena.h"
+#include "proxy_key.h"
+#include "proxy_range.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,51 +30,60 @@
 #include <time.h>
 #include <sys/wait.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <signal.h>
+#include <getopt.h>
 
 #define MAX_BYTES         4096         // Maximum allowed size of request/response
-#define MAX_CLIENTS       400          // Maximum number of client requests served concurrently
+#define MAX_CLIENTS       400          // Listen backlog (connections waiting to be accepted)
+#define QUEUE_DEPTH       256          // Accepted sockets each worker can have queued
+#define KEEPALIVE_TIMEOUT 15           // Seconds a kept-alive client may idle between requests
 #define MAX_CACHE_SIZE    (200 * (1 << 20))  // Total cache size (in bytes)
 #define MAX_ELEMENT_SIZE  (10 * (1 << 20))   // Maximum size of an individual cache element
 
-// --- Cache Element Structure ---
-typedef struct cache_element {
-    char *data;                // Cached response data
-    int len;                   // Length of the data
-    char *url;                 // Request URL used as key
-    time_t lru_time_track;     // Timestamp for LRU tracking
-    struct cache_element *next;  // Pointer to next cache element
-} cache_element;
-
 // --- Global Variables ---
-pthread_mutex_t cache_lock;           // Mutex for cache synchronization
-sem_t semaphore;                      // Semaphore to limit concurrent client threads
-
-cache_element *cache_head = NULL;     // Pointer to the head of the cache linked list
-int cache_current_size = 0;           // Current total size of the cache
-
 int port_number = 8080;               // Default proxy port number
-int proxy_socketId;                   // Proxy server socket descriptor
-
-pthread_t tid[MAX_CLIENTS];           // Array to store thread IDs for client threads
+size_t cache_shards = 0;              // Number of cache shards (0 = derive from CPU count)
+const cache_policy_ops *eviction_policy = &cache_policy_lru;  // Eviction policy of every shard
+int use_reactor = 0;                  // Serve with epoll event loops instead of the worker pool
+int reactor_loops = 0;                // Event loop threads (0 = one per CPU)
+int pool_size = 0;                    // Worker threads in threads mode (0 = one per CPU)
+size_t queue_depth = QUEUE_DEPTH;     // Per-worker queue of accepted sockets
+int keepalive_timeout = KEEPALIVE_TIMEOUT;  // Idle seconds before a kept-alive client is closed
+int use_reuseport = 0;                // One SO_REUSEPORT listener per loop / per CPU acceptor
+int pin_cpus = 0;                     // Pin each loop / acceptor thread to its own CPU
+int upstream_max_idle = UPSTREAM_MAX_IDLE;          // Idle origin connections kept per host
+int upstream_idle_timeout = UPSTREAM_IDLE_TIMEOUT;  // Seconds an idle origin connection is kept
+int resolver_threads = RESOLVER_THREADS;            // Threads running getaddrinfo()
+int dns_ttl = RESOLVER_TTL;                         // Seconds a resolved host is cached
+int stale_while_revalidate = RELAY_STALE_WHILE_REVALIDATE;  // Seconds stale is served while refreshed
+int stale_if_error = RELAY_STALE_IF_ERROR;          // Seconds stale is served while the origin fails
+int refresh_threads = REFRESH_THREADS;              // Threads refreshing stale responses
+int refresh_timeout = REFRESH_TIMEOUT;              // Seconds a refresh waits on a silent origin
+const char *disk_dir = NULL;                        // Directory of the disk cache tier (NULL = none)
+uint64_t disk_size = DISK_BUDGET;                   // Bytes the disk cache tier may use
+int snapshot_interval = DISK_SNAPSHOT_INTERVAL;     // Seconds between disk cache snapshots
 
 // --- Function Prototypes ---
-cache_element *cache_find(const char *url);
-int cache_add_element(char *data, int size, char *url);
-void cache_remove_lru_element(void);
+int formatErrorMessage(char *response, size_t size, int status_code);
 int sendErrorMessage(int socket, int status_code);
-int connectRemoteServer(const char *host_addr, int port_num);
-int handle_request(int clientSocket, struct ParsedRequest *request, char *buf, char *tempReq);
+size_t build_request(struct ParsedRequest *request, char *buf);
+int handle_request(int clientSocket, struct ParsedRequest *request, const char *upstream,
+                   size_t len, cache_flight *flight, http_response *response);
 int checkHTTPversion(const char *msg);
-void *thread_fn(void *socket_ptr);
+int check_request(struct ParsedRequest *request, const char *head, size_t len);
+char *request_key(struct ParsedRequest *request, const char *head, arena *scratch);
+int prepare_request(const char *head, size_t len, reactor_request *plan, arena *scratch);
+int serve_request(int clientSocket, const char *head, size_t head_len, arena *scratch);
+int serve_client(int clientSocket);
+void reject_client(int clientSocket);
 
 // --- Function Implementations ---
 
-/* 
- * sendErrorMessage - Sends an HTTP error message to the client.
+/*
+ * formatErrorMessage - Writes the HTTP error response for status_code into response.
+ * Returns its length, or -1 for an unknown status.
  */
-int sendErrorMessage(int socket, int status_code) {
-    char response[1024];
+int formatErrorMessage(char *response, size_t size, int status_code) {
     char currentTime[50];
     time_t now = time(NULL);
     struct tm data = *gmtime(&now);
@@ -68,52 +91,60 @@ int sendErrorMessage(int socket, int status_code) {
 
     switch (status_code) {
         case 400:
-            snprintf(response, sizeof(response),
+            snprintf(response, size,
                      "HTTP/1.1 400 Bad Request\r\nContent-Length: 95\r\n"
-                     "Connection: keep-alive\r\nContent-Type: text/html\r\nDate: %s\r\n"
+                     "Connection: close\r\nContent-Type: text/html\r\nDate: %s\r\n"
                      "Server: VaibhavN/14785\r\n\r\n"
                      "<HTML><HEAD><TITLE>400 Bad Request</TITLE></HEAD>\n"
                      "<BODY><H1>400 Bad Request</H1>\n</BODY></HTML>", currentTime);
             printf("400 Bad Request\n");
             break;
         case 403:
-            snprintf(response, sizeof(response),
+            snprintf(response, size,
                      "HTTP/1.1 403 Forbidden\r\nContent-Length: 112\r\nContent-Type: text/html\r\n"
-                     "Connection: keep-alive\r\nDate: %s\r\nServer: VaibhavN/14785\r\n\r\n"
+                     "Connection: close\r\nDate: %s\r\nServer: VaibhavN/14785\r\n\r\n"
                      "<HTML><HEAD><TITLE>403 Forbidden</TITLE></HEAD>\n"
                      "<BODY><H1>403 Forbidden</H1><br>Permission Denied\n</BODY></HTML>", currentTime);
             printf("403 Forbidden\n");
             break;
         case 404:
-            snprintf(response, sizeof(response),
+            snprintf(response, size,
                      "HTTP/1.1 404 Not Found\r\nContent-Length: 91\r\nContent-Type: text/html\r\n"
-                     "Connection: keep-alive\r\nDate: %s\r\nServer: VaibhavN/14785\r\n\r\n"
+                     "Connection: close\r\nDate: %s\r\nServer: VaibhavN/14785\r\n\r\n"
                      "<HTML><HEAD><TITLE>404 Not Found</TITLE></HEAD>\n"
                      "<BODY><H1>404 Not Found</H1>\n</BODY></HTML>", currentTime);
             printf("404 Not Found\n");
             break;
         case 500:
-            snprintf(response, sizeof(response),
+            snprintf(response, size,
                      "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 115\r\n"
-                     "Connection: keep-alive\r\nContent-Type: text/html\r\nDate: %s\r\n"
+                     "Connection: close\r\nContent-Type: text/html\r\nDate: %s\r\n"
                      "Server: VaibhavN/14785\r\n\r\n"
                      "<HTML><HEAD><TITLE>500 Internal Server Error</TITLE></HEAD>\n"
                      "<BODY><H1>500 Internal Server Error</H1>\n</BODY></HTML>", currentTime);
-            send(socket, response, strlen(response), 0);
-            return 1;
+            break;
         case 501:
-            snprintf(response, sizeof(response),
+            snprintf(response, size,
                      "HTTP/1.1 501 Not Implemented\r\nContent-Length: 103\r\n"
-                     "Connection: keep-alive\r\nContent-Type: text/html\r\nDate: %s\r\n"
+                     "Connection: close\r\nContent-Type: text/html\r\nDate: %s\r\n"
                      "Server: VaibhavN/14785\r\n\r\n"
                      "<HTML><HEAD><TITLE>501 Not Implemented</TITLE></HEAD>\n"
                      "<BODY><H1>501 Not Implemented</H1>\n</BODY></HTML>", currentTime);
             printf("501 Not Implemented\n");
             break;
+        case 503:
+            snprintf(response, size,
+                     "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 111\r\n"
+                     "Connection: close\r\nContent-Type: text/html\r\nDate: %s\r\n"
+                     "Server: VaibhavN/14785\r\n\r\n"
+                     "<HTML><HEAD><TITLE>503 Service Unavailable</TITLE></HEAD>\n"
+                     "<BODY><H1>503 Service Unavailable</H1>\n</BODY></HTML>", currentTime);
+            printf("503 Service Unavailable\n");
+            break;
         case 505:
-            snprintf(response, sizeof(response),
+            snprintf(response, size,
                      "HTTP/1.1 505 HTTP Version Not Supported\r\nContent-Length: 125\r\n"
-                     "Connection: keep-alive\r\nContent-Type: text/html\r\nDate: %s\r\n"
+                     "Connection: close\r\nContent-Type: text/html\r\nDate: %s\r\n"
                      "Server: VaibhavN/14785\r\n\r\n"
                      "<HTML><HEAD><TITLE>505 HTTP Version Not Supported</TITLE></HEAD>\n"
                      "<BODY><H1>505 HTTP Version Not Supported</H1>\n</BODY></HTML>", currentTime);
@@ -122,44 +153,27 @@ int sendErrorMessage(int socket, int status_code) {
         default:
             return -1;
     }
-    send(socket, response, strlen(response), 0);
-    return 1;
+    return (int)strlen(response);
 }
 
 /*
- * connectRemoteServer - Creates a socket and connects to a remote server given its hostname and port.
+ * sendErrorMessage - Sends an HTTP error message to the client.
  */
-int connectRemoteServer(const char *host_addr, int port_num) {
-    int remoteSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (remoteSocket < 0) {
-        perror("Error creating remote socket");
-        return -1;
-    }
-
-    struct hostent *host = gethostbyname(host_addr);
-    if (host == NULL) {
-        fprintf(stderr, "No such host exists: %s\n", host_addr);
-        return -1;
-    }
-
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port_num);
-    bcopy((char *)host->h_addr, (char *)&server_addr.sin_addr.s_addr, host->h_length);
-
-    if (connect(remoteSocket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Error connecting to remote server");
+int sendErrorMessage(int socket, int status_code) {
+    char response[1024];
+    int len = formatErrorMessage(response, sizeof(response), status_code);
+    if (len < 0)
         return -1;
-    }
-    return remoteSocket;
+    send(socket, response, (size_t)len, 0);
+    return 1;
 }
 
 /*
- * handle_request - Processes a client's request by forwarding it to the remote server
- * and then sending the response back to the client.
+ * build_request - Writes the request to forward to the remote server into buf (MAX_BYTES):
+ * the request line, then the client's end-to-end headers with Host ensured and Connection
+ * set to keep-alive, so the upstream connection can go back to the pool. Returns its length.
  */
-int handle_request(int clientSocket, struct ParsedRequest *request, char *buf, char *tempReq) {
+size_t build_request(struct ParsedRequest *request, char *buf) {
     // Construct the request line
     strcpy(buf, "GET ");
     strcat(buf, request->path);
@@ -169,8 +183,13 @@ int handle_request(int clientSocket, struct ParsedRequest *request, char *buf, c
 
     size_t len = strlen(buf);
 
-    // Ensure the "Connection" header is set to "close"
-    if (ParsedHeader_set(request, "Connection", "close") < 0) {
+    // Hop-by-hop headers describe the client's connection to us, not ours to the origin
+    static const char *const hop_by_hop[] = {
+        "Proxy-Connection", "Keep-Alive", "TE", "Trailer", "Upgrade", "Proxy-Authorization"
+    };
+    for (size_t i = 0; i < sizeof(hop_by_hop) / sizeof(hop_by_hop[0]); i++)
+        ParsedHeader_remove(request, hop_by_hop[i]);
+    if (ParsedHeader_set(request, "Connection", "keep-alive") < 0) {
         printf("Failed to set Connection header\n");
     }
 
@@ -181,71 +200,79 @@ int handle_request(int clientSocket, struct ParsedRequest *request, char *buf, c
         }
     }
 
-    // Unparse the headers and append them to the buffer
-    if (ParsedRequest_unparse_headers(request, buf + len, MAX_BYTES - len) < 0) {
+    // Unparse the headers and append them to the buffer, leaving room for the terminating
+    // NUL: the headers are not NUL-terminated and buf is not zeroed beforehand
+    if (ParsedRequest_unparse_headers(request, buf + len, MAX_BYTES - len - 1) < 0) {
         printf("Unparsing headers failed, sending request without header\n");
+        buf[len] = '\0';
+        return len;
+    }
+    len += ParsedHeader_headersLen(request);
+    buf[len] = '\0';
+    return len;
+}
+
+/*
+ * handle_request - Processes a client's request by forwarding upstream (len bytes, from
+ * build_request()) to the remote server and then sending the response back to the client.
+ * Completes flight (the single fetch other clients asking for the same request are waiting
+ * on) on every path. response is left with the framing of what was relayed.
+ */
+int handle_request(int clientSocket, struct ParsedRequest *request, const char *upstream,
+                   size_t len, cache_flight *flight, http_response *response) {
+    // Revalidating a stale copy: ask the origin whether it still holds, leaving upstream as
+    // it is for the range parts that may follow
+    char conditional[MAX_BYTES];
+    const char *buf = upstream;
+    cache_element *stale = cache_fill_stale(flight);
+    if (stale && len < sizeof(conditional)) {
+        memcpy(conditional, upstream, len + 1);
+        len = http_request_conditional(conditional, len, sizeof(conditional),
+                                       stale->validators ? stale->validators : "");
+        buf = conditional;
     }
 
     int server_port = 80; // Default remote server port
     if (request->port != NULL)
         server_port = atoi(request->port);
 
-    int remoteSocketID = connectRemoteServer(request->host, server_port);
-    if (remoteSocketID < 0)
-        return -1;
-
-    int bytes_sent = send(remoteSocketID, buf, strlen(buf), 0);
-    if (bytes_sent < 0) {
-        perror("Error sending request to remote server");
-        close(remoteSocketID);
-        return -1;
-    }
-
-    memset(buf, 0, MAX_BYTES);
-    bytes_sent = recv(remoteSocketID, buf, MAX_BYTES - 1, 0);
-
-    // Temporary buffer to hold the full response for caching
-    char *temp_buffer = (char *)malloc(MAX_BYTES);
-    if (!temp_buffer) {
-        perror("malloc failed");
-        close(remoteSocketID);
-        return -1;
-    }
-    int temp_buffer_size = MAX_BYTES;
-    int temp_buffer_index = 0;
-
-    while (bytes_sent > 0) {
-        if (send(clientSocket, buf, bytes_sent, 0) < 0) {
-            perror("Error sending data to client");
-            break;
+    // A pooled connection the origin closed meanwhile fails before any response byte;
+    // that is retried once on a new connection
+    for (int attempt = 0; ; attempt++) {
+        int reused;
+        int remoteSocketID = upstream_open(request->host, server_port, &reused);
+        if (remoteSocketID < 0) {
+            // The stale copy being revalidated may stand in for the unreachable origin
+            int ret = relay_stale(clientSocket, flight, response);
+            cache_flight_complete(flight, 0, 0);
+            return ret;
         }
-        // Append received data to temporary buffer for caching
-        for (int i = 0; i < bytes_sent; i++) {
-            temp_buffer[temp_buffer_index++] = buf[i];
+
+        size_t relayed = 0;
+        int ret = -1;
+        http_response_init(response);
+        if (send_all(remoteSocketID, buf, len) == 0) {
+            // Forward the response as it arrives, receiving it straight into the cache element
+            ret = relay_response(remoteSocketID, clientSocket, flight, &relayed, response);
+        } else {
+            perror("Error sending request to remote server");
         }
-        // Reallocate temp_buffer if needed
-        if (temp_buffer_index + MAX_BYTES > temp_buffer_size) {
-            temp_buffer_size += MAX_BYTES;
-            temp_buffer = (char *)realloc(temp_buffer, temp_buffer_size);
-            if (!temp_buffer) {
-                perror("realloc failed");
-                break;
-            }
+        upstream_release(request->host, server_port, remoteSocketID,
+                         http_response_reusable(response));
+        if (ret < 0 && relayed == 0 && reused && attempt == 0)
+            continue;
+        if (ret < 0 && relayed == 0 && relay_stale(clientSocket, flight, response) == 0) {
+            cache_flight_complete(flight, 0, 0);
+            printf("Served stale copy\n");
+            return 0;
         }
-        memset(buf, 0, MAX_BYTES);
-        bytes_sent = recv(remoteSocketID, buf, MAX_BYTES - 1, 0);
-    }
-    temp_buffer[temp_buffer_index] = '\0';
 
-    // Optionally add the response to cache (currently commented out)
-    // add_cache_element(temp_buffer, temp_buffer_index, tempReq);
+        // Publish the element only if the whole response was read
+        cache_flight_complete(flight, ret == 0, 1);
 
-    printf("Done forwarding request\n");
-
-    free(temp_buffer);
-    free(tempReq);
-    close(remoteSocketID);
-    return 0;
+        printf("Done forwarding request\n");
+        return relayed > 0 ? 0 : -1;
+    }
 }
 
 /*
@@ -261,274 +288,420 @@ int checkHTTPversion(const char *msg) {
 }
 
 /*
- * thread_fn - Function executed by each client-handling thread.
+ * check_request - Parses the request head into request. Returns 0, or the HTTP status to
+ * answer with instead.
  */
-void *thread_fn(void *socket_ptr) {
-    sem_wait(&semaphore);
-    int sem_val;
-    sem_getvalue(&semaphore, &sem_val);
-    printf("Semaphore value after wait: %d\n", sem_val);
-
-    int clientSocket = *(int *)socket_ptr;
-    int bytes_received, len;
-    char *buffer = (char *)calloc(MAX_BYTES, sizeof(char));
-    if (!buffer) {
-        perror("calloc failed");
-        close(clientSocket);
-        sem_post(&semaphore);
-        return NULL;
+int check_request(struct ParsedRequest *request, const char *head, size_t len) {
+    if (ParsedRequest_parse(request, head, (int)len) < 0) {
+        printf("Parsing failed\n");
+        return 400;
     }
-    memset(buffer, 0, MAX_BYTES);
-
-    // Receive client request
-    bytes_received = recv(clientSocket, buffer, MAX_BYTES, 0);
-    while (bytes_received > 0) {
-        len = strlen(buffer);
-        if (strstr(buffer, "\r\n\r\n") == NULL) {
-            bytes_received = recv(clientSocket, buffer + len, MAX_BYTES - len, 0);
-        } else {
-            break;
-        }
+    if (strcmp(request->method, "GET") != 0) {
+        printf("Only GET method is supported\n");
+        return 501;
     }
+    if (!request->host || !request->path || checkHTTPversion(request->version) != 1)
+        return 500;
+    return 0;
+}
 
-    // Duplicate the request buffer to use as key for cache lookup
-    char *tempReq = (char *)malloc(strlen(buffer) + 10);
-    if (!tempReq) {
-        perror("malloc failed for tempReq");
-        free(buffer);
-        close(clientSocket);
-        sem_post(&semaphore);
+/*
+ * request_key - The canonical cache key of a parsed request (see proxy_key.h), copied into
+ * scratch. Returns NULL if its URL cannot be keyed or scratch is exhausted.
+ */
+char *request_key(struct ParsedRequest *request, const char *head, arena *scratch) {
+    char key[CACHE_KEY_MAX];
+    if (cache_key_build(key, sizeof(key), head, request->protocol, request->host, request->port,
+                        request->path, strlen(request->path)) == 0)
         return NULL;
-    }
-    strcpy(tempReq, buffer);
-
-    // Check if the request exists in cache
-    cache_element *cache_entry = cache_find(tempReq);
-    if (cache_entry != NULL) {
-        // Serve from cache
-        int data_size = cache_entry->len;
-        int pos = 0;
-        char response[MAX_BYTES];
-        while (pos < data_size) {
-            memset(response, 0, MAX_BYTES);
-            int chunk = ((data_size - pos) < MAX_BYTES) ? (data_size - pos) : MAX_BYTES;
-            memcpy(response, cache_entry->data + pos, chunk);
-            send(clientSocket, response, chunk, 0);
-            pos += chunk;
-        }
-        printf("Data retrieved from the cache\n");
-    } else if (bytes_received > 0) {
-        // Parse the HTTP request
-        struct ParsedRequest *request = ParsedRequest_create();
-        if (ParsedRequest_parse(request, buffer, strlen(buffer)) < 0) {
-            printf("Parsing failed\n");
+    return arena_strdup(scratch, key);
+}
+
+/*
+ * prepare_request - Event loop counterpart of serve_request(): validates the request head
+ * and plans the upstream fetch, keyed like the threaded path by its canonical URL.
+ */
+int prepare_request(const char *head, size_t len, reactor_request *plan, arena *scratch) {
+    struct ParsedRequest *request = ParsedRequest_create();
+    int status = check_request(request, head, len);
+    if (status == 0) {
+        plan->key = request_key(request, head, scratch);
+        plan->host = arena_strdup(scratch, request->host);
+        plan->port = request->port ? atoi(request->port) : 80;
+        plan->upstream = (char *)arena_alloc(scratch, MAX_BYTES);
+        if (!plan->key || !plan->host || !plan->upstream) {
+            status = plan->key ? 500 : 400;
         } else {
-            memset(buffer, 0, MAX_BYTES);
-            if (strcmp(request->method, "GET") == 0) {
-                if (request->host && request->path && (checkHTTPversion(request->version) == 1)) {
-                    if (handle_request(clientSocket, request, buffer, tempReq) == -1)
-                        sendErrorMessage(clientSocket, 500);
-                } else {
-                    sendErrorMessage(clientSocket, 500);
-                }
-            } else {
-                printf("Only GET method is supported\n");
-            }
+            plan->upstream_len = build_request(request, plan->upstream);
         }
-        ParsedRequest_destroy(request);
-    } else if (bytes_received < 0) {
-        perror("Error receiving from client");
-    } else if (bytes_received == 0) {
-        printf("Client disconnected!\n");
     }
-
-    shutdown(clientSocket, SHUT_RDWR);
-    close(clientSocket);
-    free(buffer);
-    sem_post(&semaphore);
-    sem_getvalue(&semaphore, &sem_val);
-    printf("Semaphore value after post: %d\n", sem_val);
-    return NULL;
+    ParsedRequest_destroy(request);
+    return status;
 }
 
 /*
- * main - Entry point for the proxy server.
+ * serve_request - Answers the request whose NUL-terminated head is at head, taking its
+ * buffers from scratch. Returns 1 if the client asked to keep the connection and could tell
+ * where the response ended, else 0.
  */
-int main(int argc, char *argv[]) {
-    if (argc == 2)
-        port_number = atoi(argv[1]);
-    else {
-        printf("Usage: %s <port_number>\n", argv[0]);
-        exit(EXIT_FAILURE);
+int serve_request(int clientSocket, const char *head, size_t head_len, arena *scratch) {
+    int keep_alive = http_request_keep_alive(head);
+    http_response response;
+    http_response_init(&response);
+
+    // A request that cannot be served is answered with an error page and the connection closed
+    struct ParsedRequest *request = ParsedRequest_create();
+    int status = check_request(request, head, head_len);
+    char *buffer = (char *)arena_alloc(scratch, MAX_BYTES);
+    char *key = status == 0 ? request_key(request, head, scratch) : NULL;
+    if (status == 0 && (!buffer || !key))
+        status = key ? 500 : 400;
+    if (status != 0) {
+        sendErrorMessage(clientSocket, status);
+        ParsedRequest_destroy(request);
+        return 0;
     }
 
-    printf("Setting Proxy Server Port: %d\n", port_number);
-
-    // Initialize semaphore and mutex
-    sem_init(&semaphore, 0, MAX_CLIENTS);
-    pthread_mutex_init(&cache_lock, NULL);
-
-    // Create proxy socket
-    proxy_socketId = socket(AF_INET, SOCK_STREAM, 0);
-    if (proxy_socketId < 0) {
-        perror("Failed to create proxy socket");
-        exit(EXIT_FAILURE);
+    // Check if the request exists in cache, or join the fetch already in flight for it. A
+    // request missing the whole response is served from its parts if they are cached; only
+    // one for the whole response that has none fetches it
+    range_state range;
+    int ranged = range_request(&range, head);
+    size_t len = build_request(request, buffer);
+    range_origin origin = { key, request->host, request->port ? atoi(request->port) : 80,
+                            buffer, len };
+    cache_element *cache_entry;
+    cache_flight *flight;
+    int served = 0;
+    cache_lookup_result result = cache_lookup_cached(key, &cache_entry, &flight);
+    if (!ranged && result == CACHE_LEADER && !flight) {
+        result = range_whole(&range, &origin, &cache_entry, &flight);
+        ranged = result != CACHE_LEADER;
+        if (!ranged)
+            result = cache_lookup(key, &cache_entry, &flight);
     }
-    int reuse = 1;
-    if (setsockopt(proxy_socketId, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse)) < 0)
-        perror("setsockopt(SO_REUSEADDR) failed");
-
-    // Setup server address
-    struct sockaddr_in server_addr, client_addr;
-    memset(&server_addr, 0, sizeof(server_addr));  
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port_number);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-
-    if (bind(proxy_socketId, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Port is not free");
-        exit(EXIT_FAILURE);
+    if (result == CACHE_REFRESH) {
+        // Serve the stale copy right away; a refresh thread revalidates it meanwhile
+        refresh_start(flight, origin.host, origin.port, buffer, len);
+        printf("Refreshing in background url: %s\n", key);
+        flight = NULL;
     }
-    printf("Binding on port: %d\n", port_number);
-
-    if (listen(proxy_socketId, MAX_CLIENTS) < 0) {
-        perror("Error while listening");
-        exit(EXIT_FAILURE);
+    if (result != CACHE_LEADER) {
+        if (flight)
+            printf("Streaming in-flight fetch for url: %s\n", key);
+        else
+            printf("Cache hit for url: %s\n", key);
+
+        size_t sent;
+        int ret = 1;
+        if (ranged)
+            ret = range_send(clientSocket, &range, &origin, cache_entry, flight, &sent, &response);
+        // A part holds only a slice of the whole response asked for
+        if (ret > 0 && !range.whole)
+            ret = relay_cached(clientSocket, cache_entry, flight, &sent, &response);
+        served = ret == 0 || sent > 0;
+        if (ret < 0)
+            keep_alive = 0;
+        if (flight)
+            cache_flight_leave(flight);
+        cache_release(cache_entry);
+        flight = NULL;  // If the leader gave up before we sent anything, fetch on our own
+        // ...unless its revalidation found the origin failing: the stale copy stands in
+        if (!served && (cache_entry = cache_fallback(key)) != NULL) {
+            printf("Serving stale copy for url: %s\n", key);
+            ret = relay_cached(clientSocket, cache_entry, NULL, &sent, &response);
+            served = ret == 0 || sent > 0;
+            cache_release(cache_entry);
+        }
+        if (served)
+            printf("Data retrieved from the cache\n");
     }
-
-    int client_socketId, client_len;
-    int clientSockets[MAX_CLIENTS];
-    int thread_index = 0;
-
-    // Infinite loop for accepting client connections
-    while (1) {
-        memset(&client_addr, 0, sizeof(client_addr));
-        client_len = sizeof(client_addr);
-        client_socketId = accept(proxy_socketId, (struct sockaddr *)&client_addr, (socklen_t *)&client_len);
-        if (client_socketId < 0) {
-            fprintf(stderr, "Error in accepting connection!\n");
-            exit(EXIT_FAILURE);
+    if (!served && ranged && result == CACHE_LEADER && !flight) {
+        size_t sent;
+        int ret = range_send(clientSocket, &range, &origin, NULL, NULL, &sent, &response);
+        served = ret <= 0;
+        if (ret < 0)
+            keep_alive = 0;
+        if (served)
+            printf("Range served from cached parts for url: %s\n", key);
+    }
+    if (!served) {
+        printf("Cache miss for url: %s\n", key);
+        int ret = handle_request(clientSocket, request, buffer, len, flight, &response);
+        flight = NULL;
+        if (ret == -1) {
+            sendErrorMessage(clientSocket, 500);
+            keep_alive = 0;
+        } else {
+            // One too large to cache whole is cached in parts for the requests that follow
+            range_seed(&origin, &response);
         }
-        clientSockets[thread_index] = client_socketId;
-
-        // Display client IP address (optional)
-        char client_ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-        //printf("Client connected: IP %s, Port %d\n", client_ip, ntohs(client_addr.sin_port));
-
-        pthread_create(&tid[thread_index], NULL, thread_fn, (void *)&clientSockets[thread_index]);
-        thread_index++;
     }
-
-    close(proxy_socketId);
-    return 0;
+    ParsedRequest_destroy(request);
+    // Release anyone waiting on a fetch this request never started
+    cache_flight_complete(flight, 0, 0);
+    return keep_alive && http_response_reusable(&response);
 }
 
 /*
- * cache_find - Searches for the cache element corresponding to the given URL.
+ * serve_client - Run by a pool worker for each client with a request to send: answers
+ * requests in order, including any pipelined behind the first, while the client keeps the
+ * connection. Returns 1 to park it once it has nothing more buffered, 0 after closing it.
  */
-cache_element *cache_find(const char *url) {
-    pthread_mutex_lock(&cache_lock);
-    cache_element *curr = cache_head;
-    while (curr != NULL) {
-        if (strcmp(curr->url, url) == 0) {
-            printf("Cache hit for url: %s\n", url);
-            curr->lru_time_track = time(NULL);
-            pthread_mutex_unlock(&cache_lock);
-            return curr;
-        }
-        curr = curr->next;
+int serve_client(int clientSocket) {
+    client_reader *reader = (client_reader *)malloc(sizeof(client_reader));
+    if (!reader) {
+        perror("malloc failed for client reader");
+        close(clientSocket);
+        return 0;
     }
-    pthread_mutex_unlock(&cache_lock);
-    printf("Cache miss for url: %s\n", url);
-    return NULL;
+    client_reader_init(reader, clientSocket);
+    // Request buffers come from here and are reset, not freed, after each request
+    arena scratch;
+    arena_init(&scratch, 0);
+
+    int keep_alive = 0, pending = 0;
+    do {
+        ssize_t head_len = client_read_head(reader);
+        if (head_len < 0) {
+            perror("Error receiving from client");
+            break;
+        }
+        if (head_len == 0) {
+            printf("Client disconnected!\n");
+            break;
+        }
+        keep_alive = serve_request(clientSocket, reader->buffer, (size_t)head_len, &scratch);
+        arena_reset(&scratch);
+        pending = client_next(reader);
+    } while (keep_alive && pending);
+    arena_destroy(&scratch);
+    free(reader);
+
+    if (keep_alive && !pending)
+        return 1;
+    shutdown(clientSocket, SHUT_RDWR);
+    close(clientSocket);
+    return 0;
 }
 
 /*
- * cache_remove_lru_element - Removes the least recently used element from the cache.
+ * reject_client - Answers a client that found every worker queue full.
  */
-void cache_remove_lru_element(void) {
-    pthread_mutex_lock(&cache_lock);
-    if (cache_head == NULL) {
-        pthread_mutex_unlock(&cache_lock);
-        return;
-    }
-    cache_element *prev = cache_head, *curr = cache_head, *lru_prev = cache_head, *lru = cache_head;
-    while (curr->next != NULL) {
-        if (curr->next->lru_time_track < lru->lru_time_track) {
-            lru = curr->next;
-            lru_prev = curr;
-        }
-        curr = curr->next;
-    }
+void reject_client(int clientSocket) {
+    sendErrorMessage(clientSocket, 503);
+    close(clientSocket);
+}
 
-    if (lru == cache_head) {
-        cache_head = cache_head->next;
-    } else {
-        lru_prev->next = lru->next;
-    }
-    cache_current_size -= (lru->len + 1 + strlen(lru->url) + sizeof(cache_element));
-    free(lru->data);
-    free(lru->url);
-    free(lru);
-    pthread_mutex_unlock(&cache_lock);
+/*
+ * print_usage - Prints the command line synopsis.
+ */
+void print_usage(const char *prog) {
+    printf("Usage: %s [options] <port_number>\n"
+           "  --cache-shards=N   number of independently locked cache shards (default: 2 x CPUs, fewer\n"
+           "                     if a shard's share of the cache could not hold a whole element)\n"
+           "  --cache-policy=P   eviction policy: lru, lfu, slru or tinylfu (default: lru)\n"
+           "  --mode=M           threads (worker pool) or epoll (event loops) (default: threads)\n"
+           "  --workers=N        worker threads in threads mode (default: one per CPU)\n"
+           "  --queue-depth=N    accepted sockets queued per worker before refusing with 503 (default: %d)\n"
+           "  --loops=N          event loop threads in epoll mode (default: one per CPU)\n"
+           "  --keepalive-timeout=S      seconds a kept-alive client may idle, 0 for no limit (default: %d)\n"
+           "  --reuseport        give every event loop (or, in threads mode, one acceptor per CPU)\n"
+           "                     its own SO_REUSEPORT listener\n"
+           "  --pin-cpus         pin each event loop or acceptor thread to its own CPU\n"
+           "  --upstream-max-idle=N      idle origin connections kept per host, 0 to disable (default: %d)\n"
+           "  --upstream-idle-timeout=S  seconds an idle origin connection is kept (default: %d)\n"
+           "  --dns-threads=N    threads resolving upstream host names (default: %d)\n"
+           "  --dns-ttl=S        seconds a resolved host name is cached, 0 to disable (default: %d)\n"
+           "  --stale-while-revalidate=S  seconds a stale response is served while refreshed in the\n"
+           "                     background, unless it says otherwise (default: %d)\n"
+           "  --stale-if-error=S seconds a stale response is served while its origin fails,\n"
+           "                     unless it says otherwise (default: %d)\n"
+           "  --refresh-threads=N  threads refreshing stale responses (default: %d)\n"
+           "  --refresh-timeout=S  seconds a refresh waits on an origin that connects, sends or\n"
+           "                     takes nothing before it counts as failing, 0 for no limit (default: %d)\n"
+           "  --disk-cache=DIR   keep responses evicted from memory in segment files in DIR\n"
+           "                     (default: memory only)\n"
+           "  --disk-size=MB     megabytes of segment files the disk cache may use (default: %llu)\n"
+           "  --snapshot-interval=S  seconds between snapshots of the disk cache, restored on the\n"
+           "                     next start, 0 for SIGTERM only (default: %d)\n"
+           "Send SIGUSR1 to print statistics, SIGTERM to snapshot the disk cache and exit.\n",
+           prog, QUEUE_DEPTH, KEEPALIVE_TIMEOUT, UPSTREAM_MAX_IDLE, UPSTREAM_IDLE_TIMEOUT,
+           RESOLVER_THREADS, RESOLVER_TTL, RELAY_STALE_WHILE_REVALIDATE, RELAY_STALE_IF_ERROR,
+           REFRESH_THREADS, REFRESH_TIMEOUT, DISK_BUDGET >> 20, DISK_SNAPSHOT_INTERVAL);
 }
 
 /*
- * cache_add_element - Adds a new element to the cache after making sure there is enough space.
+ * main - Entry point for the proxy server.
  */
-int cache_add_element(char *data, int size, char *url) {
-    printf("\nAdding to cache, url: %s\nData: %s\n", url, data);
-    pthread_mutex_lock(&cache_lock);
-    int element_size = size + 1 + strlen(url) + sizeof(cache_element);
-    
-    // Uncomment or modify the next block to enforce maximum element size if required
-    /*
-    if (element_size > MAX_ELEMENT_SIZE) {
-        pthread_mutex_unlock(&cache_lock);
-        return 0;
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        {"cache-shards", required_argument, NULL, 's'},
+        {"cache-policy", required_argument, NULL, 'p'},
+        {"mode", required_argument, NULL, 'm'},
+        {"loops", required_argument, NULL, 'l'},
+        {"workers", required_argument, NULL, 'w'},
+        {"queue-depth", required_argument, NULL, 'q'},
+        {"keepalive-timeout", required_argument, NULL, 'a'},
+        {"reuseport", no_argument, NULL, 'r'},
+        {"pin-cpus", no_argument, NULL, 'c'},
+        {"upstream-max-idle", required_argument, NULL, 'k'},
+        {"upstream-idle-timeout", required_argument, NULL, 't'},
+        {"dns-threads", required_argument, NULL, 'n'},
+        {"dns-ttl", required_argument, NULL, 'd'},
+        {"stale-while-revalidate", required_argument, NULL, 'v'},
+        {"stale-if-error", required_argument, NULL, 'e'},
+        {"refresh-threads", required_argument, NULL, 'f'},
+        {"refresh-timeout", required_argument, NULL, 'o'},
+        {"disk-cache", required_argument, NULL, 'D'},
+        {"disk-size", required_argument, NULL, 'z'},
+        {"snapshot-interval", required_argument, NULL, 'i'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:p:m:l:w:q:a:rck:t:n:d:v:e:f:o:D:z:i:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 's':
+                cache_shards = strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                eviction_policy = cache_policy_find(optarg);
+                if (!eviction_policy) {
+                    fprintf(stderr, "Unknown cache policy: %s\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                if (strcmp(optarg, "epoll") == 0)
+                    use_reactor = 1;
+                else if (strcmp(optarg, "threads") == 0)
+                    use_reactor = 0;
+                else {
+                    fprintf(stderr, "Unknown mode: %s\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'l':
+                reactor_loops = atoi(optarg);
+                break;
+            case 'w':
+                pool_size = atoi(optarg);
+                break;
+            case 'q':
+                queue_depth = strtoul(optarg, NULL, 10);
+                break;
+            case 'a':
+                keepalive_timeout = atoi(optarg);
+                break;
+            case 'r':
+                use_reuseport = 1;
+                break;
+            case 'c':
+                pin_cpus = 1;
+                break;
+            case 'k':
+                upstream_max_idle = atoi(optarg);
+                break;
+            case 't':
+                upstream_idle_timeout = atoi(optarg);
+                break;
+            case 'n':
+                resolver_threads = atoi(optarg);
+                break;
+            case 'd':
+                dns_ttl = atoi(optarg);
+                break;
+            case 'v':
+                stale_while_revalidate = atoi(optarg);
+                break;
+            case 'e':
+                stale_if_error = atoi(optarg);
+                break;
+            case 'f':
+                refresh_threads = atoi(optarg);
+                break;
+            case 'o':
+                refresh_timeout = atoi(optarg);
+                break;
+            case 'D':
+                disk_dir = optarg;
+                break;
+            case 'z':
+                disk_size = strtoull(optarg, NULL, 10) << 20;
+                break;
+            case 'i':
+                snapshot_interval = atoi(optarg);
+                break;
+            default:
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
     }
-    */
-
-    while (cache_current_size + element_size > MAX_CACHE_SIZE) {
-        cache_remove_lru_element();
+    if (optind == argc - 1)
+        port_number = atoi(argv[optind]);
+    else {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
     }
 
-    cache_element *new_element = (cache_element *)malloc(sizeof(cache_element));
-    if (!new_element) {
-        perror("malloc failed for cache element");
-        pthread_mutex_unlock(&cache_lock);
-        return 0;
-    }
+    printf("Setting Proxy Server Port: %d\n", port_number);
 
-    new_element->data = (char *)malloc(size + 10);
-    if (!new_element->data) {
-        free(new_element);
-        perror("malloc failed for cache data");
-        pthread_mutex_unlock(&cache_lock);
-        return 0;
+    // Snapshot the disk cache on SIGTERM and dump stats on SIGUSR1; must precede every other
+    // thread so they all block the signals
+    if (disk_dir && disk_snapshot_on_signal(SIGTERM) < 0)
+        exit(EXIT_FAILURE);
+    if (stats_dump_on_signal(SIGUSR1) < 0)
+        exit(EXIT_FAILURE);
+
+    // Initialize the cache
+    if (cache_init(cache_shards, MAX_CACHE_SIZE, MAX_ELEMENT_SIZE, eviction_policy) < 0)
+        exit(EXIT_FAILURE);
+    printf("Cache shards: %zu, policy: %s\n", cache_shard_total(), eviction_policy->name);
+    if (disk_dir) {
+        if (disk_init(disk_dir, disk_size, snapshot_interval) < 0)
+            exit(EXIT_FAILURE);
+        printf("Disk cache: %s (%llu MB)\n", disk_dir, (unsigned long long)(disk_size >> 20));
     }
-    strcpy(new_element->data, data);
-
-    new_element->url = (char *)malloc(10 + strlen(url) * sizeof(char));
-    if (!new_element->url) {
-        free(new_element->data);
-        free(new_element);
-        perror("malloc failed for cache URL");
-        pthread_mutex_unlock(&cache_lock);
-        return 0;
+    if (resolver_init(resolver_threads, dns_ttl) < 0)
+        exit(EXIT_FAILURE);
+    if (refresh_init(refresh_threads, refresh_timeout) < 0)
+        exit(EXIT_FAILURE);
+    upstream_init(upstream_max_idle, upstream_idle_timeout);
+    relay_init(stale_while_revalidate, stale_if_error);
+    range_init();
+
+    // Open the listening socket(s)
+    int listen_count = 1;
+    if (use_reuseport)
+        listen_count = use_reactor && reactor_loops > 0 ? reactor_loops : online_cpus();
+    int *listen_fds = (int *)calloc((size_t)listen_count, sizeof(int));
+    if (!listen_fds) {
+        perror("calloc failed for listening sockets");
+        exit(EXIT_FAILURE);
     }
-    strcpy(new_element->url, url);
-    new_element->lru_time_track = time(NULL);
-    new_element->len = size;
-    new_element->next = cache_head;
-    cache_head = new_element;
-    cache_current_size += element_size;
-    pthread_mutex_unlock(&cache_lock);
-
-    free(url);
-    free(data);
-
-    printf("\nCurrent cache size: %d bytes\n", cache_current_size);
-    return 1;
+    if (use_reuseport) {
+        if (listen_sockets(port_number, MAX_CLIENTS, listen_fds, listen_count) < 0)
+            exit(EXIT_FAILURE);
+    } else if ((listen_fds[0] = listen_socket(port_number, MAX_CLIENTS, 0)) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    printf("Binding on port: %d (%d listener(s))\n", port_number, listen_count);
+
+    if (use_reactor) {
+        reactor_handler handler = { prepare_request, formatErrorMessage, keepalive_timeout };
+        reactor_run(listen_fds, listen_count, reactor_loops, pin_cpus, &handler);
+        exit(EXIT_FAILURE);
+    }
+
+    worker_pool *pool = pool_create(pool_size, queue_depth, keepalive_timeout, serve_client,
+                                    reject_client);
+    if (!pool)
+        exit(EXIT_FAILURE);
+    printf("Worker threads: %d\n", pool_workers(pool));
+
+    // Accept on every listener; only a failure to start the acceptors returns
+    pool_serve(pool, listen_fds, listen_count, pin_cpus);
+    exit(EXIT_FAILURE);
 }
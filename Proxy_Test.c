@@ -0,0 +1,730 @@
+#include "proxy_cache.h"
+#include "proxy_http.h"
+#include "proxy_relay.h"
+#include "proxy_refresh.h"
+#include "proxy_resolver.h"
+#include "proxy_stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// Tests of the proxy's modules, run in process against the real code and a stand-in origin
+// on loopback whose answers each test scripts. `make test` builds and runs them; the exit
+// status is the number of failed tests.
+
+#define TEST_ELEMENT_LIMIT    (64 << 10)    // max_element given to cache_init()
+#define TEST_TIMEOUT          1             // Seconds a refresh waits on a silent origin
+#define TEST_HEAD_MAX         4096          // Request heads kept by the origin, responses scripted
+#define TEST_URL_MAX          256
+#define TEST_RESOLVER_TTL     2             // Seconds resolved addresses are cached
+#define TEST_RESOLVER_THREADS 2             // Threads running getaddrinfo()
+#define TEST_QUERIES          8             // Queries waiting on one lookup
+
+static int test_failed;                 // The current test has failed a check
+
+#define CHECK(cond)                                                              \
+    do {                                                                         \
+        if (!(cond)) {                                                           \
+            fprintf(stderr, "  %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            test_failed = 1;                                                     \
+        }                                                                        \
+    } while (0)
+
+// --- Stand-In Origin ---
+// Answers every request head with the scripted response, or with nothing at all while hang
+// is set, and remembers the last head it was sent.
+
+static struct {
+    pthread_mutex_t lock;
+    int port;
+    char response[TEST_HEAD_MAX];
+    int hang;
+    int requests;                       // Request heads received so far
+    char request[TEST_HEAD_MAX];        // The last one, NUL-terminated
+} origin = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * origin_script - Sets the response to every following request, or makes the origin hang if
+ * response is NULL.
+ */
+static void origin_script(const char *response) {
+    pthread_mutex_lock(&origin.lock);
+    origin.hang = response == NULL;
+    snprintf(origin.response, sizeof(origin.response), "%s", response ? response : "");
+    pthread_mutex_unlock(&origin.lock);
+}
+
+static int origin_requests(void) {
+    pthread_mutex_lock(&origin.lock);
+    int requests = origin.requests;
+    pthread_mutex_unlock(&origin.lock);
+    return requests;
+}
+
+static void *origin_connection(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    char buffer[TEST_HEAD_MAX];
+    size_t have = 0, head;
+    for (;;) {
+        ssize_t n = recv(fd, buffer + have, sizeof(buffer) - have, 0);
+        if (n <= 0)
+            break;
+        have += (size_t)n;
+        while ((head = http_head_length(buffer, have, 0)) > 0) {
+            char response[TEST_HEAD_MAX];
+            pthread_mutex_lock(&origin.lock);
+            origin.requests++;
+            memcpy(origin.request, buffer, head);
+            origin.request[head < sizeof(origin.request) ? head : head - 1] = '\0';
+            int hang = origin.hang;
+            snprintf(response, sizeof(response), "%s", origin.response);
+            pthread_mutex_unlock(&origin.lock);
+            // A hanging origin reads on until the proxy gives up on it
+            if (hang || send_all(fd, response, strlen(response)) < 0)
+                goto done;
+            memmove(buffer, buffer + head, have - head);
+            have -= head;
+        }
+        if (have == sizeof(buffer))
+            break;
+    }
+done:
+    while (recv(fd, buffer, sizeof(buffer), 0) > 0)
+        ;
+    close(fd);
+    return NULL;
+}
+
+static void *origin_main(void *arg) {
+    int listener = (int)(intptr_t)arg;
+    for (;;) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0)
+            continue;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, origin_connection, (void *)(intptr_t)fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+/*
+ * origin_start - Starts the origin on a loopback port of the kernel's choosing. Returns 0, or
+ * -1 on failure.
+ */
+static int origin_start(void) {
+    struct sockaddr_in addr = {0};
+    socklen_t addr_len = sizeof(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    pthread_t thread;
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listener, 16) < 0 ||
+        getsockname(listener, (struct sockaddr *)&addr, &addr_len) < 0 ||
+        pthread_create(&thread, NULL, origin_main, (void *)(intptr_t)listener) != 0) {
+        perror("Failed to start the stand-in origin");
+        return -1;
+    }
+    pthread_detach(thread);
+    origin.port = ntohs(addr.sin_port);
+    return 0;
+}
+
+static int origin_connect(void) {
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)origin.port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+// --- Helpers ---
+
+/*
+ * test_url - Writes the URL of the origin's resource name to url (TEST_URL_MAX bytes), which
+ * is also its cache key, and the request for it to request (TEST_HEAD_MAX bytes). Returns the
+ * request length.
+ */
+static size_t test_url(const char *name, char *url, char *request) {
+    snprintf(url, TEST_URL_MAX, "http://127.0.0.1:%d/%s", origin.port, name);
+    return (size_t)snprintf(request, TEST_HEAD_MAX,
+                            "GET /%s HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n\r\n", name, origin.port);
+}
+
+static void http_date(char *out, size_t size, time_t when) {
+    struct tm tm;
+    gmtime_r(&when, &tm);
+    strftime(out, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/*
+ * parse_head - Feeds the response head to r.
+ */
+static void parse_head(http_response *r, const char *head) {
+    http_response_init(r);
+    http_response_feed(r, head, strlen(head));
+}
+
+/*
+ * element_copy - Copies the bytes of element to out (size bytes) and NUL-terminates them.
+ */
+static const char *element_copy(cache_element *element, char *out, size_t size) {
+    cache_cursor cursor;
+    const char *data;
+    size_t len = 0, n;
+    cache_cursor_init(&cursor, element);
+    while ((n = cache_cursor_next(&cursor, &data)) > 0 && len + n < size) {
+        memcpy(out + len, data, n);
+        len += n;
+    }
+    out[len] = '\0';
+    return out;
+}
+
+/*
+ * cached - Whether url is cached with exactly the bytes expected.
+ */
+static int cached(const char *url, const char *expected) {
+    char bytes[TEST_HEAD_MAX];
+    cache_element *element = cache_acquire(url);
+    if (!element)
+        return 0;
+    int same = strcmp(element_copy(element, bytes, sizeof(bytes)), expected) == 0;
+    cache_release(element);
+    return same;
+}
+
+/*
+ * fresh - Whether a lookup of url is a hit, without starting a fetch.
+ */
+static int fresh(const char *url) {
+    cache_element *element;
+    cache_flight *flight;
+    cache_lookup_result result = cache_lookup_cached(url, &element, &flight);
+    if (result == CACHE_FOLLOWER)
+        cache_flight_leave(flight);
+    if (result == CACHE_REFRESH)
+        cache_flight_complete(flight, 0, 0);
+    if (element)
+        cache_release(element);
+    return result == CACHE_HIT;
+}
+
+/*
+ * fetch - Leads the fetch of name from the origin as the threads-mode server does, relaying
+ * the response to client_fd (-1 for none) and revalidating a stale element if there is one.
+ * Returns 0 if the response was read in full, -1 if the lookup did not make us the leader or
+ * the fetch failed.
+ */
+static int fetch(const char *name, int client_fd) {
+    char url[TEST_URL_MAX], request[TEST_HEAD_MAX];
+    size_t len = test_url(name, url, request);
+    cache_element *element;
+    cache_flight *flight;
+    cache_lookup_result result = cache_lookup(url, &element, &flight);
+    if (result != CACHE_LEADER) {
+        if (result == CACHE_FOLLOWER)
+            cache_flight_leave(flight);
+        if (result == CACHE_REFRESH)
+            cache_flight_complete(flight, 0, 0);
+        cache_release(element);
+        return -1;
+    }
+    cache_element *stale = cache_fill_stale(flight);
+    len = http_request_conditional(request, len, sizeof(request),
+                                   stale && stale->validators ? stale->validators : "");
+
+    http_response response;
+    size_t relayed;
+    int ret = -1;
+    int fd = origin_connect();
+    if (fd >= 0 && send_all(fd, request, len) == 0)
+        ret = relay_response(fd, client_fd, flight, &relayed, &response);
+    if (fd >= 0)
+        close(fd);
+    cache_flight_complete(flight, ret == 0, 1);
+    return ret;
+}
+
+/*
+ * store - Caches response under the URL of name as a fill would, fresh for fresh_for seconds
+ * (negative: already stale) and served while the origin fails for if_error more.
+ */
+static int store(const char *name, const char *response, int64_t fresh_for, int64_t if_error,
+                 const char *validators) {
+    char url[TEST_URL_MAX], request[TEST_HEAD_MAX];
+    test_url(name, url, request);
+    cache_element *element;
+    cache_flight *flight;
+    if (cache_lookup(url, &element, &flight) != CACHE_LEADER)
+        return -1;
+    cache_freshness freshness = { time(NULL) + fresh_for, fresh_for > 0 ? fresh_for : 0, 0,
+                                  if_error };
+    if (cache_fill_append(flight, response, strlen(response)) < 0 ||
+        cache_fill_freshness(flight, &freshness, validators) < 0) {
+        cache_flight_complete(flight, 0, 0);
+        return -1;
+    }
+    return cache_flight_complete(flight, 1, 1) ? 0 : -1;
+}
+
+// --- Freshness ---
+
+static void test_lifetime(void) {
+    http_response r;
+    time_t now = time(NULL);
+    char date[64], later[64], earlier[64], head[512];
+
+    parse_head(&r, "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\n\r\n");
+    CHECK(http_response_lifetime(&r, now) == 60);
+    parse_head(&r, "HTTP/1.1 200 OK\r\nCache-Control: max-age=60, s-maxage=30\r\n\r\n");
+    CHECK(http_response_lifetime(&r, now) == 30);
+    parse_head(&r, "HTTP/1.1 200 OK\r\nCache-Control: max-age=60, no-cache\r\n\r\n");
+    CHECK(http_response_lifetime(&r, now) == 0);
+    parse_head(&r, "HTTP/1.1 200 OK\r\n\r\n");
+    CHECK(http_response_lifetime(&r, now) == -1);
+
+    http_date(date, sizeof(date), now);
+    http_date(later, sizeof(later), now + 120);
+    http_date(earlier, sizeof(earlier), now - 1000);
+    snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nDate: %s\r\nExpires: %s\r\n\r\n", date,
+             later);
+    parse_head(&r, head);
+    CHECK(http_response_lifetime(&r, now) == 120);
+    // Max-age wins over Expires
+    snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nDate: %s\r\nExpires: %s\r\n"
+             "Cache-Control: max-age=5\r\n\r\n", date, later);
+    parse_head(&r, head);
+    CHECK(http_response_lifetime(&r, now) == 5);
+    // A tenth of the time since Last-Modified
+    snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nDate: %s\r\nLast-Modified: %s\r\n\r\n",
+             date, earlier);
+    parse_head(&r, head);
+    CHECK(http_response_lifetime(&r, now) == 100);
+
+    parse_head(&r, "HTTP/1.1 200 OK\r\nCache-Control: max-age=60\r\nAge: 50\r\n\r\n");
+    CHECK(http_response_age(&r, now) == 50);
+}
+
+static void test_storable(void) {
+    http_response r;
+    parse_head(&r, "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n");
+    CHECK(http_response_storable(&r));
+    parse_head(&r, "HTTP/1.1 200 OK\r\nCache-Control: no-store\r\n\r\n");
+    CHECK(!http_response_storable(&r));
+    parse_head(&r, "HTTP/1.1 200 OK\r\nCache-Control: private, max-age=60\r\n\r\n");
+    CHECK(!http_response_storable(&r));
+    parse_head(&r, "HTTP/1.1 304 Not Modified\r\nCache-Control: max-age=60\r\n\r\n");
+    CHECK(!http_response_storable(&r));
+    parse_head(&r, "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes 0-1/10\r\n\r\n");
+    CHECK(!http_response_storable(&r));
+    // Not cacheable by default, but explicitly fresh
+    parse_head(&r, "HTTP/1.1 302 Found\r\n\r\n");
+    CHECK(!http_response_storable(&r));
+    parse_head(&r, "HTTP/1.1 302 Found\r\nCache-Control: max-age=60\r\n\r\n");
+    CHECK(http_response_storable(&r));
+}
+
+static void test_validators(void) {
+    http_response r;
+    char validators[HTTP_VALIDATORS_MAX];
+    parse_head(&r, "HTTP/1.1 200 OK\r\nETag: \"v1\"\r\n"
+                   "Last-Modified: Tue, 15 Nov 1994 12:45:26 GMT\r\n\r\n");
+    CHECK(http_response_validators(&r, validators, sizeof(validators)) > 0);
+    CHECK(strstr(validators, "If-None-Match: \"v1\"\r\n") != NULL);
+    CHECK(strstr(validators, "If-Modified-Since: Tue, 15 Nov 1994 12:45:26 GMT\r\n") != NULL);
+    parse_head(&r, "HTTP/1.1 200 OK\r\n\r\n");
+    CHECK(http_response_validators(&r, validators, sizeof(validators)) == 0);
+
+    // The client's own conditionals give way to the cache's
+    char head[512] = "GET / HTTP/1.1\r\nHost: origin\r\nIf-None-Match: \"mine\"\r\n"
+                     "If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\nAccept: */*\r\n\r\n";
+    size_t len = http_request_conditional(head, strlen(head), sizeof(head),
+                                          "If-None-Match: \"v1\"\r\n");
+    CHECK(len == strlen(head));
+    CHECK(strstr(head, "\"mine\"") == NULL && strstr(head, "If-Modified-Since") == NULL);
+    CHECK(strstr(head, "If-None-Match: \"v1\"\r\n") != NULL);
+    CHECK(strstr(head, "Accept: */*\r\n") != NULL);
+    CHECK(len >= 4 && memcmp(head + len - 4, "\r\n\r\n", 4) == 0);
+}
+
+static void test_request_part(void) {
+    const char *request = "GET / HTTP/1.1\r\nHost: origin\r\nRange: bytes=5-9\r\n"
+                          "If-None-Match: \"mine\"\r\n\r\n";
+    char head[512];
+    snprintf(head, sizeof(head), "%s", request);
+    size_t len = http_request_part(head, strlen(head), sizeof(head), 0, 1048575);
+    CHECK(len == strlen(head));
+    CHECK(strcmp(head, "GET / HTTP/1.1\r\nHost: origin\r\nRange: bytes=0-1048575\r\n\r\n") == 0);
+
+    // No room for the Range line: sent without it, the request would fetch everything
+    snprintf(head, sizeof(head), "%s", request);
+    size_t room = strlen("GET / HTTP/1.1\r\nHost: origin\r\n\r\n") + 8;
+    CHECK(http_request_part(head, strlen(head), room, 0, 1048575) == 0);
+
+    // No room for the validators: the request goes out unconditional
+    snprintf(head, sizeof(head), "%s", request);
+    len = http_request_conditional(head, strlen(head), strlen(head) + 1,
+                                   "If-None-Match: \"longer than the client's own\"\r\n");
+    CHECK(len == strlen(head));
+    CHECK(strstr(head, "If-None-Match") == NULL);
+    CHECK(len >= 4 && memcmp(head + len - 4, "\r\n\r\n", 4) == 0);
+}
+
+// --- Revalidation ---
+
+static void test_fresh_hit(void) {
+    const char *response = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n"
+                           "Cache-Control: max-age=60\r\n\r\nfresh";
+    char url[TEST_URL_MAX], request[TEST_HEAD_MAX];
+    test_url("fresh", url, request);
+    origin_script(response);
+    int before = origin_requests();
+    CHECK(fetch("fresh", -1) == 0);
+    CHECK(cached(url, response));
+    CHECK(fresh(url));
+    CHECK(origin_requests() == before + 1);
+}
+
+static void test_not_stored(void) {
+    static const char *const responses[] = {
+        "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nCache-Control: no-store\r\n\r\nno",
+        "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nCache-Control: private, max-age=60\r\n\r\nno",
+    };
+    char url[TEST_URL_MAX], request[TEST_HEAD_MAX];
+    test_url("not-stored", url, request);
+    for (size_t i = 0; i < sizeof(responses) / sizeof(responses[0]); i++) {
+        origin_script(responses[i]);
+        CHECK(fetch("not-stored", -1) == 0);
+        CHECK(cache_acquire(url) == NULL);
+    }
+}
+
+/*
+ * test_revalidate_304 - A stale response is revalidated with its ETag; the 304 refills the
+ * cache with a fresh copy of it, and the client gets that instead of the 304.
+ */
+static void test_revalidate_304(void) {
+    const char *response = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nETag: \"v1\"\r\n"
+                           "Cache-Control: max-age=0\r\n\r\nfirst";
+    char url[TEST_URL_MAX], request[TEST_HEAD_MAX];
+    test_url("revalidated", url, request);
+    origin_script(response);
+    CHECK(fetch("revalidated", -1) == 0);
+    CHECK(cached(url, response));
+    CHECK(!fresh(url));
+
+    int client[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, client) < 0) {
+        perror("socketpair failed");
+        test_failed = 1;
+        return;
+    }
+    origin_script("HTTP/1.1 304 Not Modified\r\nETag: \"v1\"\r\n"
+                  "Cache-Control: max-age=60\r\n\r\n");
+    CHECK(fetch("revalidated", client[0]) == 0);
+    pthread_mutex_lock(&origin.lock);
+    CHECK(strstr(origin.request, "If-None-Match: \"v1\"\r\n") != NULL);
+    pthread_mutex_unlock(&origin.lock);
+    shutdown(client[0], SHUT_WR);
+    char received[TEST_HEAD_MAX];
+    ssize_t n, len = 0;
+    while ((n = recv(client[1], received + len, sizeof(received) - 1 - (size_t)len, 0)) > 0)
+        len += n;
+    received[len] = '\0';
+    close(client[0]);
+    close(client[1]);
+    CHECK(strcmp(received, response) == 0);
+    CHECK(cached(url, response));
+    CHECK(fresh(url));
+}
+
+/*
+ * test_revalidate_changed - A stale response revalidated with its Last-Modified date is
+ * replaced by the origin's new 200.
+ */
+static void test_revalidate_changed(void) {
+    const char *response = "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n"
+                           "Last-Modified: Tue, 15 Nov 1994 12:45:26 GMT\r\n"
+                           "Cache-Control: max-age=0\r\n\r\nold";
+    const char *changed = "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n"
+                          "Cache-Control: max-age=60\r\n\r\nnew";
+    char url[TEST_URL_MAX], request[TEST_HEAD_MAX];
+    test_url("changed", url, request);
+    origin_script(response);
+    CHECK(fetch("changed", -1) == 0);
+    origin_script(changed);
+    CHECK(fetch("changed", -1) == 0);
+    pthread_mutex_lock(&origin.lock);
+    CHECK(strstr(origin.request, "If-Modified-Since: Tue, 15 Nov 1994 12:45:26 GMT\r\n") != NULL);
+    pthread_mutex_unlock(&origin.lock);
+    CHECK(cached(url, changed));
+    CHECK(fresh(url));
+}
+
+/*
+ * test_refill_abort - A 304 refill whose copy of the stale element cannot be completed is
+ * abandoned, as both servers do: the stale element stays cached whole rather than being
+ * replaced by a truncated copy. The copy is made to overrun the element limit.
+ */
+static void test_refill_abort(void) {
+    // Fits the limit once, but not twice
+    static char response[TEST_ELEMENT_LIMIT / 3 * 2];
+    int head = snprintf(response, sizeof(response), "HTTP/1.1 200 OK\r\nContent-Length: %zu"
+                        "\r\n\r\n", sizeof(response));
+    head = snprintf(response, sizeof(response), "HTTP/1.1 200 OK\r\nContent-Length: %zu"
+                    "\r\n\r\n", sizeof(response) - 1 - (size_t)head);
+    memset(response + head, 'x', sizeof(response) - 1 - (size_t)head);
+    char url[TEST_URL_MAX], request[TEST_HEAD_MAX];
+    test_url("refill", url, request);
+    CHECK(store("refill", response, -1, 0, "If-None-Match: \"v1\"\r\n") == 0);
+
+    cache_element *element;
+    cache_flight *flight;
+    CHECK(cache_lookup(url, &element, &flight) == CACHE_LEADER);
+    CHECK(cache_fill_stale(flight) != NULL);
+    if (test_failed)
+        return;
+    CHECK(cache_fill_append(flight, response, sizeof(response) - 1) == 0);
+    http_response r;
+    parse_head(&r, "HTTP/1.1 304 Not Modified\r\nCache-Control: max-age=60\r\n\r\n");
+    CHECK(relay_revalidated(&r, flight) < 0);
+    cache_fill_abandon(flight);
+    CHECK(!cache_flight_complete(flight, 1, 1));
+
+    element = cache_acquire(url);
+    CHECK(element && atomic_load(&element->len) == sizeof(response) - 1);
+    if (element)
+        cache_release(element);
+    CHECK(!fresh(url));
+}
+
+/*
+ * test_refresh_timeout - A background refresh gives up on an origin that never answers after
+ * the timeout, and the stale element is then served while its stale-if-error window lasts.
+ */
+static void test_refresh_timeout(void) {
+    const char *response = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nstale";
+    char url[TEST_URL_MAX], request[TEST_HEAD_MAX];
+    size_t len = test_url("hanging", url, request);
+    CHECK(store("hanging", response, -1, 60, "If-None-Match: \"v1\"\r\n") == 0);
+    origin_script(NULL);
+
+    cache_element *element;
+    cache_flight *flight;
+    CHECK(cache_lookup(url, &element, &flight) == CACHE_LEADER);
+    if (test_failed)
+        return;
+    time_t start = time(NULL);
+    CHECK(refresh_start(flight, "127.0.0.1", origin.port, request, len) == 0);
+    // Follow the refresh until it gives up
+    cache_lookup_result result = cache_lookup_cached(url, &element, &flight);
+    if (result == CACHE_FOLLOWER) {
+        while (cache_flight_wait(flight, atomic_load(&element->len)) == CACHE_FILLING)
+            ;
+        cache_flight_leave(flight);
+        cache_release(element);
+    } else if (element) {
+        cache_release(element);
+    }
+    time_t waited = time(NULL) - start;
+    CHECK(waited >= TEST_TIMEOUT - 1 && waited <= TEST_TIMEOUT + 2);
+    pthread_mutex_lock(&origin.lock);
+    CHECK(strstr(origin.request, "If-None-Match: \"v1\"\r\n") != NULL);
+    pthread_mutex_unlock(&origin.lock);
+    CHECK(fresh(url));
+    CHECK(cached(url, response));
+    origin_script("");
+}
+
+// --- Name Resolution ---
+// getaddrinfo() is answered locally: localhost from the hosts file, and nothing ever for the
+// reserved .invalid domain (RFC 6761), so no name server is needed.
+
+/*
+ * resolver_lookups - getaddrinfo() calls made so far, read from the resolver's stats.
+ */
+static unsigned long resolver_lookups(void) {
+    char *text = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&text, &size);
+    if (!out)
+        return 0;
+    stats_dump(out);
+    fclose(out);
+    const char *at = strstr(text, ", lookups ");
+    unsigned long lookups = at ? strtoul(at + strlen(", lookups "), NULL, 10) : 0;
+    free(text);
+    return lookups;
+}
+
+static int is_loopback(const struct sockaddr_storage *addr, int port) {
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+    return sin->sin_family == AF_INET && sin->sin_addr.s_addr == htonl(INADDR_LOOPBACK) &&
+           sin->sin_port == htons((uint16_t)port);
+}
+
+static void never_notified(resolver_query *query) {
+}
+
+static void test_resolver_cache(void) {
+    resolver_query query = { .notify = never_notified };
+    struct sockaddr_storage addr;
+    socklen_t len;
+    unsigned long before = resolver_lookups();
+    // Numeric addresses are answered without a lookup
+    CHECK(resolver_start("127.0.0.1", 80, &query) == 1);
+    CHECK(query.status == 0 && is_loopback(&query.addr, 80));
+    CHECK(resolver_lookups() == before);
+
+    CHECK(resolver_lookup("localhost", 80, &addr, &len) == 0);
+    CHECK(is_loopback(&addr, 80));
+    CHECK(resolver_lookups() == before + 1);
+    // Cached: answered at once, for whatever port is asked
+    CHECK(resolver_start("localhost", 8080, &query) == 1);
+    CHECK(query.status == 0 && is_loopback(&query.addr, 8080));
+    CHECK(resolver_lookups() == before + 1);
+}
+
+static void test_resolver_negative(void) {
+    resolver_query query = { .notify = never_notified };
+    struct sockaddr_storage addr;
+    socklen_t len;
+    unsigned long before = resolver_lookups();
+    int status = resolver_lookup("nonexistent.invalid", 80, &addr, &len);
+    CHECK(status != 0);
+    CHECK(resolver_lookups() == before + 1);
+    // The failure is cached too, for RESOLVER_NEGATIVE_TTL seconds
+    CHECK(resolver_start("nonexistent.invalid", 80, &query) == 1);
+    CHECK(query.status == status);
+    CHECK(resolver_lookups() == before + 1);
+}
+
+// Gate holding the resolver threads in notify callbacks, so lookups queue up behind them
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int open;
+    int blocked;                        // Resolver threads waiting at the gate
+    int answered;                       // Queries answered through count_notify()
+} gate = { .lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER };
+
+/*
+ * gate_notify - Blocks the resolver thread until the gate opens, which a real notify callback
+ * must never do.
+ */
+static void gate_notify(resolver_query *query) {
+    pthread_mutex_lock(&gate.lock);
+    gate.blocked++;
+    pthread_cond_broadcast(&gate.changed);
+    while (!gate.open)
+        pthread_cond_wait(&gate.changed, &gate.lock);
+    pthread_mutex_unlock(&gate.lock);
+}
+
+static void count_notify(resolver_query *query) {
+    pthread_mutex_lock(&gate.lock);
+    gate.answered++;
+    pthread_cond_broadcast(&gate.changed);
+    pthread_mutex_unlock(&gate.lock);
+}
+
+/*
+ * test_resolver_shared - Once localhost's address has expired, TEST_QUERIES queries for it
+ * made while every resolver thread is busy all wait for the one lookup that renews it.
+ */
+static void test_resolver_shared(void) {
+    static resolver_query blockers[TEST_RESOLVER_THREADS], queries[TEST_QUERIES];
+    sleep(TEST_RESOLVER_TTL + 1);
+    gate.open = gate.blocked = gate.answered = 0;
+    for (int i = 0; i < TEST_RESOLVER_THREADS; i++) {
+        char host[64];
+        snprintf(host, sizeof(host), "blocker-%d.invalid", i);
+        blockers[i].notify = gate_notify;
+        CHECK(resolver_start(host, 80, &blockers[i]) == 0);
+    }
+    pthread_mutex_lock(&gate.lock);
+    while (gate.blocked < TEST_RESOLVER_THREADS)
+        pthread_cond_wait(&gate.changed, &gate.lock);
+    pthread_mutex_unlock(&gate.lock);
+
+    unsigned long before = resolver_lookups();
+    int waiting = 0;
+    for (int i = 0; i < TEST_QUERIES; i++) {
+        queries[i].notify = count_notify;
+        waiting += resolver_start("localhost", 80 + i, &queries[i]) == 0;
+    }
+    CHECK(waiting == TEST_QUERIES);
+    pthread_mutex_lock(&gate.lock);
+    gate.open = 1;
+    pthread_cond_broadcast(&gate.changed);
+    while (gate.answered < waiting)
+        pthread_cond_wait(&gate.changed, &gate.lock);
+    pthread_mutex_unlock(&gate.lock);
+    for (int i = 0; i < TEST_QUERIES; i++)
+        CHECK(queries[i].status == 0 && is_loopback(&queries[i].addr, 80 + i));
+    CHECK(resolver_lookups() == before + 1);
+}
+
+// --- Runner ---
+
+typedef struct test_case {
+    const char *name;
+    void (*run)(void);
+} test_case;
+
+static const test_case tests[] = {
+    {"lifetime", test_lifetime},
+    {"storable", test_storable},
+    {"validators", test_validators},
+    {"request part", test_request_part},
+    {"fresh hit", test_fresh_hit},
+    {"not stored", test_not_stored},
+    {"revalidate 304", test_revalidate_304},
+    {"revalidate changed", test_revalidate_changed},
+    {"refill abort", test_refill_abort},
+    {"refresh timeout", test_refresh_timeout},
+    {"resolver cache", test_resolver_cache},
+    {"resolver negative", test_resolver_negative},
+    {"resolver shared", test_resolver_shared},
+};
+
+int main(int argc, char **argv) {
+    if (cache_init(0, 0, TEST_ELEMENT_LIMIT, NULL) < 0 ||
+        resolver_init(TEST_RESOLVER_THREADS, TEST_RESOLVER_TTL) < 0 || refresh_init(1, TEST_TIMEOUT) < 0 ||
+        origin_start() < 0)
+        return EXIT_FAILURE;
+    relay_init(0, 0);
+
+    int failures = 0;
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        // Run only the tests named on the command line, if any
+        int selected = argc < 2;
+        for (int a = 1; a < argc; a++)
+            selected |= strcmp(argv[a], tests[i].name) == 0;
+        if (!selected)
+            continue;
+        test_failed = 0;
+        tests[i].run();
+        printf("%s %s\n", test_failed ? "FAIL" : "ok  ", tests[i].name);
+        failures += test_failed;
+    }
+    return failures;
+}
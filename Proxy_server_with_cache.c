@@ -3,27 +3,38 @@
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <signal.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <getopt.h>
+
+#include "proxy_cache.h"
+#include "proxy_policy.h"
+#include "proxy_relay.h"
+#include "proxy_reactor.h"
+#include "proxy_pool.h"
+#include "proxy_listen.h"
+#include "proxy_upstream.h"
+#include "proxy_resolver.h"
+#include "proxy_refresh.h"
+#include "proxy_disk.h"
+#include "proxy_stats.h"
+#include "proxy_arena.h"
+#include "proxy_key.h"
+#include "proxy_range.h"
 
 #define PORT 8080
-#define BUFFER_SIZE 1024
-#define CACHE_SIZE 5
-
-// Structure for cache entry
-typedef struct CacheEntry {
-    char url[256];
-    char *data;
-    size_t size;
-    struct CacheEntry *prev, *next;
-} CacheEntry;
-
-// Cache variables
-CacheEntry *cache_head = NULL, *cache_tail = NULL;
-int cache_count = 0;
-pthread_mutex_t cache_lock;
+#define CACHE_SIZE (50 * (1 << 20))         // Cache budget in bytes, split between shards
+#define MAX_ELEMENT_SIZE (10 * (1 << 20))   // Responses larger than this are relayed uncached
+#define CACHE_SHARDS 0   // Default shard count: from the CPUs, as many as can each hold MAX_ELEMENT_SIZE
+#define QUEUE_DEPTH 256   // Accepted sockets each worker can have queued
+#define LISTEN_BACKLOG SOMAXCONN   // Connections the kernel queues before accept()
+#define KEEPALIVE_TIMEOUT 15   // Seconds a kept-alive client may idle between requests
+#define ORIGIN_IP "93.184.216.34"   // Example.com IP
+#define ORIGIN_HOST "example.com"   // Host the origin serves; relative URLs are keyed under it
+#define ORIGIN_PORT 80
+#define ORIGIN_REQUEST "GET %s HTTP/1.0\r\nHost: " ORIGIN_HOST "\r\nConnection: keep-alive\r\n\r\n"
 
 // Utility to print headers for logs
 void print_log_headers() {
@@ -37,198 +48,413 @@ void log_step(const char *step, const char *url) {
     printf("| %-29s | %-30s |\n", step, url);
 }
 
-// Function to remove a cache entry
-void remove_cache_entry(CacheEntry *entry) {
-    if (!entry) return;
-
-    if (entry->prev) entry->prev->next = entry->next;
-    else cache_head = entry->next;
-
-    if (entry->next) entry->next->prev = entry->prev;
-    else cache_tail = entry->prev;
-
-    free(entry->data);
-    free(entry);
-    cache_count--;
-}
-
-// Function to add a new entry to the cache
-void add_to_cache(const char *url, const char *data, size_t size) {
-    if (cache_count == CACHE_SIZE) {
-        remove_cache_entry(cache_tail);
+// Function to copy the URL of a GET request head into url (CLIENT_BUFFER_SIZE bytes) and
+// build its cache key into key (CACHE_KEY_MAX bytes); returns 0, or -1 if it is not one
+int parse_url(const char *head, char *url, char *key) {
+    size_t len;
+    const char *target = http_request_target(head, &len);
+    if (strncmp(head, "GET ", 4) != 0 || !target || len >= CLIENT_BUFFER_SIZE) {
+        return -1;
     }
-
-    CacheEntry *new_entry = (CacheEntry *)malloc(sizeof(CacheEntry));
-    strncpy(new_entry->url, url, sizeof(new_entry->url));
-    new_entry->data = (char *)malloc(size);
-    memcpy(new_entry->data, data, size);
-    new_entry->size = size;
-    new_entry->prev = NULL;
-    new_entry->next = cache_head;
-
-    if (cache_head) cache_head->prev = new_entry;
-    else cache_tail = new_entry;
-
-    cache_head = new_entry;
-    cache_count++;
-}
-
-// Function to find a URL in the cache
-CacheEntry *find_in_cache(const char *url) {
-    CacheEntry *current = cache_head;
-    while (current) {
-        if (strcmp(current->url, url) == 0) {
-            // Move to head (LRU policy)
-            if (current != cache_head) {
-                if (current->prev) current->prev->next = current->next;
-                if (current->next) current->next->prev = current->prev;
-                else cache_tail = current->prev;
-
-                current->next = cache_head;
-                current->prev = NULL;
-                if (cache_head) cache_head->prev = current;
-                cache_head = current;
-            }
-            return current;
-        }
-        current = current->next;
+    memcpy(url, target, len);
+    url[len] = '\0';
+    if (cache_key_build(key, CACHE_KEY_MAX, head, "http", ORIGIN_HOST, NULL, url, len) == 0) {
+        return -1;
     }
-    return NULL;
+    return 0;
 }
 
-// Function to fetch data from the server
-char *fetch_from_server(const char *url) {
-    const char *server_ip = "93.184.216.34"; // Example.com IP
-    int server_port = 80;
-
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
+// Function to get a (possibly pooled) connection to the server and send it the request for
+// url, made conditional on validators when a stale copy is being revalidated (NULL if not)
+int connect_to_server(const char *url, const char *validators, int *reused) {
+    int server_socket = upstream_open(ORIGIN_IP, ORIGIN_PORT, reused);
     if (server_socket < 0) {
-        perror("Socket creation failed");
-        return NULL;
+        return -1;
     }
 
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(server_port);
-    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
-
-    if (connect(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Connection to server failed");
-        close(server_socket);
-        return NULL;
+    char request[CLIENT_BUFFER_SIZE + sizeof(ORIGIN_REQUEST) + HTTP_VALIDATORS_MAX];
+    size_t len = (size_t)snprintf(request, sizeof(request), ORIGIN_REQUEST, url);
+    if (validators) {
+        len = http_request_conditional(request, len, sizeof(request), validators);
     }
-
-    char request[BUFFER_SIZE];
-    snprintf(request, sizeof(request), "GET %s HTTP/1.0\r\nHost: example.com\r\n\r\n", url);
     log_step("Proxy: Request Sent To", url);
-    send(server_socket, request, strlen(request), 0);
-
-    char *response = (char *)malloc(BUFFER_SIZE);
-    size_t total_size = 0, received;
-    while ((received = recv(server_socket, response + total_size, BUFFER_SIZE - total_size, 0)) > 0) {
-        total_size += received;
-        response = (char *)realloc(response, total_size + BUFFER_SIZE);
+    if (send_all(server_socket, request, len) < 0) {
+        perror("Sending request to server failed");
+        upstream_release(ORIGIN_IP, ORIGIN_PORT, server_socket, 0);
+        return -1;
     }
-    log_step("Proxy: Received Response From", url);
+    return server_socket;
+}
 
-    close(server_socket);
-    return response;
+// Event loop hook: the URL is requested from the origin as sent, and cached under its
+// canonical form
+int prepare_client_request(const char *head, size_t len, reactor_request *request, arena *scratch) {
+    (void)len;    // parse_url() reads the head up to its NUL
+    char url[CLIENT_BUFFER_SIZE];
+    char key[CACHE_KEY_MAX];
+    if (parse_url(head, url, key) < 0)
+        return 400;
+    log_step("Received Request For", url);
+
+    size_t size = strlen(url) + sizeof(ORIGIN_REQUEST);
+    request->key = arena_strdup(scratch, key);
+    request->host = ORIGIN_IP;
+    request->port = ORIGIN_PORT;
+    request->upstream = arena_alloc(scratch, size);
+    if (!request->key || !request->host || !request->upstream)
+        return 500;
+    request->upstream_len = (size_t)snprintf(request->upstream, size, ORIGIN_REQUEST, url);
+    return 0;
 }
 
-// Function to handle client requests
-void *handle_client(void *arg) {
-    int client_socket = *(int *)arg;
-    free(arg);
+// Event loop hook: minimal error response; the connection is closed after it
+int format_error(char *buf, size_t size, int status) {
+    return snprintf(buf, size, "HTTP/1.0 %d %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+                    status, status == 400 ? "Bad Request" :
+                            status == 503 ? "Service Unavailable" : "Internal Server Error");
+}
 
-    char buffer[BUFFER_SIZE], url[256];
-    read(client_socket, buffer, sizeof(buffer));
-    sscanf(buffer, "GET %s HTTP", url);
+// Function to answer one request; returns 1 if the client may send another on the connection
+int serve_request(int client_socket, const char *head) {
+    char url[CLIENT_BUFFER_SIZE];
+    char key[CACHE_KEY_MAX];
+    if (parse_url(head, url, key) < 0) {
+        char response[128];
+        int len = format_error(response, sizeof(response), 400);
+        send_all(client_socket, response, (size_t)len);
+        return 0;
+    }
+    int keep_alive = http_request_keep_alive(head);
+    http_response response;
+    http_response_init(&response);
 
     log_step("Received Request For", url);
 
-    pthread_mutex_lock(&cache_lock);
+    // A request missing the whole response is served from cached parts of it instead; only
+    // one for the whole response that has none fetches it
+    range_state range;
+    int ranged = range_request(&range, head);
+    char request[CLIENT_BUFFER_SIZE + sizeof(ORIGIN_REQUEST)];
+    int request_len = snprintf(request, sizeof(request), ORIGIN_REQUEST, url);
+    range_origin origin = { key, ORIGIN_IP, ORIGIN_PORT, request, (size_t)request_len };
+
+    cache_element *entry;
+    cache_flight *flight;
+    cache_lookup_result result = cache_lookup_cached(key, &entry, &flight);
+    if (!ranged && result == CACHE_LEADER && !flight) {
+        result = range_whole(&range, &origin, &entry, &flight);
+        ranged = result != CACHE_LEADER;
+        if (!ranged)
+            result = cache_lookup(key, &entry, &flight);
+    }
+    log_step("Cache Check For", url);
+
+    if (result == CACHE_REFRESH) {
+        // Serve the stale copy right away; a refresh thread revalidates it meanwhile
+        refresh_start(flight, ORIGIN_IP, ORIGIN_PORT, request, (size_t)request_len);
+        log_step("Refreshing In Background", url);
+        flight = NULL;
+        result = CACHE_HIT;
+    }
 
-    CacheEntry *entry = find_in_cache(url);
-    if (entry) {
-        log_step("Cache Check For", url);
-        log_step("Cache Hit", url);
-        pthread_mutex_unlock(&cache_lock);
+    if (result != CACHE_LEADER) {
+        // A hit, or another thread is already fetching this URL: stream its element as it fills
+        log_step(result == CACHE_HIT ? "Cache Hit" : "Joining In-Flight Fetch", url);
+
+        // The reference keeps entry valid even if it is evicted while we send
+        size_t sent;
+        int ret = 1;
+        if (ranged)
+            ret = range_send(client_socket, &range, &origin, entry, flight, &sent, &response);
+        // A part holds only a slice of the whole response asked for
+        if (ret > 0 && !range.whole)
+            ret = relay_cached(client_socket, entry, flight, &sent, &response);
+        if (flight)
+            cache_flight_leave(flight);
+        cache_release(entry);
+
+        // The leader gave up before we sent anything: if its revalidation found the origin
+        // failing, the stale copy stands in; otherwise fetch on our own, uncached
+        if (ret < 0 && sent == 0 && (entry = cache_fallback(key)) != NULL) {
+            log_step("Serving Stale Copy", url);
+            ret = relay_cached(client_socket, entry, NULL, &sent, &response);
+            cache_release(entry);
+        }
+        flight = NULL;
+        if (ret < 0)
+            keep_alive = 0;
+        if (ret == 0 || sent > 0)
+            result = CACHE_HIT;
+        else
+            result = CACHE_LEADER;
+    }
 
-        send(client_socket, entry->data, entry->size, 0);
-    } else {
-        log_step("Cache Check For", url);
+    if (result == CACHE_LEADER && ranged && !range.whole && !flight) {
+        size_t sent;
+        int ret = range_send(client_socket, &range, &origin, NULL, NULL, &sent, &response);
+        if (ret < 0)
+            keep_alive = 0;
+        if (ret <= 0) {
+            log_step("Range Served From Cached Parts", url);
+            result = CACHE_HIT;
+        }
+    }
+
+    if (result == CACHE_LEADER) {
         log_step("Cache Miss", url);
-        pthread_mutex_unlock(&cache_lock);
 
-        log_step("Fetching From Server", url);
-        char *response = fetch_from_server(url);
+        cache_element *stale = cache_fill_stale(flight);
+        log_step(stale ? "Revalidating With Server" : "Fetching From Server", url);
+        int ret = -1;
+        size_t relayed = 0;
+        // A pooled connection may have been closed by the origin: retry once on a new one
+        for (int attempt = 0; attempt < 2 && ret < 0 && relayed == 0; attempt++) {
+            int reused = 0;
+            int server_socket = connect_to_server(url, stale ? stale->validators : NULL, &reused);
+            if (server_socket < 0) {
+                if (!reused) {
+                    break;
+                }
+                continue;
+            }
+            // Forward each chunk as it arrives while filling the cache element in place
+            ret = relay_response(server_socket, client_socket, flight, &relayed, &response);
+            log_step("Proxy: Received Response From", url);
+            upstream_release(ORIGIN_IP, ORIGIN_PORT, server_socket,
+                             http_response_reusable(&response));
+            if (!reused) {
+                break;
+            }
+        }
+        // Nothing reached the client: the stale copy may stand in for the failing origin
+        if (ret < 0 && relayed == 0 && relay_stale(client_socket, flight, &response) == 0)
+            log_step("Serving Stale Copy", url);
+        else if (ret < 0)
+            keep_alive = 0;
+        if (cache_flight_complete(flight, ret == 0, 1))
+            log_step("Cached Response For", url);
+        // One too large to cache whole is cached in parts for the requests that follow
+        else if (relayed > 0)
+            range_seed(&origin, &response);
+    }
+
+    log_step("Response Sent To Client From Proxy", url);
+    return keep_alive && http_response_reusable(&response);
+}
 
-        pthread_mutex_lock(&cache_lock);
-        add_to_cache(url, response, strlen(response));
-        log_step("Cached Response For", url);
-        pthread_mutex_unlock(&cache_lock);
+// Function to handle a client's requests in order while it keeps the connection, run by a
+// pool worker; returns 1 to park the connection until the next request arrives
+int handle_client(int client_socket) {
+    client_reader reader;
+    client_reader_init(&reader, client_socket);
 
-        send(client_socket, response, strlen(response), 0);
-        free(response);
+    int keep_alive = 0, pending = 0;
+    do {
+        if (client_read_head(&reader) <= 0) {
+            break;
+        }
+        keep_alive = serve_request(client_socket, reader.buffer);
+        pending = client_next(&reader);
+    } while (keep_alive && pending);
+
+    if (keep_alive && !pending) {
+        return 1;
     }
+    close(client_socket);
+    log_step("Request Processing Completed", "");
+    return 0;
+}
 
-    log_step("Response Sent To Client From Proxy", url);
+// All workers are backed up: turn the client away rather than block accepting
+void reject_client(int client_socket) {
+    char response[128];
+    int len = format_error(response, sizeof(response), 503);
+    send_all(client_socket, response, (size_t)len);
     close(client_socket);
-    log_step("Request Processing Completed", url);
-    return NULL;
+}
+
+// Utility to print the command line synopsis
+void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--cache-shards=N] [--cache-policy=lru|lfu|slru|tinylfu] "
+            "[--mode=threads|epoll] [--workers=N] [--queue-depth=N] [--loops=N] "
+            "[--keepalive-timeout=S] [--reuseport] [--pin-cpus] [--upstream-max-idle=N] [--upstream-idle-timeout=S] "
+            "[--stale-while-revalidate=S] [--stale-if-error=S] [--refresh-threads=N] [--refresh-timeout=S] "
+            "[--disk-cache=DIR] [--disk-size=MB] [--snapshot-interval=S] [port]\n", prog);
 }
 
 int main(int argc, char *argv[]) {
     int port = PORT;
-    if (argc > 1) {
-        port = atoi(argv[1]);
+    size_t shards = CACHE_SHARDS;
+    const cache_policy_ops *policy = &cache_policy_lru;
+    int use_reactor = 0;
+    int loops = 0;
+    int workers = 0;
+    size_t queue_depth = QUEUE_DEPTH;
+    int reuseport = 0;
+    int pin = 0;
+    int keepalive_timeout = KEEPALIVE_TIMEOUT;
+    int max_idle = UPSTREAM_MAX_IDLE;
+    int idle_timeout = UPSTREAM_IDLE_TIMEOUT;
+    int stale_while_revalidate = RELAY_STALE_WHILE_REVALIDATE;
+    int stale_if_error = RELAY_STALE_IF_ERROR;
+    int refresh_threads = REFRESH_THREADS;
+    int refresh_timeout = REFRESH_TIMEOUT;
+    const char *disk_dir = NULL;
+    uint64_t disk_size = DISK_BUDGET;
+    int snapshot_interval = DISK_SNAPSHOT_INTERVAL;
+
+    static const struct option long_options[] = {
+        {"cache-shards", required_argument, NULL, 's'},
+        {"cache-policy", required_argument, NULL, 'p'},
+        {"mode", required_argument, NULL, 'm'},
+        {"loops", required_argument, NULL, 'l'},
+        {"workers", required_argument, NULL, 'w'},
+        {"queue-depth", required_argument, NULL, 'q'},
+        {"keepalive-timeout", required_argument, NULL, 'a'},
+        {"reuseport", no_argument, NULL, 'r'},
+        {"pin-cpus", no_argument, NULL, 'c'},
+        {"upstream-max-idle", required_argument, NULL, 'k'},
+        {"upstream-idle-timeout", required_argument, NULL, 't'},
+        {"stale-while-revalidate", required_argument, NULL, 'v'},
+        {"stale-if-error", required_argument, NULL, 'e'},
+        {"refresh-threads", required_argument, NULL, 'f'},
+        {"refresh-timeout", required_argument, NULL, 'o'},
+        {"disk-cache", required_argument, NULL, 'D'},
+        {"disk-size", required_argument, NULL, 'z'},
+        {"snapshot-interval", required_argument, NULL, 'i'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:p:m:l:w:q:a:rck:t:v:e:f:o:D:z:i:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 's':
+                shards = strtoul(optarg, NULL, 10);
+                break;
+            case 'l':
+                loops = atoi(optarg);
+                break;
+            case 'w':
+                workers = atoi(optarg);
+                break;
+            case 'q':
+                queue_depth = strtoul(optarg, NULL, 10);
+                break;
+            case 'a':
+                keepalive_timeout = atoi(optarg);
+                break;
+            case 'r':
+                reuseport = 1;
+                break;
+            case 'c':
+                pin = 1;
+                break;
+            case 'k':
+                max_idle = atoi(optarg);
+                break;
+            case 't':
+                idle_timeout = atoi(optarg);
+                break;
+            case 'v':
+                stale_while_revalidate = atoi(optarg);
+                break;
+            case 'e':
+                stale_if_error = atoi(optarg);
+                break;
+            case 'f':
+                refresh_threads = atoi(optarg);
+                break;
+            case 'o':
+                refresh_timeout = atoi(optarg);
+                break;
+            case 'D':
+                disk_dir = optarg;
+                break;
+            case 'z':
+                disk_size = strtoull(optarg, NULL, 10) << 20;
+                break;
+            case 'i':
+                snapshot_interval = atoi(optarg);
+                break;
+            case 'm':
+                use_reactor = strcmp(optarg, "epoll") == 0;
+                if (use_reactor || strcmp(optarg, "threads") == 0)
+                    break;
+                fprintf(stderr, "Unknown mode: %s\n", optarg);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            case 'p':
+                policy = cache_policy_find(optarg);
+                if (policy)
+                    break;
+                fprintf(stderr, "Unknown cache policy: %s\n", optarg);
+                // fall through
+            default:
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind < argc) {
+        port = atoi(argv[optind]);
     }
 
-    pthread_mutex_init(&cache_lock, NULL);
-
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0) {
-        perror("Socket creation failed");
+    // SIGTERM snapshots the disk cache and SIGUSR1 prints stats; set up before any other
+    // thread so they all block them
+    if (disk_dir && disk_snapshot_on_signal(SIGTERM) < 0) {
         exit(EXIT_FAILURE);
     }
-
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
-
-    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Bind failed");
-        close(server_socket);
+    if (stats_dump_on_signal(SIGUSR1) < 0) {
         exit(EXIT_FAILURE);
     }
 
-    if (listen(server_socket, 10) < 0) {
-        perror("Listen failed");
-        close(server_socket);
+    if (cache_init(shards, CACHE_SIZE, MAX_ELEMENT_SIZE, policy) < 0) {
         exit(EXIT_FAILURE);
     }
-
-    printf("Proxy server is running on port %d...\n", port);
-    print_log_headers();
-
-    while (1) {
-        int client_socket = accept(server_socket, NULL, NULL);
-        if (client_socket < 0) {
-            perror("Failed to accept connection");
-            continue;
+    if (disk_dir && disk_init(disk_dir, disk_size, snapshot_interval) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (resolver_init(RESOLVER_THREADS, RESOLVER_TTL) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (refresh_init(refresh_threads, refresh_timeout) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    upstream_init(max_idle, idle_timeout);
+    relay_init(stale_while_revalidate, stale_if_error);
+    range_init();
+
+    // One listener, or with --reuseport one per event loop / per CPU acceptor
+    int listen_count = 1;
+    if (reuseport) {
+        listen_count = use_reactor && loops > 0 ? loops : online_cpus();
+    }
+    int *listen_fds = (int *)calloc((size_t)listen_count, sizeof(int));
+    if (!listen_fds) {
+        perror("calloc failed for listening sockets");
+        exit(EXIT_FAILURE);
+    }
+    if (reuseport) {
+        if (listen_sockets(port, LISTEN_BACKLOG, listen_fds, listen_count) < 0) {
+            exit(EXIT_FAILURE);
         }
+    } else if ((listen_fds[0] = listen_socket(port, LISTEN_BACKLOG, 0)) < 0) {
+        exit(EXIT_FAILURE);
+    }
 
-        int *client_socket_ptr = malloc(sizeof(int));
-        *client_socket_ptr = client_socket;
+    printf("Proxy server is running on port %d (%d listener(s))...\n", port, listen_count);
+    print_log_headers();
 
-        pthread_t thread;
-        pthread_create(&thread, NULL, handle_client, client_socket_ptr);
-        pthread_detach(thread);
+    if (use_reactor) {
+        reactor_handler handler = { prepare_client_request, format_error, keepalive_timeout };
+        reactor_run(listen_fds, listen_count, loops, pin, &handler);
+        exit(EXIT_FAILURE);
     }
 
-    close(server_socket);
-    pthread_mutex_destroy(&cache_lock);
+    worker_pool *pool = pool_create(workers, queue_depth, keepalive_timeout, handle_client,
+                                    reject_client);
+    if (!pool) {
+        exit(EXIT_FAILURE);
+    }
 
-    return 0;
+    pool_serve(pool, listen_fds, listen_count, pin);
+    exit(EXIT_FAILURE);
 }
@@ -0,0 +1,63 @@
+#include "proxy_arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void arena_init(arena *a, size_t chunk_size) {
+    a->chunks = NULL;
+    a->chunk_size = chunk_size ? chunk_size : ARENA_CHUNK_SIZE;
+}
+
+/*
+ * arena_alloc - Only the newest chunk is bumped; when it is full a new one is chained, big
+ * enough for the request if that exceeds chunk_size.
+ */
+void *arena_alloc(arena *a, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    arena_chunk *chunk = a->chunks;
+    if (!chunk || chunk->size - chunk->used < size) {
+        size_t chunk_size = size > a->chunk_size ? size : a->chunk_size;
+        chunk = (arena_chunk *)malloc(sizeof(arena_chunk) + chunk_size);
+        if (!chunk) {
+            perror("malloc failed for arena chunk");
+            return NULL;
+        }
+        chunk->next = a->chunks;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        a->chunks = chunk;
+    }
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+char *arena_strdup(arena *a, const char *s) {
+    size_t len = strlen(s) + 1;
+    char *copy = (char *)arena_alloc(a, len);
+    if (copy)
+        memcpy(copy, s, len);
+    return copy;
+}
+
+void arena_reset(arena *a) {
+    arena_chunk *chunk = a->chunks;
+    if (!chunk)
+        return;
+    while (chunk->next) {
+        arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    chunk->used = 0;
+    a->chunks = chunk;
+}
+
+void arena_destroy(arena *a) {
+    while (a->chunks) {
+        arena_chunk *next = a->chunks->next;
+        free(a->chunks);
+        a->chunks = next;
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef PROXY_ARENA_H
+#define PROXY_ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_CHUNK_SIZE 16384          // Default bytes per chunk: a request head plus its rewrite
+
+// --- Request Arena ---
+// Bump allocator for memory that lives exactly as long as one request. Nothing is freed on
+// its own; arena_reset() drops everything between requests but keeps the first chunk, so a
+// connection whose requests fit in it allocates nothing after the first.
+typedef struct arena_chunk {
+    struct arena_chunk *next;           // Chunk allocated before this one
+    size_t size;                        // Bytes of data[]
+    size_t used;
+    char data[] __attribute__((aligned(16)));
+} arena_chunk;
+
+typedef struct arena {
+    arena_chunk *chunks;                // Newest first; the oldest survives arena_reset()
+    size_t chunk_size;
+} arena;
+
+/*
+ * arena_init - Sets up an empty arena allocating chunk_size bytes at a time (0 =
+ * ARENA_CHUNK_SIZE). No memory is taken until the first allocation.
+ */
+void arena_init(arena *a, size_t chunk_size);
+
+/*
+ * arena_alloc - Returns size bytes (uninitialised, 16-byte aligned) valid until the next
+ * arena_reset(), or NULL on failure.
+ */
+void *arena_alloc(arena *a, size_t size);
+
+/*
+ * arena_strdup - Copies s into the arena. Returns NULL on failure.
+ */
+char *arena_strdup(arena *a, const char *s);
+
+/*
+ * arena_reset - Releases every allocation at once, keeping the first chunk for reuse.
+ */
+void arena_reset(arena *a);
+
+/*
+ * arena_destroy - Frees every chunk. The arena can be used again afterwards.
+ */
+void arena_destroy(arena *a);
+
+#endif
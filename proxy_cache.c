@@ -0,0 +1,1331 @@
+#include "proxy_cache.h"
+#include "proxy_disk.h"
+#include "proxy_policy.h"
+#include "proxy_slab.h"
+#include "proxy_stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define INDEX_MIN_CAPACITY  64           // Initial number of hash index slots (power of two)
+#define INDEX_MAX_LOAD_PCT  70           // Grow the index beyond this load (live + tombstones)
+#define READ_BUFFER_SIZE    64           // Recorded hits per shard awaiting the policy
+#define SEGMENT_MIN_ALLOC   4096         // First segment of an element (bytes incl. header)
+#define SEGMENT_MAX_ALLOC   (64 * 1024)  // Segments double in size up to this
+
+// Marker left in a slot whose element was removed, so probe chains stay intact
+#define SLOT_TOMBSTONE ((cache_element *)1)
+
+// --- Hash Index ---
+// Readers probe the table without locks. Writers only ever fill empty slots or turn live slots
+// into tombstones, so a concurrent probe never loses its chain. Growing publishes a new table.
+typedef struct index_slot {
+    uint64_t hash;                          // Hash of the element, written before publishing
+    _Atomic(cache_element *) element;       // NULL (empty), SLOT_TOMBSTONE or a live element
+} index_slot;
+
+typedef struct index_table {
+    cache_retired retired;                  // Frees the table once replaced and unobserved
+    size_t capacity;                        // Number of slots (power of two)
+    index_slot slots[];
+} index_table;
+
+// --- Cache Shard ---
+// Each shard is an independent cache (index, eviction policy, budget) behind its own lock.
+// The lock is only taken by writers and by whoever drains the read buffer.
+typedef struct cache_shard {
+    pthread_mutex_t lock;                   // Guards every field below except the atomics
+    _Atomic(index_table *) index;           // Current table, read lock-free by cache_acquire()
+    size_t index_used;                      // Live elements in the table
+    size_t index_tombstones;                // Removed slots still occupying probe chains
+    cache_policy *policy;                   // Orders the elements and picks victims
+    size_t size;                            // Bytes charged against max_bytes
+    size_t max_bytes;                       // Byte budget (0 = unbounded)
+    struct cache_flight *flights;           // Fetches in progress for keys of this shard
+    _Atomic(cache_element *) read_buffer[READ_BUFFER_SIZE];  // Pinned hits not yet promoted
+    atomic_size_t read_count;               // Hits recorded so far (ring position)
+} __attribute__((aligned(64))) cache_shard;
+
+// --- Single-Flight Fetch ---
+// The first miss on a key becomes the leader and receives the origin response straight into a
+// new element; later misses for the same key stream that element as it grows instead of going
+// to the origin themselves. The element is published in the cache only once complete.
+struct cache_flight {
+    cache_element *element;                 // Element being filled (holds one reference)
+    cache_element *stale;                   // Element being revalidated (pinned), or NULL
+    cache_element *rewrite;                 // Published instead of element, if the leader built it
+    cache_shard *shard;                     // Shard whose lock guards refs and next
+    int refs;                               // Leader plus followers
+    struct cache_flight *next;              // Next flight in the shard's list
+    pthread_mutex_t wait_lock;              // Pairs with grow_cond
+    pthread_cond_t grow_cond;               // Signalled when the element grows or finishes
+    cache_flight_watcher *watchers;         // Event-driven followers to notify (guarded by wait_lock)
+    atomic_int waiting;                     // Followers blocked on grow_cond or watching
+};
+
+// --- Epoch Reclamation ---
+// A thread inside a lock-free read publishes the epoch it started in. Anything retired at
+// epoch E is reclaimed once every active reader has published an epoch later than E.
+typedef struct epoch_record {
+    atomic_uint_fast64_t state;             // (epoch << 1) | 1 while reading, 0 otherwise
+    atomic_int in_use;                      // Owned by a live thread
+    struct epoch_record *next;              // Next record in epoch_records
+} epoch_record;
+
+// --- Global Variables ---
+static cache_shard *cache_shards = NULL;    // Array of cache_shard_count shards
+static size_t cache_shard_count = 0;        // Power of two
+static size_t cache_max_element = 0;        // Largest fill kept (0 = bounded by the shard budget)
+static size_t cache_max_bytes = 0;          // Budget passed to cache_init() (0 = unbounded)
+
+static atomic_uint_fast64_t global_epoch = 1;           // Advanced on every retirement
+static _Atomic(epoch_record *) epoch_records = NULL;    // Every record ever registered
+static pthread_key_t epoch_key;                          // Releases a thread's record on exit
+static pthread_once_t epoch_key_once = PTHREAD_ONCE_INIT;
+static __thread epoch_record *thread_record = NULL;      // This thread's record
+
+static pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;  // Guards the retire list
+static cache_retired *retire_list = NULL;                        // Awaiting their grace period
+
+/*
+ * cache_hash - 64-bit FNV-1a over the key bytes.
+ */
+uint64_t cache_hash(const char *key, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/*
+ * element_charge - Bytes an element counts against the budget: the size classes its
+ * segments, key and header take in the slab allocator.
+ */
+static size_t element_charge(const cache_element *element) {
+    return element->charge;
+}
+
+static void element_free(cache_element *element) {
+    cache_segment *segment = element->segments;
+    while (segment) {
+        cache_segment *next = atomic_load_explicit(&segment->next, memory_order_relaxed);
+        slab_free(segment, sizeof(cache_segment) + segment->capacity);
+        segment = next;
+    }
+    if (element->disk)
+        disk_release(element->disk);
+    if (element->validators)
+        slab_free(element->validators, strlen(element->validators) + 1);
+    slab_free(element->url, strlen(element->url) + 1);
+    slab_free(element, sizeof(cache_element));
+}
+
+// --- Epoch Reclamation ---
+
+static void epoch_record_release(void *arg) {
+    epoch_record *record = (epoch_record *)arg;
+    atomic_store(&record->state, 0);
+    atomic_store(&record->in_use, 0);
+}
+
+static void epoch_key_create(void) {
+    pthread_key_create(&epoch_key, epoch_record_release);
+}
+
+/*
+ * epoch_record_get - Returns this thread's record, reusing one left by an exited thread
+ * before registering a new one.
+ */
+static epoch_record *epoch_record_get(void) {
+    if (thread_record)
+        return thread_record;
+
+    pthread_once(&epoch_key_once, epoch_key_create);
+    epoch_record *record;
+    for (record = atomic_load(&epoch_records); record; record = record->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&record->in_use, &expected, 1))
+            break;
+    }
+    if (!record) {
+        record = (epoch_record *)calloc(1, sizeof(epoch_record));
+        if (!record)
+            abort();
+        atomic_store(&record->in_use, 1);
+        record->next = atomic_load(&epoch_records);
+        while (!atomic_compare_exchange_weak(&epoch_records, &record->next, record))
+            ;
+    }
+    pthread_setspecific(epoch_key, record);
+    thread_record = record;
+    return record;
+}
+
+static void epoch_enter(void) {
+    epoch_record *record = epoch_record_get();
+    atomic_store(&record->state, (atomic_load(&global_epoch) << 1) | 1);
+}
+
+static void epoch_exit(void) {
+    atomic_store(&thread_record->state, 0);
+}
+
+/*
+ * epoch_reclaim_locked - Runs the reclaim callback of every retired object older than the
+ * oldest active reader. Caller holds retire_lock.
+ */
+static void epoch_reclaim_locked(void) {
+    uint64_t oldest = atomic_load(&global_epoch);
+    for (epoch_record *record = atomic_load(&epoch_records); record; record = record->next) {
+        uint64_t state = atomic_load(&record->state);
+        if ((state & 1) && (state >> 1) < oldest)
+            oldest = state >> 1;
+    }
+
+    cache_retired **link = &retire_list;
+    while (*link) {
+        cache_retired *node = *link;
+        if (node->epoch < oldest) {
+            *link = node->next;
+            node->reclaim(node);
+        } else {
+            link = &node->next;
+        }
+    }
+}
+
+/*
+ * epoch_retire - Queues node, already unreachable for new readers, for reclamation after
+ * every reader that might still hold it has left its read section. Read sections are a
+ * handful of loads, so the list rarely holds more than what was retired since the last call.
+ */
+static void epoch_retire(cache_retired *node) {
+    node->epoch = atomic_fetch_add(&global_epoch, 1);
+
+    pthread_mutex_lock(&retire_lock);
+    node->next = retire_list;
+    retire_list = node;
+    epoch_reclaim_locked();
+    pthread_mutex_unlock(&retire_lock);
+}
+
+static void reclaim_table(cache_retired *node) {
+    free((index_table *)node);
+}
+
+static void reclaim_element(cache_retired *node) {
+    cache_element *element = (cache_element *)((char *)node - offsetof(cache_element, retired));
+    cache_release(element);
+}
+
+// --- Read Buffer ---
+
+/*
+ * drain_read_buffer_locked - Replays the hits recorded by lock-free readers to the eviction
+ * policy and drops the references they held. Caller holds shard->lock.
+ */
+static void drain_read_buffer_locked(cache_shard *shard) {
+    for (size_t i = 0; i < READ_BUFFER_SIZE; i++) {
+        cache_element *element = atomic_exchange(&shard->read_buffer[i], NULL);
+        if (!element)
+            continue;
+        if (element->linked)
+            shard->policy->ops->on_hit(shard->policy, element);
+        cache_release(element);
+    }
+}
+
+/*
+ * record_hit - Queues a pinned element for the policy. The buffer is lossy: an overwritten
+ * entry just loses one recorded hit. Every half buffer the reader tries (never waits) to drain.
+ */
+static void record_hit(cache_shard *shard, cache_element *element) {
+    size_t pos = atomic_fetch_add(&shard->read_count, 1);
+    atomic_fetch_add(&element->refcount, 1);
+    cache_element *dropped = atomic_exchange(&shard->read_buffer[pos % READ_BUFFER_SIZE], element);
+    if (dropped)
+        cache_release(dropped);
+
+    if (pos % (READ_BUFFER_SIZE / 2) == READ_BUFFER_SIZE / 2 - 1 &&
+        pthread_mutex_trylock(&shard->lock) == 0) {
+        drain_read_buffer_locked(shard);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+// --- Hash Index ---
+
+/*
+ * index_lookup - Returns the slot holding url in table, or NULL. Safe without the shard lock
+ * inside an epoch read section.
+ */
+static index_slot *index_lookup(index_table *table, const char *url, uint64_t hash) {
+    size_t mask = table->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        index_slot *slot = &table->slots[i];
+        cache_element *element = atomic_load_explicit(&slot->element, memory_order_acquire);
+        if (element == NULL)
+            return NULL;
+        if (element != SLOT_TOMBSTONE && slot->hash == hash && strcmp(element->url, url) == 0)
+            return slot;
+    }
+}
+
+/*
+ * index_place - Publishes element in the first empty slot of its probe chain. The table must
+ * have room.
+ */
+static void index_place(index_table *table, cache_element *element) {
+    size_t mask = table->capacity - 1;
+    size_t i = element->hash & mask;
+    while (atomic_load_explicit(&table->slots[i].element, memory_order_relaxed) != NULL)
+        i = (i + 1) & mask;
+    table->slots[i].hash = element->hash;
+    atomic_store_explicit(&table->slots[i].element, element, memory_order_release);
+}
+
+static index_table *index_table_create(size_t capacity) {
+    index_table *table = (index_table *)calloc(1, sizeof(index_table) + capacity * sizeof(index_slot));
+    if (!table) {
+        perror("calloc failed for cache index");
+        return NULL;
+    }
+    table->capacity = capacity;
+    table->retired.reclaim = reclaim_table;
+    return table;
+}
+
+/*
+ * index_reserve - Makes sure one more insert stays under the load limit, publishing a
+ * larger (or tombstone-free) table if needed. Caller holds shard->lock.
+ */
+static int index_reserve(cache_shard *shard) {
+    index_table *old = atomic_load_explicit(&shard->index, memory_order_relaxed);
+    if (old != NULL &&
+        (shard->index_used + shard->index_tombstones + 1) * 100 <= old->capacity * INDEX_MAX_LOAD_PCT)
+        return 0;
+
+    size_t capacity = old ? old->capacity : INDEX_MIN_CAPACITY;
+    while ((shard->index_used + 1) * 100 > capacity * INDEX_MAX_LOAD_PCT / 2)
+        capacity *= 2;
+
+    index_table *table = index_table_create(capacity);
+    if (!table)
+        return -1;
+    if (old) {
+        for (size_t i = 0; i < old->capacity; i++) {
+            cache_element *element = atomic_load_explicit(&old->slots[i].element, memory_order_relaxed);
+            if (element != NULL && element != SLOT_TOMBSTONE)
+                index_place(table, element);
+        }
+    }
+    atomic_store_explicit(&shard->index, table, memory_order_release);
+    shard->index_tombstones = 0;
+    if (old)
+        epoch_retire(&old->retired);
+    return 0;
+}
+
+// --- Cache Operations ---
+
+/*
+ * shard_for - Picks the shard for a key. Uses the high hash bits; the low bits drive the
+ * probe position inside the shard's index.
+ */
+static cache_shard *shard_for(uint64_t hash) {
+    return &cache_shards[(hash >> 40) & (cache_shard_count - 1)];
+}
+
+/*
+ * cache_dump_stats - Compares what the elements are charged, and what the process really
+ * holds, with the budget.
+ */
+static void cache_dump_stats(FILE *out, void *arg) {
+    size_t charged = cache_current_size();
+    size_t rss = slab_resident();
+    if (cache_max_bytes)
+        fprintf(out, "charged %zu of %zu budget bytes (%zu%%), process rss %zu (%zu%% of budget)\n",
+                charged, cache_max_bytes, charged * 100 / cache_max_bytes,
+                rss, rss * 100 / cache_max_bytes);
+    else
+        fprintf(out, "charged %zu bytes (unbounded), process rss %zu\n", charged, rss);
+    size_t shard_bytes = cache_shards[0].max_bytes;
+    if (cache_max_element && shard_bytes && shard_bytes < cache_max_element)
+        fprintf(out, "elements limited to %zu bytes by the shard budget (max element %zu)\n",
+                shard_bytes, cache_max_element);
+    slab_dump_stats(out);
+}
+
+/*
+ * cache_init - Allocates the shards and splits the byte budget evenly between them. An
+ * element cannot outgrow its shard's share, so the default count stops at what leaves every
+ * shard room for max_element; a count asked for that does not is reported.
+ */
+int cache_init(size_t shard_count, size_t max_bytes, size_t max_element, const cache_policy_ops *policy) {
+    if (!policy)
+        policy = &cache_policy_lru;
+
+    int chosen = shard_count == 0;
+    if (chosen) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        shard_count = cpus > 0 ? (size_t)cpus * 2 : 1;
+    }
+    size_t count = 1;
+    while (count < shard_count)
+        count <<= 1;
+    while (chosen && count > 1 && max_bytes && max_element && max_bytes / count < max_element)
+        count >>= 1;
+    if (max_bytes && max_element && (max_bytes + count - 1) / count < max_element)
+        fprintf(stderr, "Cache: %zu shards limit elements to %zu bytes instead of %zu\n", count,
+                (max_bytes + count - 1) / count, max_element);
+
+    cache_shard *shards = (cache_shard *)aligned_alloc(64, count * sizeof(cache_shard));
+    if (!shards) {
+        perror("malloc failed for cache shards");
+        return -1;
+    }
+    memset(shards, 0, count * sizeof(cache_shard));
+    for (size_t i = 0; i < count; i++) {
+        cache_shard *shard = &shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->max_bytes = max_bytes ? (max_bytes + count - 1) / count : 0;
+        shard->policy = policy->create(shard->max_bytes);
+        if (!shard->policy || index_reserve(shard) < 0)
+            return -1;
+    }
+    cache_shards = shards;
+    cache_shard_count = count;
+    cache_max_element = max_element;
+    cache_max_bytes = max_bytes;
+    stats_register("cache memory", cache_dump_stats, NULL);
+    return 0;
+}
+
+size_t cache_shard_total(void) {
+    return cache_shard_count;
+}
+
+/*
+ * probe_hashed - Lock-free lookup. The epoch section keeps the table and the element alive
+ * until the reference is taken; from then on the reference alone keeps the element alive.
+ */
+static cache_element *probe_hashed(cache_shard *shard, const char *url, uint64_t hash) {
+    epoch_enter();
+    index_table *table = atomic_load_explicit(&shard->index, memory_order_acquire);
+    index_slot *slot = index_lookup(table, url, hash);
+    cache_element *element = NULL;
+    if (slot) {
+        element = atomic_load_explicit(&slot->element, memory_order_acquire);
+        if (element == SLOT_TOMBSTONE)
+            element = NULL;
+        else
+            atomic_fetch_add(&element->refcount, 1);
+    }
+    epoch_exit();
+    return element;
+}
+
+/*
+ * acquire_hashed - probe_hashed(), recording the hit with the eviction policy.
+ */
+static cache_element *acquire_hashed(cache_shard *shard, const char *url, uint64_t hash) {
+    cache_element *element = probe_hashed(shard, url, hash);
+    if (element)
+        record_hit(shard, element);
+    return element;
+}
+
+cache_element *cache_acquire(const char *url) {
+    uint64_t hash = cache_hash(url, strlen(url));
+    return acquire_hashed(shard_for(hash), url, hash);
+}
+
+void cache_retain(cache_element *element) {
+    atomic_fetch_add(&element->refcount, 1);
+}
+
+void cache_release(cache_element *element) {
+    if (atomic_fetch_sub(&element->refcount, 1) == 1)
+        element_free(element);
+}
+
+/*
+ * remove_locked - Unlinks the element in slot from the index and eviction policy and retires
+ * the cache's reference to it. Caller holds shard->lock.
+ */
+static void remove_locked(cache_shard *shard, index_slot *slot) {
+    cache_element *element = atomic_load_explicit(&slot->element, memory_order_relaxed);
+    atomic_store_explicit(&slot->element, SLOT_TOMBSTONE, memory_order_release);
+    shard->index_used--;
+    shard->index_tombstones++;
+
+    element->linked = 0;
+    shard->policy->ops->on_remove(shard->policy, element);
+    shard->size -= element_charge(element);
+    epoch_retire(&element->retired);
+}
+
+/*
+ * evict_locked - Removes the policy's next victim, handing it to the disk tier unless it is
+ * the element being admitted (the policy declined it). Returns it, or NULL if the shard is
+ * empty; the element may already be freed, so the result is only good for comparison.
+ * Caller holds shard->lock.
+ */
+static cache_element *evict_locked(cache_shard *shard, cache_element *admitting) {
+    cache_element *victim = shard->policy->ops->victim(shard->policy);
+    if (victim == NULL)
+        return NULL;
+    if (victim != admitting && disk_enabled()) {
+        cache_retain(victim);
+        disk_demote(victim);
+    }
+    index_table *table = atomic_load_explicit(&shard->index, memory_order_relaxed);
+    remove_locked(shard, index_lookup(table, victim->url, victim->hash));
+    return victim;
+}
+
+/*
+ * cache_evict_element - Removes the policy's next victim from the fullest shard.
+ */
+void cache_evict_element(void) {
+    cache_shard *fullest = NULL;
+    size_t fullest_size = 0;
+    for (size_t i = 0; i < cache_shard_count; i++) {
+        pthread_mutex_lock(&cache_shards[i].lock);
+        if (fullest == NULL || cache_shards[i].size > fullest_size) {
+            fullest = &cache_shards[i];
+            fullest_size = fullest->size;
+        }
+        pthread_mutex_unlock(&cache_shards[i].lock);
+    }
+    if (fullest == NULL)
+        return;
+    pthread_mutex_lock(&fullest->lock);
+    drain_read_buffer_locked(fullest);
+    evict_locked(fullest, NULL);
+    pthread_mutex_unlock(&fullest->lock);
+}
+
+/*
+ * cache_persist - Marks each element copied first, so an eviction meanwhile does not queue
+ * it a second time.
+ */
+void cache_persist(void) {
+    if (!disk_enabled())
+        return;
+    for (size_t i = 0; i < cache_shard_count; i++) {
+        cache_shard *shard = &cache_shards[i];
+        pthread_mutex_lock(&shard->lock);
+        index_table *table = atomic_load_explicit(&shard->index, memory_order_relaxed);
+        for (size_t j = 0; table && j < table->capacity; j++) {
+            cache_element *element = atomic_load_explicit(&table->slots[j].element,
+                                                          memory_order_relaxed);
+            if (element == NULL || element == SLOT_TOMBSTONE || element->on_disk)
+                continue;
+            element->on_disk = 1;
+            cache_retain(element);
+            disk_persist(element);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/*
+ * element_create - Builds an empty, unpublished element for url in the CACHE_FILLING state.
+ */
+static cache_element *element_create(const char *url, size_t url_len, uint64_t hash) {
+    cache_element *element = (cache_element *)slab_alloc(sizeof(cache_element));
+    if (!element) {
+        perror("slab_alloc failed for cache element");
+        return NULL;
+    }
+    memset(element, 0, sizeof(cache_element));
+    element->url = (char *)slab_alloc(url_len + 1);
+    if (!element->url) {
+        perror("slab_alloc failed for cache URL");
+        slab_free(element, sizeof(cache_element));
+        return NULL;
+    }
+    memcpy(element->url, url, url_len + 1);
+    element->hash = hash;
+    element->freshness.fresh_until = CACHE_NEVER_STALE;
+    element->charge = slab_charge(sizeof(cache_element)) + slab_charge(url_len + 1);
+    atomic_init(&element->len, 0);
+    atomic_init(&element->state, CACHE_FILLING);
+    atomic_init(&element->refcount, 1);
+    element->retired.reclaim = reclaim_element;
+    return element;
+}
+
+/*
+ * element_reserve - Returns the free space at the end of element, chaining a new segment
+ * (twice the size of the previous one, up to SEGMENT_MAX_ALLOC) when the tail is full.
+ * Returns NULL if that would grow the element past limit (0 = no limit).
+ */
+static char *element_reserve(cache_element *element, size_t limit, size_t *avail) {
+    cache_segment *tail = element->fill_tail;
+    if (tail == NULL || element->fill_tail_used == tail->capacity) {
+        size_t alloc = SEGMENT_MIN_ALLOC;
+        if (tail) {
+            alloc = (tail->capacity + sizeof(cache_segment)) * 2;
+            if (alloc > SEGMENT_MAX_ALLOC)
+                alloc = SEGMENT_MAX_ALLOC;
+        }
+        if (limit != 0 && element->charge + alloc > limit)
+            return NULL;
+
+        cache_segment *segment = (cache_segment *)slab_alloc(alloc);
+        if (!segment) {
+            perror("slab_alloc failed for cache segment");
+            return NULL;
+        }
+        atomic_init(&segment->next, NULL);
+        segment->capacity = alloc - sizeof(cache_segment);
+        if (tail)
+            atomic_store_explicit(&tail->next, segment, memory_order_release);
+        else
+            element->segments = segment;
+        element->fill_tail = segment;
+        element->fill_tail_used = 0;
+        element->charge += alloc;
+        tail = segment;
+    }
+    *avail = tail->capacity - element->fill_tail_used;
+    return tail->data + element->fill_tail_used;
+}
+
+/*
+ * element_commit - Publishes n bytes written at element_reserve() to concurrent readers.
+ * Sequentially consistent so flight_signal()'s check of the waiting counter cannot be
+ * reordered before it.
+ */
+static void element_commit(cache_element *element, size_t n) {
+    element->fill_tail_used += n;
+    atomic_fetch_add(&element->len, n);
+}
+
+/*
+ * element_limit - Largest charge an element of shard may grow to.
+ */
+static size_t element_limit(const cache_shard *shard) {
+    if (cache_max_element == 0 || (shard->max_bytes != 0 && shard->max_bytes < cache_max_element))
+        return shard->max_bytes;
+    return cache_max_element;
+}
+
+/*
+ * publish_locked - Makes a complete element visible under its key, replacing any previous
+ * element, then evicts the policy's victims until the shard is back under budget. The
+ * victim may be the new element itself when the policy declines to admit it. Returns -1 if
+ * the element was not inserted; otherwise the cache owns the element's initial reference
+ * and the result is 1 if it is still cached, 0 if it was evicted right away.
+ * Caller holds shard->lock.
+ */
+static int publish_locked(cache_shard *shard, cache_element *element) {
+    size_t element_size = element_charge(element);
+    if (shard->max_bytes != 0 && element_size > shard->max_bytes)
+        return -1;
+
+    drain_read_buffer_locked(shard);
+    index_table *table = atomic_load_explicit(&shard->index, memory_order_relaxed);
+    index_slot *existing = index_lookup(table, element->url, element->hash);
+    if (existing)
+        remove_locked(shard, existing);
+
+    if (index_reserve(shard) < 0)
+        return -1;
+    element->linked = 1;
+    index_place(atomic_load_explicit(&shard->index, memory_order_relaxed), element);
+    shard->index_used++;
+    shard->size += element_size;
+    shard->policy->ops->on_insert(shard->policy, element);
+    if (disk_enabled() && !element->on_disk)
+        disk_forget(element->url, element->hash);
+
+    int cached = 1;
+    while (shard->max_bytes != 0 && shard->size > shard->max_bytes) {
+        cache_element *victim = evict_locked(shard, element);
+        if (victim == NULL)
+            break;
+        if (victim == element)
+            cached = 0;
+    }
+    return cached;
+}
+
+/*
+ * element_append - Copies size bytes at data to the end of an element only its builder sees.
+ * Returns 0, or -1 if it would outgrow limit or allocation failed.
+ */
+static int element_append(cache_element *element, size_t limit, const char *data, size_t size) {
+    size_t copied = 0;
+    while (copied < size) {
+        size_t avail;
+        char *dest = element_reserve(element, limit, &avail);
+        if (!dest)
+            return -1;
+        size_t n = size - copied < avail ? size - copied : avail;
+        memcpy(dest, data + copied, n);
+        element_commit(element, n);
+        copied += n;
+    }
+    return 0;
+}
+
+/*
+ * element_build - Builds a complete, unpublished element for url from a copy of size bytes
+ * at data. Returns NULL if it would outgrow what shard allows or allocation failed.
+ */
+static cache_element *element_build(cache_shard *shard, const char *url, size_t url_len,
+                                    uint64_t hash, const char *data, size_t size) {
+    cache_element *element = element_create(url, url_len, hash);
+    if (!element)
+        return NULL;
+    if (element_append(element, element_limit(shard), data, size) < 0) {
+        element_free(element);
+        return NULL;
+    }
+    atomic_store(&element->state, CACHE_COMPLETE);
+    return element;
+}
+
+/*
+ * element_set_validators - Replaces the validators of an unpublished element with a copy of
+ * validators (NULL or empty if none), charged like the rest of the element. Returns 0, or -1
+ * if they could not be stored.
+ */
+static int element_set_validators(cache_element *element, const char *validators) {
+    if (element->validators) {
+        size_t size = strlen(element->validators) + 1;
+        slab_free(element->validators, size);
+        element->charge -= slab_charge(size);
+        element->validators = NULL;
+    }
+    if (!validators || !validators[0])
+        return 0;
+
+    size_t size = strlen(validators) + 1;
+    element->validators = (char *)slab_alloc(size);
+    if (!element->validators) {
+        perror("slab_alloc failed for cache validators");
+        return -1;
+    }
+    memcpy(element->validators, validators, size);
+    element->charge += slab_charge(size);
+    return 0;
+}
+
+/*
+ * cache_add_element - Builds a complete element from a copy of data, then publishes it under
+ * url. Readers still holding a replaced element keep a valid copy.
+ */
+int cache_add_element(const char *data, size_t size, const char *url) {
+    size_t url_len = strlen(url);
+    uint64_t hash = cache_hash(url, url_len);
+    cache_shard *shard = shard_for(hash);
+
+    cache_element *element = element_build(shard, url, url_len, hash, data, size);
+    if (!element)
+        return 0;
+
+    pthread_mutex_lock(&shard->lock);
+    int published = publish_locked(shard, element);
+    pthread_mutex_unlock(&shard->lock);
+    if (published < 0)
+        element_free(element);
+    return published > 0;
+}
+
+// --- Cache Cursor ---
+
+void cache_cursor_init(cache_cursor *cursor, cache_element *element) {
+    cursor->element = element;
+    cursor->segment = NULL;
+    cursor->segment_offset = 0;
+    cursor->offset = 0;
+    cursor->end = SIZE_MAX;
+}
+
+/*
+ * cache_cursor_next - Segments and their next links are published before the length that
+ * covers them, so everything below the acquired length is safe to walk.
+ */
+size_t cache_cursor_next(cache_cursor *cursor, const char **data) {
+    size_t len = atomic_load_explicit(&cursor->element->len, memory_order_acquire);
+    if (len > cursor->end)
+        len = cursor->end;
+    if (cursor->offset >= len)
+        return 0;
+
+    if (cursor->element->mapped) {
+        // One contiguous run; segment_offset just mirrors offset
+        size_t n = len - cursor->offset;
+        *data = cursor->element->mapped + cursor->offset;
+        cursor->offset += n;
+        cursor->segment_offset = cursor->offset;
+        return n;
+    }
+
+    if (cursor->segment == NULL) {
+        cursor->segment = cursor->element->segments;
+        cursor->segment_offset = 0;
+    } else if (cursor->segment_offset == cursor->segment->capacity) {
+        cursor->segment = atomic_load_explicit(&cursor->segment->next, memory_order_acquire);
+        cursor->segment_offset = 0;
+    }
+
+    size_t n = cursor->segment->capacity - cursor->segment_offset;
+    if (n > len - cursor->offset)
+        n = len - cursor->offset;
+    *data = cursor->segment->data + cursor->segment_offset;
+    cursor->segment_offset += n;
+    cursor->offset += n;
+    return n;
+}
+
+int cache_cursor_peek(const cache_cursor *cursor, struct iovec *iov, int max) {
+    size_t len = atomic_load_explicit(&cursor->element->len, memory_order_acquire);
+    if (len > cursor->end)
+        len = cursor->end;
+    size_t offset = cursor->offset;
+    cache_segment *segment = cursor->segment;
+    size_t segment_offset = cursor->segment_offset;
+    int count = 0;
+
+    if (cursor->element->mapped) {
+        if (max < 1 || offset >= len)
+            return 0;
+        iov[0].iov_base = (void *)(cursor->element->mapped + offset);
+        iov[0].iov_len = len - offset;
+        return 1;
+    }
+    while (count < max && offset < len) {
+        if (segment == NULL) {
+            segment = cursor->element->segments;
+            segment_offset = 0;
+        } else if (segment_offset == segment->capacity) {
+            segment = atomic_load_explicit(&segment->next, memory_order_acquire);
+            segment_offset = 0;
+        }
+        size_t n = segment->capacity - segment_offset;
+        if (n > len - offset)
+            n = len - offset;
+        iov[count].iov_base = segment->data + segment_offset;
+        iov[count].iov_len = n;
+        count++;
+        segment_offset += n;
+        offset += n;
+    }
+    return count;
+}
+
+void cache_cursor_advance(cache_cursor *cursor, size_t n) {
+    const char *data;
+    while (n > 0) {
+        size_t step = cache_cursor_next(cursor, &data);
+        if (step == 0)
+            return;
+        if (step > n) {
+            // Give back what was not consumed; it is still in the same segment
+            cursor->segment_offset -= step - n;
+            cursor->offset -= step - n;
+            step = n;
+        }
+        n -= step;
+    }
+}
+
+int cache_cursor_seek(cache_cursor *cursor, size_t offset) {
+    if (cursor->offset < offset)
+        cache_cursor_advance(cursor, offset - cursor->offset);
+    return cursor->offset >= offset;
+}
+
+void cache_cursor_limit(cache_cursor *cursor, size_t end) {
+    cursor->end = end;
+}
+
+// --- Single-Flight Fetch ---
+
+/*
+ * flight_put_locked - Drops one reference to flight, freeing it with the last one.
+ * Caller holds the shard lock.
+ */
+static void flight_put_locked(cache_flight *flight) {
+    if (--flight->refs > 0)
+        return;
+    cache_release(flight->element);
+    if (flight->stale)
+        cache_release(flight->stale);
+    pthread_cond_destroy(&flight->grow_cond);
+    pthread_mutex_destroy(&flight->wait_lock);
+    free(flight);
+}
+
+/*
+ * flight_signal - Wakes followers blocked in cache_flight_wait() and notifies (then forgets)
+ * every registered watcher. The waiting counter is raised under wait_lock before a follower
+ * re-checks the element, so skipping the lock when it reads zero cannot lose a wakeup.
+ */
+static void flight_signal(cache_flight *flight) {
+    if (atomic_load(&flight->waiting) == 0)
+        return;
+    pthread_mutex_lock(&flight->wait_lock);
+    pthread_cond_broadcast(&flight->grow_cond);
+    cache_flight_watcher *watcher = flight->watchers;
+    flight->watchers = NULL;
+    while (watcher) {
+        cache_flight_watcher *next = watcher->next;
+        atomic_fetch_sub(&flight->waiting, 1);
+        watcher->notify(watcher);
+        watcher = next;
+    }
+    pthread_mutex_unlock(&flight->wait_lock);
+}
+
+/*
+ * failed_recently - Whether a revalidation of element found the origin failing within the
+ * last CACHE_RETRY_INTERVAL seconds.
+ */
+static int failed_recently(cache_element *element, int64_t now) {
+    int64_t failed_at = atomic_load_explicit(&element->failed_at, memory_order_relaxed);
+    return failed_at != 0 && now - failed_at < CACHE_RETRY_INTERVAL;
+}
+
+/*
+ * serve_stale - Whether element, stale at now, is served while its origin keeps failing;
+ * the window is whichever of its two stale windows is longer.
+ */
+static int serve_stale(cache_element *element, int64_t now) {
+    const cache_freshness *freshness = &element->freshness;
+    int64_t window = freshness->if_error > freshness->while_revalidate
+                         ? freshness->if_error : freshness->while_revalidate;
+    return failed_recently(element, now) && now - freshness->fresh_until < window;
+}
+
+static int in_while_revalidate(cache_element *element, int64_t now) {
+    return now - element->freshness.fresh_until < element->freshness.while_revalidate;
+}
+
+/*
+ * acquire_disk - Looks url up in the disk tier after a miss in memory. An entry hit often
+ * enough is copied back into memory and published in shard; otherwise the element returned
+ * reads the mapped segment file and is never published. Returns it pinned, or NULL.
+ */
+static cache_element *acquire_disk(cache_shard *shard, const char *url, size_t url_len,
+                                   uint64_t hash) {
+    disk_hit hit;
+    if (!disk_enabled() || disk_lookup(url, hash, &hit) < 0)
+        return NULL;
+
+    cache_element *element = NULL;
+    if (hit.hot)
+        element = element_build(shard, url, url_len, hash, hit.data, hit.len);
+    if (element) {
+        element->on_disk = 1;
+        disk_release(hit.segment);
+    } else {
+        element = element_create(url, url_len, hash);
+        if (!element) {
+            disk_release(hit.segment);
+            return NULL;
+        }
+        element->mapped = hit.data;
+        element->disk = hit.segment;
+        atomic_store(&element->len, hit.len);
+        atomic_store(&element->state, CACHE_COMPLETE);
+        hit.hot = 0;
+    }
+    element->freshness = hit.freshness;
+    if (element_set_validators(element, hit.validators) < 0) {
+        element_free(element);
+        return NULL;
+    }
+
+    if (hit.hot) {
+        pthread_mutex_lock(&shard->lock);
+        cache_retain(element);
+        if (publish_locked(shard, element) < 0)
+            atomic_fetch_sub(&element->refcount, 1);
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return element;
+}
+
+/*
+ * lookup - Returns CACHE_HIT with a pinned element that may be served, or registers the
+ * caller on the key's flight: CACHE_LEADER if nobody is fetching it yet (only with lead set),
+ * CACHE_FOLLOWER otherwise. A stale element found on the way stays pinned by the new flight
+ * while it is revalidated; inside its stale-while-revalidate window it is returned too
+ * (CACHE_REFRESH), or as a plain hit if a flight already refreshes it.
+ */
+static cache_lookup_result lookup(const char *url, cache_element **element, cache_flight **flight,
+                                  int lead) {
+    size_t url_len = strlen(url);
+    uint64_t hash = cache_hash(url, url_len);
+    cache_shard *shard = shard_for(hash);
+    int64_t now = (int64_t)time(NULL);
+
+    *flight = NULL;
+    cache_element *stale = acquire_hashed(shard, url, hash);
+    if (!stale)
+        stale = acquire_disk(shard, url, url_len, hash);
+    if (stale && (now < stale->freshness.fresh_until || serve_stale(stale, now))) {
+        *element = stale;
+        return CACHE_HIT;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    // A leader may have published the key since the lock-free probe; without one, an element
+    // found before (possibly on disk) is still worth revalidating. The probe already recorded
+    // the access, so only an element published since is recorded, once the lock is dropped
+    cache_element *found = probe_hashed(shard, url, hash);
+    cache_element *published = NULL;
+    if (found) {
+        if (found != stale)
+            published = found;
+        if (stale)
+            cache_release(stale);
+        stale = found;
+    }
+    if (stale && (now < stale->freshness.fresh_until || serve_stale(stale, now))) {
+        pthread_mutex_unlock(&shard->lock);
+        if (published)
+            record_hit(shard, published);
+        *element = stale;
+        return CACHE_HIT;
+    }
+    *element = NULL;
+    if (shard->policy->ops->on_miss)
+        shard->policy->ops->on_miss(shard->policy, hash);
+
+    for (cache_flight *f = shard->flights; f; f = f->next) {
+        if (f->element->hash == hash && strcmp(f->element->url, url) == 0) {
+            if (stale && in_while_revalidate(stale, now)) {
+                // Already being refreshed; serve the stale copy meanwhile
+                pthread_mutex_unlock(&shard->lock);
+                *element = stale;
+                return CACHE_HIT;
+            }
+            f->refs++;
+            atomic_fetch_add(&f->element->refcount, 1);
+            *element = f->element;
+            *flight = f;
+            pthread_mutex_unlock(&shard->lock);
+            if (stale)
+                cache_release(stale);
+            return CACHE_FOLLOWER;
+        }
+    }
+    if (!lead && !(stale && in_while_revalidate(stale, now))) {
+        pthread_mutex_unlock(&shard->lock);
+        if (stale)
+            cache_release(stale);
+        return CACHE_LEADER;
+    }
+
+    cache_flight *f = (cache_flight *)calloc(1, sizeof(cache_flight));
+    if (f)
+        f->element = element_create(url, url_len, hash);
+    if (!f || !f->element) {
+        // Without a flight the caller simply fetches on its own, or serves the stale copy
+        perror("malloc failed for cache flight");
+        free(f);
+        pthread_mutex_unlock(&shard->lock);
+        if (stale && in_while_revalidate(stale, now)) {
+            *element = stale;
+            return CACHE_HIT;
+        }
+        if (stale)
+            cache_release(stale);
+        return CACHE_LEADER;
+    }
+    f->shard = shard;
+    f->stale = stale;
+    f->refs = 1;
+    pthread_mutex_init(&f->wait_lock, NULL);
+    pthread_cond_init(&f->grow_cond, NULL);
+    f->next = shard->flights;
+    shard->flights = f;
+    *flight = f;
+    pthread_mutex_unlock(&shard->lock);
+
+    if (stale && in_while_revalidate(stale, now)) {
+        atomic_fetch_add(&stale->refcount, 1);
+        *element = stale;
+        return CACHE_REFRESH;
+    }
+    return CACHE_LEADER;
+}
+
+cache_lookup_result cache_lookup(const char *url, cache_element **element, cache_flight **flight) {
+    return lookup(url, element, flight, 1);
+}
+
+cache_lookup_result cache_lookup_cached(const char *url, cache_element **element,
+                                        cache_flight **flight) {
+    return lookup(url, element, flight, 0);
+}
+
+/*
+ * cache_fill_reserve - Aborts the fill (waking followers) once the element would outgrow its
+ * limit; the leader then keeps relaying to its own client without caching.
+ */
+char *cache_fill_reserve(cache_flight *flight, size_t *avail) {
+    if (!flight)
+        return NULL;
+    cache_element *element = flight->element;
+    if (atomic_load(&element->state) != CACHE_FILLING)
+        return NULL;
+
+    char *dest = element_reserve(element, element_limit(flight->shard), avail);
+    if (!dest) {
+        atomic_store(&element->state, CACHE_ABORTED);
+        flight_signal(flight);
+    }
+    return dest;
+}
+
+void cache_fill_commit(cache_flight *flight, size_t n) {
+    element_commit(flight->element, n);
+    flight_signal(flight);
+}
+
+int cache_fill_fits(cache_flight *flight, uint64_t length) {
+    size_t limit = element_limit(flight->shard);
+    return limit == 0 || length <= limit;
+}
+
+int cache_fits(const char *url, uint64_t length) {
+    size_t limit = element_limit(shard_for(cache_hash(url, strlen(url))));
+    return limit == 0 || length <= limit;
+}
+
+const char *cache_fill_key(cache_flight *flight) {
+    return flight->element->url;
+}
+
+int cache_fill_append(cache_flight *flight, const char *data, size_t len) {
+    while (len > 0) {
+        size_t avail;
+        char *dest = cache_fill_reserve(flight, &avail);
+        if (!dest)
+            return -1;
+        size_t n = len < avail ? len : avail;
+        memcpy(dest, data, n);
+        cache_fill_commit(flight, n);
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * cache_fill_freshness - The validators' charge is only added to the shard when the element
+ * is published.
+ */
+int cache_fill_freshness(cache_flight *flight, const cache_freshness *freshness,
+                         const char *validators) {
+    flight->element->freshness = *freshness;
+    return element_set_validators(flight->element, validators);
+}
+
+cache_element *cache_fill_element(cache_flight *flight) {
+    return flight->element;
+}
+
+/*
+ * cache_fill_rewrite - The copy gets the fill's freshness and validators once the flight
+ * completes, as the leader may record them after starting it.
+ */
+int cache_fill_rewrite(cache_flight *flight, const char *data, size_t len) {
+    cache_element *element = flight->element;
+    if (!flight->rewrite) {
+        flight->rewrite = element_create(element->url, strlen(element->url), element->hash);
+        if (!flight->rewrite)
+            return -1;
+    }
+    if (element_append(flight->rewrite, element_limit(flight->shard), data, len) < 0) {
+        cache_fill_rewrite_cancel(flight);
+        return -1;
+    }
+    return 0;
+}
+
+void cache_fill_rewrite_cancel(cache_flight *flight) {
+    if (flight->rewrite)
+        element_free(flight->rewrite);
+    flight->rewrite = NULL;
+}
+
+cache_element *cache_fill_stale(cache_flight *flight) {
+    return flight ? flight->stale : NULL;
+}
+
+cache_element *cache_fill_failed(cache_flight *flight) {
+    cache_element *stale = cache_fill_stale(flight);
+    if (!stale)
+        return NULL;
+    int64_t now = (int64_t)time(NULL);
+    atomic_store_explicit(&stale->failed_at, now, memory_order_relaxed);
+    if (!serve_stale(stale, now))
+        return NULL;
+    cache_retain(stale);
+    return stale;
+}
+
+cache_element *cache_fallback(const char *url) {
+    cache_element *element = cache_acquire(url);
+    if (!element)
+        return NULL;
+    int64_t now = (int64_t)time(NULL);
+    if (now < element->freshness.fresh_until || serve_stale(element, now))
+        return element;
+    cache_release(element);
+    return NULL;
+}
+
+void cache_fill_abandon(cache_flight *flight) {
+    int expected = CACHE_FILLING;
+    if (atomic_compare_exchange_strong(&flight->element->state, &expected, CACHE_ABORTED))
+        flight_signal(flight);
+}
+
+/*
+ * cache_flight_complete - Ends the leader's fetch: retires the flight so new misses start a
+ * fresh one, then publishes the element if it is complete and wanted.
+ */
+int cache_flight_complete(cache_flight *flight, int ok, int store) {
+    if (!flight)
+        return 0;
+
+    cache_shard *shard = flight->shard;
+    cache_element *element = flight->element;
+    int expected = CACHE_FILLING;
+    if (!atomic_compare_exchange_strong(&element->state, &expected,
+                                        ok ? CACHE_COMPLETE : CACHE_ABORTED))
+        ok = 0;
+    flight_signal(flight);
+
+    // Followers keep streaming the element filled; the cache gets the leader's copy of it
+    cache_element *rewrite = flight->rewrite;
+    flight->rewrite = NULL;
+    if (rewrite && (!ok || !store ||
+                    element_set_validators(rewrite, element->validators) < 0)) {
+        element_free(rewrite);
+        rewrite = NULL;
+    }
+    if (rewrite) {
+        rewrite->freshness = element->freshness;
+        atomic_store(&rewrite->state, CACHE_COMPLETE);
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    cache_flight **link = &shard->flights;
+    while (*link != flight)
+        link = &(*link)->next;
+    *link = flight->next;
+
+    int published = 0;
+    if (rewrite) {
+        // The cache takes over the copy's only reference
+        published = publish_locked(shard, rewrite);
+        if (published < 0) {
+            published = 0;
+        } else {
+            rewrite = NULL;
+        }
+    } else if (ok && store) {
+        atomic_fetch_add(&element->refcount, 1);
+        published = publish_locked(shard, element);
+        if (published < 0) {
+            atomic_fetch_sub(&element->refcount, 1);
+            published = 0;
+        }
+    }
+    flight_put_locked(flight);
+    pthread_mutex_unlock(&shard->lock);
+    if (rewrite)
+        element_free(rewrite);
+    return published;
+}
+
+/*
+ * cache_flight_wait - Blocks a follower until the element grows past offset or the leader
+ * finishes.
+ */
+cache_fill_state cache_flight_wait(cache_flight *flight, size_t offset) {
+    cache_element *element = flight->element;
+
+    pthread_mutex_lock(&flight->wait_lock);
+    atomic_fetch_add(&flight->waiting, 1);
+    cache_fill_state state;
+    while ((state = atomic_load(&element->state)) == CACHE_FILLING &&
+           atomic_load(&element->len) <= offset)
+        pthread_cond_wait(&flight->grow_cond, &flight->wait_lock);
+    atomic_fetch_sub(&flight->waiting, 1);
+    pthread_mutex_unlock(&flight->wait_lock);
+    return state;
+}
+
+/*
+ * cache_flight_watch - Same check as cache_flight_wait(), made under wait_lock after raising
+ * the waiting counter, so a commit racing with the registration still notifies it.
+ */
+int cache_flight_watch(cache_flight *flight, size_t offset, cache_flight_watcher *watcher) {
+    cache_element *element = flight->element;
+
+    pthread_mutex_lock(&flight->wait_lock);
+    atomic_fetch_add(&flight->waiting, 1);
+    if (atomic_load(&element->state) != CACHE_FILLING || atomic_load(&element->len) > offset) {
+        atomic_fetch_sub(&flight->waiting, 1);
+        pthread_mutex_unlock(&flight->wait_lock);
+        return 1;
+    }
+    watcher->next = flight->watchers;
+    flight->watchers = watcher;
+    pthread_mutex_unlock(&flight->wait_lock);
+    return 0;
+}
+
+int cache_flight_unwatch(cache_flight *flight, cache_flight_watcher *watcher) {
+    int found = 0;
+    pthread_mutex_lock(&flight->wait_lock);
+    for (cache_flight_watcher **link = &flight->watchers; *link; link = &(*link)->next) {
+        if (*link == watcher) {
+            *link = watcher->next;
+            atomic_fetch_sub(&flight->waiting, 1);
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&flight->wait_lock);
+    return found;
+}
+
+void cache_flight_leave(cache_flight *flight) {
+    cache_shard *shard = flight->shard;
+    pthread_mutex_lock(&shard->lock);
+    flight_put_locked(flight);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * cache_current_size - Sums the shards. Each shard is read under its own lock, so the total
+ * is only a snapshot.
+ */
+size_t cache_current_size(void) {
+    size_t size = 0;
+    for (size_t i = 0; i < cache_shard_count; i++) {
+        pthread_mutex_lock(&cache_shards[i].lock);
+        size += cache_shards[i].size;
+        pthread_mutex_unlock(&cache_shards[i].lock);
+    }
+    return size;
+}
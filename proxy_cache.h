@@ -0,0 +1,347 @@
+#ifndef PROXY_CACHE_H
+#define PROXY_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+// --- Deferred Reclamation Link ---
+// Objects unlinked from a shared structure are queued here until no reader can still see them.
+typedef struct cache_retired {
+    struct cache_retired *next;                  // Next object in the retire list
+    uint64_t epoch;                              // Global epoch when the object was retired
+    void (*reclaim)(struct cache_retired *node); // Called once the grace period has passed
+} cache_retired;
+
+// --- Cache Segment ---
+// Response bodies are stored as a chain of segments. Every segment but the last is full.
+typedef struct cache_segment {
+    _Atomic(struct cache_segment *) next;    // Following segment, published before the bytes in it
+    size_t capacity;                         // Bytes of data[]
+    char data[];
+} cache_segment;
+
+// --- Cache Element Structure ---
+// An element is filled in place by the fetching request while other readers may already stream
+// it. Once published in the cache it is immutable; readers pin it with a reference. An element
+// read from the disk tier (proxy_disk.h) may instead point into a mapped segment file.
+typedef enum {
+    CACHE_FILLING,      // Leader is still appending
+    CACHE_COMPLETE,     // Origin response fully received
+    CACHE_ABORTED       // Leader gave up (origin error or object too large)
+} cache_fill_state;
+
+// --- Eviction Policy Hook ---
+// Bookkeeping owned by the shard's eviction policy (see proxy_policy.h), guarded by the shard lock.
+typedef struct cache_policy_node {
+    struct cache_element *prev;        // Neighbour towards the head of the policy's list
+    struct cache_element *next;        // Neighbour towards the tail (evicted first)
+    int list;                          // Which of the policy's lists holds the element
+} cache_policy_node;
+
+#define CACHE_NEVER_STALE     INT64_MAX   // fresh_until of an element stored without a lifetime
+#define CACHE_RETRY_INTERVAL  5           // Seconds a failed revalidation is not retried
+
+// --- Freshness ---
+// Recorded by the leader before the element completes; never changes after. Past fresh_until
+// the element is stale, but may still be served for a while: right away while a background
+// refresh asks the origin, or while the origin keeps failing.
+typedef struct cache_freshness {
+    int64_t fresh_until;               // Wall-clock second the element goes stale
+    int64_t lifetime;                  // Freshness lifetime it was computed from (seconds)
+    int64_t while_revalidate;          // Seconds past fresh_until it is served while refreshed
+    int64_t if_error;                  // Seconds past fresh_until it is served if the origin fails
+} cache_freshness;
+
+typedef struct cache_element {
+    cache_segment *segments;           // First segment of the cached response (NULL while empty)
+    const char *mapped;                // Or the whole response, in a disk segment (NULL if none)
+    struct disk_segment *disk;         // Disk segment pinned for mapped
+    int on_disk;                       // Copied to or from the disk tier (guarded by the shard lock)
+    cache_segment *fill_tail;          // Segment being appended to (leader only)
+    size_t fill_tail_used;             // Bytes used in fill_tail (leader only)
+    atomic_size_t len;                 // Bytes readable so far
+    atomic_int state;                  // cache_fill_state
+    size_t charge;                     // Bytes counted against the budget
+    char *url;                         // Request URL used as key
+    uint64_t hash;                     // Precomputed hash of url
+    cache_freshness freshness;         // How long it may be served without the origin
+    char *validators;                  // Header lines revalidating it once stale (NULL if none)
+    _Atomic int64_t failed_at;         // When a revalidation last found the origin failing
+    atomic_int refcount;               // One reference held by the cache plus one per reader
+    int linked;                        // Still in the index (guarded by the shard lock)
+    cache_policy_node policy;          // Position in the eviction policy
+    cache_retired retired;             // Drops the cache's reference after eviction
+} cache_element;
+
+// --- Cache Cursor ---
+// Walks an element's bytes in order; picks up bytes appended after it was started.
+typedef struct cache_cursor {
+    cache_element *element;
+    cache_segment *segment;            // Segment holding offset (NULL before the first read)
+    size_t segment_offset;             // Position inside segment
+    size_t offset;                     // Position in the element
+    size_t end;                        // Position reading stops at (SIZE_MAX: the element's end)
+} cache_cursor;
+
+struct cache_policy_ops;
+
+/*
+ * cache_init - Splits the cache into shard_count independently locked shards (rounded up to
+ * a power of two; 0 picks twice the online CPU count) and divides max_bytes between them
+ * (0 = unbounded). Each shard evicts according to its own instance of policy (NULL = LRU).
+ * Fills growing past max_element bytes are abandoned. An element is also held to its
+ * shard's share of max_bytes, so the default count is lowered until a share holds
+ * max_element; a count that is passed in and lowers the limit is reported on stderr and in
+ * the stats. Elements live in the slab allocator (proxy_slab.h) and are charged what it
+ * really takes for them. Registers the cache's memory stats.
+ */
+int cache_init(size_t shard_count, size_t max_bytes, size_t max_element,
+               const struct cache_policy_ops *policy);
+
+/*
+ * cache_shard_total - Number of shards chosen by cache_init().
+ */
+size_t cache_shard_total(void);
+
+/*
+ * cache_acquire - Looks up url without taking any lock and pins the element so it stays
+ * valid until cache_release(), even if it is evicted meanwhile. Returns NULL on a miss.
+ */
+cache_element *cache_acquire(const char *url);
+
+/*
+ * cache_release - Drops a reference taken by cache_acquire(); frees the element once it has
+ * been evicted and the last reader is done with it.
+ */
+void cache_release(cache_element *element);
+
+/*
+ * cache_add_element - Copies data into a new complete element and publishes it under url,
+ * evicting until it fits. Returns 1 if cached, 0 otherwise (including when the eviction
+ * policy declines to admit it).
+ */
+int cache_add_element(const char *data, size_t size, const char *url);
+
+/*
+ * cache_cursor_init - Positions cursor at the start of element.
+ */
+void cache_cursor_init(cache_cursor *cursor, cache_element *element);
+
+/*
+ * cache_cursor_next - Points *data at the next contiguous run of readable bytes and advances
+ * past it. Returns 0 when the cursor has caught up with what has been appended so far.
+ */
+size_t cache_cursor_next(cache_cursor *cursor, const char **data);
+
+/*
+ * cache_cursor_peek - Points up to max iovecs at the readable bytes after the cursor, one per
+ * segment, without advancing it, so they can go out in a single writev()/sendmsg(). Returns
+ * how many were filled (0 when the cursor has caught up).
+ */
+int cache_cursor_peek(const cache_cursor *cursor, struct iovec *iov, int max);
+
+/*
+ * cache_cursor_advance - Moves the cursor past n readable bytes, e.g. what a possibly partial
+ * write of cache_cursor_peek()'s iovecs sent.
+ */
+void cache_cursor_advance(cache_cursor *cursor, size_t n);
+
+/*
+ * cache_cursor_seek - Moves the cursor forward to offset, as far as bytes are readable yet.
+ * Returns 1 once it is there.
+ */
+int cache_cursor_seek(cache_cursor *cursor, size_t offset);
+
+/*
+ * cache_cursor_limit - Stops the cursor at end: bytes from there on are never read.
+ */
+void cache_cursor_limit(cache_cursor *cursor, size_t end);
+
+// --- Single-Flight Fetch ---
+typedef struct cache_flight cache_flight;
+
+typedef enum {
+    CACHE_HIT,          // *element is complete and pinned; release it when done
+    CACHE_LEADER,       // Caller fetches from the origin into the flight's element
+    CACHE_FOLLOWER,     // *element is being filled by another request; stream it as it grows
+    CACHE_REFRESH       // *element is stale but may be served (pinned, as for a hit); *flight
+                        // is a new fetch refreshing it, handed to a background leader
+} cache_lookup_result;
+
+/*
+ * cache_retain - Takes another reference to an element the caller already has pinned.
+ */
+void cache_retain(cache_element *element);
+
+/*
+ * cache_lookup - Like cache_acquire(), but a miss joins the single fetch in flight for url
+ * (or starts it), so concurrent misses for one key reach the origin only once. A follower
+ * gets the leader's element pinned and must call cache_flight_leave() when done with it.
+ * An element past its fresh_until is a miss too: its leader revalidates it (see
+ * cache_fill_stale()). It is still a hit inside its stale-while-revalidate window, the
+ * first such lookup also starting a refresh (CACHE_REFRESH), and inside its stale-if-error
+ * window for CACHE_RETRY_INTERVAL seconds after a revalidation failed. A miss in memory is
+ * looked up in the disk tier next, once disk_init() has enabled it.
+ */
+cache_lookup_result cache_lookup(const char *url, cache_element **element, cache_flight **flight);
+
+/*
+ * cache_lookup_cached - Like cache_lookup(), but a miss with no fetch in flight for url is
+ * not turned into one: it returns CACHE_LEADER with *element and *flight NULL.
+ */
+cache_lookup_result cache_lookup_cached(const char *url, cache_element **element,
+                                        cache_flight **flight);
+
+/*
+ * cache_fill_reserve - Leader only. Returns the free space at the end of the element being
+ * filled so the origin response can be received into it directly, or NULL once the fill has
+ * been abandoned (flight is NULL, allocation failed or max_element reached).
+ */
+char *cache_fill_reserve(cache_flight *flight, size_t *avail);
+
+/*
+ * cache_fill_commit - Leader only. Makes n bytes written at cache_fill_reserve() visible to
+ * followers.
+ */
+void cache_fill_commit(cache_flight *flight, size_t n);
+
+/*
+ * cache_fill_fits - Leader only. Whether a response of length bytes could be cached at all.
+ */
+int cache_fill_fits(cache_flight *flight, uint64_t length);
+
+/*
+ * cache_fits - Whether a response of length bytes could be cached under url at all.
+ */
+int cache_fits(const char *url, uint64_t length);
+
+/*
+ * cache_fill_key - Leader only. The key the response being filled will be cached under.
+ */
+const char *cache_fill_key(cache_flight *flight);
+
+/*
+ * cache_fill_append - Leader only. Copies len bytes to the end of the element being filled
+ * and makes them visible to followers. Returns 0, or -1 once the fill has been abandoned.
+ */
+int cache_fill_append(cache_flight *flight, const char *data, size_t len);
+
+/*
+ * cache_fill_freshness - Leader only. Records how long the element being filled may be
+ * served without asking the origin, and the header lines (NULL or empty if none) that
+ * revalidate it once stale. Returns 0, or -1 if the validators could not be stored.
+ */
+int cache_fill_freshness(cache_flight *flight, const cache_freshness *freshness,
+                         const char *validators);
+
+/*
+ * cache_fill_element - Leader only. The element being filled.
+ */
+cache_element *cache_fill_element(cache_flight *flight);
+
+/*
+ * cache_fill_rewrite - Leader only. Appends len bytes to a copy of the response that the
+ * cache stores instead of the element filled, for a response the leader transforms once it
+ * has been received; followers still stream the element as filled. Returns 0, or -1 if the
+ * copy would outgrow the element limit or allocation failed: it is then dropped and the
+ * element filled is stored after all.
+ */
+int cache_fill_rewrite(cache_flight *flight, const char *data, size_t len);
+
+/*
+ * cache_fill_rewrite_cancel - Leader only. Drops the copy begun by cache_fill_rewrite().
+ */
+void cache_fill_rewrite_cancel(cache_flight *flight);
+
+/*
+ * cache_fill_stale - Leader only. The stale element the fetch revalidates, pinned until the
+ * flight completes, or NULL if there is none. Its validators go on the origin request; a
+ * 304 answer lets the leader refill the element with a copy of it.
+ */
+cache_element *cache_fill_stale(cache_flight *flight);
+
+/*
+ * cache_fill_failed - Leader only. The origin could not be reached or answered with a server
+ * error. If the flight revalidates a stale element, it is marked so that lookups serve it
+ * instead of retrying the origin for CACHE_RETRY_INTERVAL seconds, as far as its
+ * stale-if-error window allows. Returns the stale element pinned for the caller to serve
+ * if that window is still open, else NULL.
+ */
+cache_element *cache_fill_failed(cache_flight *flight);
+
+/*
+ * cache_fallback - For a request whose followed fill was aborted before anything was sent:
+ * returns the element cached for url, pinned, if the fetch failed revalidating it and it may
+ * be served in its place (see cache_fill_failed()), else NULL.
+ */
+cache_element *cache_fallback(const char *url);
+
+/*
+ * cache_fill_abandon - Leader only. Gives up caching the response: followers see the fill
+ * aborted and cache_fill_reserve() returns NULL from now on.
+ */
+void cache_fill_abandon(cache_flight *flight);
+
+/*
+ * cache_flight_complete - Called exactly once by the leader. If ok the element is marked
+ * complete and, if store is set and it fits, published in the cache; otherwise followers see
+ * the fill aborted. Returns 1 if the element was cached. A NULL flight is ignored.
+ */
+int cache_flight_complete(cache_flight *flight, int ok, int store);
+
+/*
+ * cache_flight_wait - Follower only. Blocks until more than offset bytes of the element are
+ * readable or the fill has finished. Returns the fill state at that point.
+ */
+cache_fill_state cache_flight_wait(cache_flight *flight, size_t offset);
+
+/*
+ * cache_flight_leave - Follower only. Drops the follower's reference to the flight.
+ */
+void cache_flight_leave(cache_flight *flight);
+
+// --- Fill Notification ---
+// Non-blocking counterpart of cache_flight_wait() for followers driven by an event loop.
+typedef struct cache_flight_watcher {
+    void (*notify)(struct cache_flight_watcher *watcher);  // Runs on the leader's thread; must not block
+    struct cache_flight_watcher *next;                     // Next watcher of the same flight
+} cache_flight_watcher;
+
+/*
+ * cache_flight_watch - Follower only. Returns 1 if more than offset bytes of the element are
+ * readable or the fill has finished. Otherwise registers watcher and returns 0; its notify
+ * callback is then called exactly once, when the element grows or the fill finishes, unless
+ * cache_flight_unwatch() cancels it first.
+ */
+int cache_flight_watch(cache_flight *flight, size_t offset, cache_flight_watcher *watcher);
+
+/*
+ * cache_flight_unwatch - Cancels a registration made by cache_flight_watch(). Returns 1 if
+ * notify will never be called, 0 if it has already returned.
+ */
+int cache_flight_unwatch(cache_flight *flight, cache_flight_watcher *watcher);
+
+/*
+ * cache_evict_element - Evicts the policy's next victim from the fullest shard.
+ */
+void cache_evict_element(void);
+
+/*
+ * cache_persist - Queues every cached element not yet copied to the disk tier to be written
+ * there, for a snapshot. Does nothing without a disk tier.
+ */
+void cache_persist(void);
+
+/*
+ * cache_current_size - Bytes currently charged against the cache budget.
+ */
+size_t cache_current_size(void);
+
+/*
+ * cache_hash - 64-bit FNV-1a hash used to index cache keys.
+ */
+uint64_t cache_hash(const char *key, size_t len);
+
+#endif
@@ -0,0 +1,1060 @@
+#include "proxy_disk.h"
+#include "proxy_stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DISK_BUCKETS        65536          // Hash buckets of the index (power of two)
+#define DISK_RECORD_MAGIC   0x3244504bU    // Marks the start of every record
+#define DISK_INDEX_MAGIC    0x3158444bU    // Starts a snapshot index (version 1)
+#define DISK_FILE_PREFIX    "l2-"
+#define DISK_FILE_SUFFIX    ".seg"
+#define DISK_INDEX_FILE     "l2.index"
+
+// --- Segment Files ---
+// A segment is a sequence of records, each a header followed by the key, the validators and
+// the cached response, padded to 8 bytes. Only the writer thread appends, and only to the
+// newest segment; a record is indexed once it has been written in full.
+typedef struct disk_record {
+    uint32_t magic;                    // DISK_RECORD_MAGIC
+    uint32_t key_len;                  // Key bytes, NUL included
+    uint32_t validators_len;           // Validator bytes, NUL included
+    uint32_t unused;
+    uint64_t body_len;                 // Bytes of the cached response
+    uint64_t checksum;                 // FNV-1a over key, validators and response
+    cache_freshness freshness;
+} disk_record;
+
+typedef struct disk_segment {
+    struct disk_segment *next;         // Next newer segment
+    uint32_t id;                       // Number in the file name
+    uint32_t position;                 // Place in the snapshot being written
+    int fd;
+    char *map;                         // The whole file, mapped read-only
+    size_t used;                       // Bytes appended
+    size_t live;                       // Bytes of the records the index points to
+    atomic_int refs;                   // The tier's reference while listed, plus one per pin
+} disk_segment;
+
+typedef struct disk_entry {
+    struct disk_entry *next;           // Next entry in the bucket
+    uint64_t hash;
+    disk_segment *segment;
+    size_t offset;                     // Record start in segment
+    size_t size;                       // Record bytes, padding included
+    int64_t keep_until;                // Worth keeping until then (INT64_MAX if revalidatable)
+    unsigned hits;                     // Hits since the record was written
+    int verified;                      // Checksum known good (restored records start unverified)
+    char key[];
+} disk_entry;
+
+// --- Snapshot Index ---
+// A header, the segment table, then one entry per record followed by its key (padded to 8
+// bytes), and a checksum over all of it. Written to a temporary file and renamed over the
+// previous one once the segments it points into are synced.
+typedef struct disk_index_header {
+    uint32_t magic;                    // DISK_INDEX_MAGIC
+    uint32_t segments;                 // Segment table records that follow
+    uint64_t entries;                  // Entries after the segment table
+    uint64_t len;                      // File bytes, the trailing checksum included
+} disk_index_header;
+
+typedef struct disk_index_segment {
+    uint32_t id;
+    uint32_t unused;
+    uint64_t used;                     // Bytes of records in the segment file
+} disk_index_segment;
+
+typedef struct disk_index_entry {
+    uint32_t segment;                  // Position in the segment table
+    uint32_t key_len;                  // Key bytes that follow, NUL included
+    uint64_t offset;
+    uint64_t size;
+    int64_t keep_until;
+    uint64_t hits;
+} disk_index_entry;
+
+typedef struct disk_job {
+    struct disk_job *next;
+    cache_element *element;            // Element to write, referenced
+    size_t len;
+    int persist;                       // Copied by a snapshot rather than evicted
+} disk_job;
+
+// One lock covers the index, the segment list and the queue; it is never held across I/O
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t jobs_done = PTHREAD_COND_INITIALIZER;    // Signalled as jobs_written grows
+static disk_entry *buckets[DISK_BUCKETS];
+static disk_segment *oldest, *newest;      // Segment list, oldest first
+static disk_segment *active;               // Segment appended to (the newest), NULL if none yet
+static int segment_count, max_segments;
+static uint32_t next_id;
+static size_t entry_count;
+static disk_job *jobs_head, *jobs_tail;
+static size_t queued_bytes;
+static uint64_t jobs_queued, jobs_written;  // Jobs ever queued, and ever taken off and handled
+static char *directory;
+static uint64_t budget_bytes;
+static int snapshot_interval;
+static int enabled;
+
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;  // One snapshot at a time
+static sigset_t snapshot_signals;                                  // Handled by signal_main()
+static size_t restored;                    // Entries restored at startup
+static double restore_ms;                  // Time it took
+
+// Counters shown in the stats
+static atomic_ulong hits;                   // Lookups answered from disk
+static atomic_ulong misses;                 // Lookups that found nothing
+static atomic_ulong promotions;             // Hits handed back to memory
+static atomic_ulong demotions;              // Evicted elements written
+static atomic_ulong dropped;                // Evicted elements not written
+static atomic_ulong reinserted;             // Records moved out of a segment being dropped
+static atomic_ulong evicted;                // Entries dropped with their segment
+static atomic_ulong evicted_segments;       // Segments dropped to stay within the budget
+static atomic_ulong compactions;            // Segments compacted
+static atomic_ulong persisted;              // Elements written by snapshots
+static atomic_ulong damaged;                // Restored records failing their checksum
+static atomic_ulong snapshots;              // Snapshots written
+
+static uint64_t checksum(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ p[i]) * 1099511628211ULL;
+    return hash;
+}
+
+static size_t record_size(const disk_record *header) {
+    size_t size = sizeof(disk_record) + header->key_len + header->validators_len + header->body_len;
+    return (size + 7) & ~(size_t)7;
+}
+
+/*
+ * keep_until - Until when a record is worth keeping: one that can be revalidated (or has no
+ * lifetime) for good, others until both of their stale windows have passed.
+ */
+static int64_t keep_until(const cache_freshness *freshness, const char *validators) {
+    if (validators[0] || freshness->fresh_until == CACHE_NEVER_STALE)
+        return INT64_MAX;
+    int64_t window = freshness->if_error > freshness->while_revalidate
+                         ? freshness->if_error : freshness->while_revalidate;
+    return freshness->fresh_until + window;
+}
+
+/*
+ * record_at - Reads the header of the record at offset in segment into *header after
+ * checking that the record lies within the bytes appended and that its key is terminated.
+ * Returns the key, or NULL if the record is damaged.
+ */
+static const char *record_at(const disk_segment *segment, size_t offset, disk_record *header) {
+    if (offset > segment->used || segment->used - offset < sizeof(disk_record))
+        return NULL;
+    memcpy(header, segment->map + offset, sizeof(disk_record));
+    const char *key = segment->map + offset + sizeof(disk_record);
+    uint64_t max = segment->used - offset;
+    if (header->magic != DISK_RECORD_MAGIC || header->key_len == 0 ||
+        header->validators_len == 0 || header->body_len > max ||
+        (uint64_t)header->key_len + header->validators_len + header->body_len >
+            max - sizeof(disk_record) ||
+        key[header->key_len - 1] != '\0' || key[header->key_len + header->validators_len - 1] != '\0')
+        return NULL;
+    return key;
+}
+
+/*
+ * record_intact - Whether the key, validators and response after header still match its
+ * checksum.
+ */
+static int record_intact(const disk_record *header, const char *key) {
+    uint64_t sum = checksum(14695981039346656037ULL, key,
+                            header->key_len + header->validators_len + header->body_len);
+    return sum == header->checksum;
+}
+
+static void segment_path(uint32_t id, char *path, size_t size) {
+    snprintf(path, size, "%s/" DISK_FILE_PREFIX "%08u" DISK_FILE_SUFFIX, directory, id);
+}
+
+static int pwrite_all(int fd, const void *data, size_t len, off_t offset) {
+    const char *p = (const char *)data;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+        offset += n;
+    }
+    return 0;
+}
+
+// --- Segments ---
+
+/*
+ * segment_map - Maps the segment file open at fd. Closes fd on failure.
+ */
+static disk_segment *segment_map(int fd, uint32_t id) {
+    char *map = (char *)mmap(NULL, DISK_SEGMENT_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    disk_segment *segment = map != MAP_FAILED ? (disk_segment *)calloc(1, sizeof(disk_segment)) : NULL;
+    if (!segment) {
+        perror("Failed to map disk cache segment");
+        if (map != MAP_FAILED)
+            munmap(map, DISK_SEGMENT_SIZE);
+        close(fd);
+        return NULL;
+    }
+    segment->id = id;
+    segment->fd = fd;
+    segment->map = map;
+    atomic_init(&segment->refs, 1);
+    return segment;
+}
+
+/*
+ * segment_open - Creates the next segment file at its full size (sparse) and maps it.
+ */
+static disk_segment *segment_open(void) {
+    char path[PATH_MAX];
+    segment_path(next_id, path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        perror("Failed to create disk cache segment");
+        return NULL;
+    }
+    if (ftruncate(fd, DISK_SEGMENT_SIZE) < 0) {
+        perror("Failed to size disk cache segment");
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+    disk_segment *segment = segment_map(fd, next_id);
+    if (!segment) {
+        unlink(path);
+        return NULL;
+    }
+    next_id++;
+    return segment;
+}
+
+/*
+ * segment_load - Maps the segment file of a snapshot, holding used bytes of records.
+ */
+static disk_segment *segment_load(uint32_t id, size_t used) {
+    char path[PATH_MAX];
+    segment_path(id, path, sizeof(path));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size != DISK_SEGMENT_SIZE || used > DISK_SEGMENT_SIZE) {
+        close(fd);
+        return NULL;
+    }
+    disk_segment *segment = segment_map(fd, id);
+    if (segment)
+        segment->used = used;
+    return segment;
+}
+
+static void segment_put(disk_segment *segment) {
+    if (atomic_fetch_sub(&segment->refs, 1) != 1)
+        return;
+    munmap(segment->map, DISK_SEGMENT_SIZE);
+    close(segment->fd);
+    free(segment);
+}
+
+/*
+ * segment_drop - Unlists segment and removes its file; the mapping goes with the last pin.
+ * No entry may point to it any more.
+ */
+static void segment_drop(disk_segment *segment) {
+    pthread_mutex_lock(&lock);
+    disk_segment **link = &oldest, *previous = NULL;
+    while (*link != segment) {
+        previous = *link;
+        link = &(*link)->next;
+    }
+    *link = segment->next;
+    if (newest == segment)
+        newest = previous;
+    if (active == segment)
+        active = NULL;
+    segment_count--;
+    pthread_mutex_unlock(&lock);
+
+    char path[PATH_MAX];
+    segment_path(segment->id, path, sizeof(path));
+    unlink(path);
+    segment_put(segment);
+}
+
+// --- Index ---
+
+/*
+ * find_locked - Returns the link pointing to key's entry, or NULL. Lock held.
+ */
+static disk_entry **find_locked(const char *key, uint64_t hash) {
+    disk_entry **link = &buckets[hash & (DISK_BUCKETS - 1)];
+    while (*link && ((*link)->hash != hash || strcmp((*link)->key, key) != 0))
+        link = &(*link)->next;
+    return *link ? link : NULL;
+}
+
+// Lock held
+static void unlink_locked(disk_entry **link) {
+    disk_entry *entry = *link;
+    *link = entry->next;
+    entry->segment->live -= entry->size;
+    entry_count--;
+    free(entry);
+}
+
+/*
+ * insert_locked - Indexes a record of size bytes at offset in segment under key, superseding
+ * any entry for it. Returns the entry, or NULL if it could not be allocated. Lock held.
+ */
+static disk_entry *insert_locked(const char *key, size_t key_len, uint64_t hash,
+                                 disk_segment *segment, size_t offset, size_t size) {
+    disk_entry *entry = (disk_entry *)malloc(sizeof(disk_entry) + key_len + 1);
+    if (!entry)
+        return NULL;
+    disk_entry **link = find_locked(key, hash);
+    if (link)
+        unlink_locked(link);
+    entry->hash = hash;
+    entry->segment = segment;
+    entry->offset = offset;
+    entry->size = size;
+    entry->keep_until = INT64_MAX;
+    entry->hits = 0;
+    entry->verified = 1;
+    memcpy(entry->key, key, key_len + 1);
+    link = &buckets[hash & (DISK_BUCKETS - 1)];
+    entry->next = *link;
+    *link = entry;
+    segment->live += size;
+    entry_count++;
+    return entry;
+}
+
+/*
+ * forget_at - Drops key's entry if it still points at offset in segment.
+ */
+static void forget_at(const char *key, uint64_t hash, disk_segment *segment, size_t offset) {
+    pthread_mutex_lock(&lock);
+    disk_entry **link = find_locked(key, hash);
+    if (link && (*link)->segment == segment && (*link)->offset == offset)
+        unlink_locked(link);
+    pthread_mutex_unlock(&lock);
+}
+
+// --- Writer ---
+
+static void evict_oldest(void);
+
+/*
+ * append - Writes a record for key to the active segment, then points the index at it,
+ * superseding any older record. The response comes from element, or from len bytes at data
+ * without one. A full active segment is replaced by a new one only with may_rotate, which
+ * may drop the oldest segment. Writer thread only. Returns 0, or -1 if nothing was written.
+ */
+static int append(const char *key, uint64_t hash, const cache_freshness *freshness,
+                  const char *validators, cache_element *element, const char *data, size_t len,
+                  int may_rotate) {
+    disk_record header;
+    memset(&header, 0, sizeof(header));
+    header.magic = DISK_RECORD_MAGIC;
+    header.key_len = (uint32_t)strlen(key) + 1;
+    header.validators_len = (uint32_t)strlen(validators) + 1;
+    header.body_len = len;
+    header.freshness = *freshness;
+    size_t size = record_size(&header);
+    if (size > DISK_SEGMENT_SIZE)
+        return -1;
+
+    if (!active || active->used + size > DISK_SEGMENT_SIZE) {
+        if (!may_rotate)
+            return -1;
+        disk_segment *segment = segment_open();
+        if (!segment)
+            return -1;
+        pthread_mutex_lock(&lock);
+        if (newest)
+            newest->next = segment;
+        else
+            oldest = segment;
+        newest = active = segment;
+        segment_count++;
+        pthread_mutex_unlock(&lock);
+        while (segment_count > max_segments)
+            evict_oldest();
+    }
+
+    disk_segment *segment = active;
+    off_t offset = (off_t)segment->used;
+    off_t at = offset + (off_t)sizeof(header);
+    uint64_t sum = checksum(14695981039346656037ULL, key, header.key_len);
+    sum = checksum(sum, validators, header.validators_len);
+    int failed = pwrite_all(segment->fd, key, header.key_len, at) < 0 ||
+                 pwrite_all(segment->fd, validators, header.validators_len, at + header.key_len) < 0;
+    at += header.key_len + header.validators_len;
+    if (!element) {
+        sum = checksum(sum, data, len);
+        failed = failed || pwrite_all(segment->fd, data, len, at) < 0;
+    } else {
+        cache_cursor cursor;
+        size_t n;
+        cache_cursor_init(&cursor, element);
+        while (!failed && (n = cache_cursor_next(&cursor, &data)) > 0) {
+            sum = checksum(sum, data, n);
+            failed = pwrite_all(segment->fd, data, n, at) < 0;
+            at += (off_t)n;
+        }
+    }
+    header.checksum = sum;
+    if (failed || pwrite_all(segment->fd, &header, sizeof(header), offset) < 0) {
+        perror("Failed to write disk cache record");
+        return -1;
+    }
+
+    pthread_mutex_lock(&lock);
+    segment->used += size;
+    disk_entry *entry = insert_locked(key, header.key_len - 1, hash, segment, (size_t)offset, size);
+    if (entry)
+        entry->keep_until = keep_until(freshness, validators);
+    pthread_mutex_unlock(&lock);
+    return entry ? 0 : -1;
+}
+
+/*
+ * clean - Empties segment so it can be dropped: the records the index still points to are
+ * appended again to the active segment (with hot_only, just those hit since they were
+ * written), the others are forgotten. The active segment must not be segment, and is never
+ * replaced meanwhile. A damaged record ends the walk; the index is then swept for entries
+ * pointing past it.
+ */
+static void clean(disk_segment *segment, int hot_only) {
+    size_t offset = 0;
+    while (offset < segment->used) {
+        disk_record header;
+        const char *key = record_at(segment, offset, &header);
+        if (!key)
+            break;
+        const char *validators = key + header.key_len;
+        const char *data = validators + header.validators_len;
+        uint64_t hash = cache_hash(key, header.key_len - 1);
+
+        pthread_mutex_lock(&lock);
+        disk_entry **link = find_locked(key, hash);
+        int live = link && (*link)->segment == segment && (*link)->offset == offset;
+        int verified = live && (*link)->verified;
+        if (live && hot_only && (*link)->hits == 0) {
+            unlink_locked(link);
+            atomic_fetch_add(&evicted, 1);
+            live = 0;
+        }
+        pthread_mutex_unlock(&lock);
+
+        if (live && !verified && !record_intact(&header, key)) {
+            atomic_fetch_add(&damaged, 1);
+            forget_at(key, hash, segment, offset);
+        } else if (live && append(key, hash, &header.freshness, validators, NULL, data,
+                                  header.body_len, 0) == 0) {
+            atomic_fetch_add(&reinserted, 1);
+        } else if (live) {
+            forget_at(key, hash, segment, offset);
+            atomic_fetch_add(&evicted, 1);
+        }
+        offset += record_size(&header);
+    }
+
+    if (offset < segment->used) {
+        pthread_mutex_lock(&lock);
+        for (size_t i = 0; i < DISK_BUCKETS; i++) {
+            disk_entry **link = &buckets[i];
+            while (*link) {
+                if ((*link)->segment == segment)
+                    unlink_locked(link);
+                else
+                    link = &(*link)->next;
+            }
+        }
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+/*
+ * evict_oldest - Drops the oldest segment to stay within the budget, keeping what was hit
+ * since it was written. Called right after a new active segment was opened, which has room
+ * for it.
+ */
+static void evict_oldest(void) {
+    disk_segment *victim = oldest;
+    clean(victim, 1);
+    segment_drop(victim);
+    atomic_fetch_add(&evicted_segments, 1);
+}
+
+/*
+ * compact - Rewrites the oldest sealed segment that holds less than DISK_COMPACT_LIVE
+ * percent of live records, if those fit in what is left of the active one.
+ */
+static void compact(void) {
+    disk_segment *victim = NULL;
+    pthread_mutex_lock(&lock);
+    for (disk_segment *segment = oldest; active && segment != active; segment = segment->next) {
+        if (segment->live * 100 < segment->used * DISK_COMPACT_LIVE &&
+            segment->live <= DISK_SEGMENT_SIZE - active->used) {
+            victim = segment;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    if (!victim)
+        return;
+    clean(victim, 0);
+    segment_drop(victim);
+    atomic_fetch_add(&compactions, 1);
+}
+
+static void write_job(disk_job *job) {
+    cache_element *element = job->element;
+    const char *validators = element->validators ? element->validators : "";
+    if (append(element->url, element->hash, &element->freshness, validators, element, NULL,
+               job->len, 1) < 0)
+        atomic_fetch_add(&dropped, 1);
+    else if (job->persist)
+        atomic_fetch_add(&persisted, 1);
+    else
+        atomic_fetch_add(&demotions, 1);
+}
+
+static void *disk_main(void *arg) {
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        if (!jobs_head) {
+            // Compaction only runs while nothing waits to be written
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&jobs_ready, &lock, &deadline);
+        }
+        disk_job *job = jobs_head;
+        if (job) {
+            jobs_head = job->next;
+            if (!jobs_head)
+                jobs_tail = NULL;
+            queued_bytes -= job->len;
+        }
+        pthread_mutex_unlock(&lock);
+
+        if (!job) {
+            compact();
+            continue;
+        }
+        write_job(job);
+        cache_release(job->element);
+        free(job);
+
+        pthread_mutex_lock(&lock);
+        jobs_written++;
+        pthread_cond_broadcast(&jobs_done);
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+static void disk_dump_stats(FILE *out, void *arg) {
+    pthread_mutex_lock(&lock);
+    size_t live = 0, used = 0;
+    for (disk_segment *segment = oldest; segment; segment = segment->next) {
+        live += segment->live;
+        used += segment->used;
+    }
+    fprintf(out, "directory: %s, budget: %llu MB, segments: %d of %d, entries: %zu, "
+            "live %zu of %zu KB, queued %zu KB\n", directory,
+            (unsigned long long)(budget_bytes >> 20), segment_count, max_segments + 1,
+            entry_count, live >> 10, used >> 10, queued_bytes >> 10);
+    pthread_mutex_unlock(&lock);
+    fprintf(out, "  hits %lu, misses %lu, promotions %lu, demotions %lu, dropped %lu, "
+            "reinserted %lu, evicted %lu, evicted segments %lu, compactions %lu\n",
+            atomic_load(&hits), atomic_load(&misses), atomic_load(&promotions),
+            atomic_load(&demotions), atomic_load(&dropped), atomic_load(&reinserted),
+            atomic_load(&evicted), atomic_load(&evicted_segments), atomic_load(&compactions));
+    fprintf(out, "  restored %zu entries in %.1f ms, damaged %lu, snapshots %lu, persisted %lu\n",
+            restored, restore_ms, atomic_load(&damaged), atomic_load(&snapshots),
+            atomic_load(&persisted));
+}
+
+// --- Snapshots ---
+
+/*
+ * restore - Loads the index of the last snapshot in directory: maps the segment files it
+ * lists, without reading them, and indexes their entries unverified. Entries in segment
+ * files gone missing and entries no longer worth keeping are skipped. The restored
+ * segments are sealed; the first record written opens a new one.
+ */
+static void restore(void) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/" DISK_INDEX_FILE, directory);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    struct stat st;
+    char *buffer = NULL;
+    size_t len = 0;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)(sizeof(disk_index_header) + sizeof(uint64_t))) {
+        len = (size_t)st.st_size;
+        buffer = (char *)malloc(len);
+        if (buffer && pread(fd, buffer, len, 0) != (ssize_t)len) {
+            free(buffer);
+            buffer = NULL;
+        }
+    }
+    close(fd);
+    if (!buffer)
+        return;
+
+    disk_index_header header;
+    uint64_t sum;
+    memcpy(&header, buffer, sizeof(header));
+    memcpy(&sum, buffer + len - sizeof(sum), sizeof(sum));
+    const char *end = buffer + len - sizeof(sum);
+    const char *p = buffer + sizeof(header);
+    if (header.magic != DISK_INDEX_MAGIC || header.len != len ||
+        header.segments > (size_t)(end - p) / sizeof(disk_index_segment) ||
+        checksum(14695981039346656037ULL, buffer, len - sizeof(sum)) != sum) {
+        fprintf(stderr, "Ignoring damaged disk cache index %s\n", path);
+        free(buffer);
+        return;
+    }
+
+    disk_segment **table = (disk_segment **)calloc(header.segments + 1, sizeof(disk_segment *));
+    for (uint32_t i = 0; table && i < header.segments; i++, p += sizeof(disk_index_segment)) {
+        disk_index_segment record;
+        memcpy(&record, p, sizeof(record));
+        table[i] = segment_load(record.id, record.used);
+        if (!table[i])
+            continue;
+        if (newest)
+            newest->next = table[i];
+        else
+            oldest = table[i];
+        newest = table[i];
+        segment_count++;
+        if (record.id >= next_id)
+            next_id = record.id + 1;
+    }
+
+    int64_t now = (int64_t)time(NULL);
+    for (uint64_t i = 0; table && i < header.entries; i++) {
+        disk_index_entry record;
+        if ((size_t)(end - p) < sizeof(record))
+            break;
+        memcpy(&record, p, sizeof(record));
+        p += sizeof(record);
+        size_t padded = ((size_t)record.key_len + 7) & ~(size_t)7;
+        if (record.key_len == 0 || padded > (size_t)(end - p) || p[record.key_len - 1] != '\0')
+            break;
+        const char *key = p;
+        p += padded;
+
+        disk_segment *segment = record.segment < header.segments ? table[record.segment] : NULL;
+        if (!segment || record.offset > segment->used || record.size > segment->used - record.offset ||
+            record.keep_until <= now)
+            continue;
+        disk_entry *entry = insert_locked(key, record.key_len - 1, cache_hash(key, record.key_len - 1),
+                                          segment, record.offset, record.size);
+        if (!entry)
+            break;
+        entry->keep_until = record.keep_until;
+        entry->hits = (unsigned)record.hits;
+        entry->verified = 0;
+    }
+    restored = entry_count;
+    free(table);
+    free(buffer);
+}
+
+/*
+ * remove_leftovers - Deletes the segment files in directory that were not restored.
+ */
+static void remove_leftovers(void) {
+    DIR *dir = opendir(directory);
+    if (!dir)
+        return;
+    struct dirent *file;
+    size_t prefix = strlen(DISK_FILE_PREFIX), suffix = strlen(DISK_FILE_SUFFIX);
+    while ((file = readdir(dir)) != NULL) {
+        size_t len = strlen(file->d_name);
+        if (len <= prefix + suffix || strncmp(file->d_name, DISK_FILE_PREFIX, prefix) != 0 ||
+            strcmp(file->d_name + len - suffix, DISK_FILE_SUFFIX) != 0)
+            continue;
+        disk_segment *segment = oldest;
+        while (segment && (unsigned long)segment->id != strtoul(file->d_name + prefix, NULL, 10))
+            segment = segment->next;
+        if (!segment) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", directory, file->d_name);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+}
+
+/*
+ * serialize_locked - Lays the index out as the snapshot stores it and pins every listed
+ * segment into *pinned (*count of them) so it can be synced. Returns the buffer, *len bytes
+ * long, or NULL. Lock held.
+ */
+static char *serialize_locked(size_t *len, disk_segment ***pinned, uint32_t *count) {
+    size_t size = sizeof(disk_index_header) + sizeof(uint64_t);
+    uint32_t segments = 0;
+    for (disk_segment *segment = oldest; segment; segment = segment->next)
+        segment->position = segments++;
+    size += segments * sizeof(disk_index_segment);
+    for (size_t i = 0; i < DISK_BUCKETS; i++)
+        for (disk_entry *entry = buckets[i]; entry; entry = entry->next)
+            size += sizeof(disk_index_entry) + ((strlen(entry->key) + 1 + 7) & ~(size_t)7);
+
+    char *buffer = (char *)calloc(1, size);
+    *pinned = (disk_segment **)calloc(segments + 1, sizeof(disk_segment *));
+    if (!buffer || !*pinned) {
+        free(buffer);
+        free(*pinned);
+        return NULL;
+    }
+
+    disk_index_header header = { DISK_INDEX_MAGIC, segments, entry_count, size };
+    memcpy(buffer, &header, sizeof(header));
+    char *p = buffer + sizeof(header);
+    for (disk_segment *segment = oldest; segment; segment = segment->next) {
+        disk_index_segment record = { segment->id, 0, segment->used };
+        memcpy(p, &record, sizeof(record));
+        p += sizeof(record);
+        atomic_fetch_add(&segment->refs, 1);
+        (*pinned)[segment->position] = segment;
+    }
+    for (size_t i = 0; i < DISK_BUCKETS; i++) {
+        for (disk_entry *entry = buckets[i]; entry; entry = entry->next) {
+            size_t key_len = strlen(entry->key) + 1;
+            disk_index_entry record = { entry->segment->position, (uint32_t)key_len, entry->offset,
+                                        entry->size, entry->keep_until, entry->hits };
+            memcpy(p, &record, sizeof(record));
+            p += sizeof(record);
+            memcpy(p, entry->key, key_len);
+            p += (key_len + 7) & ~(size_t)7;
+        }
+    }
+    uint64_t sum = checksum(14695981039346656037ULL, buffer, size - sizeof(sum));
+    memcpy(p, &sum, sizeof(sum));
+    *len = size;
+    *count = segments;
+    return buffer;
+}
+
+/*
+ * write_index - Replaces the index file with len bytes at buffer, durably.
+ */
+static int write_index(const char *buffer, size_t len) {
+    char path[PATH_MAX], temp[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/" DISK_INDEX_FILE, directory);
+    snprintf(temp, sizeof(temp), "%s/" DISK_INDEX_FILE ".tmp", directory);
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        perror("Failed to create disk cache index");
+        return -1;
+    }
+    if (pwrite_all(fd, buffer, len, 0) < 0 || fsync(fd) < 0) {
+        perror("Failed to write disk cache index");
+        close(fd);
+        unlink(temp);
+        return -1;
+    }
+    close(fd);
+    if (rename(temp, path) < 0) {
+        perror("Failed to replace disk cache index");
+        unlink(temp);
+        return -1;
+    }
+    int dir = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir >= 0) {
+        fsync(dir);
+        close(dir);
+    }
+    return 0;
+}
+
+/*
+ * disk_snapshot - Everything queued before the index is laid out has been written; the
+ * segments are synced after, which covers every record the index points to since records
+ * never change once indexed.
+ */
+long disk_snapshot(void) {
+    if (!enabled)
+        return -1;
+    pthread_mutex_lock(&snapshot_lock);
+    cache_persist();
+
+    pthread_mutex_lock(&lock);
+    uint64_t target = jobs_queued;
+    while (jobs_written < target)
+        pthread_cond_wait(&jobs_done, &lock);
+    size_t len = 0;
+    disk_segment **pinned = NULL;
+    uint32_t count = 0;
+    long entries = (long)entry_count;
+    char *buffer = serialize_locked(&len, &pinned, &count);
+    pthread_mutex_unlock(&lock);
+    if (!buffer) {
+        perror("malloc failed for disk cache index");
+        pthread_mutex_unlock(&snapshot_lock);
+        return -1;
+    }
+
+    int failed = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (fdatasync(pinned[i]->fd) < 0)
+            failed = 1;
+        segment_put(pinned[i]);
+    }
+    if (failed)
+        perror("Failed to sync disk cache segment");
+    else
+        failed = write_index(buffer, len) < 0;
+    free(pinned);
+    free(buffer);
+    if (!failed)
+        atomic_fetch_add(&snapshots, 1);
+    pthread_mutex_unlock(&snapshot_lock);
+    return failed ? -1 : entries;
+}
+
+static void *snapshot_main(void *arg) {
+    for (;;) {
+        sleep((unsigned)snapshot_interval);
+        disk_snapshot();
+    }
+    return NULL;
+}
+
+/*
+ * signal_main - Snapshots on the signal, then ends the process.
+ */
+static void *signal_main(void *arg) {
+    int signo;
+    while (sigwait(&snapshot_signals, &signo) != 0)
+        ;
+    if (enabled) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        long entries = disk_snapshot();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (entries >= 0)
+            printf("Disk cache snapshot: %ld entries in %.1f ms\n", entries,
+                   (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    }
+    exit(EXIT_SUCCESS);
+    return NULL;
+}
+
+/*
+ * disk_snapshot_on_signal - The thread is created with every signal blocked, so the
+ * signals other threads wait for are never delivered to it.
+ */
+int disk_snapshot_on_signal(int signo) {
+    sigemptyset(&snapshot_signals);
+    sigaddset(&snapshot_signals, signo);
+    if (pthread_sigmask(SIG_BLOCK, &snapshot_signals, NULL) != 0) {
+        perror("Failed to block snapshot signal");
+        return -1;
+    }
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    pthread_t thread;
+    int ret = pthread_create(&thread, NULL, signal_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (ret != 0) {
+        perror("Failed to start snapshot signal thread");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// --- Disk Tier ---
+
+/*
+ * disk_init - The budget is kept with one segment to spare, as a new segment is opened
+ * before the oldest one is dropped.
+ */
+int disk_init(const char *dir, uint64_t budget, int interval) {
+    budget_bytes = budget > 0 ? budget : DISK_BUDGET;
+    max_segments = (int)(budget_bytes / DISK_SEGMENT_SIZE) - 1;
+    if (max_segments < 1)
+        max_segments = 1;
+    snapshot_interval = interval;
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        perror("Failed to create disk cache directory");
+        return -1;
+    }
+    directory = strdup(dir);
+    if (!directory) {
+        perror("strdup failed for disk cache directory");
+        return -1;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    restore();
+    remove_leftovers();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    restore_ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, disk_main, NULL) != 0) {
+        perror("Failed to start disk cache thread");
+        return -1;
+    }
+    pthread_detach(thread);
+    if (snapshot_interval > 0) {
+        if (pthread_create(&thread, NULL, snapshot_main, NULL) != 0) {
+            perror("Failed to start disk cache snapshot thread");
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+    stats_register("disk", disk_dump_stats, NULL);
+    enabled = 1;
+    return 0;
+}
+
+int disk_enabled(void) {
+    return enabled;
+}
+
+/*
+ * enqueue - Queues element (referenced) for the writer, bounded by DISK_QUEUE_MAX unless
+ * persist is set. Runs under a shard lock, so it does no I/O.
+ */
+static void enqueue(cache_element *element, int persist) {
+    const char *validators = element->validators ? element->validators : "";
+    int useless = (int64_t)time(NULL) >= keep_until(&element->freshness, validators);
+    size_t len = atomic_load(&element->len);
+    disk_job *job = useless ? NULL : (disk_job *)malloc(sizeof(disk_job));
+
+    int queued = 0, kept = 0;
+    pthread_mutex_lock(&lock);
+    if (element->on_disk && find_locked(element->url, element->hash)) {
+        kept = 1;
+    } else if (job && (persist || queued_bytes + len <= DISK_QUEUE_MAX)) {
+        job->next = NULL;
+        job->element = element;
+        job->len = len;
+        job->persist = persist;
+        if (jobs_tail)
+            jobs_tail->next = job;
+        else
+            jobs_head = job;
+        jobs_tail = job;
+        queued_bytes += len;
+        jobs_queued++;
+        queued = 1;
+        pthread_cond_signal(&jobs_ready);
+    }
+    pthread_mutex_unlock(&lock);
+    if (queued)
+        return;
+    free(job);
+    if (!kept)
+        atomic_fetch_add(&dropped, 1);
+    cache_release(element);
+}
+
+void disk_demote(cache_element *element) {
+    enqueue(element, 0);
+}
+
+void disk_persist(cache_element *element) {
+    enqueue(element, 1);
+}
+
+/*
+ * disk_lookup - Only the index is consulted under the lock; the record itself is read from
+ * the pinned mapping. A restored record is checked against its checksum on its first hit.
+ */
+int disk_lookup(const char *key, uint64_t hash, disk_hit *hit) {
+    pthread_mutex_lock(&lock);
+    disk_entry **link = find_locked(key, hash);
+    if (!link) {
+        pthread_mutex_unlock(&lock);
+        atomic_fetch_add(&misses, 1);
+        return -1;
+    }
+    disk_entry *entry = *link;
+    disk_segment *segment = entry->segment;
+    size_t offset = entry->offset, size = entry->size;
+    int verified = entry->verified;
+    atomic_fetch_add(&segment->refs, 1);
+    hit->hot = ++entry->hits >= DISK_PROMOTE_HITS;
+    pthread_mutex_unlock(&lock);
+
+    disk_record header;
+    const char *record_key = verified ? segment->map + offset + sizeof(header)
+                                      : record_at(segment, offset, &header);
+    if (verified) {
+        memcpy(&header, segment->map + offset, sizeof(header));
+    } else if (!record_key || record_size(&header) != size || strcmp(record_key, key) != 0 ||
+               !record_intact(&header, record_key)) {
+        forget_at(key, hash, segment, offset);
+        segment_put(segment);
+        atomic_fetch_add(&damaged, 1);
+        atomic_fetch_add(&misses, 1);
+        return -1;
+    } else {
+        pthread_mutex_lock(&lock);
+        link = find_locked(key, hash);
+        if (link && (*link)->segment == segment && (*link)->offset == offset)
+            (*link)->verified = 1;
+        pthread_mutex_unlock(&lock);
+    }
+
+    hit->segment = segment;
+    hit->validators = record_key + header.key_len;
+    hit->data = hit->validators + header.validators_len;
+    hit->len = header.body_len;
+    hit->freshness = header.freshness;
+    atomic_fetch_add(&hits, 1);
+    if (hit->hot)
+        atomic_fetch_add(&promotions, 1);
+    return 0;
+}
+
+void disk_release(disk_segment *segment) {
+    segment_put(segment);
+}
+
+void disk_forget(const char *key, uint64_t hash) {
+    pthread_mutex_lock(&lock);
+    disk_entry **link = find_locked(key, hash);
+    if (link)
+        unlink_locked(link);
+    pthread_mutex_unlock(&lock);
+}
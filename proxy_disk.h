@@ -0,0 +1,97 @@
+#ifndef PROXY_DISK_H
+#define PROXY_DISK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "proxy_cache.h"
+
+#define DISK_BUDGET         (10ULL << 30)   // Default bytes of segment files
+#define DISK_SEGMENT_SIZE   (64 << 20)      // Bytes per segment file, the unit of eviction
+#define DISK_QUEUE_MAX      (64 << 20)      // Bytes of evicted elements waiting to be written
+#define DISK_PROMOTE_HITS   2               // Hits on an entry that copy it back into memory
+#define DISK_COMPACT_LIVE   50              // Sealed segments less live than this (%) are compacted
+#define DISK_SNAPSHOT_INTERVAL 300          // Default seconds between snapshots (0 = on demand only)
+
+// --- Disk Tier ---
+// A second cache level behind the in-memory one. Elements the memory cache evicts are
+// appended by a writer thread to log-structured segment files, indexed in memory by key.
+// Segment files are mapped read-only, so a hit is sent straight from the page cache; an
+// entry hit often enough is copied back into memory. When the byte budget is reached the
+// oldest segment is dropped, entries hit since they were written moving to the newest one
+// first, and segments mostly holding superseded entries are compacted the same way.
+//
+// A snapshot also writes what is only in memory to the segment files, syncs them and writes
+// the index next to them. The next run restores the index and maps the segments without
+// reading them, so it serves hits as soon as it listens; each record's checksum is verified
+// the first time it is hit.
+struct disk_segment;
+
+typedef struct disk_hit {
+    struct disk_segment *segment;      // Pinned until disk_release()
+    const char *data;                  // The cached response, in the mapped segment file
+    size_t len;
+    cache_freshness freshness;
+    const char *validators;            // NUL-terminated, empty if none
+    int hot;                           // Hit often enough to be copied back into memory
+} disk_hit;
+
+/*
+ * disk_init - Keeps up to budget bytes (0 = DISK_BUDGET) of segment files in dir, created
+ * if missing, restoring the entries of the last snapshot taken there; other segment files
+ * are removed. Starts the writer thread, a snapshot every snapshot_interval seconds unless
+ * 0, and registers the disk stats. Returns 0, or -1 on failure.
+ */
+int disk_init(const char *dir, uint64_t budget, int snapshot_interval);
+
+/*
+ * disk_enabled - Whether disk_init() succeeded.
+ */
+int disk_enabled(void);
+
+/*
+ * disk_demote - Takes over a reference to element, which the memory cache is evicting, and
+ * queues it to be written. Elements no longer worth keeping (stale for good, without
+ * validators) and elements that do not fit in the queue are dropped; one copied from the
+ * disk tier is not written again while its entry is still there.
+ */
+void disk_demote(cache_element *element);
+
+/*
+ * disk_persist - Like disk_demote(), for an element staying in memory that a snapshot
+ * copies; the queue limit does not apply.
+ */
+void disk_persist(cache_element *element);
+
+/*
+ * disk_lookup - Looks up key (hashed to hash) and pins the segment holding it. Returns 0
+ * with the entry in *hit, or -1 on a miss.
+ */
+int disk_lookup(const char *key, uint64_t hash, disk_hit *hit);
+
+/*
+ * disk_release - Unpins a segment pinned by disk_lookup().
+ */
+void disk_release(struct disk_segment *segment);
+
+/*
+ * disk_forget - Drops the entry for key, superseded by an element published in memory.
+ */
+void disk_forget(const char *key, uint64_t hash);
+
+/*
+ * disk_snapshot - Copies every element only held in memory to the segment files (see
+ * cache_persist()), waits until they are written and synced, then replaces the index in the
+ * directory. Returns the number of entries saved, or -1 on failure.
+ */
+long disk_snapshot(void);
+
+/*
+ * disk_snapshot_on_signal - Blocks signo in the calling thread (and so in every thread it
+ * creates afterwards) and starts a thread that takes a snapshot, if the disk tier is
+ * enabled, and exits the process when signo is delivered. Call it before starting any other
+ * thread, including stats_dump_on_signal()'s. Returns 0, or -1 on error.
+ */
+int disk_snapshot_on_signal(int signo);
+
+#endif
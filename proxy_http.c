@@ -0,0 +1,716 @@
+#define _GNU_SOURCE   // strptime(), timegm()
+
+#include "proxy_http.h"
+#include "proxy_scan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+void http_response_init(http_response *r) {
+    memset(r, 0, sizeof(*r));
+    r->state = HTTP_HEAD;
+    r->content_length = -1;
+    r->range_first = -1;
+    r->range_last = -1;
+    r->range_total = -1;
+    r->max_age = -1;
+    r->s_maxage = -1;
+    r->stale_while_revalidate = -1;
+    r->stale_if_error = -1;
+    r->date = -1;
+    r->expires = -1;
+    r->last_modified = -1;
+}
+
+/*
+ * read_until_close - Gives up on framing: the body runs until the origin closes.
+ */
+static void read_until_close(http_response *r) {
+    r->state = HTTP_BODY_EOF;
+    r->keep_alive = 0;
+}
+
+// Whether the comma-separated list value contains token (case-insensitive)
+static int has_token(const char *value, const char *token) {
+    size_t len = strlen(token);
+    while (*value) {
+        while (*value == ' ' || *value == '\t' || *value == ',')
+            value++;
+        const char *end = value;
+        while (*end && *end != ',')
+            end++;
+        const char *last = end;
+        while (last > value && (last[-1] == ' ' || last[-1] == '\t'))
+            last--;
+        if ((size_t)(last - value) == len && strncasecmp(value, token, len) == 0)
+            return 1;
+        value = end;
+    }
+    return 0;
+}
+
+// Whether the last coding of a Transfer-Encoding value is chunked
+static int ends_chunked(const char *value) {
+    const char *last = strrchr(value, ',');
+    last = last ? last + 1 : value;
+    while (*last == ' ' || *last == '\t')
+        last++;
+    size_t len = strlen(last);
+    while (len > 0 && (last[len - 1] == ' ' || last[len - 1] == '\t'))
+        len--;
+    return len == 7 && strncasecmp(last, "chunked", 7) == 0;
+}
+
+size_t http_head_length(const char *data, size_t len, size_t from) {
+    return scan_head_end(data, len, from);
+}
+
+int http_request_keep_alive(const char *head) {
+    const char *line_end = strstr(head, "\r\n");
+    const char *version = line_end ? line_end : head + strlen(head);
+    while (version > head && version[-1] != ' ')
+        version--;
+    int keep_alive = strncmp(version, "HTTP/1.", 7) == 0 && version[7] != '0';
+
+    for (const char *line = line_end; line && line[2] != '\r' && line[2] != '\0';
+         line = strstr(line + 2, "\r\n")) {
+        const char *name = line + 2;
+        const char *value;
+        if (strncasecmp(name, "Connection:", 11) == 0)
+            value = name + 11;
+        else if (strncasecmp(name, "Proxy-Connection:", 17) == 0)
+            value = name + 17;
+        else
+            continue;
+
+        char tokens[HTTP_LINE_MAX];
+        const char *end = strstr(value, "\r\n");
+        size_t n = end ? (size_t)(end - value) : strlen(value);
+        if (n >= sizeof(tokens))
+            n = sizeof(tokens) - 1;
+        memcpy(tokens, value, n);
+        tokens[n] = '\0';
+        if (has_token(tokens, "close"))
+            return 0;
+        if (has_token(tokens, "keep-alive"))
+            keep_alive = 1;
+    }
+    return keep_alive;
+}
+
+const char *http_request_target(const char *head, size_t *len) {
+    const char *line_end = strstr(head, "\r\n");
+    if (!line_end)
+        line_end = head + strlen(head);
+    const char *target = memchr(head, ' ', (size_t)(line_end - head));
+    if (!target || target == head)
+        return NULL;
+    target++;
+    const char *end = memchr(target, ' ', (size_t)(line_end - target));
+    if (!end || end == target || strncmp(end + 1, "HTTP/", 5) != 0)
+        return NULL;
+    *len = (size_t)(end - target);
+    return target;
+}
+
+int http_header_value(const char *head, const char *name, char *out, size_t size) {
+    size_t name_len = strlen(name), used = 0;
+    int found = 0;
+    out[0] = '\0';
+    for (const char *line = strstr(head, "\r\n"); line && line[2] != '\r' && line[2] != '\0';
+         line = strstr(line + 2, "\r\n")) {
+        const char *field = line + 2;
+        if (strncasecmp(field, name, name_len) != 0 || field[name_len] != ':')
+            continue;
+        const char *value = field + name_len + 1;
+        const char *end = strstr(value, "\r\n");
+        if (!end)
+            end = value + strlen(value);
+        while (value < end && (*value == ' ' || *value == '\t'))
+            value++;
+        while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+            end--;
+
+        if (found++ && used + 2 < size) {
+            memcpy(out + used, ", ", 2);
+            used += 2;
+        }
+        size_t n = (size_t)(end - value);
+        if (n > size - 1 - used)
+            n = size - 1 - used;
+        memcpy(out + used, value, n);
+        used += n;
+        out[used] = '\0';
+    }
+    return found ? (int)used : -1;
+}
+
+// Parses an HTTP-date in any of the three formats RFC 9110 5.6.7 accepts; -1 if invalid
+static time_t parse_http_date(const char *value) {
+    static const char *const formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT",    // IMF-fixdate
+        "%A, %d-%b-%y %H:%M:%S GMT",    // Obsolete RFC 850 format
+        "%a %b %e %H:%M:%S %Y"          // asctime() format
+    };
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char *end = strptime(value, formats[i], &tm);
+        if (!end)
+            continue;
+        while (*end == ' ' || *end == '\t')
+            end++;
+        if (*end == '\0')
+            return timegm(&tm);
+    }
+    return -1;
+}
+
+// Seconds of a delta-seconds value (quotes tolerated); an invalid one counts as 0
+static int64_t parse_seconds(const char *value) {
+    if (*value == '"')
+        value++;
+    char *end;
+    long long seconds = strtoll(value, &end, 10);
+    return end == value || seconds < 0 ? 0 : (int64_t)seconds;
+}
+
+// Whether the len bytes at name are the directive want (case-insensitive)
+static int is_directive(const char *name, size_t len, const char *want) {
+    return strlen(want) == len && strncasecmp(name, want, len) == 0;
+}
+
+/*
+ * parse_cache_control - Picks the directives a shared cache obeys out of a Cache-Control
+ * value. A field cut short may have lost a no-store, so it is not stored at all.
+ */
+static void parse_cache_control(http_response *r, const char *value) {
+    if (r->truncated) {
+        r->no_store = 1;
+        return;
+    }
+    while (*value) {
+        while (*value == ' ' || *value == '\t' || *value == ',')
+            value++;
+        const char *name = value;
+        while (*value && *value != ',' && *value != '=' && *value != ' ' && *value != '\t')
+            value++;
+        size_t len = (size_t)(value - name);
+        while (*value == ' ' || *value == '\t')
+            value++;
+        const char *arg = NULL;
+        if (*value == '=') {
+            arg = ++value;
+            if (*value == '"') {
+                value = strchr(value + 1, '"');
+                value = value ? value + 1 : arg + strlen(arg);
+            }
+        }
+        while (*value && *value != ',')
+            value++;
+
+        // A qualified private or no-cache ("private=field") is treated like the plain one
+        if (is_directive(name, len, "no-store") || is_directive(name, len, "private"))
+            r->no_store = 1;
+        else if (is_directive(name, len, "no-cache"))
+            r->no_cache = 1;
+        else if (is_directive(name, len, "must-revalidate") ||
+                 is_directive(name, len, "proxy-revalidate"))
+            r->must_revalidate = 1;
+        else if (is_directive(name, len, "max-age") && arg)
+            r->max_age = parse_seconds(arg);
+        else if (is_directive(name, len, "s-maxage") && arg)
+            r->s_maxage = parse_seconds(arg);
+        else if (is_directive(name, len, "stale-while-revalidate") && arg)
+            r->stale_while_revalidate = parse_seconds(arg);
+        else if (is_directive(name, len, "stale-if-error") && arg)
+            r->stale_if_error = parse_seconds(arg);
+    }
+}
+
+// Reads "bytes first-last/total" ("*" for an unknown total); anything else is ignored
+static void parse_content_range(http_response *r, const char *value) {
+    unsigned long long first, last, total;
+    int n = 0;
+    if (sscanf(value, "bytes %llu-%llu/%n", &first, &last, &n) != 2 || n == 0 || first > last)
+        return;
+    r->range_first = (int64_t)first;
+    r->range_last = (int64_t)last;
+    if (sscanf(value + n, "%llu", &total) == 1 && total > last)
+        r->range_total = (int64_t)total;
+}
+
+static void parse_status_line(http_response *r) {
+    int minor, status;
+    if (sscanf(r->line, "HTTP/1.%d %3d", &minor, &status) != 2) {
+        read_until_close(r);
+        return;
+    }
+    r->status = status;
+    r->keep_alive = minor >= 1;     // HTTP/1.0 needs an explicit keep-alive
+}
+
+static void parse_header(http_response *r) {
+    char *colon = strchr(r->line, ':');
+    if (!colon)
+        return;
+    *colon = '\0';
+    char *value = colon + 1;
+    while (*value == ' ' || *value == '\t')
+        value++;
+
+    if (strcasecmp(r->line, "Content-Length") == 0) {
+        char *end;
+        long long length = strtoll(value, &end, 10);
+        if (end == value || length < 0 ||
+            (r->content_length >= 0 && r->content_length != length)) {
+            read_until_close(r);
+            return;
+        }
+        r->content_length = length;
+    } else if (strcasecmp(r->line, "Content-Range") == 0) {
+        parse_content_range(r, value);
+    } else if (strcasecmp(r->line, "Transfer-Encoding") == 0) {
+        r->chunked = ends_chunked(value);
+        if (!r->chunked)
+            read_until_close(r);
+    } else if (strcasecmp(r->line, "Cache-Control") == 0) {
+        parse_cache_control(r, value);
+    } else if (strcasecmp(r->line, "Expires") == 0) {
+        r->expires = parse_http_date(value);
+        if (r->expires < 0)
+            r->expires = 0;
+    } else if (strcasecmp(r->line, "Date") == 0) {
+        r->date = parse_http_date(value);
+    } else if (strcasecmp(r->line, "Last-Modified") == 0) {
+        r->last_modified = parse_http_date(value);
+    } else if (strcasecmp(r->line, "Age") == 0) {
+        r->age = parse_seconds(value);
+    } else if (strcasecmp(r->line, "ETag") == 0) {
+        // A validator cut short would never match
+        if (!r->truncated)
+            snprintf(r->etag, sizeof(r->etag), "%s", value);
+    } else if (strcasecmp(r->line, "Vary") == 0) {
+        // A list cut short would leave out fields the response depends on
+        size_t used = strlen(r->vary);
+        int n = snprintf(r->vary + used, sizeof(r->vary) - used, "%s%s", used ? ", " : "", value);
+        if (r->truncated || used + (size_t)n >= sizeof(r->vary))
+            strcpy(r->vary, "*");
+    } else if (strcasecmp(r->line, "Accept-Ranges") == 0) {
+        r->accept_ranges = has_token(value, "bytes");
+    } else if (strcasecmp(r->line, "Connection") == 0) {
+        if (has_token(value, "close"))
+            r->keep_alive = 0;
+        else if (has_token(value, "keep-alive"))
+            r->keep_alive = 1;
+    }
+}
+
+/*
+ * end_of_head - Picks the framing of the body once the blank line is seen.
+ */
+static void end_of_head(http_response *r) {
+    if (r->status >= 100 && r->status < 200 && r->status != 101) {
+        // Interim response: the real one follows on the same connection
+        int keep_alive = r->keep_alive;
+        http_response_init(r);
+        r->keep_alive = keep_alive;
+        return;
+    }
+    if (r->status == 101) {
+        read_until_close(r);
+    } else if (r->status == 204 || r->status == 304) {
+        r->state = HTTP_DONE;
+    } else if (r->chunked) {
+        // Transfer-Encoding overrides Content-Length, but a sender of both is not trusted again
+        if (r->content_length >= 0)
+            r->keep_alive = 0;
+        r->state = HTTP_CHUNK_SIZE;
+    } else if (r->content_length >= 0) {
+        r->remaining = (uint64_t)r->content_length;
+        r->state = r->remaining > 0 ? HTTP_BODY_LENGTH : HTTP_DONE;
+    } else {
+        read_until_close(r);
+    }
+}
+
+static void parse_chunk_size(http_response *r) {
+    char *end;
+    unsigned long long size = strtoull(r->line, &end, 16);
+    while (*end == ' ' || *end == '\t')
+        end++;
+    if (end == r->line || (*end != '\0' && *end != ';')) {
+        read_until_close(r);
+        return;
+    }
+    r->remaining = size;
+    r->state = size > 0 ? HTTP_CHUNK_DATA : HTTP_TRAILER;
+}
+
+/*
+ * complete_line - Handles a line of the head, a chunk size line, the CRLF after a chunk, or a
+ * trailer line. The line is NUL-terminated without its CRLF.
+ */
+static void complete_line(http_response *r) {
+    if (r->line_len > 0 && r->line[r->line_len - 1] == '\r')
+        r->line_len--;
+    r->line[r->line_len] = '\0';
+    int empty = r->line_len == 0;
+    r->line_len = 0;
+
+    switch (r->state) {
+        case HTTP_HEAD:
+            if (r->lines++ == 0)
+                parse_status_line(r);
+            else if (empty)
+                end_of_head(r);
+            else
+                parse_header(r);
+            break;
+        case HTTP_CHUNK_SIZE:
+            parse_chunk_size(r);
+            break;
+        case HTTP_CHUNK_END:
+            if (empty)
+                r->state = HTTP_CHUNK_SIZE;
+            else
+                read_until_close(r);
+            break;
+        case HTTP_TRAILER:
+            if (empty)
+                r->state = HTTP_DONE;
+            break;
+        default:
+            break;
+    }
+    r->truncated = 0;
+}
+
+/*
+ * http_response_feed - Line states copy up to the next LF at once; body bytes are skipped in
+ * bulk.
+ */
+size_t http_response_feed(http_response *r, const char *data, size_t len) {
+    size_t used = 0;
+    while (used < len && r->state != HTTP_DONE) {
+        switch (r->state) {
+            case HTTP_BODY_EOF:
+                return len;
+            case HTTP_BODY_LENGTH:
+            case HTTP_CHUNK_DATA: {
+                size_t n = len - used;
+                if (n > r->remaining)
+                    n = (size_t)r->remaining;
+                used += n;
+                r->remaining -= n;
+                if (r->remaining == 0)
+                    r->state = r->state == HTTP_BODY_LENGTH ? HTTP_DONE : HTTP_CHUNK_END;
+                break;
+            }
+            default: {
+                const char *lf = memchr(data + used, '\n', len - used);
+                size_t n = lf ? (size_t)(lf - (data + used)) : len - used;
+                size_t keep = sizeof(r->line) - 1 - r->line_len;
+                if (keep > n)
+                    keep = n;
+                memcpy(r->line + r->line_len, data + used, keep);
+                r->line_len += keep;
+                if (keep < n)
+                    r->truncated = 1;
+                used += n;
+                if (used < len) {
+                    used++;
+                    complete_line(r);
+                }
+                break;
+            }
+        }
+    }
+    return used;
+}
+
+void http_response_feed_iov(http_response *r, const struct iovec *iov, size_t len) {
+    for (; len > 0; iov++) {
+        size_t n = iov->iov_len < len ? iov->iov_len : len;
+        http_response_feed(r, (const char *)iov->iov_base, n);
+        len -= n;
+    }
+}
+
+uint64_t http_response_opaque(const http_response *r) {
+    if (r->state == HTTP_BODY_LENGTH || r->state == HTTP_CHUNK_DATA)
+        return r->remaining;
+    return r->state == HTTP_BODY_EOF ? UINT64_MAX : 0;
+}
+
+void http_response_skip(http_response *r, uint64_t n) {
+    if (r->state != HTTP_BODY_LENGTH && r->state != HTTP_CHUNK_DATA)
+        return;
+    r->remaining -= n < r->remaining ? n : r->remaining;
+    if (r->remaining == 0)
+        r->state = r->state == HTTP_BODY_LENGTH ? HTTP_DONE : HTTP_CHUNK_END;
+}
+
+int http_response_eof(http_response *r) {
+    if (r->state != HTTP_BODY_EOF)
+        return r->state == HTTP_DONE;
+    r->state = HTTP_DONE;
+    return 1;
+}
+
+int http_response_done(const http_response *r) {
+    return r->state == HTTP_DONE;
+}
+
+int http_response_reusable(const http_response *r) {
+    return r->state == HTTP_DONE && r->keep_alive;
+}
+
+size_t http_head_reframe(char *out, size_t size, const char *head, const char *status,
+                         const char *framing) {
+    static const char *const dropped[] = { "Content-Length:", "Content-Range:",
+                                           "Transfer-Encoding:", "Trailer:", NULL };
+    const char *line = strchr(head, '\n');
+    if (!line)
+        return 0;
+    size_t used;
+    if (!status) {
+        status = head;
+        used = (size_t)(line - head);
+        if (used > 0 && head[used - 1] == '\r')
+            used--;
+    } else {
+        used = strlen(status);
+    }
+    if (used + 2 >= size)
+        return 0;
+    memcpy(out, status, used);
+    memcpy(out + used, "\r\n", 2);
+    used += 2;
+
+    while (*++line && *line != '\r' && *line != '\n') {
+        const char *eol = strchr(line, '\n');
+        if (!eol)
+            return 0;
+        size_t len = (size_t)(eol - line);
+        if (len > 0 && line[len - 1] == '\r')
+            len--;
+        int keep = 1;
+        for (const char *const *name = dropped; *name && keep; name++)
+            keep = strncasecmp(line, *name, strlen(*name)) != 0;
+        if (keep) {
+            if (used + len + 2 >= size)
+                return 0;
+            memcpy(out + used, line, len);
+            memcpy(out + used + len, "\r\n", 2);
+            used += len + 2;
+        }
+        line = eol;
+    }
+    size_t n = strlen(framing);
+    if (used + n + 3 > size)
+        return 0;
+    memcpy(out + used, framing, n);
+    memcpy(out + used + n, "\r\n", 3);
+    return used + n + 2;
+}
+
+// --- Freshness ---
+
+// Statuses a cache may store without explicit freshness (RFC 9110 15.1)
+static int heuristically_cacheable(int status) {
+    switch (status) {
+        case 200: case 203: case 204: case 206: case 300: case 301: case 308:
+        case 404: case 405: case 410: case 414: case 501:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Whether r's directives and status let a shared cache keep it, 206 included
+static int storable(const http_response *r) {
+    if (r->no_store || r->status < 200 || r->status == 304)
+        return 0;
+    return heuristically_cacheable(r->status) || r->s_maxage >= 0 || r->max_age >= 0 ||
+           r->expires >= 0;
+}
+
+int http_response_storable(const http_response *r) {
+    return r->status != 206 && storable(r);
+}
+
+int http_response_storable_part(const http_response *r, uint64_t first) {
+    return r->status == 206 && r->range_first == (int64_t)first && storable(r);
+}
+
+int64_t http_response_lifetime(const http_response *r, time_t now) {
+    if (r->no_cache)
+        return 0;
+    if (r->s_maxage >= 0)
+        return r->s_maxage;
+    if (r->max_age >= 0)
+        return r->max_age;
+
+    time_t date = r->date >= 0 ? r->date : now;
+    if (r->expires >= 0)
+        return r->expires > date ? (int64_t)(r->expires - date) : 0;
+    if (r->last_modified >= 0 && heuristically_cacheable(r->status)) {
+        int64_t lifetime = r->last_modified < date ? (int64_t)(date - r->last_modified) / 10 : 0;
+        return lifetime < HTTP_HEURISTIC_MAX ? lifetime : HTTP_HEURISTIC_MAX;
+    }
+    return -1;
+}
+
+int64_t http_response_age(const http_response *r, time_t now) {
+    int64_t apparent = r->date >= 0 && now > r->date ? (int64_t)(now - r->date) : 0;
+    return apparent > r->age ? apparent : r->age;
+}
+
+int http_response_failed(const http_response *r) {
+    return r->status == 500 || r->status == 502 || r->status == 503 || r->status == 504;
+}
+
+size_t http_response_validators(const http_response *r, char *out, size_t size) {
+    size_t used = 0;
+    out[0] = '\0';
+    if (r->etag[0]) {
+        int n = snprintf(out, size, "If-None-Match: %s\r\n", r->etag);
+        if (n < 0 || (size_t)n >= size)
+            return 0;
+        used = (size_t)n;
+    }
+    if (r->last_modified >= 0) {
+        char date[64];
+        struct tm tm;
+        gmtime_r(&r->last_modified, &tm);
+        strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        int n = snprintf(out + used, size - used, "If-Modified-Since: %s\r\n", date);
+        if (n < 0 || (size_t)n >= size - used)
+            return 0;
+        used += (size_t)n;
+    }
+    return used;
+}
+
+/*
+ * rewrite_request - Drops the fields named in drop (each with its colon) from the
+ * NUL-terminated request head of len bytes, closing them up in place, then inserts the
+ * header lines extra before the blank line. Returns the new length, or 0 if head does not end
+ * in a blank line or extra does not fit in size bytes (the fields are dropped all the same).
+ */
+static size_t rewrite_request(char *head, size_t len, size_t size, const char *const *drop,
+                              const char *extra) {
+    if (len < 4 || memcmp(head + len - 4, "\r\n\r\n", 4) != 0)
+        return 0;
+
+    // line is the CRLF ending a line; the blank line's CRLF is the last two bytes
+    char *line = strstr(head, "\r\n");
+    while (line && line + 2 < head + len - 2) {
+        char *field = line + 2;
+        char *next = strstr(field, "\r\n");
+        int dropped = 0;
+        for (const char *const *name = drop; *name && !dropped; name++)
+            dropped = strncasecmp(field, *name, strlen(*name)) == 0;
+        if (dropped) {
+            size_t n = (size_t)(next + 2 - field);
+            memmove(field, next + 2, (size_t)(head + len + 1 - (next + 2)));
+            len -= n;
+            continue;
+        }
+        line = next;
+    }
+
+    size_t n = strlen(extra);
+    if (len + n + 1 > size)
+        return 0;
+    memmove(head + len - 2 + n, head + len - 2, 3);
+    memcpy(head + len - 2, extra, n);
+    return len + n;
+}
+
+size_t http_request_conditional(char *head, size_t len, size_t size, const char *validators) {
+    static const char *const drop[] = { "If-None-Match:", "If-Modified-Since:", NULL };
+    size_t rewritten = rewrite_request(head, len, size, drop, validators);
+    // Validators that do not fit are left out: the origin then answers in full
+    return rewritten > 0 ? rewritten : strlen(head);
+}
+
+// --- Byte Ranges ---
+
+int http_request_range(const char *head, http_range *range) {
+    char value[HTTP_LINE_MAX];
+    memset(range, 0, sizeof(*range));
+    if (http_header_value(head, "Range", value, sizeof(value)) < 0 ||
+        strncasecmp(value, "bytes=", 6) != 0 || strchr(value, ',') != NULL)
+        return 0;
+
+    const char *spec = value + 6;
+    while (*spec == ' ' || *spec == '\t')
+        spec++;
+    char *end;
+    if (*spec == '-') {
+        range->suffix = 1;
+        range->first = strtoull(spec + 1, &end, 10);
+        range->last = UINT64_MAX;
+        if (end == spec + 1 || range->first == 0)
+            return 0;
+    } else {
+        if (*spec < '0' || *spec > '9')
+            return 0;
+        range->first = strtoull(spec, &end, 10);
+        if (*end++ != '-')
+            return 0;
+        const char *last = end;
+        range->last = *last ? strtoull(last, &end, 10) : UINT64_MAX;
+        if (end == last && *last)
+            return 0;
+        if (range->last < range->first)
+            return 0;
+    }
+    while (*end == ' ' || *end == '\t')
+        end++;
+    if (*end != '\0')
+        return 0;
+    http_header_value(head, "If-Range", range->if_range, sizeof(range->if_range));
+    return 1;
+}
+
+int http_range_resolve(const http_range *range, uint64_t total, uint64_t *first, uint64_t *last) {
+    if (total == 0)
+        return -1;
+    if (range->suffix) {
+        *first = range->first < total ? total - range->first : 0;
+        *last = total - 1;
+        return 0;
+    }
+    if (range->first >= total)
+        return -1;
+    *first = range->first;
+    *last = range->last < total ? range->last : total - 1;
+    return 0;
+}
+
+int http_range_if_matches(const http_range *range, const http_response *r) {
+    const char *value = range->if_range;
+    if (!value[0])
+        return 1;
+    if (value[0] == '"' || strncmp(value, "W/", 2) == 0)
+        return value[0] == '"' && r->etag[0] == '"' && strcmp(value, r->etag) == 0;
+    // A date only validates a Last-Modified known to the second
+    time_t date = parse_http_date(value);
+    return date >= 0 && date == r->last_modified;
+}
+
+size_t http_request_part(char *head, size_t len, size_t size, uint64_t first, uint64_t last) {
+    static const char *const drop[] = {
+        "Range:", "If-Range:", "If-None-Match:", "If-Modified-Since:", "If-Match:",
+        "If-Unmodified-Since:", NULL
+    };
+    char line[64];
+    snprintf(line, sizeof(line), "Range: bytes=%llu-%llu\r\n", (unsigned long long)first,
+             (unsigned long long)last);
+    return rewrite_request(head, len, size, drop, line);
+}
@@ -0,0 +1,236 @@
+#ifndef PROXY_HTTP_H
+#define PROXY_HTTP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#define HTTP_LINE_MAX       256     // Bytes kept of each head line; the rest of a longer line is ignored
+#define HTTP_VALIDATORS_MAX 384     // Conditional header lines built from a response's validators
+#define HTTP_HEURISTIC_MAX  86400   // Longest heuristic freshness lifetime (seconds)
+
+// --- Request Heads ---
+
+/*
+ * http_head_length - Looks for the blank line ending a request head in the len bytes at data,
+ * of which the first from were already searched. Returns the length of the head including
+ * the blank line, or 0 if it is not complete yet.
+ */
+size_t http_head_length(const char *data, size_t len, size_t from);
+
+/*
+ * http_request_keep_alive - Whether the client of the NUL-terminated request head wants to
+ * send further requests on its connection: by default from HTTP/1.1 on, unless Connection
+ * (or Proxy-Connection) says close; with HTTP/1.0 only if it says keep-alive.
+ */
+int http_request_keep_alive(const char *head);
+
+/*
+ * http_request_target - Finds the request target (the URL) in the request line of the
+ * NUL-terminated head. Returns it, not NUL-terminated, with its length in *len, or NULL if
+ * the line is not "method target HTTP/version".
+ */
+const char *http_request_target(const char *head, size_t *len);
+
+/*
+ * http_header_value - Copies the value of the field name (case-insensitive) in the
+ * NUL-terminated head to out (size bytes, truncated and NUL-terminated), joining repeated
+ * fields with ", " and trimming surrounding whitespace. Returns its length, or -1 if the head
+ * has no such field.
+ */
+int http_header_value(const char *head, const char *name, char *out, size_t size);
+
+// --- Response Framing ---
+// Follows an origin response as it is received to find where it ends, so the connection can
+// carry the next request. Bodies are framed by Content-Length or chunked encoding; anything
+// else (or anything malformed) is read until the origin closes the connection.
+typedef enum {
+    HTTP_HEAD,          // Status line and headers
+    HTTP_BODY_LENGTH,   // remaining bytes of a Content-Length body
+    HTTP_CHUNK_SIZE,    // Chunk size line
+    HTTP_CHUNK_DATA,    // remaining bytes of a chunk
+    HTTP_CHUNK_END,     // CRLF after a chunk
+    HTTP_TRAILER,       // Trailer fields after the last chunk
+    HTTP_BODY_EOF,      // Body delimited by the origin closing the connection
+    HTTP_DONE           // Response complete
+} http_frame_state;
+
+typedef struct http_response {
+    http_frame_state state;
+    int status;                 // Status code (0 until the status line is read)
+    int keep_alive;             // Origin allows another request on the connection
+    int chunked;                // Transfer-Encoding ends in chunked
+    int no_store;               // Cache-Control forbids keeping it (no-store or private)
+    int no_cache;               // Cache-Control no-cache: revalidated before every use
+    int must_revalidate;        // Cache-Control must-revalidate or proxy-revalidate
+    int accept_ranges;          // Accept-Ranges lists bytes: the origin serves byte ranges
+    int64_t max_age;            // Cache-Control max-age in seconds (-1 if absent)
+    int64_t s_maxage;           // Cache-Control s-maxage in seconds (-1 if absent)
+    int64_t stale_while_revalidate;  // Cache-Control stale-while-revalidate (-1 if absent)
+    int64_t stale_if_error;     // Cache-Control stale-if-error (-1 if absent)
+    int64_t age;                // Age in seconds (0 if absent)
+    time_t date;                // Date (-1 if absent)
+    time_t expires;             // Expires (-1 if absent, 0 if invalid: already expired)
+    time_t last_modified;       // Last-Modified (-1 if absent)
+    char etag[HTTP_LINE_MAX];   // ETag as sent (empty if absent or too long to keep)
+    char vary[HTTP_LINE_MAX];   // Vary fields joined with ", " ("*" if too long to keep)
+    int64_t content_length;     // -1 if absent
+    int64_t range_first;        // Content-Range of a 206: first byte (-1 if absent or invalid)
+    int64_t range_last;         // Last byte
+    int64_t range_total;        // Length of the whole representation (-1 if unknown)
+    uint64_t remaining;         // Bytes left of the body or of the current chunk
+    int lines;                  // Head lines read so far
+    size_t line_len;            // Bytes kept in line
+    int truncated;              // line lost bytes that did not fit
+    char line[HTTP_LINE_MAX];
+} http_response;
+
+/*
+ * http_response_init - Prepares r for a new response.
+ */
+void http_response_init(http_response *r);
+
+/*
+ * http_response_feed - Advances r over the next len received bytes. Returns how many of them
+ * belong to the response; fewer than len only once it is complete.
+ */
+size_t http_response_feed(http_response *r, const char *data, size_t len);
+
+/*
+ * http_response_feed_iov - http_response_feed() over the first len bytes spread across iov.
+ */
+void http_response_feed_iov(http_response *r, const struct iovec *iov, size_t len);
+
+/*
+ * http_response_opaque - Bytes from the current position on that are body data the framer
+ * need not see: the rest of a Content-Length body or of the current chunk, UINT64_MAX for a
+ * body read until the origin closes, 0 while in the head or a framing line.
+ */
+uint64_t http_response_opaque(const http_response *r);
+
+/*
+ * http_response_skip - Advances r past n bytes that were relayed without being fed; n must
+ * not exceed http_response_opaque().
+ */
+void http_response_skip(http_response *r, uint64_t n);
+
+/*
+ * http_response_eof - The origin closed the connection. Returns 1 if that ends the response
+ * (it is then done), 0 if the response was cut short.
+ */
+int http_response_eof(http_response *r);
+
+/*
+ * http_response_done - The whole response has been fed.
+ */
+int http_response_done(const http_response *r);
+
+/*
+ * http_response_reusable - The response is complete and the origin connection can be reused.
+ */
+int http_response_reusable(const http_response *r);
+
+/*
+ * http_head_reframe - Copies the NUL-terminated response head to out (size bytes of room,
+ * NUL-terminated) without the fields framing its body (Content-Length, Content-Range,
+ * Transfer-Encoding, Trailer), with the status line replaced by status unless NULL and the
+ * header lines framing (each ending in CRLF) added last. Returns the new length, or 0 if it
+ * does not fit.
+ */
+size_t http_head_reframe(char *out, size_t size, const char *head, const char *status,
+                         const char *framing);
+
+// --- Freshness ---
+// How long a shared cache may serve a response without asking the origin (RFC 9111 4.2),
+// and the validators that ask it whether a stale copy is still good.
+
+/*
+ * http_response_storable - Whether a shared cache may store the response whose head r has
+ * read: neither no-store nor private, and a final status that is cacheable by default or
+ * comes with an explicit lifetime. Never a 206 (a part of the resource) or a 304.
+ */
+int http_response_storable(const http_response *r);
+
+/*
+ * http_response_storable_part - Like http_response_storable(), for a response to a request
+ * for the bytes from first on: only a 206 whose Content-Range starts there qualifies.
+ */
+int http_response_storable_part(const http_response *r, uint64_t first);
+
+/*
+ * http_response_lifetime - Seconds r is fresh for from its Date (now if it has none):
+ * s-maxage, else max-age, else Expires minus Date, else a tenth of the time since
+ * Last-Modified, up to HTTP_HEURISTIC_MAX, for a status cacheable by default. 0 with
+ * no-cache; -1 if r says nothing about its freshness.
+ */
+int64_t http_response_lifetime(const http_response *r, time_t now);
+
+/*
+ * http_response_age - Seconds r had already spent in caches when received at now: its Age,
+ * or the time since its Date if longer.
+ */
+int64_t http_response_age(const http_response *r, time_t now);
+
+/*
+ * http_response_failed - Whether r is a server error a stale response may stand in for under
+ * stale-if-error (RFC 5861 4): 500, 502, 503 or 504.
+ */
+int http_response_failed(const http_response *r);
+
+/*
+ * http_response_validators - Writes the conditional header lines ("If-None-Match: ...\r\n",
+ * "If-Modified-Since: ...\r\n") that revalidate r to out (size bytes). Returns their length,
+ * 0 if r has no validator or they do not fit.
+ */
+size_t http_response_validators(const http_response *r, char *out, size_t size);
+
+/*
+ * http_request_conditional - Turns the NUL-terminated request head of len bytes at head
+ * (size bytes of room) into a revalidation with the header lines validators. The client's
+ * own If-None-Match and If-Modified-Since are always dropped, as a 304 must answer the
+ * cache's question; validators are inserted before the blank line if they fit. Returns the
+ * new length.
+ */
+size_t http_request_conditional(char *head, size_t len, size_t size, const char *validators);
+
+// --- Byte Ranges ---
+// A request for one range of bytes of a response body (RFC 9110 14). Requests for several
+// ranges at once are answered in full instead, as a server may.
+typedef struct http_range {
+    uint64_t first;             // First byte, or how many last bytes with suffix set
+    uint64_t last;              // Last byte, UINT64_MAX for up to the end
+    int suffix;                 // "bytes=-N"
+    char if_range[HTTP_LINE_MAX];   // If-Range as sent (empty if absent)
+} http_range;
+
+/*
+ * http_request_range - Reads the Range and If-Range fields of the NUL-terminated request head
+ * into *range. Returns 1 if it asks for a single byte range, 0 otherwise (no Range, another
+ * unit, several ranges or a malformed one: the whole response is sent).
+ */
+int http_request_range(const char *head, http_range *range);
+
+/*
+ * http_range_resolve - The bytes of a body of total bytes that range selects, in *first and
+ * *last. Returns 0, or -1 if it selects none (416 Range Not Satisfiable).
+ */
+int http_range_resolve(const http_range *range, uint64_t total, uint64_t *first, uint64_t *last);
+
+/*
+ * http_range_if_matches - Whether the range may be served from the response whose head r has
+ * read: without If-Range, or if it carries the response's (strong) ETag or its Last-Modified
+ * date. Otherwise the whole, current response is sent.
+ */
+int http_range_if_matches(const http_range *range, const http_response *r);
+
+/*
+ * http_request_part - Turns the NUL-terminated request head of len bytes at head (size bytes
+ * of room) into a request for bytes first to last of the response: the client's own Range,
+ * If-Range and conditional fields are dropped and a Range line is inserted before the blank
+ * line. Returns the new length, or 0 if the Range line does not fit: sent without it, the
+ * request would fetch the whole response.
+ */
+size_t http_request_part(char *head, size_t len, size_t size, uint64_t first, uint64_t last);
+
+#endif
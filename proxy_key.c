@@ -0,0 +1,415 @@
+#include "proxy_key.h"
+#include "proxy_cache.h"
+#include "proxy_http.h"
+#include "proxy_stats.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define KEY_VARY_MAX    HTTP_LINE_MAX   // Longest normalised Vary list remembered
+#define KEY_VARY_FIELDS 16              // Most fields a remembered Vary may name
+#define KEY_VALUE_MAX   1024            // Bytes of a varying request field kept in the key
+#define KEY_LOCKS       64              // Locks striped over the Vary slots
+
+typedef struct vary_slot {
+    uint64_t hash;                      // Hash of the URL, 0 if the slot is empty
+    char fields[KEY_VARY_MAX];          // Field names, lowercased, sorted and joined by ','
+} vary_slot;
+
+static vary_slot vary_slots[KEY_VARY_SLOTS];
+static pthread_mutex_t vary_locks[KEY_LOCKS];
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static atomic_size_t vary_remembered;   // Responses whose Vary was new for their URL
+static atomic_size_t vary_star;         // Responses not cached for "Vary: *"
+
+static void key_dump_stats(FILE *out, void *arg) {
+    size_t used = 0;
+    for (size_t i = 0; i < KEY_VARY_SLOTS; i++) {
+        pthread_mutex_t *lock = &vary_locks[i % KEY_LOCKS];
+        pthread_mutex_lock(lock);
+        used += vary_slots[i].hash != 0;
+        pthread_mutex_unlock(lock);
+    }
+    fprintf(out, "URLs with Vary %zu of %d slots, new Vary seen %zu times, Vary: * %zu\n",
+            used, KEY_VARY_SLOTS, atomic_load(&vary_remembered), atomic_load(&vary_star));
+}
+
+static void key_init(void) {
+    for (int i = 0; i < KEY_LOCKS; i++)
+        pthread_mutex_init(&vary_locks[i], NULL);
+    stats_register("cache keys", key_dump_stats, NULL);
+}
+
+// --- Key Output ---
+// Appends stop at the end of the buffer and mark it overflowed instead.
+typedef struct key_buf {
+    char *out;
+    size_t size;
+    size_t len;
+    int overflow;
+} key_buf;
+
+static void put(key_buf *b, char c) {
+    if (b->len + 1 >= b->size) {
+        b->overflow = 1;
+        return;
+    }
+    b->out[b->len++] = c;
+}
+
+static void put_lower(key_buf *b, const char *s, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        put(b, (char)tolower((unsigned char)s[i]));
+}
+
+/*
+ * name_valid - Whether a scheme or host can go into a key: it may hold neither the '#' that
+ * marks a part key nor the control bytes that separate a key's lines.
+ */
+static int name_valid(const char *s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '#' || c < 0x20 || c == 0x7f)
+            return 0;
+    }
+    return 1;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c = (char)tolower((unsigned char)c);
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+static int is_unreserved(int c) {
+    return isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+// Copies a path segment or query with escapes normalised: %7E becomes ~, %2f becomes %2F
+static void put_escaped(key_buf *b, const char *s, size_t n) {
+    static const char hex[] = "0123456789ABCDEF";
+    for (size_t i = 0; i < n; i++) {
+        int high, low;
+        if (s[i] == '%' && i + 2 < n &&
+            (high = hex_value(s[i + 1])) >= 0 && (low = hex_value(s[i + 2])) >= 0) {
+            int c = high * 16 + low;
+            if (is_unreserved(c)) {
+                put(b, (char)c);
+            } else {
+                put(b, '%');
+                put(b, hex[high]);
+                put(b, hex[low]);
+            }
+            i += 2;
+        } else {
+            put(b, s[i]);
+        }
+    }
+}
+
+/*
+ * put_path - Copies the path (starting with '/') segment by segment, dropping "." segments
+ * and letting ".." drop the segment before it. Escapes are decoded first, so %2E%2E counts
+ * as "..".
+ */
+static void put_path(key_buf *b, const char *p, size_t n) {
+    size_t root = b->len;
+    int trailing = 0;       // The last segment was a dot segment: the path ends in '/'
+    size_t i = 0;
+    while (i < n) {
+        size_t start = ++i;
+        while (i < n && p[i] != '/')
+            i++;
+        size_t segment = b->len;
+        put(b, '/');
+        put_escaped(b, p + start, i - start);
+        if (b->overflow)
+            return;
+
+        const char *s = b->out + segment + 1;
+        size_t len = b->len - segment - 1;
+        trailing = (len == 1 && s[0] == '.') || (len == 2 && s[0] == '.' && s[1] == '.');
+        if (trailing) {
+            b->len = segment;
+            if (len == 2) {
+                while (b->len > root && b->out[b->len - 1] != '/')
+                    b->len--;
+                if (b->len > root)
+                    b->len--;
+            }
+        }
+    }
+    if (trailing || b->len == root)
+        put(b, '/');
+}
+
+size_t cache_key_url(char *out, size_t size, const char *scheme, const char *host,
+                     const char *port, const char *target, size_t target_len) {
+    key_buf b = { out, size, 0, 0 };
+    const char *end = target + target_len;
+    const char *authority_end;
+    size_t scheme_len, host_len, port_len;
+
+    const char *sep = memchr(target, ':', target_len);
+    if (target_len > 0 && target[0] != '/') {
+        // Absolute URL: scheme "://" [userinfo "@"] host [":" port] path
+        if (!sep || end - sep < 3 || memcmp(sep, "://", 3) != 0 || sep == target)
+            return 0;
+        scheme = target;
+        scheme_len = (size_t)(sep - target);
+        host = sep + 3;
+        authority_end = host;
+        while (authority_end < end && *authority_end != '/' && *authority_end != '?' &&
+               *authority_end != '#')
+            authority_end++;
+        const char *at = memchr(host, '@', (size_t)(authority_end - host));
+        if (at)
+            host = at + 1;
+        const char *host_end = host;
+        if (host_end < authority_end && *host_end == '[') {
+            while (host_end < authority_end && *host_end != ']')
+                host_end++;
+            if (host_end < authority_end)
+                host_end++;
+        }
+        while (host_end < authority_end && *host_end != ':')
+            host_end++;
+        host_len = (size_t)(host_end - host);
+        port = host_end < authority_end ? host_end + 1 : NULL;
+        port_len = port ? (size_t)(authority_end - port) : 0;
+        target = authority_end;
+    } else {
+        if (!scheme || !host)
+            return 0;
+        scheme_len = strlen(scheme);
+        host_len = strlen(host);
+        port_len = port ? strlen(port) : 0;
+    }
+    if (host_len > 1 && host[host_len - 1] == '.')
+        host_len--;
+    if (scheme_len == 0 || host_len == 0 || !name_valid(scheme, scheme_len) ||
+        !name_valid(host, host_len))
+        return 0;
+
+    // Leading zeros and the scheme's default port do not make a different URL
+    while (port_len > 1 && port[0] == '0') {
+        port++;
+        port_len--;
+    }
+    for (size_t i = 0; i < port_len; i++) {
+        if (!isdigit((unsigned char)port[i]))
+            return 0;
+    }
+    if ((port_len == 2 && memcmp(port, "80", 2) == 0 && scheme_len == 4 &&
+         strncasecmp(scheme, "http", 4) == 0) ||
+        (port_len == 3 && memcmp(port, "443", 3) == 0 && scheme_len == 5 &&
+         strncasecmp(scheme, "https", 5) == 0))
+        port_len = 0;
+
+    put_lower(&b, scheme, scheme_len);
+    put(&b, ':');
+    put(&b, '/');
+    put(&b, '/');
+    put_lower(&b, host, host_len);
+    if (port_len > 0) {
+        put(&b, ':');
+        for (size_t i = 0; i < port_len; i++)
+            put(&b, port[i]);
+    }
+
+    const char *fragment = memchr(target, '#', (size_t)(end - target));
+    if (fragment)
+        end = fragment;
+    const char *query = memchr(target, '?', (size_t)(end - target));
+    const char *path_end = query ? query : end;
+    if (target < path_end && target[0] != '/')
+        return 0;
+    put_path(&b, target, (size_t)(path_end - target));
+    if (query && end - query > 1) {
+        put(&b, '?');
+        put_escaped(&b, query + 1, (size_t)(end - query - 1));
+    }
+
+    if (b.overflow)
+        return 0;
+    out[b.len] = '\0';
+    return b.len;
+}
+
+// --- Vary ---
+
+static vary_slot *vary_slot_for(uint64_t hash, pthread_mutex_t **lock) {
+    size_t i = hash & (KEY_VARY_SLOTS - 1);
+    *lock = &vary_locks[i % KEY_LOCKS];
+    return &vary_slots[i];
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/*
+ * vary_normalise - Turns a Vary value into its field names, lowercased, sorted, without
+ * duplicates and joined by ','. Returns 0, or -1 for "*" or a list too long to remember.
+ */
+static int vary_normalise(const char *vary, char *fields, size_t size) {
+    char copy[KEY_VARY_MAX];
+    char *names[KEY_VARY_FIELDS];
+    int count = 0;
+    if (strlen(vary) >= sizeof(copy))
+        return -1;
+    strcpy(copy, vary);
+
+    for (char *save = NULL, *name = strtok_r(copy, ",", &save); name;
+         name = strtok_r(NULL, ",", &save)) {
+        while (*name == ' ' || *name == '\t')
+            name++;
+        size_t len = strlen(name);
+        while (len > 0 && (name[len - 1] == ' ' || name[len - 1] == '\t'))
+            name[--len] = '\0';
+        if (len == 0)
+            continue;
+        if (strcmp(name, "*") == 0 || count == KEY_VARY_FIELDS)
+            return -1;
+        for (size_t i = 0; i < len; i++)
+            name[i] = (char)tolower((unsigned char)name[i]);
+        names[count++] = name;
+    }
+    qsort(names, (size_t)count, sizeof(names[0]), compare_names);
+
+    size_t used = 0;
+    fields[0] = '\0';
+    for (int i = 0; i < count; i++) {
+        if (i > 0 && strcmp(names[i], names[i - 1]) == 0)
+            continue;
+        int n = snprintf(fields + used, size - used, "%s%s", used ? "," : "", names[i]);
+        if (n < 0 || used + (size_t)n >= size)
+            return -1;
+        used += (size_t)n;
+    }
+    return 0;
+}
+
+/*
+ * put_field - Appends a varying request field as "\nname: value", with runs of whitespace in
+ * the value collapsed, or "\nname" if the request does not have it.
+ */
+static void put_field(key_buf *b, const char *head, const char *name) {
+    char value[KEY_VALUE_MAX];
+    put(b, '\n');
+    for (const char *c = name; *c; c++)
+        put(b, *c);
+    if (http_header_value(head, name, value, sizeof(value)) < 0)
+        return;
+    put(b, ':');
+    put(b, ' ');
+    int space = 0;
+    for (const char *c = value; *c; c++) {
+        if (*c == ' ' || *c == '\t') {
+            space = 1;
+            continue;
+        }
+        if (space)
+            put(b, ' ');
+        space = 0;
+        put(b, *c);
+    }
+}
+
+size_t cache_key_build(char *out, size_t size, const char *head, const char *scheme,
+                       const char *host, const char *port, const char *target, size_t target_len) {
+    pthread_once(&key_once, key_init);
+    size_t len = cache_key_url(out, size, scheme, host, port, target, target_len);
+    if (len == 0)
+        return 0;
+
+    char fields[KEY_VARY_MAX];
+    pthread_mutex_t *lock;
+    uint64_t hash = cache_hash(out, len) | 1;
+    vary_slot *slot = vary_slot_for(hash, &lock);
+    pthread_mutex_lock(lock);
+    if (slot->hash == hash)
+        strcpy(fields, slot->fields);
+    else
+        fields[0] = '\0';
+    pthread_mutex_unlock(lock);
+
+    key_buf b = { out, size, len, 0 };
+    for (char *save = NULL, *name = strtok_r(fields, ",", &save); name;
+         name = strtok_r(NULL, ",", &save))
+        put_field(&b, head, name);
+    if (b.overflow)
+        return 0;
+    out[b.len] = '\0';
+    return b.len;
+}
+
+int cache_key_vary_matches(const char *key, const char *vary) {
+    pthread_once(&key_once, key_init);
+    char fields[KEY_VARY_MAX];
+    if (vary_normalise(vary, fields, sizeof(fields)) < 0) {
+        atomic_fetch_add_explicit(&vary_star, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    // The names of the key's field lines, joined the same way
+    char carried[KEY_VARY_MAX];
+    size_t used = 0;
+    // The Vary of a part is remembered for its URL
+    const char *url_end = strchr(key, '\n');
+    size_t url_len = strcspn(key, "#\n");
+    for (const char *line = url_end; line; line = strchr(line + 1, '\n')) {
+        const char *name = line + 1;
+        size_t n = strcspn(name, ":\n");
+        if (used + n + 1 >= sizeof(carried))
+            break;
+        if (used > 0)
+            carried[used++] = ',';
+        memcpy(carried + used, name, n);
+        used += n;
+    }
+    carried[used] = '\0';
+    if (strcmp(carried, fields) == 0)
+        return 1;
+
+    // A slot shared with another URL is simply taken over: a wrong list only costs a miss,
+    // as responses are still checked against their own Vary before being stored
+    pthread_mutex_t *lock;
+    uint64_t hash = cache_hash(key, url_len) | 1;
+    vary_slot *slot = vary_slot_for(hash, &lock);
+    pthread_mutex_lock(lock);
+    if (fields[0] == '\0') {
+        if (slot->hash == hash)
+            slot->hash = 0;
+    } else {
+        slot->hash = hash;
+        strcpy(slot->fields, fields);
+    }
+    pthread_mutex_unlock(lock);
+    atomic_fetch_add_explicit(&vary_remembered, 1, memory_order_relaxed);
+    return 0;
+}
+
+size_t cache_key_part(char *out, size_t size, const char *key, uint64_t first, uint64_t last) {
+    size_t url_len = strcspn(key, "\n");
+    int n = snprintf(out, size, "%.*s#bytes=%llu-%llu%s", (int)url_len, key,
+                     (unsigned long long)first, (unsigned long long)last, key + url_len);
+    return n > 0 && (size_t)n < size ? (size_t)n : 0;
+}
+
+int cache_key_part_first(const char *key, uint64_t *first) {
+    size_t url_len = strcspn(key, "\n");
+    const char *part = memchr(key, '#', url_len);
+    unsigned long long value;
+    if (!part || sscanf(part, "#bytes=%llu-", &value) != 1)
+        return 0;
+    *first = value;
+    return 1;
+}
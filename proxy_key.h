@@ -0,0 +1,68 @@
+#ifndef PROXY_KEY_H
+#define PROXY_KEY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_KEY_MAX   8192    // Longest key built: a request head's URL and varying fields
+#define KEY_VARY_SLOTS  1024    // URLs whose Vary is remembered (direct-mapped by hash)
+
+// --- Canonical Cache Keys ---
+// A response is cached under its URL in one spelling, so requests that differ only in the
+// case of the host, an explicit default port, escaping or dot segments share it, and
+// unrelated request headers (User-Agent, cookies) do not split it. The fields a response
+// names in Vary are appended to the key of the next requests for its URL: the Vary last seen
+// for every URL is remembered, and a response is only stored under a key that carries the
+// fields its own Vary names.
+//
+//   http://example.com/a%7Eb?q=1                    no Vary seen for the URL
+//   http://example.com/a%7Eb?q=1\naccept-encoding: gzip
+//                                                   after "Vary: Accept-Encoding"
+//
+// A part of a response cached on its own (see proxy_range.h) is keyed by its byte range,
+// put where a fragment would be: canonical URLs never have one, and a scheme or host that
+// holds a '#' cannot be keyed at all, so no other key can read as a part key:
+//
+//   http://example.com/big.iso#bytes=1048576-2097151\naccept-encoding: gzip
+
+/*
+ * cache_key_url - Writes the canonical URL of target into out (size bytes): scheme and host
+ * lowercased, the scheme's default port dropped, percent-escapes of unreserved characters
+ * decoded and the others uppercased, dot segments removed from the path, an empty query and
+ * the fragment dropped. target is absolute ("http://host:port/path?query") or just the path
+ * and query, completed with scheme, host and port (NULL for the default). Returns the length,
+ * or 0 if target is malformed, the scheme or host holds a '#' or a control byte, or the key
+ * does not fit.
+ */
+size_t cache_key_url(char *out, size_t size, const char *scheme, const char *host,
+                     const char *port, const char *target, size_t target_len);
+
+/*
+ * cache_key_build - cache_key_url() followed, one line each, by the request fields (from the
+ * NUL-terminated head) named by the Vary last seen for the URL. Returns the key's length, or
+ * 0 if the request cannot be keyed.
+ */
+size_t cache_key_build(char *out, size_t size, const char *head, const char *scheme,
+                       const char *host, const char *port, const char *target, size_t target_len);
+
+/*
+ * cache_key_vary_matches - Called with the Vary of a response fetched for key (empty if it
+ * has none). Returns 1 if key carries exactly the fields it names, so the response can be
+ * stored under it; otherwise remembers the Vary for the URL, so the next request is keyed
+ * by those fields, and returns 0. "Vary: *" never matches.
+ */
+int cache_key_vary_matches(const char *key, const char *vary);
+
+/*
+ * cache_key_part - Writes the key of bytes first to last of the response cached under key
+ * into out (size bytes). Returns its length, or 0 if it does not fit.
+ */
+size_t cache_key_part(char *out, size_t size, const char *key, uint64_t first, uint64_t last);
+
+/*
+ * cache_key_part_first - Whether key is the key of a part; if so, sets *first to the first
+ * byte it holds.
+ */
+int cache_key_part_first(const char *key, uint64_t *first);
+
+#endif
@@ -0,0 +1,99 @@
+#define _GNU_SOURCE   // CPU_* macros, pthread_setaffinity_np()
+
+#include "proxy_listen.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+int listen_socket(int port, int backlog, int reuseport) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Failed to create listening socket");
+        return -1;
+    }
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0)
+        perror("setsockopt(SO_REUSEADDR) failed");
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("setsockopt(SO_REUSEPORT) failed");
+        close(fd);
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Port is not free");
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, backlog) < 0) {
+        perror("Error while listening");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int listen_sockets(int port, int backlog, int *fds, int count) {
+    for (int i = 0; i < count; i++) {
+        fds[i] = listen_socket(port, backlog, 1);
+        if (fds[i] < 0) {
+            while (i-- > 0)
+                close(fds[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void client_socket_init(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+int online_cpus(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+/*
+ * pin_thread - Counts through the calling thread's current mask, which it inherited from its
+ * creator, so pinning respects taskset/cgroup restrictions as long as threads are created
+ * from a thread that is not pinned yet.
+ */
+int pin_thread(int index) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        perror("sched_getaffinity failed");
+        return -1;
+    }
+    int count = CPU_COUNT(&allowed);
+    if (count == 0)
+        return -1;
+
+    int want = index % count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed) || want-- > 0)
+            continue;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0) {
+            fprintf(stderr, "Failed to pin thread to CPU %d: %s\n", cpu, strerror(err));
+            return -1;
+        }
+        return 0;
+    }
+    return -1;
+}
@@ -0,0 +1,35 @@
+#ifndef PROXY_LISTEN_H
+#define PROXY_LISTEN_H
+
+/*
+ * listen_socket - Opens a TCP socket listening on port (all interfaces) with the given
+ * backlog. With reuseport set, SO_REUSEPORT lets several such sockets share the port and
+ * the kernel spreads new connections across them. Returns the socket, or -1 on error.
+ */
+int listen_socket(int port, int backlog, int reuseport);
+
+/*
+ * listen_sockets - Opens count SO_REUSEPORT listeners on port into fds. Returns 0, or -1
+ * (closing any already opened) on error.
+ */
+int listen_sockets(int port, int backlog, int *fds, int count);
+
+/*
+ * client_socket_init - Prepares a socket accepted from a listener: Nagle's algorithm is
+ * turned off, so a response sent right after another (one per pipelined request) is not held
+ * back until the client acknowledges the first.
+ */
+void client_socket_init(int fd);
+
+/*
+ * online_cpus - Number of online CPUs (at least 1).
+ */
+int online_cpus(void);
+
+/*
+ * pin_thread - Binds the calling thread to the index-th CPU it is allowed to run on
+ * (wrapping around). Returns 0, or -1 on error.
+ */
+int pin_thread(int index);
+
+#endif
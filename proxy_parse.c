@@ -0,0 +1,249 @@
+#include "proxy_parse.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define PARSE_MIN_LEN      4            // Shortest request head accepted
+#define PARSE_MAX_LEN      65535        // Longest request head accepted
+#define PARSE_HEADERS_INIT 8            // Header slots allocated up front
+
+struct ParsedRequest *ParsedRequest_create(void) {
+    struct ParsedRequest *pr = (struct ParsedRequest *)calloc(1, sizeof(*pr));
+    if (!pr) {
+        perror("calloc failed for parsed request");
+        return NULL;
+    }
+    pr->headers = (struct ParsedHeader *)calloc(PARSE_HEADERS_INIT, sizeof(*pr->headers));
+    if (!pr->headers) {
+        perror("calloc failed for parsed headers");
+        free(pr);
+        return NULL;
+    }
+    pr->headerslen = PARSE_HEADERS_INIT;
+    return pr;
+}
+
+/*
+ * copy_range - NUL-terminated copy of the len bytes at s, or NULL on failure.
+ */
+static char *copy_range(const char *s, size_t len) {
+    char *copy = (char *)malloc(len + 1);
+    if (!copy)
+        return NULL;
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+/*
+ * parse_url - Splits the absolute URL url (len bytes) into protocol, host, port and path.
+ */
+static int parse_url(struct ParsedRequest *pr, const char *url, size_t len) {
+    const char *end = url + len;
+    const char *scheme_end = strstr(url, "://");
+    if (!scheme_end || scheme_end >= end)
+        return -1;
+    const char *authority = scheme_end + 3;
+    const char *path = memchr(authority, '/', (size_t)(end - authority));
+    if (!path || (end - path >= 2 && path[1] == '/'))
+        return -1;
+
+    const char *colon = memchr(authority, ':', (size_t)(path - authority));
+    pr->protocol = copy_range(url, (size_t)(scheme_end - url));
+    pr->host = copy_range(authority, (size_t)((colon ? colon : path) - authority));
+    pr->path = copy_range(path, (size_t)(end - path));
+    if (!pr->protocol || !pr->host || !pr->path)
+        return -1;
+    if (colon) {
+        pr->port = copy_range(colon + 1, (size_t)(path - colon - 1));
+        if (!pr->port || atoi(pr->port) == 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * parse_request_line - "METHOD URL VERSION", the line's len bytes at line.
+ */
+static int parse_request_line(struct ParsedRequest *pr, const char *line, size_t len) {
+    pr->buf = copy_range(line, len);
+    if (!pr->buf)
+        return -1;
+    pr->buflen = len;
+
+    char *method_end = strchr(pr->buf, ' ');
+    if (!method_end || method_end == pr->buf)
+        return -1;
+    char *url = method_end + 1;
+    char *url_end = strchr(url, ' ');
+    if (!url_end || url_end == url)
+        return -1;
+    char *version = url_end + 1;
+    if (strncmp(version, "HTTP/", 5) != 0 || strchr(version, ' '))
+        return -1;
+
+    pr->method = copy_range(pr->buf, (size_t)(method_end - pr->buf));
+    pr->version = strdup(version);
+    if (!pr->method || !pr->version)
+        return -1;
+    return parse_url(pr, url, (size_t)(url_end - url));
+}
+
+int ParsedRequest_parse(struct ParsedRequest *parse, const char *buf, int buflen) {
+    if (buflen < PARSE_MIN_LEN || buflen > PARSE_MAX_LEN)
+        return -1;
+    char *head = copy_range(buf, (size_t)buflen);
+    if (!head)
+        return -1;
+    char *head_end = strstr(head, "\r\n\r\n");
+    char *line_end = strstr(head, "\r\n");
+    if (!head_end || parse_request_line(parse, head, (size_t)(line_end - head)) < 0) {
+        free(head);
+        return -1;
+    }
+
+    int ret = 0;
+    char *line = line_end + 2;
+    while (line < head_end + 2) {
+        line_end = strstr(line, "\r\n");
+        if (line_end == line)
+            break;
+        char *colon = memchr(line, ':', (size_t)(line_end - line));
+        if (!colon) {
+            ret = -1;
+            break;
+        }
+        *colon = '\0';
+        *line_end = '\0';
+        char *value = colon + 1;
+        if (*value == ' ')
+            value++;
+        if (ParsedHeader_set(parse, line, value) < 0) {
+            ret = -1;
+            break;
+        }
+        line = line_end + 2;
+    }
+    free(head);
+    return ret;
+}
+
+void ParsedRequest_destroy(struct ParsedRequest *pr) {
+    if (!pr)
+        return;
+    for (size_t i = 0; i < pr->headersused; i++) {
+        free(pr->headers[i].key);
+        free(pr->headers[i].value);
+    }
+    free(pr->headers);
+    free(pr->method);
+    free(pr->protocol);
+    free(pr->host);
+    free(pr->port);
+    free(pr->path);
+    free(pr->version);
+    free(pr->buf);
+    free(pr);
+}
+
+size_t ParsedHeader_headersLen(struct ParsedRequest *pr) {
+    size_t len = 2;
+    for (size_t i = 0; i < pr->headersused; i++)
+        len += pr->headers[i].keylen + 2 + pr->headers[i].valuelen + 2;
+    return len;
+}
+
+/*
+ * request_line_len - Bytes of "METHOD protocol://host[:port]path VERSION\r\n".
+ */
+static size_t request_line_len(struct ParsedRequest *pr) {
+    size_t len = strlen(pr->method) + 1 + strlen(pr->protocol) + 3 + strlen(pr->host) +
+                 strlen(pr->path) + 1 + strlen(pr->version) + 2;
+    if (pr->port)
+        len += 1 + strlen(pr->port);
+    return len;
+}
+
+size_t ParsedRequest_totalLen(struct ParsedRequest *pr) {
+    return request_line_len(pr) + ParsedHeader_headersLen(pr);
+}
+
+int ParsedRequest_unparse_headers(struct ParsedRequest *pr, char *buf, size_t buflen) {
+    if (buflen < ParsedHeader_headersLen(pr))
+        return -1;
+    char *out = buf;
+    for (size_t i = 0; i < pr->headersused; i++) {
+        struct ParsedHeader *h = &pr->headers[i];
+        memcpy(out, h->key, h->keylen);
+        out += h->keylen;
+        memcpy(out, ": ", 2);
+        out += 2;
+        memcpy(out, h->value, h->valuelen);
+        out += h->valuelen;
+        memcpy(out, "\r\n", 2);
+        out += 2;
+    }
+    memcpy(out, "\r\n", 2);
+    return 0;
+}
+
+int ParsedRequest_unparse(struct ParsedRequest *pr, char *buf, size_t buflen) {
+    size_t line_len = request_line_len(pr);
+    if (buflen < line_len + ParsedHeader_headersLen(pr))
+        return -1;
+    // One byte more for the NUL snprintf() writes, which the headers then overwrite
+    char *line = (char *)malloc(line_len + 1);
+    if (!line)
+        return -1;
+    snprintf(line, line_len + 1, "%s %s://%s%s%s%s %s\r\n", pr->method, pr->protocol, pr->host,
+             pr->port ? ":" : "", pr->port ? pr->port : "", pr->path, pr->version);
+    memcpy(buf, line, line_len);
+    free(line);
+    return ParsedRequest_unparse_headers(pr, buf + line_len, buflen - line_len);
+}
+
+struct ParsedHeader *ParsedHeader_get(struct ParsedRequest *pr, const char *key) {
+    for (size_t i = 0; i < pr->headersused; i++)
+        if (strcasecmp(pr->headers[i].key, key) == 0)
+            return &pr->headers[i];
+    return NULL;
+}
+
+int ParsedHeader_set(struct ParsedRequest *pr, const char *key, const char *value) {
+    ParsedHeader_remove(pr, key);
+    if (pr->headersused == pr->headerslen) {
+        size_t slots = pr->headerslen * 2;
+        struct ParsedHeader *headers =
+            (struct ParsedHeader *)realloc(pr->headers, slots * sizeof(*headers));
+        if (!headers)
+            return -1;
+        pr->headers = headers;
+        pr->headerslen = slots;
+    }
+    struct ParsedHeader *h = &pr->headers[pr->headersused];
+    h->key = strdup(key);
+    h->value = strdup(value);
+    if (!h->key || !h->value) {
+        free(h->key);
+        free(h->value);
+        return -1;
+    }
+    h->keylen = strlen(key);
+    h->valuelen = strlen(value);
+    pr->headersused++;
+    return 0;
+}
+
+int ParsedHeader_remove(struct ParsedRequest *pr, const char *key) {
+    struct ParsedHeader *h = ParsedHeader_get(pr, key);
+    if (!h)
+        return -1;
+    free(h->key);
+    free(h->value);
+    size_t index = (size_t)(h - pr->headers);
+    memmove(h, h + 1, (pr->headersused - index - 1) * sizeof(*h));
+    pr->headersused--;
+    return 0;
+}
@@ -0,0 +1,89 @@
+#ifndef PROXY_PARSE_H
+#define PROXY_PARSE_H
+
+#include <stddef.h>
+
+// --- Request Parsing ---
+// C request parser used by the forwarding proxy: splits a request head with an absolute URL
+// ("GET http://host[:port]/path HTTP/1.1") into its fields and a list of headers that can be
+// edited and written back out. Every field is a NUL-terminated copy owned by the request.
+
+struct ParsedHeader {
+    char *key;
+    size_t keylen;
+    char *value;
+    size_t valuelen;
+};
+
+struct ParsedRequest {
+    char *method;
+    char *protocol;
+    char *host;
+    char *port;                         // NULL if the URL names none
+    char *path;                         // Starts with '/'
+    char *version;
+    char *buf;                          // Request line as received
+    size_t buflen;
+    struct ParsedHeader *headers;
+    size_t headersused;
+    size_t headerslen;                  // Slots allocated in headers
+};
+
+/*
+ * ParsedRequest_create - Returns an empty request to parse into, or NULL on failure.
+ */
+struct ParsedRequest *ParsedRequest_create(void);
+
+/*
+ * ParsedRequest_parse - Parses the request head in buf (buflen bytes, up to and including the
+ * blank line) into parse. A header repeated later replaces the earlier one. Returns 0, or -1
+ * if the head is malformed.
+ */
+int ParsedRequest_parse(struct ParsedRequest *parse, const char *buf, int buflen);
+
+/*
+ * ParsedRequest_destroy - Frees the request and everything it holds. NULL is ignored.
+ */
+void ParsedRequest_destroy(struct ParsedRequest *pr);
+
+/*
+ * ParsedRequest_unparse - Writes the request back out as "METHOD URL VERSION", the headers
+ * and the blank line into buf. Nothing is NUL-terminated. Returns 0, or -1 if buflen is
+ * short of ParsedRequest_totalLen().
+ */
+int ParsedRequest_unparse(struct ParsedRequest *pr, char *buf, size_t buflen);
+
+/*
+ * ParsedRequest_unparse_headers - Writes just the headers and the blank line into buf, as
+ * ParsedRequest_unparse() does. Returns 0, or -1 if buflen is short of
+ * ParsedHeader_headersLen().
+ */
+int ParsedRequest_unparse_headers(struct ParsedRequest *pr, char *buf, size_t buflen);
+
+/*
+ * ParsedRequest_totalLen - Bytes ParsedRequest_unparse() writes.
+ */
+size_t ParsedRequest_totalLen(struct ParsedRequest *pr);
+
+/*
+ * ParsedHeader_headersLen - Bytes ParsedRequest_unparse_headers() writes.
+ */
+size_t ParsedHeader_headersLen(struct ParsedRequest *pr);
+
+/*
+ * ParsedHeader_set - Sets header key to value, replacing any header of that name (compared
+ * without case). Returns 0, or -1 on failure.
+ */
+int ParsedHeader_set(struct ParsedRequest *pr, const char *key, const char *value);
+
+/*
+ * ParsedHeader_get - The header named key (compared without case), or NULL.
+ */
+struct ParsedHeader *ParsedHeader_get(struct ParsedRequest *pr, const char *key);
+
+/*
+ * ParsedHeader_remove - Removes the header named key. Returns 0, or -1 if there was none.
+ */
+int ParsedHeader_remove(struct ParsedRequest *pr, const char *key);
+
+#endif
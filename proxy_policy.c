@@ -0,0 +1,386 @@
+#include "proxy_policy.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LFU_MAX_FREQ         32                 // Hits past this no longer raise an element's rank
+#define LFU_AGE_FACTOR       10                 // Halve all counts every elements held * this hits
+#define SLRU_PROTECTED_PCT   80                 // Share of the main budget for re-used elements
+#define TINYLFU_WINDOW_PCT   1                  // Share of the budget for the admission window
+#define SKETCH_DEPTH         4                  // Count-min rows
+#define SKETCH_MAX_COUNT     15                 // Counters saturate here
+#define SKETCH_OBJECT_GUESS  (8 * 1024)         // Average element size assumed to size the sketch
+#define SKETCH_MIN_WIDTH     256                // Counters per row (power of two)
+#define SKETCH_MAX_WIDTH     (1 << 20)
+#define SKETCH_RESET_FACTOR  10                 // Halve all counters every width * this increments
+
+// --- Element Lists ---
+// Intrusive recency lists threaded through cache_element.policy, head = most recently used.
+
+typedef struct policy_list {
+    cache_element *head;                        // Most recently used
+    cache_element *tail;                        // Next candidate for eviction
+    size_t bytes;                               // Sum of the members' charges
+} policy_list;
+
+static void list_unlink(policy_list *list, cache_element *element) {
+    cache_policy_node *node = &element->policy;
+    if (node->prev) node->prev->policy.next = node->next;
+    else list->head = node->next;
+
+    if (node->next) node->next->policy.prev = node->prev;
+    else list->tail = node->prev;
+
+    node->prev = node->next = NULL;
+    list->bytes -= element->charge;
+}
+
+static void list_push_head(policy_list *list, cache_element *element) {
+    cache_policy_node *node = &element->policy;
+    node->prev = NULL;
+    node->next = list->head;
+    if (list->head) list->head->policy.prev = element;
+    else list->tail = element;
+    list->head = element;
+    list->bytes += element->charge;
+}
+
+/*
+ * list_move - Unlinks element from one list and makes it the head of another (or the same).
+ */
+static void list_move(policy_list *from, policy_list *to, cache_element *element) {
+    list_unlink(from, element);
+    list_push_head(to, element);
+}
+
+static void *policy_alloc(size_t size, const cache_policy_ops *ops) {
+    cache_policy *policy = (cache_policy *)calloc(1, size);
+    if (!policy) {
+        perror("calloc failed for cache policy");
+        return NULL;
+    }
+    policy->ops = ops;
+    return policy;
+}
+
+// --- LRU ---
+
+typedef struct lru_policy {
+    cache_policy base;
+    policy_list list;
+} lru_policy;
+
+static cache_policy *lru_create(size_t capacity) {
+    (void)capacity;
+    return (cache_policy *)policy_alloc(sizeof(lru_policy), &cache_policy_lru);
+}
+
+static void lru_on_insert(cache_policy *policy, cache_element *element) {
+    list_push_head(&((lru_policy *)policy)->list, element);
+}
+
+static void lru_on_hit(cache_policy *policy, cache_element *element) {
+    lru_policy *lru = (lru_policy *)policy;
+    if (lru->list.head != element)
+        list_move(&lru->list, &lru->list, element);
+}
+
+static void lru_on_remove(cache_policy *policy, cache_element *element) {
+    list_unlink(&((lru_policy *)policy)->list, element);
+}
+
+static cache_element *lru_victim(cache_policy *policy) {
+    return ((lru_policy *)policy)->list.tail;
+}
+
+const cache_policy_ops cache_policy_lru = {
+    "lru", lru_create, lru_on_insert, lru_on_hit, NULL, lru_on_remove, lru_victim
+};
+
+// --- LFU ---
+// One recency list per hit count, so finding the victim and counting a hit are both O(1).
+// policy.list holds the element's count minus one. Counts are halved periodically, like the
+// sketch's below, so elements that were popular a long time ago can be evicted again.
+
+typedef struct lfu_policy {
+    cache_policy base;
+    policy_list buckets[LFU_MAX_FREQ];          // Elements hit i + 1 times
+    size_t elements;                            // Elements held
+    size_t hits;                                // Hits since the last halving
+} lfu_policy;
+
+static cache_policy *lfu_create(size_t capacity) {
+    (void)capacity;
+    return (cache_policy *)policy_alloc(sizeof(lfu_policy), &cache_policy_lfu);
+}
+
+static void lfu_on_insert(cache_policy *policy, cache_element *element) {
+    lfu_policy *lfu = (lfu_policy *)policy;
+    element->policy.list = 0;
+    list_push_head(&lfu->buckets[0], element);
+    lfu->elements++;
+}
+
+/*
+ * lfu_age - Halves every element's count. The buckets that merge keep their recency order,
+ * those with the higher count ahead, so ties still go to the least recently used.
+ */
+static void lfu_age(lfu_policy *lfu) {
+    policy_list aged[LFU_MAX_FREQ];
+    memset(aged, 0, sizeof(aged));
+    for (int freq = 0; freq < LFU_MAX_FREQ; freq++) {
+        int to = (freq + 1) / 2 > 0 ? (freq + 1) / 2 - 1 : 0;
+        cache_element *element = lfu->buckets[freq].tail;
+        while (element) {
+            cache_element *prev = element->policy.prev;
+            element->policy.list = to;
+            list_push_head(&aged[to], element);
+            element = prev;
+        }
+    }
+    memcpy(lfu->buckets, aged, sizeof(aged));
+    lfu->hits = 0;
+}
+
+static void lfu_on_hit(cache_policy *policy, cache_element *element) {
+    lfu_policy *lfu = (lfu_policy *)policy;
+    int freq = element->policy.list;
+    if (freq + 1 < LFU_MAX_FREQ)
+        element->policy.list = freq + 1;
+    list_move(&lfu->buckets[freq], &lfu->buckets[element->policy.list], element);
+    if (++lfu->hits >= lfu->elements * LFU_AGE_FACTOR)
+        lfu_age(lfu);
+}
+
+static void lfu_on_remove(cache_policy *policy, cache_element *element) {
+    lfu_policy *lfu = (lfu_policy *)policy;
+    list_unlink(&lfu->buckets[element->policy.list], element);
+    lfu->elements--;
+}
+
+static cache_element *lfu_victim(cache_policy *policy) {
+    lfu_policy *lfu = (lfu_policy *)policy;
+    for (int i = 0; i < LFU_MAX_FREQ; i++) {
+        if (lfu->buckets[i].tail)
+            return lfu->buckets[i].tail;
+    }
+    return NULL;
+}
+
+const cache_policy_ops cache_policy_lfu = {
+    "lfu", lfu_create, lfu_on_insert, lfu_on_hit, NULL, lfu_on_remove, lfu_victim
+};
+
+// --- Frequency Sketch ---
+// Count-min sketch of recent key popularity for W-TinyLFU. Counters are halved periodically
+// so keys that were popular a long time ago lose their advantage.
+
+typedef struct frequency_sketch {
+    uint8_t *counters;                          // SKETCH_DEPTH rows of mask + 1 counters
+    size_t mask;                                // Row width - 1
+    size_t additions;                           // Increments since the last halving
+    size_t reset_at;                            // Halve once additions reaches this
+} frequency_sketch;
+
+static const uint64_t sketch_seeds[SKETCH_DEPTH] = {
+    0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL, 0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL
+};
+
+static int sketch_init(frequency_sketch *sketch, size_t capacity) {
+    size_t want = capacity ? capacity / SKETCH_OBJECT_GUESS : SKETCH_MAX_WIDTH;
+    size_t width = SKETCH_MIN_WIDTH;
+    while (width < want && width < SKETCH_MAX_WIDTH)
+        width <<= 1;
+
+    sketch->counters = (uint8_t *)calloc(SKETCH_DEPTH, width);
+    if (!sketch->counters) {
+        perror("calloc failed for frequency sketch");
+        return -1;
+    }
+    sketch->mask = width - 1;
+    sketch->reset_at = width * SKETCH_RESET_FACTOR;
+    return 0;
+}
+
+static uint8_t *sketch_counter(frequency_sketch *sketch, uint64_t hash, int row) {
+    uint64_t h = (hash ^ sketch_seeds[row]) * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 29;
+    return &sketch->counters[row * (sketch->mask + 1) + (h & sketch->mask)];
+}
+
+static void sketch_increment(frequency_sketch *sketch, uint64_t hash) {
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        uint8_t *counter = sketch_counter(sketch, hash, row);
+        if (*counter < SKETCH_MAX_COUNT)
+            (*counter)++;
+    }
+    if (++sketch->additions >= sketch->reset_at) {
+        for (size_t i = 0; i < SKETCH_DEPTH * (sketch->mask + 1); i++)
+            sketch->counters[i] >>= 1;
+        sketch->additions /= 2;
+    }
+}
+
+static unsigned sketch_estimate(frequency_sketch *sketch, uint64_t hash) {
+    unsigned estimate = SKETCH_MAX_COUNT;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        uint8_t counter = *sketch_counter(sketch, hash, row);
+        if (counter < estimate)
+            estimate = counter;
+    }
+    return estimate;
+}
+
+// --- Segmented LRU and W-TinyLFU ---
+// New elements start on probation; a hit there moves them to the protected segment, whose
+// overflow is demoted back to probation. Victims come from probation first, so a scan only
+// ever churns probation. W-TinyLFU puts a small LRU window in front: elements pushed out of
+// the window must have been requested more often than the probation victim to stay.
+
+enum {
+    LIST_WINDOW,
+    LIST_PROBATION,
+    LIST_PROTECTED,
+    LIST_COUNT
+};
+
+typedef struct segmented_policy {
+    cache_policy base;
+    policy_list lists[LIST_COUNT];
+    size_t window_max;                          // Window budget (W-TinyLFU only)
+    size_t protected_max;                       // Protected segment budget
+    frequency_sketch sketch;                    // Request frequencies (W-TinyLFU only)
+} segmented_policy;
+
+static segmented_policy *segmented_create(size_t capacity, size_t window_pct, const cache_policy_ops *ops) {
+    segmented_policy *slru = (segmented_policy *)policy_alloc(sizeof(segmented_policy), ops);
+    if (!slru)
+        return NULL;
+    if (capacity == 0) {
+        slru->window_max = slru->protected_max = (size_t)-1;
+    } else {
+        slru->window_max = capacity / 100 * window_pct;
+        slru->protected_max = (capacity - slru->window_max) / 100 * SLRU_PROTECTED_PCT;
+    }
+    return slru;
+}
+
+static void segmented_set(segmented_policy *slru, cache_element *element, int from, int to) {
+    list_move(&slru->lists[from], &slru->lists[to], element);
+    element->policy.list = to;
+}
+
+static void segmented_on_hit(segmented_policy *slru, cache_element *element) {
+    int list = element->policy.list;
+    if (list != LIST_PROBATION) {
+        if (slru->lists[list].head != element)
+            segmented_set(slru, element, list, list);
+        return;
+    }
+
+    segmented_set(slru, element, LIST_PROBATION, LIST_PROTECTED);
+    policy_list *protected = &slru->lists[LIST_PROTECTED];
+    while (protected->bytes > slru->protected_max && protected->tail != element)
+        segmented_set(slru, protected->tail, LIST_PROTECTED, LIST_PROBATION);
+}
+
+static void segmented_on_remove(cache_policy *policy, cache_element *element) {
+    segmented_policy *slru = (segmented_policy *)policy;
+    list_unlink(&slru->lists[element->policy.list], element);
+}
+
+static cache_element *segmented_main_victim(segmented_policy *slru) {
+    if (slru->lists[LIST_PROBATION].tail)
+        return slru->lists[LIST_PROBATION].tail;
+    return slru->lists[LIST_PROTECTED].tail;
+}
+
+static cache_policy *slru_create(size_t capacity) {
+    return (cache_policy *)segmented_create(capacity, 0, &cache_policy_slru);
+}
+
+static void slru_on_insert(cache_policy *policy, cache_element *element) {
+    element->policy.list = LIST_PROBATION;
+    list_push_head(&((segmented_policy *)policy)->lists[LIST_PROBATION], element);
+}
+
+static void slru_on_hit(cache_policy *policy, cache_element *element) {
+    segmented_on_hit((segmented_policy *)policy, element);
+}
+
+static cache_element *slru_victim(cache_policy *policy) {
+    return segmented_main_victim((segmented_policy *)policy);
+}
+
+const cache_policy_ops cache_policy_slru = {
+    "slru", slru_create, slru_on_insert, slru_on_hit, NULL, segmented_on_remove, slru_victim
+};
+
+static cache_policy *tinylfu_create(size_t capacity) {
+    segmented_policy *slru = segmented_create(capacity, TINYLFU_WINDOW_PCT, &cache_policy_tinylfu);
+    if (slru && sketch_init(&slru->sketch, capacity) < 0) {
+        free(slru);
+        return NULL;
+    }
+    return (cache_policy *)slru;
+}
+
+static void tinylfu_on_insert(cache_policy *policy, cache_element *element) {
+    element->policy.list = LIST_WINDOW;
+    list_push_head(&((segmented_policy *)policy)->lists[LIST_WINDOW], element);
+}
+
+static void tinylfu_on_hit(cache_policy *policy, cache_element *element) {
+    segmented_policy *slru = (segmented_policy *)policy;
+    sketch_increment(&slru->sketch, element->hash);
+    segmented_on_hit(slru, element);
+}
+
+static void tinylfu_on_miss(cache_policy *policy, uint64_t hash) {
+    sketch_increment(&((segmented_policy *)policy)->sketch, hash);
+}
+
+/*
+ * tinylfu_victim - Takes the window's overflow one element at a time and pits each against
+ * the probation tail: the newcomer is evicted unless the sketch says it is requested more
+ * often, in which case it moves to probation and the tail is evicted instead.
+ */
+static cache_element *tinylfu_victim(cache_policy *policy) {
+    segmented_policy *slru = (segmented_policy *)policy;
+    policy_list *window = &slru->lists[LIST_WINDOW];
+    while (window->bytes > slru->window_max) {
+        cache_element *candidate = window->tail;
+        cache_element *victim = slru->lists[LIST_PROBATION].tail;
+        if (victim && sketch_estimate(&slru->sketch, candidate->hash) <=
+                      sketch_estimate(&slru->sketch, victim->hash))
+            return candidate;
+        segmented_set(slru, candidate, LIST_WINDOW, LIST_PROBATION);
+        if (victim)
+            return victim;
+    }
+
+    cache_element *victim = slru->lists[LIST_PROBATION].tail;
+    if (victim == NULL)
+        victim = slru->lists[LIST_PROTECTED].tail;
+    return victim ? victim : window->tail;
+}
+
+const cache_policy_ops cache_policy_tinylfu = {
+    "tinylfu", tinylfu_create, tinylfu_on_insert, tinylfu_on_hit, tinylfu_on_miss,
+    segmented_on_remove, tinylfu_victim
+};
+
+// --- Registry ---
+
+static const cache_policy_ops *const cache_policies[] = {
+    &cache_policy_lru, &cache_policy_lfu, &cache_policy_slru, &cache_policy_tinylfu
+};
+
+const cache_policy_ops *cache_policy_find(const char *name) {
+    for (size_t i = 0; i < sizeof(cache_policies) / sizeof(cache_policies[0]); i++) {
+        if (strcmp(cache_policies[i]->name, name) == 0)
+            return cache_policies[i];
+    }
+    return NULL;
+}
@@ -0,0 +1,37 @@
+#ifndef PROXY_POLICY_H
+#define PROXY_POLICY_H
+
+#include "proxy_cache.h"
+
+// --- Eviction Policy Interface ---
+// Each shard owns one policy instance and only calls it with the shard lock held. The shard
+// keeps the index and the byte count; the policy orders the linked elements, sized by their
+// charge, and names the next one to evict whenever the shard is over budget.
+typedef struct cache_policy cache_policy;
+
+typedef struct cache_policy_ops {
+    const char *name;                                                // Value of --cache-policy
+    cache_policy *(*create)(size_t capacity);                        // Shard byte budget (0 = unbounded)
+    void (*on_insert)(cache_policy *policy, cache_element *element); // Element was published
+    void (*on_hit)(cache_policy *policy, cache_element *element);    // Drained from the read buffer
+    void (*on_miss)(cache_policy *policy, uint64_t hash);            // Optional; key was not cached
+    void (*on_remove)(cache_policy *policy, cache_element *element); // Replaced or evicted
+    cache_element *(*victim)(cache_policy *policy);                  // Next element to evict, or NULL
+} cache_policy_ops;
+
+// Every implementation starts its state with this header
+struct cache_policy {
+    const cache_policy_ops *ops;
+};
+
+extern const cache_policy_ops cache_policy_lru;      // Least recently used
+extern const cache_policy_ops cache_policy_lfu;      // Least frequently used, ties broken by recency
+extern const cache_policy_ops cache_policy_slru;     // Segmented LRU (probation + protected)
+extern const cache_policy_ops cache_policy_tinylfu;  // W-TinyLFU: LRU window + SLRU behind a frequency filter
+
+/*
+ * cache_policy_find - Returns the policy called name, or NULL if there is none.
+ */
+const cache_policy_ops *cache_policy_find(const char *name);
+
+#endif
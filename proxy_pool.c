@@ -0,0 +1,451 @@
+#include "proxy_pool.h"
+#include "proxy_stats.h"
+#include "proxy_listen.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#define PARK_MAX_EVENTS 64              // Parked clients resumed per epoll_wait()
+
+// --- Socket Queue ---
+// Bounded lock-free MPMC ring (Vyukov): each cell's sequence number says whether it is free
+// for the enqueue at that position or holds the item for the dequeue at that position, so
+// the acceptor, the owner and thieves only ever contend on one CAS.
+typedef struct pool_cell {
+    atomic_size_t sequence;             // pos when free for enqueue pos, pos + 1 once filled
+    int fd;
+} pool_cell;
+
+typedef struct pool_queue {
+    atomic_size_t head;                 // Next position to dequeue (owner and thieves)
+    char pad[64 - sizeof(atomic_size_t)];
+    atomic_size_t tail;                 // Next position to enqueue (acceptors)
+    size_t mask;                        // Capacity - 1
+    pool_cell *cells;
+} pool_queue;
+
+typedef struct pool_worker {
+    worker_pool *pool;
+    int index;                          // Position in pool->workers
+    pthread_t thread;
+    pool_queue queue;                   // Sockets assigned to this worker
+    atomic_ulong handled;               // Clients served
+    atomic_ulong stolen;                // Of those, taken from another worker's queue
+    atomic_int busy;                    // Serving a client right now
+} __attribute__((aligned(64))) pool_worker;
+
+// A client waiting for its next request
+typedef struct pool_parked {
+    int fd;
+    uint64_t since;                     // Monotonic milliseconds when it was parked
+    struct pool_parked *prev;           // Towards the most recently parked
+    struct pool_parked *next;           // Towards the least recently parked
+} pool_parked;
+
+struct worker_pool {
+    pool_worker *workers;
+    int count;
+    size_t depth;                       // Capacity of each queue
+    pool_handler handler;
+    pool_reject reject;
+    sem_t pending;                      // Posted once per queued socket
+    atomic_size_t next;                 // Round-robin start for submissions
+    atomic_ulong submitted;             // Sockets queued
+    atomic_ulong rejected;              // Sockets refused because every queue was full
+
+    int park_fd;                        // epoll set of parked clients
+    uint64_t idle_timeout_ms;           // 0 = parked clients never time out
+    pthread_mutex_t park_lock;          // Guards the parked list
+    pool_parked *parked_newest;
+    pool_parked *parked_oldest;
+    long parked_now;                    // Entries on the list
+    atomic_ulong parked;                // Times a client was parked
+    atomic_ulong resumed;               // Parked clients queued again with a new request
+    atomic_ulong idle_closed;           // Parked clients closed by the timeout or by hanging up
+};
+
+static int queue_init(pool_queue *queue, size_t depth) {
+    queue->cells = (pool_cell *)calloc(depth, sizeof(pool_cell));
+    if (!queue->cells) {
+        perror("calloc failed for worker queue");
+        return -1;
+    }
+    for (size_t i = 0; i < depth; i++)
+        atomic_init(&queue->cells[i].sequence, i);
+    queue->mask = depth - 1;
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    return 0;
+}
+
+static int queue_push(pool_queue *queue, int fd) {
+    size_t pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    pool_cell *cell;
+    for (;;) {
+        cell = &queue->cells[pos & queue->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return -1;  // Full
+        } else {
+            pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        }
+    }
+    cell->fd = fd;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    return 0;
+}
+
+static int queue_pop(pool_queue *queue) {
+    size_t pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    pool_cell *cell;
+    for (;;) {
+        cell = &queue->cells[pos & queue->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return -1;  // Empty
+        } else {
+            pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        }
+    }
+    int fd = cell->fd;
+    atomic_store_explicit(&cell->sequence, pos + queue->mask + 1, memory_order_release);
+    return fd;
+}
+
+static size_t queue_length(pool_queue *queue) {
+    size_t tail = atomic_load(&queue->tail);
+    size_t head = atomic_load(&queue->head);
+    return tail > head ? tail - head : 0;
+}
+
+// --- Workers ---
+
+static void pool_park(worker_pool *pool, int fd);
+
+/*
+ * worker_take - Pops from the worker's own queue, else steals from the others in turn.
+ * Only called after taking a pending token, so some queue holds a socket for us; a pass can
+ * still come up empty while another worker's pop races ours, hence the retry.
+ */
+static int worker_take(pool_worker *worker) {
+    worker_pool *pool = worker->pool;
+    for (;;) {
+        int fd = queue_pop(&worker->queue);
+        if (fd >= 0)
+            return fd;
+        for (int i = 1; i < pool->count; i++) {
+            fd = queue_pop(&pool->workers[(worker->index + i) % pool->count].queue);
+            if (fd >= 0) {
+                atomic_fetch_add(&worker->stolen, 1);
+                return fd;
+            }
+        }
+    }
+}
+
+static void *worker_main(void *arg) {
+    pool_worker *worker = (pool_worker *)arg;
+    worker_pool *pool = worker->pool;
+    for (;;) {
+        if (sem_wait(&pool->pending) < 0) {
+            if (errno != EINTR)
+                perror("sem_wait failed in worker");
+            continue;
+        }
+        int fd = worker_take(worker);
+        atomic_store(&worker->busy, 1);
+        int park = pool->handler(fd);
+        atomic_store(&worker->busy, 0);
+        atomic_fetch_add(&worker->handled, 1);
+        if (park)
+            pool_park(pool, fd);
+    }
+    return NULL;
+}
+
+// --- Parked Clients ---
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Park lock held
+static void parked_unlink(worker_pool *pool, pool_parked *entry) {
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        pool->parked_newest = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        pool->parked_oldest = entry->prev;
+    pool->parked_now--;
+}
+
+/*
+ * pool_park - Watches fd for its next request. It is linked before it is registered, so the
+ * watcher never sees an event for an entry it cannot find.
+ */
+static void pool_park(worker_pool *pool, int fd) {
+    pool_parked *entry = (pool_parked *)malloc(sizeof(pool_parked));
+    if (!entry) {
+        perror("malloc failed for parked client");
+        close(fd);
+        return;
+    }
+    entry->fd = fd;
+    entry->since = now_ms();
+    entry->prev = NULL;
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.ptr = entry;
+    pthread_mutex_lock(&pool->park_lock);
+    entry->next = pool->parked_newest;
+    if (entry->next)
+        entry->next->prev = entry;
+    else
+        pool->parked_oldest = entry;
+    pool->parked_newest = entry;
+    pool->parked_now++;
+    int err = epoll_ctl(pool->park_fd, EPOLL_CTL_ADD, fd, &event);
+    if (err < 0)
+        parked_unlink(pool, entry);
+    pthread_mutex_unlock(&pool->park_lock);
+
+    if (err < 0) {
+        perror("epoll_ctl failed for parked client");
+        close(fd);
+        free(entry);
+        return;
+    }
+    atomic_fetch_add(&pool->parked, 1);
+}
+
+/*
+ * parker_main - Queues parked clients again once they send a request and closes those that
+ * hang up or stay idle past the timeout.
+ */
+static void *parker_main(void *arg) {
+    worker_pool *pool = (worker_pool *)arg;
+    struct epoll_event events[PARK_MAX_EVENTS];
+    for (;;) {
+        int n = epoll_wait(pool->park_fd, events, PARK_MAX_EVENTS, 1000);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait failed for parked clients");
+            return NULL;
+        }
+        for (int i = 0; i < n; i++) {
+            pool_parked *entry = (pool_parked *)events[i].data.ptr;
+            int fd = entry->fd;
+            pthread_mutex_lock(&pool->park_lock);
+            parked_unlink(pool, entry);
+            epoll_ctl(pool->park_fd, EPOLL_CTL_DEL, fd, NULL);
+            pthread_mutex_unlock(&pool->park_lock);
+            free(entry);
+
+            // A client that hung up needs no worker
+            char byte;
+            if (recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+                atomic_fetch_add(&pool->idle_closed, 1);
+                close(fd);
+                continue;
+            }
+            atomic_fetch_add(&pool->resumed, 1);
+            if (pool_submit(pool, fd) < 0)
+                pool->reject(fd);
+        }
+
+        if (pool->idle_timeout_ms == 0)
+            continue;
+        uint64_t now = now_ms();
+        pthread_mutex_lock(&pool->park_lock);
+        while (pool->parked_oldest && now - pool->parked_oldest->since >= pool->idle_timeout_ms) {
+            pool_parked *entry = pool->parked_oldest;
+            parked_unlink(pool, entry);
+            epoll_ctl(pool->park_fd, EPOLL_CTL_DEL, entry->fd, NULL);
+            close(entry->fd);
+            free(entry);
+            atomic_fetch_add(&pool->idle_closed, 1);
+        }
+        pthread_mutex_unlock(&pool->park_lock);
+    }
+}
+
+static void pool_dump_stats(FILE *out, void *arg) {
+    worker_pool *pool = (worker_pool *)arg;
+    fprintf(out, "workers: %d, queue depth: %zu, submitted: %lu, rejected: %lu\n",
+            pool->count, pool->depth, atomic_load(&pool->submitted), atomic_load(&pool->rejected));
+    pthread_mutex_lock(&pool->park_lock);
+    long parked_now = pool->parked_now;
+    pthread_mutex_unlock(&pool->park_lock);
+    fprintf(out, "parked now: %ld, parked: %lu, resumed: %lu, closed idle: %lu\n", parked_now,
+            atomic_load(&pool->parked), atomic_load(&pool->resumed), atomic_load(&pool->idle_closed));
+    for (int i = 0; i < pool->count; i++) {
+        pool_worker *worker = &pool->workers[i];
+        fprintf(out, "  worker %d: %s, queued %zu, handled %lu, stolen %lu\n", i,
+                atomic_load(&worker->busy) ? "busy" : "idle", queue_length(&worker->queue),
+                atomic_load(&worker->handled), atomic_load(&worker->stolen));
+    }
+}
+
+/*
+ * pool_create - Allocates every queue before starting the first worker.
+ */
+worker_pool *pool_create(int worker_count, size_t queue_depth, int idle_timeout,
+                         pool_handler handler, pool_reject reject) {
+    if (worker_count <= 0)
+        worker_count = online_cpus();
+    size_t depth = 2;
+    while (depth < queue_depth)
+        depth <<= 1;
+
+    worker_pool *pool = (worker_pool *)calloc(1, sizeof(worker_pool));
+    pool_worker *workers = (pool_worker *)aligned_alloc(64, (size_t)worker_count * sizeof(pool_worker));
+    if (!pool || !workers) {
+        perror("malloc failed for worker pool");
+        free(pool);
+        free(workers);
+        return NULL;
+    }
+    memset(workers, 0, (size_t)worker_count * sizeof(pool_worker));
+    pool->workers = workers;
+    pool->count = worker_count;
+    pool->depth = depth;
+    pool->handler = handler;
+    pool->reject = reject;
+    sem_init(&pool->pending, 0, 0);
+    pool->idle_timeout_ms = idle_timeout > 0 ? (uint64_t)idle_timeout * 1000 : 0;
+    pthread_mutex_init(&pool->park_lock, NULL);
+    pool->park_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (pool->park_fd < 0) {
+        perror("Failed to create epoll set for parked clients");
+        return NULL;
+    }
+    for (int i = 0; i < worker_count; i++) {
+        workers[i].pool = pool;
+        workers[i].index = i;
+        if (queue_init(&workers[i].queue, depth) < 0)
+            return NULL;
+    }
+    for (int i = 0; i < worker_count; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            perror("Failed to start worker thread");
+            return NULL;
+        }
+    }
+    pthread_t parker;
+    if (pthread_create(&parker, NULL, parker_main, pool) != 0) {
+        perror("Failed to start parked client thread");
+        return NULL;
+    }
+    pthread_detach(parker);
+    stats_register("worker pool", pool_dump_stats, pool);
+    return pool;
+}
+
+/*
+ * pool_submit - Tries the queues round-robin from a rotating start, so consecutive sockets
+ * land on different workers even before any stealing happens.
+ */
+int pool_submit(worker_pool *pool, int client_fd) {
+    size_t start = atomic_fetch_add_explicit(&pool->next, 1, memory_order_relaxed);
+    for (int i = 0; i < pool->count; i++) {
+        pool_worker *worker = &pool->workers[(start + (size_t)i) % (size_t)pool->count];
+        if (queue_push(&worker->queue, client_fd) == 0) {
+            atomic_fetch_add(&pool->submitted, 1);
+            sem_post(&pool->pending);
+            return 0;
+        }
+    }
+    atomic_fetch_add(&pool->rejected, 1);
+    return -1;
+}
+
+// --- Acceptors ---
+
+typedef struct pool_acceptor {
+    worker_pool *pool;
+    int listen_fd;
+    int index;                          // CPU to pin to, or -1
+} pool_acceptor;
+
+/*
+ * acceptor_main - Accept loop of one listener. Errors never stop it; running out of
+ * descriptors backs off briefly instead of spinning.
+ */
+static void *acceptor_main(void *arg) {
+    pool_acceptor *acceptor = (pool_acceptor *)arg;
+    if (acceptor->index >= 0)
+        pin_thread(acceptor->index);
+
+    for (;;) {
+        int fd = accept(acceptor->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("Error in accepting connection");
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+                usleep(10000);
+            continue;
+        }
+        client_socket_init(fd);
+        // Every worker queue is full: refuse instead of stalling the accept loop
+        if (pool_submit(acceptor->pool, fd) < 0)
+            acceptor->pool->reject(fd);
+    }
+    return NULL;
+}
+
+/*
+ * pool_serve - The extra acceptors are started before the calling thread pins itself, so
+ * they inherit its unrestricted affinity.
+ */
+int pool_serve(worker_pool *pool, const int *listen_fds, int count, int pin) {
+    pool_acceptor *acceptors = (pool_acceptor *)calloc((size_t)count, sizeof(pool_acceptor));
+    if (!acceptors) {
+        perror("calloc failed for acceptors");
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        acceptors[i].pool = pool;
+        acceptors[i].listen_fd = listen_fds[i];
+        acceptors[i].index = pin ? i : -1;
+    }
+    for (int i = 1; i < count; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, acceptor_main, &acceptors[i]) != 0) {
+            perror("Failed to start acceptor thread");
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+    acceptor_main(&acceptors[0]);
+    return -1;
+}
+
+int pool_workers(const worker_pool *pool) {
+    return pool->count;
+}
@@ -0,0 +1,44 @@
+#ifndef PROXY_POOL_H
+#define PROXY_POOL_H
+
+#include <stddef.h>
+
+// --- Worker Pool ---
+// A fixed set of threads started up front. Each worker has its own bounded queue of accepted
+// sockets; idle workers steal from the others, so a burst landing on one queue is spread out.
+// Kept-alive clients waiting for their next request are parked in an epoll set watched by one
+// thread and queued again once they send something, so idle connections hold no worker.
+typedef struct worker_pool worker_pool;
+
+typedef int (*pool_handler)(int client_fd);    // Serves a client; returns 1 to park it, 0 once closed
+typedef void (*pool_reject)(int client_fd);    // Turns away and closes a client
+
+/*
+ * pool_create - Starts worker_count workers (0 = one per online CPU), each with a queue of
+ * queue_depth sockets (rounded up to a power of two), and the thread watching parked clients,
+ * which closes them after idle_timeout seconds (0 = never). Clients that find every queue
+ * full are passed to reject. Registers the pool's stats. Returns NULL on failure.
+ */
+worker_pool *pool_create(int worker_count, size_t queue_depth, int idle_timeout,
+                         pool_handler handler, pool_reject reject);
+
+/*
+ * pool_submit - Queues client_fd for a worker without ever blocking. Returns 0, or -1 if
+ * every queue is full; the caller then still owns client_fd.
+ */
+int pool_submit(worker_pool *pool, int client_fd);
+
+/*
+ * pool_serve - Accepts clients on each of the count listeners from its own thread (the
+ * calling thread takes the first) and submits them to the pool. With pin set, the i-th
+ * acceptor is bound to the i-th CPU. Returns -1 if an acceptor could not be started;
+ * otherwise it does not return.
+ */
+int pool_serve(worker_pool *pool, const int *listen_fds, int count, int pin);
+
+/*
+ * pool_workers - Number of workers started by pool_create().
+ */
+int pool_workers(const worker_pool *pool);
+
+#endif
@@ -0,0 +1,514 @@
+#include "proxy_range.h"
+#include "proxy_key.h"
+#include "proxy_refresh.h"
+#include "proxy_relay.h"
+#include "proxy_upstream.h"
+#include "proxy_stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+// Counters shown in the stats
+static atomic_ulong sliced;                 // Ranges served from the cache
+static atomic_ulong assembled;              // Whole responses sent from their parts
+static atomic_ulong unsatisfiable;          // Answered 416 from the cache
+static atomic_ulong whole;                  // Sent whole: not sliceable or If-Range failed
+static atomic_ulong part_hits;              // Parts found cached
+static atomic_ulong part_fetches;           // Parts fetched from the origin
+static atomic_ulong unsplit_skips;          // Parts not fetched: the origin did not split
+static atomic_ulong resumed;                // Ranges finished from the origin, a part missing
+
+// Responses whose origin lately did not split them, by the hash of their URL, in a
+// direct-mapped table: a newer entry simply takes the slot of an older one
+typedef struct unsplit_slot {
+    uint64_t hash;
+    time_t until;                           // Parts are fetched again from then on
+} unsplit_slot;
+
+static unsplit_slot unsplit[RANGE_UNSPLIT_SLOTS];
+static pthread_mutex_t unsplit_lock = PTHREAD_MUTEX_INITIALIZER;  // Guards unsplit
+
+static void range_dump_stats(FILE *out, void *arg) {
+    fprintf(out, "sliced %lu, unsatisfiable %lu, sent whole %lu, assembled from parts %lu, "
+            "parts hit %lu, fetched %lu, not split %lu, resumed from the origin %lu\n",
+            atomic_load(&sliced), atomic_load(&unsatisfiable), atomic_load(&whole),
+            atomic_load(&assembled), atomic_load(&part_hits), atomic_load(&part_fetches),
+            atomic_load(&unsplit_skips), atomic_load(&resumed));
+}
+
+void range_init(void) {
+    stats_register("ranges", range_dump_stats, NULL);
+}
+
+// Hash of the URL of key, the same for the key of the whole response and those of its parts
+static uint64_t unsplit_hash(const char *key) {
+    return cache_hash(key, strcspn(key, "#\n"));
+}
+
+void range_unsplit(const char *key) {
+    uint64_t hash = unsplit_hash(key);
+    unsplit_slot *slot = &unsplit[hash % RANGE_UNSPLIT_SLOTS];
+    pthread_mutex_lock(&unsplit_lock);
+    slot->hash = hash;
+    slot->until = time(NULL) + RANGE_UNSPLIT_TTL;
+    pthread_mutex_unlock(&unsplit_lock);
+}
+
+/*
+ * unsplit_marked - Whether parts of the response cached under key are not to be fetched.
+ */
+static int unsplit_marked(const char *key) {
+    uint64_t hash = unsplit_hash(key);
+    unsplit_slot *slot = &unsplit[hash % RANGE_UNSPLIT_SLOTS];
+    pthread_mutex_lock(&unsplit_lock);
+    int marked = slot->hash == hash && slot->until > time(NULL);
+    pthread_mutex_unlock(&unsplit_lock);
+    if (marked)
+        atomic_fetch_add(&unsplit_skips, 1);
+    return marked;
+}
+
+int range_request(range_state *state, const char *head) {
+    memset(state, 0, sizeof(*state));
+    if (!http_request_range(head, &state->range))
+        return 0;
+    state->next = state->range.suffix ? 0 : state->range.first;
+    return 1;
+}
+
+int range_more(const range_state *state) {
+    return state->started && state->next < state->end;
+}
+
+/*
+ * build_head - The head sending body bytes first to last of total: the stored head's fields
+ * but those framing the whole body, as a 206, or as the 200 it was for a whole response.
+ * Returns its length, or 0 if it does not fit.
+ */
+static size_t build_head(const range_state *state, const char *stored, char *head,
+                         size_t size, uint64_t first, uint64_t last, uint64_t total) {
+    char framing[128];
+    if (state->whole) {
+        snprintf(framing, sizeof(framing), "Content-Length: %" PRIu64 "\r\n", total);
+        return http_head_reframe(head, size, stored, "HTTP/1.1 200 OK", framing);
+    }
+    snprintf(framing, sizeof(framing),
+             "Content-Range: bytes %" PRIu64 "-%" PRIu64 "/%" PRIu64 "\r\n"
+             "Content-Length: %" PRIu64 "\r\n", first, last, total, last - first + 1);
+    return http_head_reframe(head, size, stored, "HTTP/1.1 206 Partial Content", framing);
+}
+
+range_plan_result range_plan(range_state *state, cache_element *element, cache_cursor *cursor,
+                             char *head, size_t size, size_t *head_len, size_t *start) {
+    char stored[RANGE_HEAD_MAX];
+    size_t stored_len = relay_head(element, stored, sizeof(stored));
+    int fill_state = atomic_load(&element->state);
+    *head_len = 0;
+    if (stored_len == 0) {
+        if (fill_state == CACHE_FILLING && atomic_load(&element->len) < sizeof(stored) - 1)
+            return RANGE_WAIT;
+        return state->started ? RANGE_FAILED : RANGE_WHOLE;
+    }
+
+    http_response r;
+    http_response_init(&r);
+    http_response_feed(&r, stored, stored_len);
+
+    // Where the element's body sits in the whole body
+    uint64_t piece_first, piece_last, total, part_first;
+    if (cache_key_part_first(element->url, &part_first)) {
+        if (r.status != 206 || r.range_first < 0 || (uint64_t)r.range_first != part_first ||
+            r.range_total < 0)
+            return state->started ? RANGE_FAILED : RANGE_WHOLE;
+        piece_first = (uint64_t)r.range_first;
+        piece_last = (uint64_t)r.range_last;
+        total = (uint64_t)r.range_total;
+    } else {
+        if (r.status != 200 || r.chunked)
+            return state->started ? RANGE_FAILED : RANGE_WHOLE;
+        if (r.content_length >= 0)
+            total = (uint64_t)r.content_length;
+        else if (fill_state == CACHE_COMPLETE)
+            total = atomic_load(&element->len) - stored_len;
+        else
+            return RANGE_WHOLE;
+        piece_first = 0;
+        piece_last = total - 1;
+    }
+
+    if (!state->started) {
+        uint64_t first, last;
+        if (!http_range_if_matches(&state->range, &r)) {
+            atomic_fetch_add(&whole, 1);
+            return RANGE_WHOLE;
+        }
+        if (state->whole && total == 0)
+            return RANGE_WHOLE;
+        if (http_range_resolve(&state->range, total, &first, &last) < 0) {
+            int n = snprintf(head, size, "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                             "Content-Range: bytes */%" PRIu64 "\r\nContent-Length: 0\r\n\r\n",
+                             total);
+            if (n < 0 || (size_t)n >= size)
+                return RANGE_WHOLE;
+            *head_len = (size_t)n;
+            state->started = 1;
+            state->next = state->end = 0;
+            *start = 0;
+            cache_cursor_limit(cursor, 0);
+            atomic_fetch_add(&unsatisfiable, 1);
+            return RANGE_UNSATISFIABLE;
+        }
+        *head_len = build_head(state, stored, head, size, first, last, total);
+        if (*head_len == 0)
+            return RANGE_WHOLE;
+        state->started = 1;
+        state->next = first;
+        state->end = last + 1;
+        memcpy(state->etag, r.etag, sizeof(state->etag));
+        state->last_modified = r.last_modified;
+        atomic_fetch_add(state->whole ? &assembled : &sliced, 1);
+    } else if (strcmp(r.etag, state->etag) != 0 || r.last_modified != state->last_modified) {
+        return RANGE_FAILED;    // The response changed between parts
+    }
+
+    if (state->next < piece_first || state->next > piece_last)
+        return RANGE_FAILED;
+    uint64_t last = state->end - 1 < piece_last ? state->end - 1 : piece_last;
+    *start = stored_len + (size_t)(state->next - piece_first);
+    cache_cursor_limit(cursor, stored_len + (size_t)(last - piece_first) + 1);
+    state->next = last + 1;
+    return RANGE_SLICE;
+}
+
+/*
+ * part_request - Writes the request to the origin for bytes first to last of the response to
+ * out (size bytes). Returns its length, 0 if it does not fit.
+ */
+static size_t part_request(const range_origin *origin, uint64_t first, uint64_t last,
+                           char *out, size_t size) {
+    if (size <= origin->len)
+        return 0;
+    memcpy(out, origin->request, origin->len);
+    out[origin->len] = '\0';
+    return http_request_part(out, origin->len, size, first, last);
+}
+
+/*
+ * fetch_part - Hands flight, the fetch of the part from first to last, to the part threads.
+ * A request for it that does not fit is never sent; the flight fails instead.
+ */
+static void fetch_part(cache_flight *flight, const range_origin *origin, uint64_t first,
+                       uint64_t last) {
+    size_t size = origin->len + 64;
+    char *request = (char *)malloc(size);
+    if (!request) {
+        perror("malloc failed for range part");
+        cache_flight_complete(flight, 0, 0);
+        return;
+    }
+    size_t len = part_request(origin, first, last, request, size);
+    if (len == 0) {
+        cache_flight_complete(flight, 0, 0);
+        free(request);
+        return;
+    }
+    refresh_part(flight, origin->host, origin->port, request, len);
+    free(request);
+    atomic_fetch_add(&part_fetches, 1);
+}
+
+/*
+ * lookup_part - range_lookup(), but a part that is missing is only fetched if fetch is set.
+ */
+static cache_lookup_result lookup_part(const range_state *state, const range_origin *origin,
+                                       int fetch, cache_element **element, cache_flight **flight) {
+    char key[CACHE_KEY_MAX];
+    uint64_t first = state->next / RANGE_PART_SIZE * RANGE_PART_SIZE;
+    uint64_t last = first + RANGE_PART_SIZE - 1;
+    *element = NULL;
+    *flight = NULL;
+    // The part a suffix range starts in is only known once the length is
+    if ((state->range.suffix && !state->started) ||
+        cache_key_part(key, sizeof(key), origin->key, first, last) == 0)
+        return CACHE_LEADER;
+    // Parts already cached are still served
+    if (fetch && unsplit_marked(origin->key))
+        fetch = 0;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        cache_lookup_result result = fetch ? cache_lookup(key, element, flight)
+                                           : cache_lookup_cached(key, element, flight);
+        if (result == CACHE_HIT || result == CACHE_FOLLOWER) {
+            if (attempt == 0)
+                atomic_fetch_add(&part_hits, 1);
+            return result;
+        }
+        if (result == CACHE_LEADER && (!*flight || attempt > 0))
+            break;
+
+        // Have the refresh threads lead the fetch, then follow it like any other
+        fetch_part(*flight, origin, first, last);
+        *flight = NULL;
+        if (result == CACHE_REFRESH)
+            return CACHE_HIT;    // The stale part may be served meanwhile
+        fetch = 1;
+    }
+    cache_flight_complete(*flight, 0, 0);
+    *element = NULL;
+    *flight = NULL;
+    return CACHE_LEADER;
+}
+
+cache_lookup_result range_lookup(const range_state *state, const range_origin *origin,
+                                 cache_element **element, cache_flight **flight) {
+    return lookup_part(state, origin, 1, element, flight);
+}
+
+cache_lookup_result range_whole(range_state *state, const range_origin *origin,
+                                cache_element **element, cache_flight **flight) {
+    memset(state, 0, sizeof(*state));
+    state->range.last = UINT64_MAX;
+    state->whole = 1;
+    return lookup_part(state, origin, 0, element, flight);
+}
+
+/*
+ * range_seed - Fetches just the first part: the rest follow when a request needs them.
+ */
+void range_seed(const range_origin *origin, const http_response *response) {
+    if (response->status != 200 || response->chunked || response->content_length < 0 ||
+        !response->accept_ranges || !http_response_storable(response) ||
+        cache_fits(origin->key, (uint64_t)response->content_length) ||
+        unsplit_marked(origin->key))
+        return;
+
+    char key[CACHE_KEY_MAX];
+    cache_element *element;
+    cache_flight *flight;
+    if (cache_key_part(key, sizeof(key), origin->key, 0, RANGE_PART_SIZE - 1) == 0)
+        return;
+    cache_lookup_result result = cache_lookup(key, &element, &flight);
+    if (result == CACHE_LEADER) {
+        if (flight)
+            fetch_part(flight, origin, 0, RANGE_PART_SIZE - 1);
+        return;
+    }
+    if (result == CACHE_REFRESH)
+        fetch_part(flight, origin, 0, RANGE_PART_SIZE - 1);
+    else if (result == CACHE_FOLLOWER)
+        cache_flight_leave(flight);
+    cache_release(element);
+}
+
+void range_rewind(range_state *state, const cache_cursor *cursor, size_t start) {
+    size_t from = cursor->offset > start ? cursor->offset : start;
+    state->next -= cursor->end - from;
+}
+
+size_t range_resume_request(const range_state *state, const range_origin *origin, char *out,
+                            size_t size) {
+    atomic_fetch_add(&resumed, 1);
+    return part_request(origin, state->next, state->end - 1, out, size);
+}
+
+int64_t range_resume_skip(const range_state *state, const http_response *r) {
+    if (r->chunked || strcmp(r->etag, state->etag) != 0 ||
+        r->last_modified != state->last_modified)
+        return -1;
+    if (r->status == 206 && r->range_first == (int64_t)state->next &&
+        r->range_last >= (int64_t)(state->end - 1))
+        return 0;
+    // An origin that ignored the Range sends the whole body, the range somewhere inside it
+    if (r->status == 200 && r->content_length >= (int64_t)state->end)
+        return (int64_t)state->next;
+    return -1;
+}
+
+/*
+ * resume_head - Sends the request for the rest of the range to the origin on a connection
+ * from upstream_open() and reads the head of the answer into buffer (size bytes), retrying
+ * once on a new connection if a pooled one was closed. Returns the connection, with the
+ * bytes read in *have and the head's length in *head_len, or -1.
+ */
+static int resume_head(const range_origin *origin, const char *request, size_t len,
+                       char *buffer, size_t size, size_t *have, size_t *head_len) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int reused = 0;
+        int fd = attempt == 0 ? upstream_open(origin->host, origin->port, &reused)
+                              : upstream_connect(origin->host, origin->port, 0);
+        if (fd < 0)
+            return -1;
+        *have = 0;
+        *head_len = 0;
+        int ret = send_all(fd, request, len);
+        while (ret == 0 && *head_len == 0 && *have < size) {
+            ssize_t n = recv(fd, buffer + *have, size - *have, 0);
+            if (n <= 0)
+                break;
+            *head_len = http_head_length(buffer, *have + (size_t)n, *have);
+            *have += (size_t)n;
+        }
+        if (*head_len > 0)
+            return fd;
+        upstream_release(origin->host, origin->port, fd, 0);
+        if (!reused || *have > 0)
+            return -1;
+    }
+    return -1;
+}
+
+/*
+ * range_resume - Blocking fallback of range_send() once the head went out: the rest of the
+ * range, from state->next on, is relayed from the origin's answer to a request of its own,
+ * uncached. Returns 0 once it was all sent, -1 otherwise.
+ */
+static int range_resume(int client_fd, range_state *state, const range_origin *origin,
+                        size_t *sent, http_response *response) {
+    size_t size = origin->len + 64;
+    char *request = (char *)malloc(size);
+    if (!request) {
+        perror("malloc failed for range resume");
+        return -1;
+    }
+    size_t len = range_resume_request(state, origin, request, size);
+    char buffer[RANGE_HEAD_MAX];
+    size_t have = 0, head_len = 0;
+    int fd = len > 0 ? resume_head(origin, request, len, buffer, sizeof(buffer), &have,
+                                   &head_len) : -1;
+    free(request);
+    if (fd < 0)
+        return -1;
+
+    http_response r;
+    http_response_init(&r);
+    http_response_feed(&r, buffer, head_len);
+    int64_t skip = r.state != HTTP_HEAD ? range_resume_skip(state, &r) : -1;
+    const char *data = buffer + head_len;
+    size_t n = have - head_len;
+    int ret = skip < 0 ? -1 : 0;
+    while (ret == 0 && state->next < state->end) {
+        if (n == 0) {
+            ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+            if (received <= 0) {
+                ret = -1;
+                break;
+            }
+            data = buffer;
+            n = (size_t)received;
+        }
+        http_response_feed(&r, data, n);
+        size_t drop = (uint64_t)skip < n ? (size_t)skip : n;
+        skip -= (int64_t)drop;
+        data += drop;
+        n -= drop;
+        size_t out = state->end - state->next < n ? (size_t)(state->end - state->next) : n;
+        if (out > 0) {
+            if (send_all(client_fd, data, out) < 0) {
+                ret = -1;
+                break;
+            }
+            http_response_feed(response, data, out);
+            relay_count(RELAY_COPIED, out);
+            *sent += out;
+            state->next += out;
+        }
+        n = 0;
+    }
+    upstream_release(origin->host, origin->port, fd, ret == 0 && http_response_reusable(&r));
+    return ret;
+}
+
+/*
+ * send_slice - Sends the range, or what element holds of it, following the fill through flight
+ * (NULL for a complete element). If the range goes on past element, the next part is looked
+ * up into *ahead (and *ahead_flight) meanwhile, so its fetch overlaps this one being sent.
+ * Returns as range_send() does; 1 also once the head went out if element cannot supply its
+ * bytes, with state->next the first byte not sent.
+ */
+static int send_slice(int client_fd, range_state *state, const range_origin *origin,
+                      cache_element *element, cache_flight *flight, cache_element **ahead,
+                      cache_flight **ahead_flight, size_t *sent, http_response *response) {
+    char head[RANGE_HEAD_MAX];
+    size_t head_len, start = 0;
+    cache_cursor cursor;
+    cache_cursor_init(&cursor, element);
+
+    range_plan_result plan;
+    while ((plan = range_plan(state, element, &cursor, head, sizeof(head), &head_len,
+                              &start)) == RANGE_WAIT) {
+        if (!flight || cache_flight_wait(flight, atomic_load(&element->len)) == CACHE_ABORTED)
+            return 1;
+    }
+    if (plan == RANGE_WHOLE || plan == RANGE_FAILED)
+        return 1;
+    if (plan == RANGE_SLICE && range_more(state) && !*ahead)
+        range_lookup(state, origin, ahead, ahead_flight);
+    if (head_len > 0) {
+        if (send_all(client_fd, head, head_len) < 0)
+            return -1;
+        http_response_feed(response, head, head_len);
+        *sent += head_len;
+    }
+    if (plan == RANGE_UNSATISFIABLE)
+        return 0;
+
+    for (;;) {
+        if (cache_cursor_seek(&cursor, start)) {
+            if (relay_cursor(client_fd, &cursor, sent, response) < 0)
+                return -1;
+            if (cursor.offset == cursor.end)
+                return 0;
+        }
+        cache_fill_state fill = flight ? cache_flight_wait(flight, cursor.offset) : CACHE_COMPLETE;
+        // A complete element ending before the slice does was cut short
+        if (fill == CACHE_ABORTED ||
+            (fill == CACHE_COMPLETE && atomic_load(&element->len) <= cursor.offset)) {
+            range_rewind(state, &cursor, start);
+            return 1;
+        }
+    }
+}
+
+int range_send(int client_fd, range_state *state, const range_origin *origin,
+               cache_element *element, cache_flight *flight, size_t *sent,
+               http_response *response) {
+    int own = element == NULL;    // Parts looked up here are also released here
+    cache_element *ahead = NULL;  // Next part, looked up while the current one is sent
+    cache_flight *ahead_flight = NULL;
+    int ret = 1;
+    http_response_init(response);
+    *sent = 0;
+    for (;;) {
+        if (own && !element && range_lookup(state, origin, &element, &flight) == CACHE_LEADER)
+            break;
+        ret = send_slice(client_fd, state, origin, element, flight, &ahead, &ahead_flight, sent,
+                         response);
+        if (own) {
+            if (flight)
+                cache_flight_leave(flight);
+            cache_release(element);
+        }
+        if (ret != 0 || !range_more(state))
+            break;
+        own = 1;
+        element = ahead;
+        flight = ahead_flight;
+        ahead = NULL;
+        ahead_flight = NULL;
+        ret = 1;
+    }
+    if (ahead) {
+        if (ahead_flight)
+            cache_flight_leave(ahead_flight);
+        cache_release(ahead);
+    }
+    // A part missing once the head went out: the rest comes from the origin
+    if (ret > 0 && state->started)
+        ret = range_resume(client_fd, state, origin, sent, response);
+    return ret;
+}
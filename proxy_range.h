@@ -0,0 +1,150 @@
+#ifndef PROXY_RANGE_H
+#define PROXY_RANGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "proxy_cache.h"
+#include "proxy_http.h"
+
+#define RANGE_PART_SIZE  (1 << 20)   // Body bytes of a large response cached as one part
+#define RANGE_HEAD_MAX   8192        // Longest cached head a partial response is built from
+#define RANGE_UNSPLIT_TTL    300     // Seconds parts of a response the origin did not split are
+                                     // not asked for again
+#define RANGE_UNSPLIT_SLOTS  256     // Responses remembered as not split
+
+// --- Range Requests ---
+// A request for one byte range is answered with 206 Partial Content from the cached
+// response: a head built from the cached one, then the selected bytes straight from the
+// element, as it grows if it is still being filled. A response that is not cached whole
+// (it may be larger than an element may grow) is cached in parts instead, RANGE_PART_SIZE
+// body bytes each, fetched from the origin with a Range request of their own and cached
+// under a part key (see proxy_key.h). A request then only waits for the parts it selects
+// that are missing, which the part threads fetch (see proxy_refresh.h), the next one while
+// the current one is sent. Requests for the whole of such a response are sent its parts one
+// after another, and each part is evicted on its own, so only the parts in use take up
+// memory. A part that cannot be had once the head went out is not the end of the response:
+// the rest of it is relayed from the origin, uncached. Parts are only fetched of responses
+// whose origin says it serves byte ranges, and for a while not at all once it answered a
+// part's Range request with something else.
+
+typedef enum {
+    RANGE_WAIT,             // The element's head is not readable yet
+    RANGE_WHOLE,            // Nothing to slice: send the whole response instead
+    RANGE_SLICE,            // Send the head built, then the element from start to its limit
+    RANGE_UNSATISFIABLE,    // Send the 416 head built and nothing else
+    RANGE_FAILED            // The part does not continue the response begun; give up
+} range_plan_result;
+
+typedef struct range_state {
+    http_range range;               // Range asked for
+    uint64_t next;                  // Next body byte to send
+    uint64_t end;                   // One past the last body byte to send (once started)
+    int started;                    // The head has been built
+    int whole;                      // Sending the whole response, from its parts
+    char etag[HTTP_LINE_MAX];       // Validators of the first element sliced; later parts
+    time_t last_modified;           // must carry the same
+} range_state;
+
+// Where parts missing from the cache are fetched from
+typedef struct range_origin {
+    const char *key;                // Cache key of the whole response
+    const char *host;
+    int port;
+    const char *request;            // Request head to the origin (NUL-terminated)
+    size_t len;
+} range_origin;
+
+/*
+ * range_init - Registers the range stats.
+ */
+void range_init(void);
+
+/*
+ * range_request - Prepares state for the NUL-terminated request head. Returns 1 if it asks
+ * for a single byte range, 0 if the whole response is sent.
+ */
+int range_request(range_state *state, const char *head);
+
+/*
+ * range_more - Body bytes are left to send once the current element is done: they are in
+ * the following part.
+ */
+int range_more(const range_state *state);
+
+/*
+ * range_plan - Decides how the range is served from element, the whole response or the part
+ * of it holding state->next. The first time it also builds the head to send in head (size
+ * bytes of room, length in *head_len; 0 for later parts). For RANGE_SLICE, cursor (fresh from
+ * cache_cursor_init()) is limited to the end of the bytes to send from element and *start is
+ * where they begin.
+ */
+range_plan_result range_plan(range_state *state, cache_element *element, cache_cursor *cursor,
+                             char *head, size_t size, size_t *head_len, size_t *start);
+
+/*
+ * range_lookup - Looks up the part holding state->next, starting its fetch if it is missing.
+ * Returns CACHE_HIT or CACHE_FOLLOWER with *element (and *flight) as cache_lookup() would, or
+ * CACHE_LEADER with both NULL if the part cannot be had from the cache.
+ */
+cache_lookup_result range_lookup(const range_state *state, const range_origin *origin,
+                                 cache_element **element, cache_flight **flight);
+
+/*
+ * range_whole - For a request for the whole response that is not cached whole, as a response
+ * too large for one element is not: if its first part is cached, prepares state to send the
+ * whole response from its parts (as a 200) and returns that part as range_lookup() would.
+ * Otherwise returns CACHE_LEADER with *element and *flight NULL.
+ */
+cache_lookup_result range_whole(range_state *state, const range_origin *origin,
+                                cache_element **element, cache_flight **flight);
+
+/*
+ * range_seed - Called by a leader once it has relayed response uncached. If it was a 200 too
+ * large to be cached whole, from an origin that accepts byte ranges, the refresh threads
+ * fetch its first part, so that the following requests for it are served from parts.
+ */
+void range_seed(const range_origin *origin, const http_response *response);
+
+/*
+ * range_rewind - The slice range_plan() limited cursor to (starting at start) was cut short:
+ * moves state->next back to its first byte not sent.
+ */
+void range_rewind(range_state *state, const cache_cursor *cursor, size_t start);
+
+/*
+ * range_resume_request - For a range whose head went out but whose bytes from state->next on
+ * cannot be had from the cache: writes the request to the origin for them to out (size
+ * bytes). Returns its length, 0 if it does not fit.
+ */
+size_t range_resume_request(const range_state *state, const range_origin *origin, char *out,
+                            size_t size);
+
+/*
+ * range_resume_skip - Checks the head of the origin's answer to range_resume_request(), read
+ * by r. Returns how many bytes of its body come before state->next, or -1 if it cannot
+ * continue the response begun: its validators differ, or it does not hold those bytes.
+ */
+int64_t range_resume_skip(const range_state *state, const http_response *r);
+
+/*
+ * range_unsplit - Notes that the origin answered the Range request for the part cached under
+ * key with something other than that part: no parts of the response are fetched for the
+ * next RANGE_UNSPLIT_TTL seconds.
+ */
+void range_unsplit(const char *key);
+
+/*
+ * range_send - Blocking sender for the threaded server: sends the range to client_fd from
+ * element (borrowed, followed through flight if not NULL), or, with element NULL, from parts
+ * it looks up itself, then from the following parts as long as the range goes on, and from
+ * the origin if one of them cannot be had. Adds what was sent to *sent and feeds it to
+ * response. Returns 0 once done, -1 on an error, 1 if nothing was sent and the request is to
+ * be answered otherwise.
+ */
+int range_send(int client_fd, range_state *state, const range_origin *origin,
+               cache_element *element, cache_flight *flight, size_t *sent,
+               http_response *response);
+
+#endif
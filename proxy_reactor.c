@@ -0,0 +1,1325 @@
+#define _GNU_SOURCE   // accept4()
+
+#include "proxy_reactor.h"
+#include "proxy_cache.h"
+#include "proxy_listen.h"
+#include "proxy_http.h"
+#include "proxy_upstream.h"
+#include "proxy_resolver.h"
+#include "proxy_relay.h"
+#include "proxy_refresh.h"
+#include "proxy_range.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define REACTOR_BUFFER_SIZE  4096       // Request head limit, and bounce buffer for uncached bodies
+#define REACTOR_MAX_EVENTS   256        // Events handled per epoll_wait()
+#define REACTOR_IOV_MAX      16         // Cache segments gathered into one write to a client
+
+// --- Connection State Machine ---
+typedef enum {
+    CONN_READ_REQUEST,                  // Reading the (next) request head
+    CONN_SEND_CACHED,                   // Streaming a cached (or still filling) element
+    CONN_RESOLVING,                     // Waiting for the resolver to look up the upstream host
+    CONN_CONNECTING,                    // Non-blocking connect to the upstream in progress
+    CONN_SEND_UPSTREAM,                 // Writing the request upstream
+    CONN_RELAY,                         // Relaying (and filling) the upstream response
+    CONN_RESUME,                        // Relaying the rest of a range from the upstream
+    CONN_FLUSH,                         // Writing what is left (error page), then closing
+    CONN_CLOSED                         // Waiting to be freed by its loop
+} conn_state;
+
+// epoll data points at one of these, so one connection can register two sockets
+typedef enum {
+    HANDLE_LISTEN,
+    HANDLE_WAKE,
+    HANDLE_CLIENT,
+    HANDLE_UPSTREAM
+} handle_kind;
+
+typedef struct reactor_handle {
+    handle_kind kind;
+    void *owner;                        // reactor_loop or reactor_conn
+} reactor_handle;
+
+typedef struct reactor_loop reactor_loop;
+
+typedef struct reactor_conn {
+    reactor_loop *loop;                 // Loop that owns both sockets
+    conn_state state;
+    int client_fd;
+    int upstream_fd;                    // -1 until connecting, and again once released
+    int reused;                         // upstream_fd came from the upstream pool
+    resolver_query query;               // Address of the upstream host
+    atomic_int resolving;               // query is pending (cleared by its notification)
+    reactor_handle client_handle;
+    reactor_handle upstream_handle;
+    reactor_request request;            // Fetch plan from the server's prepare hook
+    arena scratch;                      // Holds request's strings; reset between requests
+    size_t upstream_sent;               // Bytes of request.upstream written
+
+    cache_element *element;             // Element being streamed (hit or follower), pinned
+    cache_flight *flight;               // Flight followed, or led when leader is set
+    int leader;                         // Fetching from the upstream ourselves
+    cache_cursor cursor;                // Position in element
+    cache_flight_watcher watcher;       // Wakes the connection when the followed fill grows
+    atomic_int watching;                // watcher is registered (cleared by its notification)
+    range_state range;                  // Byte range asked for
+    int ranged;                         // Sending only range (cleared to send the whole element)
+    int planned;                        // range_plan() has positioned cursor in element
+    int parts;                          // element is a part of the response (see proxy_range.h)
+    size_t slice_start;                 // Where the bytes of the range begin in element
+    cache_element *ahead;               // Next part, looked up while element is sent, pinned
+    cache_flight *ahead_flight;         // Its fill followed, if still in flight
+    int resuming;                       // The rest of the range comes from the upstream
+    uint64_t resume_skip;               // Upstream body bytes to drop before it
+    http_response resumed;              // Framing of the upstream's answer when resuming
+
+    const char *out;                    // Bytes waiting to be written to the client
+    size_t out_len;
+    size_t sent;                        // Bytes written to the client so far
+    size_t relayed;                     // Bytes received from the upstream so far
+    size_t held;                        // Head bytes received into the fill (or buffer, when
+                                        // resuming) not committed yet
+    int decided;                        // Whether the response is cacheable has been checked
+    int passthrough;                    // Not caching the response: its body is spliced
+    int revalidating;                   // Head held from the client too until it shows a 304
+    relay_pipe pipe;                    // Pipe the body is spliced through
+    http_response response;             // Framing of the response sent to the client
+    int keep_alive;                     // Client wants the connection kept after this request
+    int reusable;                       // The upstream connection can go back to the pool
+    int client_alive;                   // Cleared once a write to the client fails
+
+    int queued;                         // On loop->ready (guarded by loop->ready_lock)
+    struct reactor_conn *ready_next;    // Next connection on loop->ready
+    struct reactor_conn *dead_next;     // Next connection on loop->dead
+    struct reactor_conn *prev;          // Neighbours on loop->conns
+    struct reactor_conn *next;
+    uint64_t idle_since;                // When it started waiting for its current request
+
+    size_t in_len;                      // Bytes received from the client in in
+    size_t head_len;                    // Bytes of in forming the current head, 0 until complete
+    size_t searched;                    // Bytes of in already searched for the end of the head
+    char in[REACTOR_BUFFER_SIZE];       // Request head, possibly followed by pipelined requests
+    char buffer[REACTOR_BUFFER_SIZE];   // Error page or uncached response bytes
+} reactor_conn;
+
+// --- Event Loop ---
+struct reactor_loop {
+    int epoll_fd;
+    int wake_fd;                        // eventfd written when ready gains connections
+    int listen_fd;                      // Shared, or this loop's own SO_REUSEPORT listener
+    int cpu;                            // CPU index to pin the loop to, or -1
+    reactor_handle listen_handle;
+    reactor_handle wake_handle;
+    const reactor_handler *handler;
+    pthread_mutex_t ready_lock;         // Guards ready and every connection's queued flag
+    reactor_conn *ready;                // Connections whose followed fill made progress
+    reactor_conn *dead;                 // Closed connections, freed after the current batch
+    reactor_conn *conns;                // Open connections, checked for idling once a second
+    uint64_t last_sweep;                // When they were last checked
+    pthread_t thread;
+};
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * conn_queue - Queues the connection on its loop, clears *pending, the flag of the
+ * notification that queued it, and kicks the loop's eventfd. Safe from any thread. The flag
+ * is only cleared once the connection is queued, both under ready_lock: a loop that sees it
+ * cleared and closes the connection leaves it to loop_free_dead(), which then waits for the
+ * queue to be drained. Nothing of the connection is touched after the lock is released.
+ */
+static void conn_queue(reactor_conn *conn, atomic_int *pending) {
+    reactor_loop *loop = conn->loop;
+    pthread_mutex_lock(&loop->ready_lock);
+    int kick = !conn->queued;
+    if (kick) {
+        conn->queued = 1;
+        conn->ready_next = loop->ready;
+        loop->ready = conn;
+    }
+    atomic_store(pending, 0);
+    pthread_mutex_unlock(&loop->ready_lock);
+
+    if (kick) {
+        uint64_t one = 1;
+        if (write(loop->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            perror("Failed to wake event loop");
+    }
+}
+
+/*
+ * conn_wakeup - Watcher callback, run on the leader's thread.
+ */
+static void conn_wakeup(cache_flight_watcher *watcher) {
+    reactor_conn *conn = (reactor_conn *)((char *)watcher - offsetof(reactor_conn, watcher));
+    conn_queue(conn, &conn->watching);
+}
+
+/*
+ * conn_resolved - Resolver callback, run on a resolver thread.
+ */
+static void conn_resolved(resolver_query *query) {
+    reactor_conn *conn = (reactor_conn *)((char *)query - offsetof(reactor_conn, query));
+    conn_queue(conn, &conn->resolving);
+}
+
+/*
+ * conn_drop_ahead - Releases the part looked up ahead, if any.
+ */
+static void conn_drop_ahead(reactor_conn *conn) {
+    if (conn->ahead) {
+        if (conn->ahead_flight)
+            cache_flight_leave(conn->ahead_flight);
+        cache_release(conn->ahead);
+    }
+    conn->ahead = NULL;
+    conn->ahead_flight = NULL;
+}
+
+/*
+ * conn_close - Releases everything the connection holds. The memory itself is freed by the
+ * loop once no epoll event or ready-queue entry can still refer to it.
+ */
+static void conn_close(reactor_conn *conn) {
+    // If the watcher has fired already, the ready queue still refers to the connection and
+    // loop_free_dead() waits until it has been drained; if it is firing now, unwatching
+    // waits for it to return, and so to have queued the connection (see conn_queue())
+    if (atomic_load(&conn->watching))
+        cache_flight_unwatch(conn->flight, &conn->watcher);
+
+    if (conn->leader) {
+        cache_flight_complete(conn->flight, 0, 0);
+    } else if (conn->element) {
+        if (conn->flight)
+            cache_flight_leave(conn->flight);
+        cache_release(conn->element);
+    }
+    conn->flight = NULL;
+    conn->element = NULL;
+    conn_drop_ahead(conn);
+
+    close(conn->client_fd);
+    if (conn->upstream_fd >= 0)
+        close(conn->upstream_fd);
+    relay_pipe_close(&conn->pipe);
+    arena_destroy(&conn->scratch);
+
+    reactor_loop *loop = conn->loop;
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        loop->conns = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+
+    conn->state = CONN_CLOSED;
+    conn->dead_next = loop->dead;
+    loop->dead = conn;
+}
+
+/*
+ * conn_send_error - Switches to writing the server's error page for status, then closing.
+ */
+static int conn_send_error(reactor_conn *conn, int status) {
+    int len = conn->loop->handler->error_page(conn->buffer, sizeof(conn->buffer), status);
+    if (len <= 0 || conn->sent > 0)
+        return -1;
+    conn->out = conn->buffer;
+    conn->out_len = (size_t)len;
+    conn->state = CONN_FLUSH;
+    return 1;
+}
+
+/*
+ * conn_flush - Writes pending output to the client. Returns 1 once nothing is pending, 0 if
+ * the socket is full, -1 if the client is gone (pending output is dropped).
+ */
+static int conn_flush(reactor_conn *conn) {
+    while (conn->out_len > 0) {
+        ssize_t n = send(conn->client_fd, conn->out, conn->out_len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            conn->client_alive = 0;
+            conn->out_len = 0;
+            return -1;
+        }
+        conn->out += n;
+        conn->out_len -= (size_t)n;
+        conn->sent += (size_t)n;
+    }
+    return 1;
+}
+
+/*
+ * conn_finish - The response was sent in full. Goes back to reading requests if the client
+ * keeps the connection and could tell where the response ended; otherwise closes.
+ */
+static int conn_finish(reactor_conn *conn) {
+    if (!conn->keep_alive || !conn->client_alive || !http_response_reusable(&conn->response))
+        return -1;
+
+    if (conn->element) {
+        if (conn->flight)
+            cache_flight_leave(conn->flight);
+        cache_release(conn->element);
+    }
+    conn->element = NULL;
+    conn->flight = NULL;
+    conn->ranged = 0;
+    conn->planned = 0;
+    conn->parts = 0;
+    conn->resuming = 0;
+    conn_drop_ahead(conn);
+    arena_reset(&conn->scratch);
+    memset(&conn->request, 0, sizeof(conn->request));
+    conn->upstream_sent = 0;
+    conn->sent = 0;
+    conn->relayed = 0;
+    conn->out_len = 0;
+    conn->reused = 0;
+    conn->reusable = 0;
+
+    // Drop the head just answered; a pipelined request may already follow it
+    conn->in_len -= conn->head_len;
+    memmove(conn->in, conn->in + conn->head_len, conn->in_len);
+    conn->head_len = 0;
+    conn->searched = 0;
+    conn->idle_since = now_ms();
+    conn->state = CONN_READ_REQUEST;
+    return 1;
+}
+
+/*
+ * conn_origin - Where parts of the response asked for are fetched from.
+ */
+static range_origin conn_origin(reactor_conn *conn) {
+    range_origin origin = { conn->request.key, conn->request.host, conn->request.port,
+                            conn->request.upstream, conn->request.upstream_len };
+    return origin;
+}
+
+// --- Upstream ---
+
+/*
+ * conn_release_upstream - Done with the upstream connection: back to the pool if the whole
+ * response was read and the origin keeps it open, closed otherwise.
+ */
+static void conn_release_upstream(reactor_conn *conn, int reusable) {
+    epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_DEL, conn->upstream_fd, NULL);
+    upstream_release(conn->request.host, conn->request.port, conn->upstream_fd, reusable);
+    conn->upstream_fd = -1;
+}
+
+/*
+ * conn_serve_stale - The leader's revalidation failed and stale may stand in for the origin's
+ * answer: abandons the fill and the upstream connection, and sends stale instead.
+ */
+static int conn_serve_stale(reactor_conn *conn, cache_element *stale) {
+    cache_flight_complete(conn->flight, 0, 0);
+    conn->flight = NULL;
+    conn->leader = 0;
+    if (conn->upstream_fd >= 0)
+        conn_release_upstream(conn, 0);
+    relay_pipe_close(&conn->pipe);
+
+    conn->element = stale;
+    cache_cursor_init(&conn->cursor, stale);
+    http_response_init(&conn->response);
+    conn->state = CONN_SEND_CACHED;
+    return 1;
+}
+
+/*
+ * conn_upstream_failed - No upstream connection could be made, or the response broke off
+ * before any of it reached the client: abandons the fill and answers with the stale element
+ * being revalidated if it may stand in, else an error page.
+ */
+static int conn_upstream_failed(reactor_conn *conn) {
+    if (conn->resuming)
+        return -1;
+    cache_element *stale = conn->sent == 0 ? cache_fill_failed(conn->flight) : NULL;
+    if (stale)
+        return conn_serve_stale(conn, stale);
+    cache_flight_complete(conn->flight, 0, 0);
+    conn->flight = NULL;
+    conn->leader = 0;
+    return conn_send_error(conn, 500);
+}
+
+/*
+ * conn_watch_upstream - Registers the new upstream socket with the loop.
+ */
+static int conn_watch_upstream(reactor_conn *conn) {
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = &conn->upstream_handle;
+    if (epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_ADD, conn->upstream_fd, &event) < 0) {
+        perror("epoll_ctl failed for remote socket");
+        return conn_upstream_failed(conn);
+    }
+    conn->state = conn->reused ? CONN_SEND_UPSTREAM : CONN_CONNECTING;
+    return 1;
+}
+
+/*
+ * conn_connect - Takes a pooled upstream connection (if pooled is set and there is one), or
+ * looks up the host for a new one for a leader (flight may be NULL when the response will not
+ * be cached). A lookup that is not cached leaves the connection waiting in CONN_RESOLVING
+ * until a resolver thread queues it on the loop again.
+ */
+static int conn_connect(reactor_conn *conn, int pooled) {
+    // A resumed range goes on with the response already begun to the client
+    http_response_init(conn->resuming ? &conn->resumed : &conn->response);
+    conn->upstream_sent = 0;
+    conn->reused = 0;
+    conn->held = 0;
+    conn->decided = 0;
+    conn->passthrough = 0;
+    conn->revalidating = cache_fill_stale(conn->flight) != NULL;
+    if (pooled)
+        conn->upstream_fd = upstream_acquire(conn->request.host, conn->request.port);
+    if (conn->upstream_fd >= 0) {
+        conn->reused = 1;
+        if (set_nonblocking(conn->upstream_fd) < 0) {
+            perror("Failed to make remote socket non-blocking");
+            return conn_upstream_failed(conn);
+        }
+        return conn_watch_upstream(conn);
+    }
+
+    conn->query.notify = conn_resolved;
+    atomic_store(&conn->resolving, 1);
+    conn->state = CONN_RESOLVING;
+    if (resolver_start(conn->request.host, conn->request.port, &conn->query) == 0)
+        return 0;
+    atomic_store(&conn->resolving, 0);
+    return 1;
+}
+
+/*
+ * conn_resolving - Starts the non-blocking connect once the upstream host is known.
+ */
+static int conn_resolving(reactor_conn *conn) {
+    if (atomic_load(&conn->resolving))
+        return 0;
+    if (conn->query.status != 0) {
+        fprintf(stderr, "No such host exists: %s (%s)\n", conn->request.host,
+                gai_strerror(conn->query.status));
+        return conn_upstream_failed(conn);
+    }
+    conn->upstream_fd = upstream_connect_addr((struct sockaddr *)&conn->query.addr,
+                                              conn->query.addr_len, 1);
+    if (conn->upstream_fd < 0)
+        return conn_upstream_failed(conn);
+    return conn_watch_upstream(conn);
+}
+
+/*
+ * conn_retry - A pooled connection failed before any response byte arrived, most likely
+ * closed by the origin while idle: the request is sent again on a new connection.
+ */
+static int conn_retry(reactor_conn *conn) {
+    close(conn->upstream_fd);
+    conn->upstream_fd = -1;
+    return conn_connect(conn, 0);
+}
+
+static int conn_connecting(reactor_conn *conn) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(conn->upstream_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        err = errno;
+    if (err != 0) {
+        errno = err;
+        perror("Error connecting to remote server");
+        return conn_upstream_failed(conn);
+    }
+
+    struct sockaddr_storage peer;
+    len = sizeof(peer);
+    if (getpeername(conn->upstream_fd, (struct sockaddr *)&peer, &len) < 0)
+        return 0;  // Still in progress
+    conn->state = CONN_SEND_UPSTREAM;
+    return 1;
+}
+
+static int conn_send_upstream(reactor_conn *conn) {
+    while (conn->upstream_sent < conn->request.upstream_len) {
+        ssize_t n = send(conn->upstream_fd, conn->request.upstream + conn->upstream_sent,
+                         conn->request.upstream_len - conn->upstream_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (conn->reused)
+                return conn_retry(conn);
+            perror("Error sending request to remote server");
+            return conn_upstream_failed(conn);
+        }
+        conn->upstream_sent += (size_t)n;
+    }
+    conn->state = conn->resuming ? CONN_RESUME : CONN_RELAY;
+    return 1;
+}
+
+/*
+ * conn_revalidated - The origin answered the revalidation with a 304: the fill becomes a
+ * copy of the stale element, which is sent to the client instead.
+ */
+static int conn_revalidated(reactor_conn *conn) {
+    cache_element *stale = cache_fill_stale(conn->flight);
+    cache_retain(stale);
+    // A copy cut short is not published; the stale element is still sent
+    if (relay_revalidated(&conn->response, conn->flight) < 0)
+        cache_fill_abandon(conn->flight);
+    cache_flight_complete(conn->flight, 1, 1);
+    conn->flight = NULL;
+    conn->leader = 0;
+    conn_release_upstream(conn, conn->reusable);
+
+    conn->element = stale;
+    cache_cursor_init(&conn->cursor, stale);
+    http_response_init(&conn->response);
+    conn->state = CONN_SEND_CACHED;
+    return 1;
+}
+
+/*
+ * conn_relay - Event-driven relay_response(): the response is received straight into the
+ * cache element while filling, with the head held back from followers until it shows the
+ * response is cacheable; one whose head does not fit in the first segment is not cached. A
+ * response that is not cached has its body spliced from socket to socket, and anything else
+ * received into the connection's buffer. Nothing new is read until the previous chunk
+ * reached the client, and reading goes on after the client is gone only while the element
+ * is being filled. The upstream connection is released once the last chunk was flushed, as
+ * the element may be reclaimed when the flight completes. A revalidation holds the head
+ * back from the client as well, until it shows whether the stale element is to be sent
+ * instead.
+ */
+static int conn_relay(reactor_conn *conn) {
+    int flushed = conn_flush(conn);
+    if (flushed == 0)
+        return 0;
+    if (conn->pipe.held > 0 && conn->client_alive) {
+        int out = relay_splice_out(&conn->pipe, conn->client_fd);
+        if (out == 0)
+            return 0;
+        if (out < 0)
+            conn->client_alive = 0;
+    }
+
+    for (;;) {
+        if (http_response_done(&conn->response)) {
+            relay_pipe_close(&conn->pipe);
+            relay_dechunk(&conn->response, conn->flight);
+            if (!cache_flight_complete(conn->flight, 1, 1) && !conn->ranged) {
+                // One too large to cache whole is cached in parts for the requests that follow
+                range_origin origin = conn_origin(conn);
+                range_seed(&origin, &conn->response);
+            }
+            conn->flight = NULL;
+            conn->leader = 0;
+            conn_release_upstream(conn, conn->reusable);
+            return conn_finish(conn);
+        }
+
+        uint64_t opaque = http_response_opaque(&conn->response);
+        if (conn->passthrough && conn->client_alive && opaque > 0 &&
+            relay_pipe_usable(&conn->pipe)) {
+            ssize_t received = relay_splice_in(&conn->pipe, conn->upstream_fd, opaque);
+            if (received < 0 && errno == EINTR)
+                continue;
+            if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 0;
+            if (received == 0) {
+                if (!http_response_eof(&conn->response))
+                    break;
+                conn->reusable = 0;
+                continue;
+            }
+            if (received < 0)
+                break;
+            http_response_skip(&conn->response, (uint64_t)received);
+            conn->reusable = http_response_reusable(&conn->response);
+            conn->relayed += (size_t)received;
+            int out = relay_splice_out(&conn->pipe, conn->client_fd);
+            if (out == 0)
+                return 0;
+            if (out < 0)
+                conn->client_alive = 0;
+            continue;
+        }
+
+        size_t avail;
+        char *dest = cache_fill_reserve(conn->passthrough ? NULL : conn->flight, &avail);
+        int filling = dest != NULL;
+        if (!filling) {
+            conn->passthrough = 1;
+            conn->revalidating = 0;
+            if (!conn->client_alive)
+                break;
+            dest = conn->buffer;
+            avail = sizeof(conn->buffer);
+        } else if (conn->held > 0) {
+            // A head filling the whole segment is not cached, as in relay_response()
+            if (conn->held == avail) {
+                cache_fill_abandon(conn->flight);
+                conn->passthrough = 1;
+                if (conn->revalidating && conn->client_alive) {
+                    conn->out = dest;
+                    conn->out_len = conn->held;
+                }
+                conn->revalidating = 0;
+                conn->held = 0;
+                if (conn_flush(conn) == 0)
+                    return 0;
+                continue;
+            }
+            dest += conn->held;
+            avail -= conn->held;
+        }
+
+        ssize_t received = recv(conn->upstream_fd, dest, avail, 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (received <= 0 && conn->relayed == 0 && conn->reused)
+            return conn_retry(conn);
+        if (received == 0) {
+            // Publish the element only if the whole response was read
+            if (!http_response_eof(&conn->response) || conn->relayed == 0)
+                break;
+            conn->reusable = 0;
+            continue;
+        }
+        if (received < 0)
+            break;
+
+        size_t used = http_response_feed(&conn->response, dest, (size_t)received);
+        conn->reusable = used == (size_t)received && http_response_reusable(&conn->response);
+        const char *out = dest;
+        size_t out_len = used;
+        conn->relayed += used;
+        if (filling) {
+            conn->held += used;
+            if (conn->response.state != HTTP_HEAD) {
+                if (!conn->decided && conn->revalidating && http_response_failed(&conn->response)) {
+                    cache_element *stale = cache_fill_failed(conn->flight);
+                    if (stale)
+                        return conn_serve_stale(conn, stale);
+                }
+                if (!conn->decided && conn->revalidating && conn->response.status == 304)
+                    return conn_revalidated(conn);
+                if (!conn->decided) {
+                    conn->decided = 1;
+                    if (!relay_cacheable(&conn->response, conn->flight)) {
+                        cache_fill_abandon(conn->flight);
+                        conn->passthrough = 1;
+                    }
+                    if (conn->revalidating) {
+                        out = dest + used - conn->held;
+                        out_len = conn->held;
+                        conn->revalidating = 0;
+                    }
+                }
+                if (!conn->passthrough)
+                    cache_fill_commit(conn->flight, conn->held);
+                conn->held = 0;
+            } else if (conn->revalidating) {
+                out_len = 0;
+            }
+        }
+        relay_count(conn->passthrough ? RELAY_COPIED : RELAY_FILLED, used);
+        if (conn->client_alive && out_len > 0) {
+            conn->out = out;
+            conn->out_len = out_len;
+            if (conn_flush(conn) == 0)
+                return 0;
+        }
+    }
+
+    if (conn->sent == 0)
+        return conn_upstream_failed(conn);
+    cache_flight_complete(conn->flight, 0, 0);
+    conn->flight = NULL;
+    conn->leader = 0;
+    return -1;
+}
+
+/*
+ * conn_become_leader - A followed fill was abandoned before anything was sent: fetch on our
+ * own, uncached, unless it was a revalidation that found the origin failing and the stale
+ * element stands in.
+ */
+static int conn_become_leader(reactor_conn *conn) {
+    cache_flight_leave(conn->flight);
+    cache_release(conn->element);
+    conn->flight = NULL;
+    conn->element = cache_fallback(conn->request.key);
+    if (conn->element) {
+        cache_cursor_init(&conn->cursor, conn->element);
+        http_response_init(&conn->response);
+        return 1;
+    }
+    conn->leader = 1;
+    return conn_connect(conn, 1);
+}
+
+/*
+ * conn_resume - Relays the upstream's answer to the request conn_range_resume() made: its head
+ * is collected in the buffer and checked against the response begun, then the body bytes
+ * before the rest of the range are dropped and those of it sent, uncached. The upstream
+ * connection is kept only if its response ended with the range.
+ */
+static int conn_resume(reactor_conn *conn) {
+    if (conn_flush(conn) <= 0)
+        return conn->client_alive ? 0 : -1;
+    for (;;) {
+        if (conn->range.next == conn->range.end) {
+            conn->leader = 0;
+            conn_release_upstream(conn, conn->reusable);
+            return conn_finish(conn);
+        }
+        if (conn->held == sizeof(conn->buffer))
+            return -1;    // Head too long
+        char *dest = conn->buffer + conn->held;
+        ssize_t received = recv(conn->upstream_fd, dest, sizeof(conn->buffer) - conn->held, 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (received <= 0 && conn->relayed == 0 && conn->reused)
+            return conn_retry(conn);
+        if (received <= 0)
+            return -1;
+        conn->relayed += (size_t)received;
+
+        const char *data = dest;
+        size_t len = (size_t)received;
+        if (conn->resumed.state == HTTP_HEAD) {
+            size_t head_len = http_head_length(conn->buffer, conn->held + len, conn->held);
+            if (head_len == 0) {
+                conn->held += len;
+                continue;
+            }
+            http_response_feed(&conn->resumed, conn->buffer, head_len);
+            int64_t skip = conn->resumed.state != HTTP_HEAD
+                         ? range_resume_skip(&conn->range, &conn->resumed) : -1;
+            if (skip < 0)
+                return -1;
+            conn->resume_skip = (uint64_t)skip;
+            data = conn->buffer + head_len;
+            len = conn->held + len - head_len;
+            conn->held = 0;
+        }
+        size_t used = http_response_feed(&conn->resumed, data, len);
+        conn->reusable = used == len && http_response_reusable(&conn->resumed);
+        size_t drop = conn->resume_skip < len ? (size_t)conn->resume_skip : len;
+        conn->resume_skip -= drop;
+        data += drop;
+        len -= drop;
+        uint64_t left = conn->range.end - conn->range.next;
+        size_t out_len = left < len ? (size_t)left : len;
+        conn->range.next += out_len;
+        http_response_feed(&conn->response, data, out_len);
+        relay_count(RELAY_COPIED, out_len);
+        conn->out = data;
+        conn->out_len = out_len;
+        int flushed = conn_flush(conn);
+        if (flushed <= 0)
+            return flushed;
+    }
+}
+
+// --- Range Requests ---
+
+/*
+ * conn_range_blind - A range the cache cannot serve before anything was sent: the request
+ * goes to the upstream as it came, and the answer is relayed uncached.
+ */
+static int conn_range_blind(reactor_conn *conn) {
+    if (conn->element) {
+        if (conn->flight)
+            cache_flight_leave(conn->flight);
+        cache_release(conn->element);
+    }
+    conn->element = NULL;
+    conn->flight = NULL;
+    conn_drop_ahead(conn);
+    conn->ranged = 0;
+    conn->leader = 1;
+    return conn_connect(conn, 1);
+}
+
+/*
+ * conn_range_resume - The bytes of the range from conn->range.next on cannot be had from the
+ * cache, but its head went out: they are asked of the upstream with a request of their own,
+ * whose answer conn_resume() relays uncached.
+ */
+static int conn_range_resume(reactor_conn *conn) {
+    if (conn->element) {
+        if (conn->flight)
+            cache_flight_leave(conn->flight);
+        cache_release(conn->element);
+    }
+    conn->element = NULL;
+    conn->flight = NULL;
+    conn_drop_ahead(conn);
+
+    range_origin origin = conn_origin(conn);
+    size_t size = conn->request.upstream_len + 64;
+    char *request = (char *)arena_alloc(&conn->scratch, size);
+    size_t len = request ? range_resume_request(&conn->range, &origin, request, size) : 0;
+    if (len == 0)
+        return -1;
+    conn->request.upstream = request;
+    conn->request.upstream_len = len;
+    conn->resuming = 1;
+    conn->relayed = 0;
+    conn->leader = 1;
+    return conn_connect(conn, 1);
+}
+
+/*
+ * conn_range_cut - The element ended, or its fill was abandoned, before the slice planned
+ * from it was all sent: the rest of the range is resumed from the upstream.
+ */
+static int conn_range_cut(reactor_conn *conn) {
+    range_rewind(&conn->range, &conn->cursor, conn->slice_start);
+    return conn_range_resume(conn);
+}
+
+/*
+ * conn_range_part - Takes the part of the response holding the next byte of the range, as
+ * looked up ahead or looking it up now; a missing one is fetched by a part thread and
+ * followed as it fills.
+ */
+static int conn_range_part(reactor_conn *conn) {
+    range_origin origin = conn_origin(conn);
+    if (conn->ahead) {
+        conn->element = conn->ahead;
+        conn->flight = conn->ahead_flight;
+        conn->ahead = NULL;
+        conn->ahead_flight = NULL;
+    } else if (range_lookup(&conn->range, &origin, &conn->element, &conn->flight) ==
+               CACHE_LEADER) {
+        return conn->range.started ? conn_range_resume(conn) : conn_range_blind(conn);
+    }
+    conn->parts = 1;
+    conn->planned = 0;
+    cache_cursor_init(&conn->cursor, conn->element);
+    conn->state = CONN_SEND_CACHED;
+    return 1;
+}
+
+/*
+ * conn_range_next - The bytes of the range in element were sent: on to the next part, if
+ * the range goes on.
+ */
+static int conn_range_next(reactor_conn *conn) {
+    if (!range_more(&conn->range))
+        return conn_finish(conn);
+    if (conn->flight)
+        cache_flight_leave(conn->flight);
+    cache_release(conn->element);
+    conn->element = NULL;
+    conn->flight = NULL;
+    return conn_range_part(conn);
+}
+
+/*
+ * conn_range_plan - Positions the cursor on the bytes of the range in element, with the head
+ * (if this is the first element) queued as pending output. Waits for a followed fill until
+ * the element's head is readable. A response that cannot be sliced is sent whole, or for a
+ * part, fetched blind.
+ */
+static int conn_range_plan(reactor_conn *conn) {
+    for (;;) {
+        size_t head_len;
+        range_plan_result plan = range_plan(&conn->range, conn->element, &conn->cursor,
+                                            conn->buffer, sizeof(conn->buffer), &head_len,
+                                            &conn->slice_start);
+        switch (plan) {
+            case RANGE_WAIT:
+                if (!conn->flight)
+                    return -1;
+                atomic_store(&conn->watching, 1);
+                if (!cache_flight_watch(conn->flight, atomic_load(&conn->element->len),
+                                        &conn->watcher))
+                    return 0;
+                atomic_store(&conn->watching, 0);
+                continue;
+            case RANGE_WHOLE:
+                if (conn->range.started)
+                    return -1;
+                if (conn->parts)
+                    return conn_range_blind(conn);
+                conn->ranged = 0;
+                return 1;
+            case RANGE_FAILED:
+                return conn_range_resume(conn);
+            case RANGE_SLICE:
+            case RANGE_UNSATISFIABLE:
+                break;
+        }
+        conn->planned = 1;
+        // The next part is fetched while this one is sent
+        if (plan == RANGE_SLICE && range_more(&conn->range) && !conn->ahead) {
+            range_origin origin = conn_origin(conn);
+            range_lookup(&conn->range, &origin, &conn->ahead, &conn->ahead_flight);
+        }
+        if (head_len > 0) {
+            http_response_feed(&conn->response, conn->buffer, head_len);
+            conn->out = conn->buffer;
+            conn->out_len = head_len;
+        }
+        return 1;
+    }
+}
+
+// --- Cached Responses ---
+
+/*
+ * conn_send_cached - Writes straight from the element's segments, gathering up to
+ * REACTOR_IOV_MAX of them per sendmsg(). The cursor only moves past what the socket took, so
+ * a partial write resumes where it stopped once the client drains. For a range, the head
+ * built for it goes first and the cursor skips to the range before anything is sent.
+ */
+static int conn_send_cached(reactor_conn *conn) {
+    if (atomic_load(&conn->watching))
+        return 0;
+    if (conn->ranged && !conn->planned) {
+        int step = conn_range_plan(conn);
+        if (step <= 0 || conn->state != CONN_SEND_CACHED)
+            return step;
+    }
+    int flushed = conn_flush(conn);
+    if (flushed <= 0)
+        return flushed;
+
+    for (;;) {
+        struct iovec iov[REACTOR_IOV_MAX];
+        int count = 0;
+        if (!conn->ranged || cache_cursor_seek(&conn->cursor, conn->slice_start))
+            count = cache_cursor_peek(&conn->cursor, iov, REACTOR_IOV_MAX);
+        if (count > 0) {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = (size_t)count;
+            ssize_t n = sendmsg(conn->client_fd, &msg, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return 0;
+                conn->client_alive = 0;
+                return -1;
+            }
+            http_response_feed_iov(&conn->response, iov, (size_t)n);
+            cache_cursor_advance(&conn->cursor, (size_t)n);
+            relay_count(RELAY_HIT, (size_t)n);
+            conn->sent += (size_t)n;
+            continue;
+        }
+        if (conn->ranged && conn->cursor.offset == conn->cursor.end)
+            return conn_range_next(conn);
+        // A range still unsent when the element is complete was cut short
+        if (!conn->flight)
+            return conn->ranged ? conn_range_cut(conn) : conn_finish(conn);
+
+        cache_element *element = conn->element;
+        cache_fill_state state = atomic_load(&element->state);
+        if (state == CACHE_ABORTED && conn->ranged && conn->range.started)
+            return conn_range_cut(conn);
+        if (state == CACHE_ABORTED && (conn->sent > 0 || conn->range.started))
+            return -1;
+        if (state == CACHE_ABORTED)
+            return conn->parts ? conn_range_blind(conn) : conn_become_leader(conn);
+        if (state == CACHE_COMPLETE && conn->cursor.offset == atomic_load(&element->len))
+            return conn->ranged ? conn_range_cut(conn) : conn_finish(conn);
+        // Flag first: the notification may fire before cache_flight_watch() returns
+        atomic_store(&conn->watching, 1);
+        if (!cache_flight_watch(conn->flight, conn->cursor.offset, &conn->watcher))
+            return 0;
+        atomic_store(&conn->watching, 0);
+    }
+}
+
+// --- Request Head ---
+
+/*
+ * conn_conditional - Copies the upstream request into the scratch arena with the stale
+ * element's validators added. Without room for the copy, the client's own conditionals are
+ * still dropped in place and the request goes out unconditional.
+ */
+static void conn_conditional(reactor_conn *conn, const char *validators) {
+    size_t len = conn->request.upstream_len;
+    size_t size = len + strlen(validators) + 1;
+    char *upstream = (char *)arena_alloc(&conn->scratch, size);
+    if (!upstream) {
+        upstream = conn->request.upstream;
+        size = len + 1;
+    } else {
+        memcpy(upstream, conn->request.upstream, len);
+        upstream[len] = '\0';
+    }
+    conn->request.upstream = upstream;
+    conn->request.upstream_len = http_request_conditional(upstream, len, size, validators);
+}
+
+/*
+ * conn_start - Hands the complete head to the server, then serves it from the cache or
+ * becomes the leader of its fetch.
+ */
+static int conn_start(reactor_conn *conn) {
+    // The head is passed NUL-terminated; the byte after it may begin a pipelined request
+    char saved = conn->in[conn->head_len];
+    conn->in[conn->head_len] = '\0';
+    conn->keep_alive = http_request_keep_alive(conn->in);
+    const reactor_handler *handler = conn->loop->handler;
+    int status = handler->prepare(conn->in, conn->head_len, &conn->request, &conn->scratch);
+    conn->ranged = range_request(&conn->range, conn->in);
+    conn->in[conn->head_len] = saved;
+    if (status != 0)
+        return conn_send_error(conn, status);
+
+    // A request missing the whole response is served from its parts if they are cached; only
+    // one for the whole response that has none fetches it
+    http_response_init(&conn->response);
+    cache_lookup_result result = cache_lookup_cached(conn->request.key, &conn->element,
+                                                     &conn->flight);
+    if (!conn->ranged && result == CACHE_LEADER && !conn->flight) {
+        range_origin origin = conn_origin(conn);
+        result = range_whole(&conn->range, &origin, &conn->element, &conn->flight);
+        conn->ranged = conn->parts = result != CACHE_LEADER;
+        if (!conn->ranged)
+            result = cache_lookup(conn->request.key, &conn->element, &conn->flight);
+    }
+    if (result == CACHE_REFRESH) {
+        // Serve the stale element right away; a refresh thread revalidates it meanwhile
+        refresh_start(conn->flight, conn->request.host, conn->request.port,
+                      conn->request.upstream, conn->request.upstream_len);
+        conn->flight = NULL;
+    } else if (result == CACHE_LEADER && conn->ranged && !conn->flight) {
+        return conn_range_part(conn);
+    } else if (result == CACHE_LEADER) {
+        conn->element = NULL;
+        conn->leader = 1;
+        cache_element *stale = cache_fill_stale(conn->flight);
+        if (stale)
+            conn_conditional(conn, stale->validators ? stale->validators : "");
+        return conn_connect(conn, 1);
+    }
+    cache_cursor_init(&conn->cursor, conn->element);
+    conn->state = CONN_SEND_CACHED;
+    return 1;
+}
+
+/*
+ * conn_read_request - Starts on the next head as soon as it is complete in conn->in, which
+ * for a pipelined request can be before anything more is received. Only bytes received since
+ * the last search are searched for its end.
+ */
+static int conn_read_request(reactor_conn *conn) {
+    for (;;) {
+        conn->head_len = http_head_length(conn->in, conn->in_len, conn->searched);
+        if (conn->head_len > 0)
+            return conn_start(conn);
+        if (conn->in_len == sizeof(conn->in) - 1)
+            return conn_send_error(conn, 400);
+
+        conn->searched = conn->in_len;
+        ssize_t n = recv(conn->client_fd, conn->in + conn->in_len,
+                         sizeof(conn->in) - 1 - conn->in_len, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            perror("Error receiving from client");
+            return -1;
+        }
+        if (n == 0)
+            return -1;
+        conn->in_len += (size_t)n;
+    }
+}
+
+/*
+ * conn_run - Advances the connection until it has to wait for a socket or a followed fill.
+ * Each step returns 1 to keep going, 0 to wait, -1 to close.
+ */
+static void conn_run(reactor_conn *conn) {
+    int step = 1;
+    while (step > 0) {
+        switch (conn->state) {
+            case CONN_READ_REQUEST:  step = conn_read_request(conn); break;
+            case CONN_SEND_CACHED:   step = conn_send_cached(conn); break;
+            case CONN_RESOLVING:     step = conn_resolving(conn); break;
+            case CONN_CONNECTING:    step = conn_connecting(conn); break;
+            case CONN_SEND_UPSTREAM: step = conn_send_upstream(conn); break;
+            case CONN_RELAY:         step = conn_relay(conn); break;
+            case CONN_RESUME:        step = conn_resume(conn); break;
+            case CONN_FLUSH:         step = conn_flush(conn) == 0 ? 0 : -1; break;
+            case CONN_CLOSED:        return;
+        }
+    }
+    if (step < 0)
+        conn_close(conn);
+}
+
+// --- Event Loop ---
+
+static void loop_accept(reactor_loop *loop) {
+    for (;;) {
+        int fd = accept4(loop->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("Error in accepting connection");
+            return;
+        }
+        client_socket_init(fd);
+
+        reactor_conn *conn = (reactor_conn *)calloc(1, sizeof(reactor_conn));
+        if (!conn) {
+            perror("calloc failed for connection");
+            close(fd);
+            continue;
+        }
+        conn->loop = loop;
+        conn->client_fd = fd;
+        conn->upstream_fd = -1;
+        conn->client_alive = 1;
+        conn->client_handle.kind = HANDLE_CLIENT;
+        conn->client_handle.owner = conn;
+        conn->upstream_handle.kind = HANDLE_UPSTREAM;
+        conn->upstream_handle.owner = conn;
+        conn->watcher.notify = conn_wakeup;
+        relay_pipe_init(&conn->pipe);
+        arena_init(&conn->scratch, 0);
+        conn->idle_since = now_ms();
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = &conn->client_handle;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            perror("epoll_ctl failed for client socket");
+            close(fd);
+            free(conn);
+            continue;
+        }
+        conn->next = loop->conns;
+        if (conn->next)
+            conn->next->prev = conn;
+        loop->conns = conn;
+    }
+}
+
+/*
+ * loop_sweep_idle - Once a second, closes the connections that have been waiting for a
+ * request longer than the keep-alive timeout.
+ */
+static void loop_sweep_idle(reactor_loop *loop) {
+    uint64_t timeout = (uint64_t)loop->handler->keepalive_timeout * 1000;
+    uint64_t now = now_ms();
+    if (timeout == 0 || now - loop->last_sweep < 1000)
+        return;
+    loop->last_sweep = now;
+
+    reactor_conn *conn = loop->conns;
+    while (conn) {
+        reactor_conn *next = conn->next;
+        if (conn->state == CONN_READ_REQUEST && now - conn->idle_since >= timeout)
+            conn_close(conn);
+        conn = next;
+    }
+}
+
+/*
+ * loop_drain_ready - Resumes the connections whose followed fill made progress.
+ */
+static void loop_drain_ready(reactor_loop *loop) {
+    uint64_t count;
+    while (read(loop->wake_fd, &count, sizeof(count)) > 0)
+        ;
+
+    pthread_mutex_lock(&loop->ready_lock);
+    reactor_conn *conn = loop->ready;
+    loop->ready = NULL;
+    for (reactor_conn *c = conn; c; c = c->ready_next)
+        c->queued = 0;
+    pthread_mutex_unlock(&loop->ready_lock);
+
+    while (conn) {
+        reactor_conn *next = conn->ready_next;
+        conn_run(conn);
+        conn = next;
+    }
+}
+
+/*
+ * loop_free_dead - Frees the connections closed during the last batch of events, except
+ * those a fill notification has queued meanwhile; they go at the next batch.
+ */
+static void loop_free_dead(reactor_loop *loop) {
+    reactor_conn **link = &loop->dead;
+    pthread_mutex_lock(&loop->ready_lock);
+    while (*link) {
+        reactor_conn *conn = *link;
+        if (conn->queued) {
+            link = &conn->dead_next;
+        } else {
+            *link = conn->dead_next;
+            free(conn);
+        }
+    }
+    pthread_mutex_unlock(&loop->ready_lock);
+}
+
+static void *loop_main(void *arg) {
+    reactor_loop *loop = (reactor_loop *)arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    if (loop->cpu >= 0)
+        pin_thread(loop->cpu);
+
+    for (;;) {
+        int n = epoll_wait(loop->epoll_fd, events, REACTOR_MAX_EVENTS,
+                           loop->handler->keepalive_timeout > 0 ? 1000 : -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait failed");
+            return NULL;
+        }
+        for (int i = 0; i < n; i++) {
+            reactor_handle *handle = (reactor_handle *)events[i].data.ptr;
+            switch (handle->kind) {
+                case HANDLE_LISTEN:
+                    loop_accept(loop);
+                    break;
+                case HANDLE_WAKE:
+                    loop_drain_ready(loop);
+                    break;
+                case HANDLE_CLIENT:
+                case HANDLE_UPSTREAM:
+                    conn_run((reactor_conn *)handle->owner);
+                    break;
+            }
+        }
+        loop_sweep_idle(loop);
+        loop_free_dead(loop);
+    }
+}
+
+static int loop_init(reactor_loop *loop, int listen_fd, int shared, int cpu,
+                     const reactor_handler *handler) {
+    memset(loop, 0, sizeof(*loop));
+    loop->listen_fd = listen_fd;
+    loop->cpu = cpu;
+    loop->handler = handler;
+    loop->listen_handle.kind = HANDLE_LISTEN;
+    loop->listen_handle.owner = loop;
+    loop->wake_handle.kind = HANDLE_WAKE;
+    loop->wake_handle.owner = loop;
+    pthread_mutex_init(&loop->ready_lock, NULL);
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->epoll_fd < 0 || loop->wake_fd < 0) {
+        perror("Failed to create event loop");
+        return -1;
+    }
+
+    // Loops sharing a listening socket use EPOLLEXCLUSIVE so a connection wakes only one
+    struct epoll_event event;
+    event.events = shared ? EPOLLIN | EPOLLEXCLUSIVE : EPOLLIN;
+    event.data.ptr = &loop->listen_handle;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) < 0) {
+        perror("epoll_ctl failed for listening socket");
+        return -1;
+    }
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = &loop->wake_handle;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &event) < 0) {
+        perror("epoll_ctl failed for eventfd");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * reactor_run - Sets up every loop before starting any, so a failure leaves nothing running.
+ * The calling thread pins itself last so the loops it starts inherit its full affinity.
+ */
+int reactor_run(const int *listen_fds, int listen_count, int loop_count, int pin,
+                const reactor_handler *handler) {
+    if (listen_count < 1)
+        return -1;
+    int shared = listen_count == 1;
+    if (!shared)
+        loop_count = listen_count;
+    else if (loop_count <= 0)
+        loop_count = online_cpus();
+    for (int i = 0; i < listen_count; i++) {
+        if (set_nonblocking(listen_fds[i]) < 0) {
+            perror("Failed to make listening socket non-blocking");
+            return -1;
+        }
+    }
+
+    reactor_loop *loops = (reactor_loop *)calloc((size_t)loop_count, sizeof(reactor_loop));
+    if (!loops) {
+        perror("calloc failed for event loops");
+        return -1;
+    }
+    for (int i = 0; i < loop_count; i++) {
+        if (loop_init(&loops[i], listen_fds[shared ? 0 : i], shared, pin ? i : -1, handler) < 0)
+            return -1;
+    }
+    for (int i = 1; i < loop_count; i++) {
+        if (pthread_create(&loops[i].thread, NULL, loop_main, &loops[i]) != 0) {
+            perror("Failed to start event loop");
+            return -1;
+        }
+    }
+    printf("Serving with %d event loop(s), %s\n", loop_count,
+           shared ? "one shared listener" : "one SO_REUSEPORT listener each");
+    loop_main(&loops[0]);
+    return -1;
+}
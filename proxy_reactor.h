@@ -0,0 +1,48 @@
+#ifndef PROXY_REACTOR_H
+#define PROXY_REACTOR_H
+
+#include <stddef.h>
+
+#include "proxy_arena.h"
+
+// --- Upstream Fetch Plan ---
+// Filled in by the server's prepare hook from a complete request head. Every string is
+// allocated from the connection's arena, which is reset once the response has been sent.
+typedef struct reactor_request {
+    char *key;                  // Cache key
+    const char *host;           // Upstream host name or address
+    int port;                   // Upstream port
+    char *upstream;             // Request to send upstream
+    size_t upstream_len;        // Bytes of upstream
+} reactor_request;
+
+// --- Server Hooks ---
+typedef struct reactor_handler {
+    /*
+     * prepare - Turns the request head (NUL-terminated, len bytes) into a fetch plan whose
+     * strings come from scratch. Returns 0, or an HTTP status to answer with instead.
+     */
+    int (*prepare)(const char *head, size_t len, reactor_request *request, arena *scratch);
+
+    /*
+     * error_page - Formats the response for status into buf. Returns its length, or -1 to
+     * just close the connection.
+     */
+    int (*error_page)(char *buf, size_t size, int status);
+
+    int keepalive_timeout;      // Seconds a client may take to send its next request (0 = no limit)
+} reactor_handler;
+
+/*
+ * reactor_run - Serves clients with edge-triggered epoll loops, each driving its clients and
+ * their upstream sockets through read request -> cache lookup -> upstream fetch -> write
+ * response without blocking, then back to read request while the client keeps the connection
+ * (pipelined requests are answered in order). With a single listener, loop_count loops (0 = one per online
+ * CPU) share it; with several, each loop accepts from its own. With pin set, the i-th loop is
+ * bound to the i-th CPU. The calling thread runs the first loop. Returns -1 if the loops
+ * could not be started; otherwise it does not return.
+ */
+int reactor_run(const int *listen_fds, int listen_count, int loop_count, int pin,
+                const reactor_handler *handler);
+
+#endif
@@ -0,0 +1,198 @@
+#include "proxy_refresh.h"
+#include "proxy_http.h"
+#include "proxy_relay.h"
+#include "proxy_upstream.h"
+#include "proxy_stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+typedef struct refresh_job {
+    struct refresh_job *next;           // Next job waiting for a refresh thread
+    cache_flight *flight;
+    const char *host;                   // Stored after the request
+    int port;
+    size_t len;                         // Request bytes
+    char request[];                     // Conditional request head, then the host name
+} refresh_job;
+
+// Jobs waiting for the threads of one queue
+typedef struct refresh_queue {
+    pthread_mutex_t lock;               // Guards the jobs and queued
+    pthread_cond_t jobs_ready;
+    refresh_job *jobs_head, *jobs_tail;
+    int queued;
+    int max;                            // Jobs that may wait; more are dropped (0 = no limit)
+    int threads;
+
+    // Counters shown in the stats
+    atomic_ulong started;               // Jobs queued
+    atomic_ulong refreshed;             // Completed with a response read in full
+    atomic_ulong failed;                // The origin could not be reached or failed
+    atomic_ulong timed_out;             // ...of which it hung past the timeout
+    atomic_ulong dropped;               // Not queued: the queue was full
+} refresh_queue;
+
+// Stale elements revalidated in the background, and parts of large responses
+static refresh_queue refreshes = { .lock = PTHREAD_MUTEX_INITIALIZER,
+                                   .jobs_ready = PTHREAD_COND_INITIALIZER,
+                                   .max = REFRESH_QUEUE_MAX };
+static refresh_queue parts = { .lock = PTHREAD_MUTEX_INITIALIZER,
+                               .jobs_ready = PTHREAD_COND_INITIALIZER };
+static int origin_timeout;                  // Seconds without progress before the origin fails
+
+/*
+ * refresh - Leads the flight without a client, retrying once if a pooled connection turns
+ * out to have been closed by the origin. Only an origin that sent no answer, or stopped
+ * answering for the timeout, counts as failing here; relay_response() deals with the server
+ * errors it does send.
+ */
+static void refresh(refresh_queue *queue, refresh_job *job) {
+    http_response response;
+    size_t relayed = 0;
+    int ret = -1, hung = 0;
+    http_response_init(&response);
+    for (int attempt = 0; attempt < 2 && ret < 0 && relayed == 0; attempt++) {
+        int reused = 0;
+        int fd = upstream_open_timed(job->host, job->port, origin_timeout, &reused);
+        if (fd < 0)
+            break;
+        errno = 0;
+        if (send_all(fd, job->request, job->len) == 0)
+            ret = relay_response(fd, -1, job->flight, &relayed, &response);
+        hung = ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        int reusable = ret == 0 && http_response_reusable(&response) &&
+                       upstream_set_timeout(fd, 0) == 0;
+        upstream_release(job->host, job->port, fd, reusable);
+        if (!reused || hung)
+            break;
+    }
+
+    if (hung)
+        atomic_fetch_add(&queue->timed_out, 1);
+    if (ret < 0 && (hung || response.state == HTTP_HEAD || http_response_failed(&response))) {
+        cache_element *stale = cache_fill_failed(job->flight);
+        if (stale)
+            cache_release(stale);
+        atomic_fetch_add(&queue->failed, 1);
+    } else if (ret == 0) {
+        atomic_fetch_add(&queue->refreshed, 1);
+    }
+    cache_flight_complete(job->flight, ret == 0, 1);
+}
+
+static void *refresh_main(void *arg) {
+    refresh_queue *queue = (refresh_queue *)arg;
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        while (!queue->jobs_head)
+            pthread_cond_wait(&queue->jobs_ready, &queue->lock);
+        refresh_job *job = queue->jobs_head;
+        queue->jobs_head = job->next;
+        if (!queue->jobs_head)
+            queue->jobs_tail = NULL;
+        queue->queued--;
+        pthread_mutex_unlock(&queue->lock);
+
+        refresh(queue, job);
+        free(job);
+    }
+    return NULL;
+}
+
+static void dump_queue(FILE *out, refresh_queue *queue, const char *name) {
+    pthread_mutex_lock(&queue->lock);
+    int waiting = queue->queued;
+    pthread_mutex_unlock(&queue->lock);
+    fprintf(out, "%s threads: %d, queued now: %d\n", name, queue->threads, waiting);
+    fprintf(out, "  started %lu, refreshed %lu, failed %lu (timed out %lu), dropped %lu\n",
+            atomic_load(&queue->started), atomic_load(&queue->refreshed),
+            atomic_load(&queue->failed), atomic_load(&queue->timed_out),
+            atomic_load(&queue->dropped));
+}
+
+static void refresh_dump_stats(FILE *out, void *arg) {
+    dump_queue(out, &refreshes, "refresh");
+    dump_queue(out, &parts, "part");
+}
+
+static int start_threads(refresh_queue *queue, int count) {
+    queue->threads = count;
+    for (int i = 0; i < count; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, refresh_main, queue) != 0) {
+            perror("Failed to start refresh thread");
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+    return 0;
+}
+
+int refresh_init(int thread_count, int timeout) {
+    origin_timeout = timeout > 0 ? timeout : 0;
+    if (start_threads(&refreshes, thread_count > 0 ? thread_count : REFRESH_THREADS) < 0 ||
+        start_threads(&parts, REFRESH_PART_THREADS) < 0)
+        return -1;
+    stats_register("refresh", refresh_dump_stats, NULL);
+    return 0;
+}
+
+/*
+ * queue_job - The request is copied, made conditional, together with the host name into one
+ * allocation freed by the thread that takes the job.
+ */
+static int queue_job(refresh_queue *queue, cache_flight *flight, const char *host, int port,
+                     const char *request, size_t len) {
+    cache_element *stale = cache_fill_stale(flight);
+    const char *validators = stale && stale->validators ? stale->validators : "";
+    size_t size = len + strlen(validators) + 1;
+    size_t host_size = strlen(host) + 1;
+    refresh_job *job = (refresh_job *)malloc(sizeof(refresh_job) + size + host_size);
+    if (!job) {
+        perror("malloc failed for refresh");
+        cache_flight_complete(flight, 0, 0);
+        return -1;
+    }
+    memcpy(job->request, request, len);
+    job->request[len] = '\0';
+    job->len = http_request_conditional(job->request, len, size, validators);
+    memcpy(job->request + size, host, host_size);
+    job->host = job->request + size;
+    job->port = port;
+    job->flight = flight;
+    job->next = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->max > 0 && queue->queued >= queue->max) {
+        pthread_mutex_unlock(&queue->lock);
+        free(job);
+        atomic_fetch_add(&queue->dropped, 1);
+        cache_flight_complete(flight, 0, 0);
+        return -1;
+    }
+    if (queue->jobs_tail)
+        queue->jobs_tail->next = job;
+    else
+        queue->jobs_head = job;
+    queue->jobs_tail = job;
+    queue->queued++;
+    pthread_cond_signal(&queue->jobs_ready);
+    pthread_mutex_unlock(&queue->lock);
+    atomic_fetch_add(&queue->started, 1);
+    return 0;
+}
+
+int refresh_start(cache_flight *flight, const char *host, int port, const char *request,
+                  size_t len) {
+    return queue_job(&refreshes, flight, host, port, request, len);
+}
+
+int refresh_part(cache_flight *flight, const char *host, int port, const char *request,
+                 size_t len) {
+    return queue_job(&parts, flight, host, port, request, len);
+}
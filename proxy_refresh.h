@@ -0,0 +1,48 @@
+#ifndef PROXY_REFRESH_H
+#define PROXY_REFRESH_H
+
+#include <stddef.h>
+
+#include "proxy_cache.h"
+
+#define REFRESH_THREADS    2      // Default threads refreshing stale elements
+#define REFRESH_QUEUE_MAX  256    // Refreshes waiting for a thread; more are dropped
+#define REFRESH_TIMEOUT    10     // Default seconds a refresh waits on a silent origin
+#define REFRESH_PART_THREADS 8    // Threads fetching parts of large responses
+
+// --- Background Refresh ---
+// A stale element inside its stale-while-revalidate window is served as it is, and the
+// lookup that found it hands the fetch revalidating it (CACHE_REFRESH) to one of a small pool
+// of threads, so no client waits for the origin. The refresh leads the flight like any other
+// leader, only without a client to relay to. The parts of large responses that range
+// requests find missing (see proxy_range.h) are fetched the same way, by threads of their
+// own, so they never queue behind refreshes or get dropped.
+
+/*
+ * refresh_init - Starts thread_count refresh threads (0 = REFRESH_THREADS) and
+ * REFRESH_PART_THREADS part threads, and registers the refresh stats. A refresh gives up on
+ * an origin that accepts no connection, or sends or takes nothing, for timeout seconds (0 = no
+ * limit), and counts it as failing, so the stale element may stand in for it. Call it before
+ * refresh_start(). Returns 0, or -1 on failure.
+ */
+int refresh_init(int thread_count, int timeout);
+
+/*
+ * refresh_start - Queues the fetch of flight, revalidating its stale element if it has one:
+ * request (len bytes, NUL-terminated) is sent to host:port with the element's validators
+ * added. Takes over flight, which is completed once the response is read, or right away if
+ * the queue is full. Returns 0 if the refresh was queued, -1 otherwise.
+ */
+int refresh_start(cache_flight *flight, const char *host, int port, const char *request,
+                  size_t len);
+
+/*
+ * refresh_part - refresh_start() for the fetch of a part of a large response, on the queue of
+ * the part threads. It is never dropped, however many are waiting: each is one a client is
+ * about to read, or the first part of a response just relayed, so there are only as many as
+ * requests in progress.
+ */
+int refresh_part(cache_flight *flight, const char *host, int port, const char *request,
+                 size_t len);
+
+#endif
@@ -0,0 +1,523 @@
+#define _GNU_SOURCE   // splice(), pipe2()
+
+#include "proxy_relay.h"
+#include "proxy_http.h"
+#include "proxy_key.h"
+#include "proxy_range.h"
+#include "proxy_stats.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define RELAY_BUFFER_SIZE 4096    // Bounce buffer used when the response is not being cached
+#define RELAY_IOV_MAX     16      // Cache segments gathered into one send of a cached response
+#define RELAY_HEAD_MAX    8192    // Longest head of a chunked response that is stored de-chunked
+
+static atomic_ulong relay_bytes[RELAY_PATHS];
+static int64_t default_while_revalidate = RELAY_STALE_WHILE_REVALIDATE;
+static int64_t default_if_error = RELAY_STALE_IF_ERROR;
+
+static void relay_dump_stats(FILE *out, void *arg) {
+    fprintf(out, "bytes filled %lu, copied %lu, spliced %lu, sent from cache %lu\n",
+            atomic_load(&relay_bytes[RELAY_FILLED]), atomic_load(&relay_bytes[RELAY_COPIED]),
+            atomic_load(&relay_bytes[RELAY_SPLICED]), atomic_load(&relay_bytes[RELAY_HIT]));
+}
+
+void relay_init(int stale_while_revalidate, int stale_if_error) {
+    default_while_revalidate = stale_while_revalidate > 0 ? stale_while_revalidate : 0;
+    default_if_error = stale_if_error > 0 ? stale_if_error : 0;
+    stats_register("relay", relay_dump_stats, NULL);
+}
+
+void relay_count(relay_path path, size_t n) {
+    atomic_fetch_add_explicit(&relay_bytes[path], n, memory_order_relaxed);
+}
+
+int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/*
+ * fill_freshness - Records in the fill until when the response whose head was just read
+ * stays fresh: its lifetime less the time it already spent in caches. A response that says
+ * nothing about its freshness (a 304 may not) keeps what previous, the element it updates,
+ * was stored with, or is stale at once without one. The stale windows come from the
+ * response's directives, or the defaults; must-revalidate and no-cache rule out serving it
+ * stale other than on error, and s-maxage rules out the defaults, which it is meant to pin
+ * down for shared caches.
+ */
+static void fill_freshness(const http_response *response, cache_flight *flight,
+                           const cache_element *previous, const char *validators) {
+    time_t now = time(NULL);
+    cache_freshness freshness = { 0, 0, 0, 0 };
+    int64_t lifetime = http_response_lifetime(response, now);
+    if (lifetime < 0 && previous) {
+        freshness = previous->freshness;
+        lifetime = freshness.lifetime;
+    } else {
+        int strict = response->must_revalidate || response->no_cache;
+        int defaults = !strict && response->s_maxage < 0;
+        if (lifetime < 0)
+            lifetime = 0;
+        if (strict)
+            freshness.while_revalidate = 0;
+        else if (response->stale_while_revalidate >= 0)
+            freshness.while_revalidate = response->stale_while_revalidate;
+        else
+            freshness.while_revalidate = defaults ? default_while_revalidate : 0;
+        if (response->stale_if_error >= 0)
+            freshness.if_error = response->stale_if_error;
+        else
+            freshness.if_error = defaults ? default_if_error : 0;
+    }
+    freshness.lifetime = lifetime;
+    freshness.fresh_until = (int64_t)now + lifetime - http_response_age(response, now);
+    cache_fill_freshness(flight, &freshness, validators);
+}
+
+int relay_cacheable(const http_response *response, cache_flight *flight) {
+    const char *key = cache_fill_key(flight);
+    uint64_t first;
+    int storable;
+    if (cache_key_part_first(key, &first)) {
+        storable = http_response_storable_part(response, first);
+        // The origin sent the whole response, or some other range, instead of the part
+        if (response->status == 200 ||
+            (response->status == 206 && response->range_first != (int64_t)first))
+            range_unsplit(key);
+    } else {
+        storable = http_response_storable(response);
+    }
+    if (!storable || !cache_key_vary_matches(key, response->vary))
+        return 0;
+    if (response->content_length >= 0 && !cache_fill_fits(flight, (uint64_t)response->content_length))
+        return 0;
+
+    char validators[HTTP_VALIDATORS_MAX];
+    http_response_validators(response, validators, sizeof(validators));
+    fill_freshness(response, flight, NULL, validators);
+    return 1;
+}
+
+int relay_revalidated(const http_response *response, cache_flight *flight) {
+    cache_element *stale = cache_fill_stale(flight);
+    cache_cursor cursor;
+    const char *data;
+    size_t n;
+    cache_cursor_init(&cursor, stale);
+    while ((n = cache_cursor_next(&cursor, &data)) > 0) {
+        if (cache_fill_append(flight, data, n) < 0)
+            return -1;
+    }
+
+    char validators[HTTP_VALIDATORS_MAX];
+    if (http_response_validators(response, validators, sizeof(validators)) == 0)
+        snprintf(validators, sizeof(validators), "%s", stale->validators ? stale->validators : "");
+    fill_freshness(response, flight, stale, validators);
+    return 0;
+}
+
+size_t relay_head(cache_element *element, char *head, size_t size) {
+    cache_cursor cursor;
+    const char *data;
+    size_t len = 0, n, head_len = 0;
+    cache_cursor_init(&cursor, element);
+    while (head_len == 0 && len < size - 1 && (n = cache_cursor_next(&cursor, &data)) > 0) {
+        if (n > size - 1 - len)
+            n = size - 1 - len;
+        memcpy(head + len, data, n);
+        head_len = http_head_length(head, len + n, len);
+        len += n;
+    }
+    head[head_len] = '\0';
+    return head_len;
+}
+
+/*
+ * dechunk_body - Walks the chunked response in element, adding the data of its chunks to the
+ * flight's copy if copy is set. Framing lines are fed to the framer a byte at a time, chunk
+ * data is skipped over. Returns the body length, or -1 if the response is not complete or
+ * the copy was dropped.
+ */
+static int64_t dechunk_body(cache_flight *flight, cache_element *element, int copy) {
+    cache_cursor cursor;
+    http_response r;
+    const char *data;
+    size_t n;
+    uint64_t length = 0;
+    cache_cursor_init(&cursor, element);
+    http_response_init(&r);
+    while (!http_response_done(&r) && (n = cache_cursor_next(&cursor, &data)) > 0) {
+        while (n > 0 && !http_response_done(&r)) {
+            uint64_t opaque = http_response_opaque(&r);
+            size_t k = 1;
+            if (opaque > 0) {
+                k = opaque < n ? (size_t)opaque : n;
+                if (copy && cache_fill_rewrite(flight, data, k) < 0)
+                    return -1;
+                http_response_skip(&r, k);
+                length += k;
+            } else {
+                http_response_feed(&r, data, 1);
+            }
+            data += k;
+            n -= k;
+        }
+    }
+    return http_response_done(&r) ? (int64_t)length : -1;
+}
+
+/*
+ * relay_dechunk - Two passes over the element: the first finds the body's length for the
+ * head, the second copies the chunks' data after it.
+ */
+int relay_dechunk(const http_response *response, cache_flight *flight) {
+    if (!flight || !response->chunked || !http_response_done(response))
+        return 0;
+    // Nothing to rewrite if the response is not being cached
+    cache_element *element = cache_fill_element(flight);
+    if (atomic_load(&element->state) == CACHE_ABORTED)
+        return 0;
+    char stored[RELAY_HEAD_MAX], head[RELAY_HEAD_MAX];
+    if (relay_head(element, stored, sizeof(stored)) == 0)
+        return -1;
+    int64_t length = dechunk_body(flight, element, 0);
+    if (length < 0)
+        return -1;
+
+    char framing[64];
+    snprintf(framing, sizeof(framing), "Content-Length: %lld\r\n", (long long)length);
+    size_t head_len = http_head_reframe(head, sizeof(head), stored, NULL, framing);
+    if (head_len == 0 || cache_fill_rewrite(flight, head, head_len) < 0)
+        return -1;
+    if (dechunk_body(flight, element, 1) < 0) {
+        cache_fill_rewrite_cancel(flight);
+        return -1;
+    }
+    return 0;
+}
+
+int relay_stale(int client_fd, cache_flight *flight, http_response *response) {
+    cache_element *stale = cache_fill_failed(flight);
+    if (!stale)
+        return -1;
+    size_t sent;
+    http_response_init(response);
+    if (client_fd >= 0 && relay_cached(client_fd, stale, NULL, &sent, response) < 0)
+        perror("Error sending data to client");
+    cache_release(stale);
+    return 0;
+}
+
+/*
+ * relay_response - Receives into the cache element in place, holding back the head from
+ * followers until it shows the response is cacheable, and not caching one whose head does
+ * not fit in the first segment; falls back to splicing (or, if that is not possible, a
+ * stack buffer) once there is no fill. Bytes past the end of the response are dropped and
+ * keep the connection from being reused. A revalidation also holds the head back from the
+ * client, which gets the stale element instead of a 304; that needs the head to fit in the
+ * first segment, as anything larger has been forwarded by the time the status is known.
+ */
+int relay_response(int remote_fd, int client_fd, cache_flight *flight, size_t *relayed,
+                   http_response *response) {
+    char buffer[RELAY_BUFFER_SIZE];
+    relay_pipe pipe;
+    int client_alive = client_fd >= 0;
+    int decided = 0;            // Whether the response is cacheable has been checked
+    size_t held = 0;            // Head bytes received into the fill but not committed yet
+    cache_element *stale = cache_fill_stale(flight);  // Revalidating it: held from the client
+    int ret = -1;
+    ssize_t received;
+
+    relay_pipe_init(&pipe);
+    http_response_init(response);
+    *relayed = 0;
+    while (!http_response_done(response)) {
+        // Not caching: body bytes go from socket to socket through the pipe
+        uint64_t opaque = http_response_opaque(response);
+        if (!flight && client_alive && opaque > 0 && relay_pipe_usable(&pipe)) {
+            received = relay_splice_in(&pipe, remote_fd, opaque);
+            if (received < 0 && errno == EINTR)
+                continue;
+            if (received == 0) {
+                ret = http_response_eof(response) ? 0 : -1;
+                break;
+            }
+            if (received < 0)
+                break;
+            http_response_skip(response, (uint64_t)received);
+            *relayed += (size_t)received;
+            if (relay_splice_out(&pipe, client_fd) < 0) {
+                perror("Error sending data to client");
+                break;
+            }
+            continue;
+        }
+
+        size_t avail;
+        char *dest = cache_fill_reserve(flight, &avail);
+        int filling = dest != NULL;
+        if (!filling) {
+            flight = NULL;
+            stale = NULL;
+            dest = buffer;
+            avail = sizeof(buffer);
+        } else if (held > 0) {
+            // A head filling the whole segment is not cached: followers never see it, since
+            // whether the response may be cached is only known once the head is complete
+            if (held == avail) {
+                if (stale && client_alive && send_all(client_fd, dest, held) < 0)
+                    client_alive = 0;
+                cache_fill_abandon(flight);
+                flight = NULL;
+                stale = NULL;
+                held = 0;
+                continue;
+            }
+            dest += held;
+            avail -= held;
+        }
+
+        received = recv(remote_fd, dest, avail, 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received == 0) {
+            ret = http_response_eof(response) && *relayed > 0 ? 0 : -1;
+            break;
+        }
+        if (received < 0)
+            break;
+        size_t used = http_response_feed(response, dest, (size_t)received);
+        if (used < (size_t)received)
+            response->keep_alive = 0;
+        *relayed += used;
+        const char *out = dest;
+        size_t out_len = used;
+        if (filling) {
+            held += used;
+            if (response->state != HTTP_HEAD) {
+                if (!decided && stale && http_response_failed(response)) {
+                    // Answer with the stale element instead of the error while it may
+                    http_response served;
+                    if (relay_stale(client_alive ? client_fd : -1, flight, &served) == 0) {
+                        cache_fill_abandon(flight);
+                        response->keep_alive = 0;
+                        break;
+                    }
+                }
+                if (!decided && stale && response->status == 304) {
+                    // The 304 head is overwritten by a copy of the stale element; a copy cut
+                    // short is not published, though the stale element is still served
+                    if (relay_revalidated(response, flight) < 0)
+                        cache_fill_abandon(flight);
+                    http_response served;
+                    size_t sent;
+                    http_response_init(&served);
+                    if (client_alive && relay_cached(client_fd, stale, NULL, &sent, &served) < 0)
+                        perror("Error sending data to client");
+                    if (!http_response_reusable(&served))
+                        response->keep_alive = 0;
+                    break;
+                }
+                if (!decided) {
+                    decided = 1;
+                    if (!relay_cacheable(response, flight)) {
+                        cache_fill_abandon(flight);
+                        flight = NULL;
+                    }
+                    if (stale) {
+                        out = dest + used - held;
+                        out_len = held;
+                        stale = NULL;
+                    }
+                }
+                if (flight)
+                    cache_fill_commit(flight, held);
+                held = 0;
+            } else if (stale) {
+                out_len = 0;
+            }
+        }
+        relay_count(flight ? RELAY_FILLED : RELAY_COPIED, used);
+
+        if (client_alive && out_len > 0 && send_all(client_fd, out, out_len) < 0) {
+            perror("Error sending data to client");
+            client_alive = 0;
+        }
+        // Nobody is left to read the rest of the response
+        if (!client_alive && !flight)
+            break;
+    }
+    if (http_response_done(response)) {
+        relay_dechunk(response, flight);
+        ret = 0;
+    }
+    relay_pipe_close(&pipe);
+    return ret;
+}
+
+/*
+ * relay_cursor - Sends straight from the element's segments, up to RELAY_IOV_MAX of them per
+ * sendmsg(); a partial send only advances the cursor by what went out.
+ */
+int relay_cursor(int client_fd, cache_cursor *cursor, size_t *sent, http_response *response) {
+    struct iovec iov[RELAY_IOV_MAX];
+    int count;
+    while ((count = cache_cursor_peek(cursor, iov, RELAY_IOV_MAX)) > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (size_t)count;
+        ssize_t n = sendmsg(client_fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        http_response_feed_iov(response, iov, (size_t)n);
+        cache_cursor_advance(cursor, (size_t)n);
+        relay_count(RELAY_HIT, (size_t)n);
+        *sent += (size_t)n;
+    }
+    return 0;
+}
+
+int relay_cached(int client_fd, cache_element *element, cache_flight *flight, size_t *sent,
+                 http_response *response) {
+    cache_cursor cursor;
+    cache_cursor_init(&cursor, element);
+
+    http_response_init(response);
+    *sent = 0;
+    for (;;) {
+        if (relay_cursor(client_fd, &cursor, sent, response) < 0)
+            return -1;
+        if (!flight)
+            return 0;
+
+        cache_fill_state state = cache_flight_wait(flight, cursor.offset);
+        if (state == CACHE_ABORTED)
+            return -1;
+        if (state == CACHE_COMPLETE && cursor.offset == atomic_load(&element->len))
+            return 0;
+    }
+}
+
+// --- Pass-Through ---
+
+void relay_pipe_init(relay_pipe *pipe) {
+    pipe->fds[0] = pipe->fds[1] = -1;
+    pipe->held = 0;
+    pipe->unusable = 0;
+}
+
+/*
+ * relay_pipe_usable - The pipe itself is non-blocking, but splice() calls do not pass
+ * SPLICE_F_NONBLOCK, so each socket's own O_NONBLOCK decides whether they wait for it.
+ */
+int relay_pipe_usable(relay_pipe *pipe) {
+    if (pipe->fds[0] < 0 && !pipe->unusable && pipe2(pipe->fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        perror("Failed to create pipe for pass-through");
+        pipe->fds[0] = pipe->fds[1] = -1;
+        pipe->unusable = 1;
+    }
+    return !pipe->unusable;
+}
+
+ssize_t relay_splice_in(relay_pipe *pipe, int fd, uint64_t max) {
+    size_t len = max < RELAY_PIPE_SIZE ? (size_t)max : RELAY_PIPE_SIZE;
+    ssize_t n = splice(fd, NULL, pipe->fds[1], NULL, len, SPLICE_F_MOVE);
+    if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        relay_pipe_close(pipe);
+        pipe->unusable = 1;
+        errno = EINTR;
+        return -1;
+    }
+    if (n > 0) {
+        pipe->held += (size_t)n;
+        relay_count(RELAY_SPLICED, (size_t)n);
+    }
+    return n;
+}
+
+int relay_splice_out(relay_pipe *pipe, int fd) {
+    while (pipe->held > 0) {
+        ssize_t n = splice(pipe->fds[0], NULL, fd, NULL, pipe->held, SPLICE_F_MOVE);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        pipe->held -= (size_t)n;
+    }
+    return 1;
+}
+
+void relay_pipe_close(relay_pipe *pipe) {
+    if (pipe->fds[0] >= 0) {
+        close(pipe->fds[0]);
+        close(pipe->fds[1]);
+    }
+    pipe->fds[0] = pipe->fds[1] = -1;
+    pipe->held = 0;
+}
+
+void client_reader_init(client_reader *reader, int fd) {
+    reader->fd = fd;
+    reader->len = 0;
+    reader->head_len = 0;
+    reader->saved = '\0';
+}
+
+ssize_t client_read_head(client_reader *reader) {
+    size_t searched = 0;
+    for (;;) {
+        size_t head = http_head_length(reader->buffer, reader->len, searched);
+        if (head > 0) {
+            reader->head_len = head;
+            reader->saved = reader->buffer[head];
+            reader->buffer[head] = '\0';
+            return (ssize_t)head;
+        }
+        if (reader->len == sizeof(reader->buffer) - 1)
+            return -1;
+
+        searched = reader->len;
+        ssize_t n = recv(reader->fd, reader->buffer + reader->len,
+                         sizeof(reader->buffer) - 1 - reader->len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            return 0;
+        reader->len += (size_t)n;
+    }
+}
+
+int client_next(client_reader *reader) {
+    reader->buffer[reader->head_len] = reader->saved;
+    reader->len -= reader->head_len;
+    memmove(reader->buffer, reader->buffer + reader->head_len, reader->len);
+    reader->head_len = 0;
+    return reader->len > 0;
+}
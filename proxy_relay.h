@@ -0,0 +1,186 @@
+#ifndef PROXY_RELAY_H
+#define PROXY_RELAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "proxy_cache.h"
+#include "proxy_http.h"
+
+#define RELAY_STALE_WHILE_REVALIDATE  0     // Default seconds a stale response is served while
+                                            // refreshed in the background
+#define RELAY_STALE_IF_ERROR          300   // Default seconds a stale response is served while
+                                            // the origin fails
+
+// --- Byte Counters ---
+// Response bytes by the path they took, shown in the "relay" stats section.
+typedef enum {
+    RELAY_FILLED,       // Received from the origin into a cache element being filled
+    RELAY_COPIED,       // Received from the origin into a bounce buffer
+    RELAY_SPLICED,      // Passed from the origin to the client through a pipe
+    RELAY_HIT,          // Sent to a client from a cache element
+    RELAY_PATHS
+} relay_path;
+
+/*
+ * relay_init - Sets for how many seconds past their freshness lifetime responses are served
+ * while refreshed, and while their origin fails, unless they say otherwise with the
+ * stale-while-revalidate and stale-if-error directives (RFC 5861). Registers the relay stats.
+ */
+void relay_init(int stale_while_revalidate, int stale_if_error);
+
+/*
+ * relay_count - Adds n bytes to the counter of path.
+ */
+void relay_count(relay_path path, size_t n);
+
+/*
+ * send_all - Keeps calling send() until all len bytes are written. Returns 0, or -1 on error.
+ */
+int send_all(int fd, const char *data, size_t len);
+
+/*
+ * relay_response - Streams the origin response on remote_fd to client_fd as it arrives. With a
+ * flight, each chunk is received straight into the growing cache element and forwarded from
+ * there, so followers can stream it too; the caller completes the flight afterwards. The
+ * fill is abandoned as soon as the head shows the response cannot be cached (see
+ * relay_cacheable()). Body bytes that are not cached are spliced through a pipe without
+ * entering user space. Reading continues after the client goes away as long as the element
+ * is still being filled; client_fd is -1 for a fill nobody waits on. If the flight
+ * revalidates a stale element and the origin answers 304, the client is sent the stale
+ * element and the fill becomes a copy of it; if it answers with a server error the stale
+ * element may stand in for (see cache_fill_failed()), that is sent and the fill abandoned.
+ * Returns 0 once the whole response was read (its end found from Content-Length, chunked
+ * encoding, or the origin closing), -1 otherwise; *relayed is set to the number of bytes
+ * received from the origin. response is left with its framing:
+ * http_response_reusable() tells whether remote_fd can carry another request, and whether
+ * the client could tell where the response ended.
+ */
+int relay_response(int remote_fd, int client_fd, cache_flight *flight, size_t *relayed,
+                   http_response *response);
+
+/*
+ * relay_cacheable - Checked once the head of a response being filled has been read, before
+ * any of it is published to followers, so abandoning the fill lets them fetch on their own:
+ * 0 for responses a shared cache may not store (see http_response_storable(); a part
+ * fetched on its own, see proxy_range.h, must be the 206 for it),
+ * Content-Lengths over the element limit, and a Vary naming other request fields than the
+ * flight's key carries (see proxy_key.h). Otherwise records in the fill how long the
+ * response stays fresh and its validators, and returns 1.
+ */
+int relay_cacheable(const http_response *response, cache_flight *flight);
+
+/*
+ * relay_revalidated - Called instead of relay_cacheable() when the origin answered the
+ * flight's revalidation with the 304 whose head is in response, nothing of it committed:
+ * fills the element with a copy of the stale one, fresh for the 304's lifetime (or, if it
+ * gives none, the one the stale element was stored with) and keeping its validators unless
+ * the 304 sends new ones. Returns 0, or -1 if the copy could not be completed: the caller
+ * then abandons the fill rather than publish a truncated body.
+ */
+int relay_revalidated(const http_response *response, cache_flight *flight);
+
+/*
+ * relay_dechunk - Called by the leader once a response has been filled in full. A chunked
+ * response is stored de-chunked: the cache keeps a copy whose head frames the body by
+ * Content-Length, without the chunk framing or trailer fields, so hits are smaller and byte
+ * ranges of it can be served (see proxy_range.h). Followers are not affected. Returns 0, or
+ * -1 if the copy could not be made and the response is stored as received.
+ */
+int relay_dechunk(const http_response *response, cache_flight *flight);
+
+/*
+ * relay_head - Copies the head at the start of element to head (size bytes of room) and
+ * NUL-terminates it. Returns its length, or 0 if it is not all readable (yet) or too long.
+ */
+size_t relay_head(cache_element *element, char *head, size_t size);
+
+/*
+ * relay_cached - Sends element to client_fd. If flight is set the element is still being
+ * filled by the leader and is followed until the fill completes. Returns 0 once the whole
+ * element was sent, -1 on a send error or an aborted fill; *sent is set to the bytes sent and
+ * response to the framing of what was sent.
+ */
+int relay_cached(int client_fd, cache_element *element, cache_flight *flight, size_t *sent,
+                 http_response *response);
+
+/*
+ * relay_cursor - Sends to client_fd what cursor can read so far, advancing it, feeding it to
+ * response and adding it to *sent. Returns 0, or -1 on a send error.
+ */
+int relay_cursor(int client_fd, cache_cursor *cursor, size_t *sent, http_response *response);
+
+/*
+ * relay_stale - Called when the fetch of flight failed before anything was sent to client_fd.
+ * If the flight revalidates a stale element that may stand in for the origin's answer (see
+ * cache_fill_failed()), sends it. Returns 0 if it did, -1 otherwise; response is set as by
+ * relay_cached().
+ */
+int relay_stale(int client_fd, cache_flight *flight, http_response *response);
+
+// --- Pass-Through ---
+// A pipe for splice()ing a response body from the origin socket to the client socket.
+#define RELAY_PIPE_SIZE 65536      // Bytes spliced into the pipe at a time (default capacity)
+
+typedef struct relay_pipe {
+    int fds[2];                     // Read and write end, -1 until first needed
+    size_t held;                    // Bytes in the pipe not written out yet
+    int unusable;                   // pipe2() or splice() failed: copy instead
+} relay_pipe;
+
+void relay_pipe_init(relay_pipe *pipe);
+
+/*
+ * relay_pipe_usable - Opens the pipe on first use. Returns 0 if splicing is not possible
+ * and the bytes have to be copied instead.
+ */
+int relay_pipe_usable(relay_pipe *pipe);
+
+/*
+ * relay_splice_in - Moves up to max bytes from fd into the (empty) pipe. Returns the count,
+ * 0 on EOF, or -1 with errno set: EAGAIN if a non-blocking fd has nothing yet, EINTR also
+ * when splicing turned out to be unsupported (the pipe is then unusable; retry by copying).
+ */
+ssize_t relay_splice_in(relay_pipe *pipe, int fd, uint64_t max);
+
+/*
+ * relay_splice_out - Writes what the pipe holds to fd. Returns 1 once the pipe is empty, 0 if
+ * a non-blocking fd is full, -1 on error.
+ */
+int relay_splice_out(relay_pipe *pipe, int fd);
+
+/*
+ * relay_pipe_close - Closes the pipe, discarding what it still holds.
+ */
+void relay_pipe_close(relay_pipe *pipe);
+
+// --- Client Requests ---
+// Reads request heads from a client connection one at a time. Bytes past the current head
+// (a pipelined request) stay buffered for the next one.
+#define CLIENT_BUFFER_SIZE 4096
+
+typedef struct client_reader {
+    int fd;
+    size_t len;                        // Bytes buffered
+    size_t head_len;                   // Bytes of the current head, 0 until one is read
+    char saved;                        // Byte the head's NUL terminator replaced
+    char buffer[CLIENT_BUFFER_SIZE];
+} client_reader;
+
+void client_reader_init(client_reader *reader, int fd);
+
+/*
+ * client_read_head - Receives until a complete request head is buffered, unless one already
+ * is. The head starts at reader->buffer and is NUL-terminated in place. Returns its length,
+ * 0 if the client closed the connection first, -1 on error or a head too large to buffer.
+ */
+ssize_t client_read_head(client_reader *reader);
+
+/*
+ * client_next - Drops the current head. Returns 1 if bytes of a further request are
+ * already buffered.
+ */
+int client_next(client_reader *reader);
+
+#endif
@@ -0,0 +1,332 @@
+#include "proxy_resolver.h"
+#include "proxy_stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#define RESOLVER_BUCKETS      256   // Hash buckets of cached hosts
+#define RESOLVER_MAX_ENTRIES  1024  // Cached hosts; the least recently used goes beyond this
+#define RESOLVER_MAX_ADDRS    4     // Addresses kept per host, handed out in turn
+#define RESOLVER_HOT_HITS     2     // Uses since the last lookup that make a host worth prefetching
+
+// --- Cached Hosts ---
+typedef struct resolver_entry {
+    struct resolver_entry *next;        // Next entry in the bucket
+    struct resolver_entry *job_next;    // Next entry waiting for a resolver thread
+    char *host;
+    int resolved;                       // status and addrs hold an answer
+    int resolving;                      // Queued for or being looked up by a resolver thread
+    int status;                         // 0, or the getaddrinfo() error of the last lookup
+    uint64_t expires;                   // Monotonic milliseconds when the answer goes stale
+    uint64_t last_used;
+    unsigned long hits;                 // Uses since the last lookup
+    unsigned rotate;                    // Next address to hand out
+    int count;                          // Entries used in addrs
+    struct sockaddr_storage addrs[RESOLVER_MAX_ADDRS];
+    socklen_t addr_lens[RESOLVER_MAX_ADDRS];
+    resolver_query *waiters;            // Queries waiting for the lookup in progress
+} resolver_entry;
+
+// One lock covers the table and the job queue: it is taken once per upstream connect, never
+// across a lookup
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_ready = PTHREAD_COND_INITIALIZER;
+static resolver_entry *buckets[RESOLVER_BUCKETS];
+static resolver_entry *jobs_head, *jobs_tail;
+static int entry_count;
+static uint64_t ttl_ms = RESOLVER_TTL * 1000;
+static uint64_t negative_ttl_ms = RESOLVER_NEGATIVE_TTL * 1000;
+static int threads;
+
+// Counters shown in the stats
+static atomic_ulong hits;                   // Answered from the cache
+static atomic_ulong negative_hits;          // Answered with a cached failure
+static atomic_ulong misses;                 // Had to wait for a lookup
+static atomic_ulong lookups;                // getaddrinfo() calls
+static atomic_ulong failures;               // Lookups that failed
+static atomic_ulong prefetches;             // Lookups started before the entry expired
+static atomic_ulong evictions;              // Entries dropped to make room
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static resolver_entry **bucket_for(const char *host) {
+    uint64_t hash = 14695981039346656037ULL;    // FNV-1a
+    for (const unsigned char *p = (const unsigned char *)host; *p; p++)
+        hash = (hash ^ *p) * 1099511628211ULL;
+    return &buckets[hash % RESOLVER_BUCKETS];
+}
+
+static void set_port(struct sockaddr_storage *addr, int port) {
+    if (addr->ss_family == AF_INET)
+        ((struct sockaddr_in *)addr)->sin_port = htons((uint16_t)port);
+    else if (addr->ss_family == AF_INET6)
+        ((struct sockaddr_in6 *)addr)->sin6_port = htons((uint16_t)port);
+}
+
+/*
+ * answer - Copies entry's answer into query, rotating through its addresses. Lock held.
+ */
+static void answer(resolver_entry *entry, resolver_query *query) {
+    query->status = entry->status;
+    if (entry->status != 0)
+        return;
+    int i = (int)(entry->rotate++ % (unsigned)entry->count);
+    query->addr = entry->addrs[i];
+    query->addr_len = entry->addr_lens[i];
+    set_port(&query->addr, query->port);
+}
+
+// Lock held
+static void enqueue(resolver_entry *entry) {
+    entry->resolving = 1;
+    entry->job_next = NULL;
+    if (jobs_tail)
+        jobs_tail->job_next = entry;
+    else
+        jobs_head = entry;
+    jobs_tail = entry;
+    pthread_cond_signal(&jobs_ready);
+}
+
+/*
+ * make_room - Drops expired entries, and if the table is still full the least recently used
+ * one. Entries being looked up stay. Lock held.
+ */
+static void make_room(uint64_t now) {
+    resolver_entry **victim = NULL;
+    for (int i = 0; i < RESOLVER_BUCKETS; i++) {
+        resolver_entry **link = &buckets[i];
+        while (*link) {
+            resolver_entry *entry = *link;
+            if (!entry->resolving && now >= entry->expires) {
+                *link = entry->next;
+                free(entry->host);
+                free(entry);
+                entry_count--;
+                atomic_fetch_add(&evictions, 1);
+                continue;
+            }
+            // Entries before it are never unlinked any more, so its link stays valid
+            if (!entry->resolving && (!victim || entry->last_used < (*victim)->last_used))
+                victim = link;
+            link = &entry->next;
+        }
+    }
+    if (entry_count >= RESOLVER_MAX_ENTRIES && victim) {
+        resolver_entry *entry = *victim;
+        *victim = entry->next;
+        free(entry->host);
+        free(entry);
+        entry_count--;
+        atomic_fetch_add(&evictions, 1);
+    }
+}
+
+/*
+ * resolve - Runs one lookup outside the lock, then answers every query that waited for it.
+ * Notifications are sent after the lock is dropped; a query may be gone once notified.
+ */
+static void resolve(resolver_entry *entry) {
+    struct addrinfo hints, *result = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    atomic_fetch_add(&lookups, 1);
+    int status = getaddrinfo(entry->host, NULL, &hints, &result);
+    if (status != 0)
+        atomic_fetch_add(&failures, 1);
+
+    pthread_mutex_lock(&lock);
+    entry->resolved = 1;
+    entry->resolving = 0;
+    entry->status = status;
+    entry->count = 0;
+    entry->hits = 0;
+    for (struct addrinfo *ai = result; ai && entry->count < RESOLVER_MAX_ADDRS; ai = ai->ai_next) {
+        if (ai->ai_addrlen > sizeof(struct sockaddr_storage))
+            continue;
+        memcpy(&entry->addrs[entry->count], ai->ai_addr, ai->ai_addrlen);
+        entry->addr_lens[entry->count] = ai->ai_addrlen;
+        entry->count++;
+    }
+    if (status == 0 && entry->count == 0)
+        entry->status = EAI_NONAME;
+    entry->expires = now_ms() + (entry->status == 0 ? ttl_ms : negative_ttl_ms);
+    resolver_query *waiters = entry->waiters;
+    entry->waiters = NULL;
+    for (resolver_query *query = waiters; query; query = query->next)
+        answer(entry, query);
+    pthread_mutex_unlock(&lock);
+    if (result)
+        freeaddrinfo(result);
+
+    while (waiters) {
+        resolver_query *next = waiters->next;
+        waiters->notify(waiters);
+        waiters = next;
+    }
+}
+
+static void *resolver_main(void *arg) {
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (!jobs_head)
+            pthread_cond_wait(&jobs_ready, &lock);
+        resolver_entry *entry = jobs_head;
+        jobs_head = entry->job_next;
+        if (!jobs_head)
+            jobs_tail = NULL;
+        pthread_mutex_unlock(&lock);
+
+        resolve(entry);
+    }
+    return NULL;
+}
+
+static void resolver_dump_stats(FILE *out, void *arg) {
+    pthread_mutex_lock(&lock);
+    int count = entry_count;
+    pthread_mutex_unlock(&lock);
+    fprintf(out, "threads: %d, ttl: %llu s, negative ttl: %llu s, cached hosts: %d\n", threads,
+            (unsigned long long)(ttl_ms / 1000), (unsigned long long)(negative_ttl_ms / 1000), count);
+    fprintf(out, "  hits %lu, negative hits %lu, misses %lu, lookups %lu, failures %lu, "
+            "prefetches %lu, evictions %lu\n",
+            atomic_load(&hits), atomic_load(&negative_hits), atomic_load(&misses),
+            atomic_load(&lookups), atomic_load(&failures), atomic_load(&prefetches),
+            atomic_load(&evictions));
+}
+
+int resolver_init(int thread_count, int ttl) {
+    threads = thread_count > 0 ? thread_count : RESOLVER_THREADS;
+    ttl_ms = ttl > 0 ? (uint64_t)ttl * 1000 : 0;
+    negative_ttl_ms = ttl > 0 ? RESOLVER_NEGATIVE_TTL * 1000 : 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, resolver_main, NULL) != 0) {
+            perror("Failed to start resolver thread");
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+    stats_register("resolver", resolver_dump_stats, NULL);
+    return 0;
+}
+
+/*
+ * resolver_start - Numeric addresses never reach the cache. A fresh entry answers at once
+ * and, when it is close to expiring and still in demand, is looked up again meanwhile; a
+ * stale or unknown one queues the query on its (possibly already running) lookup.
+ */
+int resolver_start(const char *host, int port, resolver_query *query) {
+    query->port = port;
+    query->next = NULL;
+    struct sockaddr_in *sin = (struct sockaddr_in *)&query->addr;
+    memset(&query->addr, 0, sizeof(query->addr));
+    if (inet_pton(AF_INET, host, &sin->sin_addr) == 1) {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons((uint16_t)port);
+        query->addr_len = sizeof(struct sockaddr_in);
+        query->status = 0;
+        return 1;
+    }
+
+    uint64_t now = now_ms();
+    pthread_mutex_lock(&lock);
+    resolver_entry **bucket = bucket_for(host);
+    resolver_entry *entry = *bucket;
+    while (entry && strcmp(entry->host, host) != 0)
+        entry = entry->next;
+
+    if (entry && entry->resolved && now < entry->expires) {
+        entry->last_used = now;
+        entry->hits++;
+        answer(entry, query);
+        uint64_t window = ttl_ms / 10 > 1000 ? ttl_ms / 10 : 1000;
+        if (!entry->resolving && entry->status == 0 && entry->hits >= RESOLVER_HOT_HITS &&
+            entry->expires - now <= window) {
+            enqueue(entry);
+            atomic_fetch_add(&prefetches, 1);
+        }
+        pthread_mutex_unlock(&lock);
+        atomic_fetch_add(query->status == 0 ? &hits : &negative_hits, 1);
+        return 1;
+    }
+
+    if (!entry) {
+        if (entry_count >= RESOLVER_MAX_ENTRIES)
+            make_room(now);
+        entry = (resolver_entry *)calloc(1, sizeof(resolver_entry));
+        char *name = strdup(host);
+        if (!entry || !name) {
+            pthread_mutex_unlock(&lock);
+            free(entry);
+            free(name);
+            query->status = EAI_MEMORY;
+            return 1;
+        }
+        entry->host = name;
+        entry->next = *bucket;
+        *bucket = entry;
+        entry_count++;
+    }
+    entry->last_used = now;
+    query->next = entry->waiters;
+    entry->waiters = query;
+    if (!entry->resolving)
+        enqueue(entry);
+    pthread_mutex_unlock(&lock);
+    atomic_fetch_add(&misses, 1);
+    return 0;
+}
+
+// --- Blocking Lookups ---
+typedef struct resolver_wait {
+    resolver_query query;
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    int done;
+} resolver_wait;
+
+static void wait_notify(resolver_query *query) {
+    resolver_wait *wait = (resolver_wait *)((char *)query - offsetof(resolver_wait, query));
+    pthread_mutex_lock(&wait->lock);
+    wait->done = 1;
+    pthread_cond_signal(&wait->done_cond);
+    pthread_mutex_unlock(&wait->lock);
+}
+
+int resolver_lookup(const char *host, int port, struct sockaddr_storage *addr, socklen_t *len) {
+    resolver_wait wait;
+    wait.query.notify = wait_notify;
+    wait.done = 0;
+    pthread_mutex_init(&wait.lock, NULL);
+    pthread_cond_init(&wait.done_cond, NULL);
+
+    if (resolver_start(host, port, &wait.query) == 0) {
+        pthread_mutex_lock(&wait.lock);
+        while (!wait.done)
+            pthread_cond_wait(&wait.done_cond, &wait.lock);
+        pthread_mutex_unlock(&wait.lock);
+    }
+    pthread_cond_destroy(&wait.done_cond);
+    pthread_mutex_destroy(&wait.lock);
+
+    if (wait.query.status == 0) {
+        *addr = wait.query.addr;
+        *len = wait.query.addr_len;
+    }
+    return wait.query.status;
+}
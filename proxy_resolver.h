@@ -0,0 +1,44 @@
+#ifndef PROXY_RESOLVER_H
+#define PROXY_RESOLVER_H
+
+#include <sys/socket.h>
+
+#define RESOLVER_THREADS       2    // Default threads running getaddrinfo()
+#define RESOLVER_TTL           60   // Default seconds a resolved address is kept
+#define RESOLVER_NEGATIVE_TTL  5    // Seconds a failed lookup is remembered
+
+// --- Name Resolution ---
+// Host names are resolved by a small pool of threads calling getaddrinfo() and cached, so a
+// slow resolver only delays the requests for the host being looked up. Concurrent lookups of
+// one host share a single query, failures are cached briefly, and hosts still in use when
+// their entry is about to expire are looked up again in the background.
+typedef struct resolver_query {
+    void (*notify)(struct resolver_query *query);   // Runs on a resolver thread; must not block
+    int status;                                     // 0, or the getaddrinfo() error
+    struct sockaddr_storage addr;                   // Resolved address with the port filled in
+    socklen_t addr_len;
+    int port;                                       // Set by resolver_start()
+    struct resolver_query *next;                    // Next query waiting on the same host
+} resolver_query;
+
+/*
+ * resolver_init - Starts thread_count resolver threads (0 = RESOLVER_THREADS) and sets how
+ * many seconds addresses are cached (0 disables caching). Registers the resolver's stats.
+ * Call it before any other resolver_* function. Returns 0, or -1 on failure.
+ */
+int resolver_init(int thread_count, int ttl);
+
+/*
+ * resolver_start - Resolves host for port into query. Returns 1 if the answer (possibly an
+ * error) is already in query: a numeric address or a cached entry. Otherwise returns 0 and
+ * query's notify callback is called exactly once when the lookup finishes.
+ */
+int resolver_start(const char *host, int port, resolver_query *query);
+
+/*
+ * resolver_lookup - resolver_start() that waits for the answer. Returns 0 with the address
+ * in addr and len, or the getaddrinfo() error.
+ */
+int resolver_lookup(const char *host, int port, struct sockaddr_storage *addr, socklen_t *len);
+
+#endif
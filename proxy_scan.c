@@ -0,0 +1,223 @@
+#include "proxy_scan.h"
+
+#include <string.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+typedef struct scan_ops {
+    const char *name;
+    size_t (*head_end)(const char *data, size_t len, size_t start);
+    uint64_t (*block)(const char *data, char a, char b, char c);   // Matches in 64 bytes
+} scan_ops;
+
+// --- Scalar Kernels ---
+
+static size_t head_end_scalar(const char *data, size_t len, size_t i) {
+    for (; i + 4 <= len; i++) {
+        if (data[i] == '\r' && data[i + 1] == '\n' && data[i + 2] == '\r' && data[i + 3] == '\n')
+            return i + 4;
+    }
+    return 0;
+}
+
+static uint64_t block_scalar(const char *data, char a, char b, char c) {
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i++) {
+        if (data[i] == a || data[i] == b || data[i] == c)
+            bits |= (uint64_t)1 << i;
+    }
+    return bits;
+}
+
+#ifdef SCAN_X86
+// --- SSE2 Kernels ---
+// The blank line is found by comparing four loads offset by one byte each against CR, LF,
+// CR, LF: a lane set in all four starts the terminator. The loads must stay inside data, so
+// the last few positions are left to the scalar loop.
+
+static size_t head_end_sse2(const char *data, size_t len, size_t i) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    for (; i + 3 + 16 <= len; i += 16) {
+        const __m128i *p = (const __m128i *)(data + i);
+        __m128i first = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(p), cr),
+                                      _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 1)), lf));
+        __m128i second = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 2)), cr),
+                                       _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 3)), lf));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(first, second));
+        if (mask)
+            return i + (size_t)__builtin_ctz(mask) + 4;
+    }
+    return head_end_scalar(data, len, i);
+}
+
+static uint64_t block_sse2(const char *data, char a, char b, char c) {
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    const __m128i vc = _mm_set1_epi8(c);
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+                                   _mm_cmpeq_epi8(v, vc));
+        bits |= (uint64_t)(unsigned)_mm_movemask_epi8(hit) << i;
+    }
+    return bits;
+}
+
+// --- AVX2 Kernels ---
+// Same as SSE2, 32 bytes at a time. A tail left to the SSE2 kernel is only handed over after
+// clearing the upper halves of the registers: legacy SSE code running with them dirty is
+// slowed down on every instruction.
+
+__attribute__((target("avx2")))
+static size_t head_end_avx2(const char *data, size_t len, size_t i) {
+    if (i + 3 + 32 > len)
+        return head_end_sse2(data, len, i);
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    for (; i + 3 + 32 <= len; i += 32) {
+        __m256i first = _mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i)), cr),
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i + 1)), lf));
+        __m256i second = _mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i + 2)), cr),
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i + 3)), lf));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(first, second));
+        if (mask)
+            return i + (size_t)__builtin_ctz(mask) + 4;
+    }
+    _mm256_zeroupper();
+    return head_end_sse2(data, len, i);
+}
+
+__attribute__((target("avx2")))
+static uint64_t block_avx2(const char *data, char a, char b, char c) {
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    const __m256i vc = _mm256_set1_epi8(c);
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, va),
+                                                      _mm256_cmpeq_epi8(v, vb)),
+                                      _mm256_cmpeq_epi8(v, vc));
+        bits |= (uint64_t)(unsigned)_mm256_movemask_epi8(hit) << i;
+    }
+    return bits;
+}
+#endif
+
+// --- Dispatch ---
+
+static const scan_ops scan_kernels[] = {
+    [SCAN_SCALAR] = { "scalar", head_end_scalar, block_scalar },
+#ifdef SCAN_X86
+    [SCAN_SSE2] = { "sse2", head_end_sse2, block_sse2 },
+    [SCAN_AVX2] = { "avx2", head_end_avx2, block_avx2 },
+#else
+    [SCAN_SSE2] = { "sse2", head_end_scalar, block_scalar },
+    [SCAN_AVX2] = { "avx2", head_end_scalar, block_scalar },
+#endif
+};
+
+static _Atomic(const scan_ops *) scan_active = NULL;
+
+static int kernel_supported(scan_kernel kernel) {
+    switch (kernel) {
+        case SCAN_SCALAR:
+            return 1;
+#ifdef SCAN_X86
+        case SCAN_SSE2:
+            return __builtin_cpu_supports("sse2");
+        case SCAN_AVX2:
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return 0;
+    }
+}
+
+/*
+ * scan_ops_get - The first scan picks the widest supported kernel. Racing first scans pick
+ * the same one, so a plain relaxed store is enough.
+ */
+static const scan_ops *scan_ops_get(void) {
+    const scan_ops *ops = atomic_load_explicit(&scan_active, memory_order_relaxed);
+    if (!ops) {
+        scan_kernel kernel = SCAN_SCALAR;
+        if (kernel_supported(SCAN_AVX2))
+            kernel = SCAN_AVX2;
+        else if (kernel_supported(SCAN_SSE2))
+            kernel = SCAN_SSE2;
+        ops = &scan_kernels[kernel];
+        atomic_store_explicit(&scan_active, ops, memory_order_relaxed);
+    }
+    return ops;
+}
+
+size_t scan_head_end(const char *data, size_t len, size_t from) {
+    // The terminator may straddle what was searched and what is new
+    return scan_ops_get()->head_end(data, len, from > 3 ? from - 3 : 0);
+}
+
+// --- Delimiter Cursor ---
+
+// Matches in the block at cursor->block; a last block shorter than 64 bytes is compared from
+// a zero-padded copy, as the kernels always read 64 bytes
+static uint64_t cursor_block(const scan_cursor *cursor) {
+    const scan_ops *ops = scan_ops_get();
+    size_t remain = cursor->len - cursor->block;
+    if (remain >= 64)
+        return ops->block(cursor->data + cursor->block, cursor->set[0], cursor->set[1], cursor->set[2]);
+
+    char tail[64];
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, cursor->data + cursor->block, remain);
+    return ops->block(tail, cursor->set[0], cursor->set[1], cursor->set[2]) &
+           (((uint64_t)1 << remain) - 1);
+}
+
+void scan_cursor_init(scan_cursor *cursor, const char *data, size_t len, char a, char b, char c) {
+    cursor->data = data;
+    cursor->len = len;
+    cursor->block = 0;
+    cursor->set[0] = a;
+    cursor->set[1] = b;
+    cursor->set[2] = c;
+    cursor->bits = len > 0 ? cursor_block(cursor) : 0;
+}
+
+int scan_cursor_refill(scan_cursor *cursor) {
+    while (cursor->bits == 0) {
+        if (cursor->block + 64 >= cursor->len)
+            return -1;
+        cursor->block += 64;
+        cursor->bits = cursor_block(cursor);
+    }
+    return 0;
+}
+
+void scan_cursor_seek(scan_cursor *cursor, size_t offset) {
+    size_t block = offset & ~(size_t)63;
+    if (block != cursor->block) {
+        cursor->block = block;
+        cursor->bits = block < cursor->len ? cursor_block(cursor) : 0;
+    }
+    cursor->bits &= ~(uint64_t)0 << (offset - block);
+}
+
+int scan_select(scan_kernel kernel) {
+    if (!kernel_supported(kernel))
+        return -1;
+    atomic_store_explicit(&scan_active, &scan_kernels[kernel], memory_order_relaxed);
+    return 0;
+}
+
+const char *scan_kernel_name(void) {
+    return scan_ops_get()->name;
+}
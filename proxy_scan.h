@@ -0,0 +1,83 @@
+#ifndef PROXY_SCAN_H
+#define PROXY_SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// --- Delimiter Scanning ---
+// Finds the bytes that structure an HTTP head 16 (SSE2) or 32 (AVX2) bytes at a time. The
+// widest kernel the CPU supports is picked on first use; other CPUs get a scalar loop.
+typedef enum {
+    SCAN_SCALAR,
+    SCAN_SSE2,
+    SCAN_AVX2
+} scan_kernel;
+
+/*
+ * scan_head_end - Looks for the blank line ending a head in the len bytes at data, of which
+ * the first from were already searched by an earlier call. Returns the length of the head
+ * including the blank line, or 0 if it is not complete yet.
+ */
+size_t scan_head_end(const char *data, size_t len, size_t from);
+
+// --- Delimiter Cursor ---
+// Walks the offsets of every byte of a set (up to three bytes) in a buffer, in order. Each
+// 64-byte block is compared once and its matches kept as a bitmask, so finding the next
+// delimiter is usually just a bit scan.
+typedef struct scan_cursor {
+    const char *data;
+    size_t len;
+    size_t block;           // Offset of the 64-byte block described by bits
+    uint64_t bits;          // Matches in that block not returned yet (bit i = block + i)
+    char set[3];
+} scan_cursor;
+
+/*
+ * scan_cursor_init - Starts cursor at the beginning of the len bytes at data, looking for a,
+ * b and c (pass one byte twice to look for fewer).
+ */
+void scan_cursor_init(scan_cursor *cursor, const char *data, size_t len, char a, char b, char c);
+
+/*
+ * scan_cursor_refill - Moves cursor on to the next block with a match. Returns 0, or -1 at
+ * the end of the buffer. Only called by scan_cursor_next().
+ */
+int scan_cursor_refill(scan_cursor *cursor);
+
+/*
+ * scan_cursor_next - Offset of the next match, or len once there are no more. Inline, as
+ * most calls only clear the lowest bit of the current block.
+ */
+static inline size_t scan_cursor_next(scan_cursor *cursor) {
+    if (cursor->bits == 0 && scan_cursor_refill(cursor) < 0)
+        return cursor->len;
+    size_t offset = cursor->block + (size_t)__builtin_ctzll(cursor->bits);
+    cursor->bits &= cursor->bits - 1;
+    return offset;
+}
+
+/*
+ * scan_cursor_seek - Skips the matches before offset.
+ */
+void scan_cursor_seek(scan_cursor *cursor, size_t offset);
+
+/*
+ * scan_select - Makes every later scan use kernel. Returns 0, or -1 (and changes nothing)
+ * if this CPU cannot run it.
+ */
+int scan_select(scan_kernel kernel);
+
+/*
+ * scan_kernel_name - Name of the kernel in use.
+ */
+const char *scan_kernel_name(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
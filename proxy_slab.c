@@ -0,0 +1,222 @@
+#include "proxy_slab.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#define SLAB_CLASSES 11     // Powers of two from SLAB_MIN_OBJECT to SLAB_MAX_OBJECT
+
+typedef struct slab_object {
+    struct slab_object *next;           // Next free object of the same slab
+} slab_object;
+
+// The header sits at the start of the mapping, so an object finds its slab by masking
+typedef struct slab {
+    struct slab *prev;                  // Neighbours on the class's partial list
+    struct slab *next;
+    slab_object *free;                  // Objects freed since the slab was mapped
+    size_t carved;                      // Offset of the first object never handed out
+    size_t used;                        // Objects handed out
+    int listed;                         // On the partial list
+} slab;
+
+typedef struct slab_class {
+    pthread_mutex_t lock;               // Guards every field below and the class's slabs
+    size_t size;                        // Object size
+    size_t first;                       // Offset of the first object in a slab
+    size_t capacity;                    // Objects per slab
+    slab *partial;                      // Slabs with at least one free object
+    slab *spare;                        // Empty slab kept for reuse (NULL if none)
+    size_t slabs;                       // Slabs mapped, including the spare
+    size_t objects;                     // Objects handed out
+} slab_class;
+
+static slab_class slab_classes[SLAB_CLASSES];
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static atomic_size_t large_bytes;       // Objects above SLAB_MAX_OBJECT, from malloc()
+static atomic_size_t large_count;
+
+static void slab_classes_init(void) {
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        slab_class *class = &slab_classes[i];
+        pthread_mutex_init(&class->lock, NULL);
+        class->size = (size_t)SLAB_MIN_OBJECT << i;
+        class->first = (sizeof(slab) + class->size - 1) / class->size * class->size;
+        class->capacity = (SLAB_SIZE - class->first) / class->size;
+    }
+}
+
+static slab_class *class_for(size_t size) {
+    if (size <= SLAB_MIN_OBJECT)
+        return &slab_classes[0];
+    int bits = 64 - __builtin_clzll((unsigned long long)(size - 1));
+    return &slab_classes[bits - __builtin_ctz(SLAB_MIN_OBJECT)];
+}
+
+/*
+ * slab_map - Maps a SLAB_SIZE region aligned to SLAB_SIZE: twice that is mapped and the
+ * excess on both sides unmapped again.
+ */
+static slab *slab_map(void) {
+    char *base = mmap(NULL, 2 * SLAB_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap failed for slab");
+        return NULL;
+    }
+    char *aligned = (char *)(((uintptr_t)base + SLAB_SIZE - 1) & ~(uintptr_t)(SLAB_SIZE - 1));
+    if (aligned > base)
+        munmap(base, (size_t)(aligned - base));
+    if (aligned + SLAB_SIZE < base + 2 * SLAB_SIZE)
+        munmap(aligned + SLAB_SIZE, (size_t)(base + 2 * SLAB_SIZE - aligned - SLAB_SIZE));
+    return (slab *)aligned;
+}
+
+static void slab_link(slab_class *class, slab *s) {
+    s->prev = NULL;
+    s->next = class->partial;
+    if (s->next)
+        s->next->prev = s;
+    class->partial = s;
+    s->listed = 1;
+}
+
+static void slab_unlink(slab_class *class, slab *s) {
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        class->partial = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    s->listed = 0;
+}
+
+// An empty slab hands its objects out again from the start, reusing pages already touched
+static void slab_reset(slab_class *class, slab *s) {
+    s->free = NULL;
+    s->carved = class->first;
+    s->used = 0;
+    s->listed = 0;
+}
+
+void *slab_alloc(size_t size) {
+    if (size > SLAB_MAX_OBJECT) {
+        void *ptr = malloc(size);
+        if (ptr) {
+            atomic_fetch_add_explicit(&large_bytes, size, memory_order_relaxed);
+            atomic_fetch_add_explicit(&large_count, 1, memory_order_relaxed);
+        }
+        return ptr;
+    }
+    pthread_once(&slab_once, slab_classes_init);
+    slab_class *class = class_for(size);
+
+    pthread_mutex_lock(&class->lock);
+    slab *s = class->partial;
+    if (!s) {
+        s = class->spare;
+        class->spare = NULL;
+        if (!s) {
+            // Map outside the lock; a concurrent allocation may map one as well
+            pthread_mutex_unlock(&class->lock);
+            s = slab_map();
+            if (!s)
+                return NULL;
+            pthread_mutex_lock(&class->lock);
+            slab_reset(class, s);
+            class->slabs++;
+        }
+        slab_link(class, s);
+    }
+
+    void *ptr;
+    if (s->free) {
+        ptr = s->free;
+        s->free = s->free->next;
+    } else {
+        ptr = (char *)s + s->carved;
+        s->carved += class->size;
+    }
+    class->objects++;
+    if (++s->used == class->capacity)
+        slab_unlink(class, s);
+    pthread_mutex_unlock(&class->lock);
+    return ptr;
+}
+
+void slab_free(void *ptr, size_t size) {
+    if (!ptr)
+        return;
+    if (size > SLAB_MAX_OBJECT) {
+        free(ptr);
+        atomic_fetch_sub_explicit(&large_bytes, size, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&large_count, 1, memory_order_relaxed);
+        return;
+    }
+    slab_class *class = class_for(size);
+    slab *s = (slab *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+    slab *unmap = NULL;
+
+    pthread_mutex_lock(&class->lock);
+    slab_object *object = (slab_object *)ptr;
+    object->next = s->free;
+    s->free = object;
+    class->objects--;
+    s->used--;
+    if (!s->listed)
+        slab_link(class, s);
+    if (s->used == 0) {
+        slab_unlink(class, s);
+        if (!class->spare) {
+            slab_reset(class, s);
+            class->spare = s;
+        } else {
+            class->slabs--;
+            unmap = s;
+        }
+    }
+    pthread_mutex_unlock(&class->lock);
+
+    if (unmap)
+        munmap(unmap, SLAB_SIZE);
+}
+
+size_t slab_charge(size_t size) {
+    if (size > SLAB_MAX_OBJECT)
+        return size;
+    pthread_once(&slab_once, slab_classes_init);
+    return class_for(size)->size;
+}
+
+size_t slab_resident(void) {
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (!statm)
+        return 0;
+    unsigned long pages = 0;
+    if (fscanf(statm, "%*u %lu", &pages) != 1)
+        pages = 0;
+    fclose(statm);
+    return (size_t)pages * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+void slab_dump_stats(FILE *out) {
+    pthread_once(&slab_once, slab_classes_init);
+    size_t mapped = 0, used = 0;
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        slab_class *class = &slab_classes[i];
+        pthread_mutex_lock(&class->lock);
+        size_t slabs = class->slabs, objects = class->objects;
+        pthread_mutex_unlock(&class->lock);
+        if (slabs == 0)
+            continue;
+        fprintf(out, "  %6zu-byte objects: %zu in %zu slabs (%zu%% used)\n", class->size,
+                objects, slabs, objects * 100 / (slabs * class->capacity));
+        mapped += slabs * SLAB_SIZE;
+        used += objects * class->size;
+    }
+    fprintf(out, "slabs mapped %zu bytes, %zu in objects; %zu bytes in %zu large objects\n",
+            mapped, used, atomic_load(&large_bytes), atomic_load(&large_count));
+}
@@ -0,0 +1,43 @@
+#ifndef PROXY_SLAB_H
+#define PROXY_SLAB_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define SLAB_SIZE        (1024 * 1024)  // Bytes mapped per slab (aligned to this)
+#define SLAB_MIN_OBJECT  64             // Smallest size class
+#define SLAB_MAX_OBJECT  (64 * 1024)    // Largest size class; bigger objects come from malloc()
+
+// --- Slab Allocator ---
+// Cache memory is carved out of SLAB_SIZE mappings in power-of-two size classes. Objects of
+// a class reuse each other's space instead of fragmenting the heap, and a slab left empty is
+// unmapped (one per class is kept for reuse), so the cache's footprint shrinks with it.
+// Callers pass the size back on free, as the cache always knows it.
+
+/*
+ * slab_alloc - Returns size bytes (uninitialised), or NULL on failure.
+ */
+void *slab_alloc(size_t size);
+
+/*
+ * slab_free - Frees ptr, allocated by slab_alloc() with the same size. NULL is ignored.
+ */
+void slab_free(void *ptr, size_t size);
+
+/*
+ * slab_charge - Bytes an allocation of size really takes: its size class, or size itself
+ * for objects above SLAB_MAX_OBJECT.
+ */
+size_t slab_charge(size_t size);
+
+/*
+ * slab_resident - Resident set size of the process in bytes, or 0 if it cannot be read.
+ */
+size_t slab_resident(void);
+
+/*
+ * slab_dump_stats - Prints the mapped and used bytes of every size class to out.
+ */
+void slab_dump_stats(FILE *out);
+
+#endif
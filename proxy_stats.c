@@ -0,0 +1,76 @@
+#include "proxy_stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+
+#define STATS_MAX_SECTIONS 16            // Registered sections kept
+
+typedef struct stats_section {
+    const char *name;                    // Heading printed before the section
+    stats_dump_fn dump;
+    void *arg;
+} stats_section;
+
+// --- Global Variables ---
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;  // Guards the registry
+static stats_section stats_sections[STATS_MAX_SECTIONS];
+static int stats_count = 0;
+static sigset_t stats_signals;                                  // Signal handled by stats_thread
+
+int stats_register(const char *name, stats_dump_fn dump, void *arg) {
+    pthread_mutex_lock(&stats_lock);
+    if (stats_count == STATS_MAX_SECTIONS) {
+        pthread_mutex_unlock(&stats_lock);
+        fprintf(stderr, "Too many stats sections, dropping %s\n", name);
+        return -1;
+    }
+    stats_sections[stats_count].name = name;
+    stats_sections[stats_count].dump = dump;
+    stats_sections[stats_count].arg = arg;
+    stats_count++;
+    pthread_mutex_unlock(&stats_lock);
+    return 0;
+}
+
+void stats_dump(FILE *out) {
+    pthread_mutex_lock(&stats_lock);
+    for (int i = 0; i < stats_count; i++) {
+        fprintf(out, "--- %s ---\n", stats_sections[i].name);
+        stats_sections[i].dump(out, stats_sections[i].arg);
+    }
+    fflush(out);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void *stats_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        int signo;
+        if (sigwait(&stats_signals, &signo) == 0)
+            stats_dump(stdout);
+    }
+    return NULL;
+}
+
+/*
+ * stats_dump_on_signal - The dump runs on an ordinary thread, so sections may take locks
+ * and use stdio, which a signal handler could not.
+ */
+int stats_dump_on_signal(int signo) {
+    sigemptyset(&stats_signals);
+    sigaddset(&stats_signals, signo);
+    if (pthread_sigmask(SIG_BLOCK, &stats_signals, NULL) != 0) {
+        perror("Failed to block stats signal");
+        return -1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, stats_thread, NULL) != 0) {
+        perror("Failed to start stats thread");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
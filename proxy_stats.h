@@ -0,0 +1,29 @@
+#ifndef PROXY_STATS_H
+#define PROXY_STATS_H
+
+#include <stdio.h>
+
+// --- Exported Statistics ---
+// Modules register a callback that prints their counters; everything registered is dumped
+// together on demand (SIGUSR1 by default in the servers).
+typedef void (*stats_dump_fn)(FILE *out, void *arg);
+
+/*
+ * stats_register - Adds a section printed by stats_dump() under the heading name.
+ * Returns 0, or -1 if the registry is full.
+ */
+int stats_register(const char *name, stats_dump_fn dump, void *arg);
+
+/*
+ * stats_dump - Prints every registered section to out.
+ */
+void stats_dump(FILE *out);
+
+/*
+ * stats_dump_on_signal - Blocks signo in the calling thread (and so in every thread it
+ * creates afterwards) and starts a thread that dumps the stats to stdout whenever signo is
+ * delivered. Call it before starting any other thread. Returns 0, or -1 on error.
+ */
+int stats_dump_on_signal(int signo);
+
+#endif
@@ -0,0 +1,325 @@
+#include "proxy_upstream.h"
+#include "proxy_resolver.h"
+#include "proxy_stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define UPSTREAM_BUCKETS 64     // Hash buckets of (host, port) entries, each with its own lock
+
+// --- Idle Connections ---
+typedef struct upstream_idle {
+    int fd;
+    uint64_t since;             // Monotonic milliseconds when it was parked
+} upstream_idle;
+
+// Exists only while it has idle connections, so the table is bounded by what is parked
+typedef struct upstream_host {
+    struct upstream_host *next; // Next entry in the bucket
+    char *host;
+    int port;
+    int count;                  // Entries used in idle, oldest first
+    upstream_idle idle[];       // max_idle entries
+} upstream_host;
+
+typedef struct upstream_bucket {
+    pthread_mutex_t lock;
+    upstream_host *hosts;
+} upstream_bucket;
+
+static upstream_bucket buckets[UPSTREAM_BUCKETS];
+static int max_idle = UPSTREAM_MAX_IDLE;
+static uint64_t idle_timeout_ms = UPSTREAM_IDLE_TIMEOUT * 1000;
+static _Atomic uint64_t last_sweep;        // When upstream_sweep() last ran
+
+// Counters shown in the stats
+static atomic_ulong connects;               // New connections opened
+static atomic_ulong reuses;                 // Parked connections handed out again
+static atomic_ulong parked;                 // Connections handed back for reuse
+static atomic_ulong expired;                // Closed after idling past the timeout
+static atomic_ulong stale;                  // Closed by the health check
+static atomic_ulong overflowed;             // Closed because their host had no room
+static atomic_long idle_now;                // Connections parked right now
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static upstream_bucket *bucket_for(const char *host, int port) {
+    uint64_t hash = 14695981039346656037ULL;    // FNV-1a
+    for (const unsigned char *p = (const unsigned char *)host; *p; p++)
+        hash = (hash ^ *p) * 1099511628211ULL;
+    hash = (hash ^ (uint64_t)port) * 1099511628211ULL;
+    return &buckets[hash % UPSTREAM_BUCKETS];
+}
+
+static upstream_host **find_host(upstream_bucket *bucket, const char *host, int port) {
+    upstream_host **link = &bucket->hosts;
+    while (*link && ((*link)->port != port || strcmp((*link)->host, host) != 0))
+        link = &(*link)->next;
+    return link;
+}
+
+/*
+ * drop_oldest - Closes the first n idle connections of entry. Bucket lock held.
+ */
+static void drop_oldest(upstream_host *entry, int n) {
+    for (int i = 0; i < n; i++)
+        close(entry->idle[i].fd);
+    entry->count -= n;
+    memmove(entry->idle, entry->idle + n, (size_t)entry->count * sizeof(upstream_idle));
+    atomic_fetch_sub(&idle_now, n);
+}
+
+/*
+ * expire_host - Closes the connections of entry that idled past the timeout and unlinks it
+ * once it is empty. Bucket lock held.
+ */
+static void expire_host(upstream_host **link, uint64_t now) {
+    upstream_host *entry = *link;
+    int n = 0;
+    while (n < entry->count && now - entry->idle[n].since >= idle_timeout_ms)
+        n++;
+    if (n > 0) {
+        drop_oldest(entry, n);
+        atomic_fetch_add(&expired, (unsigned long)n);
+    }
+    if (entry->count == 0) {
+        *link = entry->next;
+        free(entry->host);
+        free(entry);
+    }
+}
+
+/*
+ * upstream_sweep - At most once a second, expires idle connections of every host, including
+ * ones that are never asked for again.
+ */
+static void upstream_sweep(uint64_t now) {
+    uint64_t last = atomic_load(&last_sweep);
+    if (now - last < 1000 || !atomic_compare_exchange_strong(&last_sweep, &last, now))
+        return;
+    for (int i = 0; i < UPSTREAM_BUCKETS; i++) {
+        upstream_bucket *bucket = &buckets[i];
+        pthread_mutex_lock(&bucket->lock);
+        upstream_host **link = &bucket->hosts;
+        while (*link) {
+            upstream_host *entry = *link;
+            expire_host(link, now);
+            if (*link == entry)
+                link = &entry->next;
+        }
+        pthread_mutex_unlock(&bucket->lock);
+    }
+}
+
+static void upstream_dump_stats(FILE *out, void *arg) {
+    fprintf(out, "max idle per host: %d, idle timeout: %llu s, idle now: %ld\n", max_idle,
+            (unsigned long long)(idle_timeout_ms / 1000), atomic_load(&idle_now));
+    fprintf(out, "  connects %lu, reuses %lu, parked %lu, expired %lu, stale %lu, overflowed %lu\n",
+            atomic_load(&connects), atomic_load(&reuses), atomic_load(&parked),
+            atomic_load(&expired), atomic_load(&stale), atomic_load(&overflowed));
+}
+
+void upstream_init(int max_idle_per_host, int idle_timeout) {
+    max_idle = max_idle_per_host > 0 ? max_idle_per_host : 0;
+    idle_timeout_ms = idle_timeout > 0 ? (uint64_t)idle_timeout * 1000 : 0;
+    for (int i = 0; i < UPSTREAM_BUCKETS; i++) {
+        pthread_mutex_init(&buckets[i].lock, NULL);
+        buckets[i].hosts = NULL;
+    }
+    atomic_store(&last_sweep, now_ms());
+    stats_register("upstream pool", upstream_dump_stats, NULL);
+}
+
+/*
+ * healthy - An idle connection must have nothing to read: EOF means the origin closed it,
+ * and data or an error means it cannot carry a new request.
+ */
+static int healthy(int fd) {
+    char byte;
+    ssize_t n = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * upstream_acquire - Pops the newest connection under the lock and checks it outside it.
+ */
+int upstream_acquire(const char *host, int port) {
+    if (max_idle == 0)
+        return -1;
+    upstream_bucket *bucket = bucket_for(host, port);
+    for (;;) {
+        uint64_t now = now_ms();
+        int fd = -1;
+        pthread_mutex_lock(&bucket->lock);
+        upstream_host **link = find_host(bucket, host, port);
+        if (*link) {
+            upstream_host *entry = *link;
+            expire_host(link, now);
+            if (*link == entry) {
+                fd = entry->idle[--entry->count].fd;
+                atomic_fetch_sub(&idle_now, 1);
+                expire_host(link, now);
+            }
+        }
+        pthread_mutex_unlock(&bucket->lock);
+
+        if (fd < 0)
+            return -1;
+        if (healthy(fd)) {
+            atomic_fetch_add(&reuses, 1);
+            return fd;
+        }
+        atomic_fetch_add(&stale, 1);
+        close(fd);
+    }
+}
+
+int upstream_connect(const char *host, int port, int nonblocking) {
+    struct sockaddr_storage addr;
+    socklen_t len;
+    int err = resolver_lookup(host, port, &addr, &len);
+    if (err != 0) {
+        fprintf(stderr, "No such host exists: %s (%s)\n", host, gai_strerror(err));
+        return -1;
+    }
+    return upstream_connect_addr((struct sockaddr *)&addr, len, nonblocking);
+}
+
+int upstream_connect_addr(const struct sockaddr *addr, socklen_t len, int nonblocking) {
+    int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0), 0);
+    if (fd < 0) {
+        perror("Failed to create remote socket");
+        return -1;
+    }
+    if (connect(fd, addr, len) < 0 && !(nonblocking && errno == EINPROGRESS)) {
+        perror("Error connecting to remote server");
+        close(fd);
+        return -1;
+    }
+    atomic_fetch_add(&connects, 1);
+    return fd;
+}
+
+int upstream_open(const char *host, int port, int *reused) {
+    int fd = upstream_acquire(host, port);
+    *reused = fd >= 0;
+    return fd >= 0 ? fd : upstream_connect(host, port, 0);
+}
+
+int upstream_set_timeout(int fd, int timeout) {
+    struct timeval tv = { timeout, 0 };
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
+        perror("Failed to set origin timeout");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * connect_wait - Waits up to timeout seconds for the non-blocking connect on fd to finish.
+ * Returns 0 once it succeeded, -1 if it failed or timed out.
+ */
+static int connect_wait(int fd, int timeout) {
+    struct pollfd pfd = { fd, POLLOUT, 0 };
+    int ready;
+    do {
+        ready = poll(&pfd, 1, timeout * 1000);
+    } while (ready < 0 && errno == EINTR);
+    if (ready == 0) {
+        fprintf(stderr, "Timed out connecting to remote server\n");
+        return -1;
+    }
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (ready < 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        fprintf(stderr, "Error connecting to remote server: %s\n", strerror(err ? err : errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * upstream_open_timed - A new connection is made non-blocking to bound the connect; it and
+ * pooled connections parked by the event loops are then switched to blocking.
+ */
+int upstream_open_timed(const char *host, int port, int timeout, int *reused) {
+    int fd = upstream_acquire(host, port);
+    *reused = fd >= 0;
+    if (fd < 0) {
+        fd = upstream_connect(host, port, timeout > 0);
+        if (fd >= 0 && timeout > 0 && connect_wait(fd, timeout) < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    if (fd < 0)
+        return -1;
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0 && (flags & O_NONBLOCK))
+        fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    if (upstream_set_timeout(fd, timeout) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void upstream_release(const char *host, int port, int fd, int reusable) {
+    if (fd < 0)
+        return;
+    uint64_t now = now_ms();
+    upstream_sweep(now);
+    if (!reusable || max_idle == 0 || idle_timeout_ms == 0) {
+        close(fd);
+        return;
+    }
+
+    upstream_bucket *bucket = bucket_for(host, port);
+    pthread_mutex_lock(&bucket->lock);
+    upstream_host **link = find_host(bucket, host, port);
+    if (!*link) {
+        upstream_host *entry = (upstream_host *)malloc(sizeof(upstream_host) +
+                                                       (size_t)max_idle * sizeof(upstream_idle));
+        char *name = strdup(host);
+        if (!entry || !name) {
+            pthread_mutex_unlock(&bucket->lock);
+            free(entry);
+            free(name);
+            close(fd);
+            return;
+        }
+        entry->host = name;
+        entry->port = port;
+        entry->count = 0;
+        entry->next = NULL;
+        *link = entry;
+    }
+    upstream_host *entry = *link;
+    if (entry->count == max_idle) {
+        drop_oldest(entry, 1);
+        atomic_fetch_add(&overflowed, 1);
+    }
+    entry->idle[entry->count].fd = fd;
+    entry->idle[entry->count].since = now;
+    entry->count++;
+    atomic_fetch_add(&idle_now, 1);
+    atomic_fetch_add(&parked, 1);
+    pthread_mutex_unlock(&bucket->lock);
+}
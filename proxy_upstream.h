@@ -0,0 +1,66 @@
+#ifndef PROXY_UPSTREAM_H
+#define PROXY_UPSTREAM_H
+
+#include <sys/socket.h>
+
+#define UPSTREAM_MAX_IDLE      8    // Default idle connections kept per (host, port)
+#define UPSTREAM_IDLE_TIMEOUT  4    // Default seconds an idle connection is kept, below the
+                                    // 5 s keep-alive timeout common on origin servers
+
+// --- Upstream Connection Pool ---
+// Origin connections whose last response was completely read and allowed keep-alive are
+// parked here by (host, port) and handed out again instead of opening a new connection.
+
+/*
+ * upstream_init - Sets how many idle connections are kept per (host, port) (0 disables
+ * pooling) and for how many seconds, and registers the pool's stats. Call it before any
+ * other upstream_* function.
+ */
+void upstream_init(int max_idle_per_host, int idle_timeout);
+
+/*
+ * upstream_acquire - Takes the most recently parked connection to host:port that still looks
+ * healthy (no EOF, error or unexpected data pending). Returns it, or -1 if there is none.
+ */
+int upstream_acquire(const char *host, int port);
+
+/*
+ * upstream_connect - Resolves host with resolver_lookup(), waiting for the answer if it is not
+ * cached, and opens a new connection to it with upstream_connect_addr().
+ */
+int upstream_connect(const char *host, int port, int nonblocking);
+
+/*
+ * upstream_connect_addr - Opens a new connection to addr. With nonblocking set the socket is
+ * non-blocking and the connect may still be in progress. Returns the socket, or -1 on error.
+ */
+int upstream_connect_addr(const struct sockaddr *addr, socklen_t len, int nonblocking);
+
+/*
+ * upstream_open - upstream_acquire(), falling back to upstream_connect(). *reused tells
+ * which one provided the socket.
+ */
+int upstream_open(const char *host, int port, int *reused);
+
+/*
+ * upstream_open_timed - upstream_open() for a thread that must not wait on a hung origin for
+ * ever: the socket is blocking, a new connection gets timeout seconds to be established,
+ * and a send or receive making no progress for timeout seconds fails with EAGAIN (0 = no
+ * limit). Clear the limit with upstream_set_timeout(fd, 0) before releasing the socket.
+ */
+int upstream_open_timed(const char *host, int port, int timeout, int *reused);
+
+/*
+ * upstream_set_timeout - Fails sends and receives on fd that make no progress for timeout
+ * seconds with EAGAIN (0 = no limit). Returns 0, or -1 on error.
+ */
+int upstream_set_timeout(int fd, int timeout);
+
+/*
+ * upstream_release - Hands back a connection taken from upstream_open()/upstream_acquire()
+ * or connected by the caller. It is parked if reusable is set and host:port has room,
+ * closed otherwise.
+ */
+void upstream_release(const char *host, int port, int fd, int reusable);
+
+#endif